@@ -93,28 +93,78 @@ bupsplit_sum (uint8_t *buf, size_t ofs, size_t len)
   return rollsum_digest (&r);
 }
 
+// Scanning variant of rollsum_roll.  Rather than keeping a copy of the
+// window, the byte being dropped is read straight back out of the input
+// buffer; the window is zero-filled at init time, so for the first
+// BUP_WINDOWSIZE bytes the dropped byte is 0.  This avoids the window
+// store and the modulo per byte, and lets the compiler keep s1/s2 in
+// registers.  The digest sequence is identical to rollsum_roll.
+#define rollsum_scan_step(s1, s2, drop, add) \
+  do \
+    { \
+      (s1) += (uint8_t)(add) - (uint8_t)(drop); \
+      (s2) += (s1) - (BUP_WINDOWSIZE * ((uint8_t)(drop) + ROLLSUM_CHAR_OFFSET)); \
+    } \
+  while (0)
+
+#define rollsum_scan_is_split(s2) \
+  (((s2) & (BUP_BLOBSIZE - 1)) == ((~0) & (BUP_BLOBSIZE - 1)))
+
+static int
+rollsum_scan_found (unsigned s1, unsigned s2, int count, int *bits)
+{
+  if (bits)
+    {
+      unsigned rsum = (s1 << 16) | (s2 & 0xffff);
+      rsum >>= BUP_BLOBBITS;
+      for (*bits = BUP_BLOBBITS; (rsum >>= 1) & 1; (*bits)++)
+        ;
+    }
+  return count + 1;
+}
+
 int
 bupsplit_find_ofs (const unsigned char *buf, int len, int *bits)
 {
-  Rollsum r;
-  int count;
+  unsigned s1 = BUP_WINDOWSIZE * ROLLSUM_CHAR_OFFSET;
+  unsigned s2 = BUP_WINDOWSIZE * (BUP_WINDOWSIZE - 1) * ROLLSUM_CHAR_OFFSET;
+  int count = 0;
+  const int warmup = len < BUP_WINDOWSIZE ? len : BUP_WINDOWSIZE;
 
-  rollsum_init (&r);
-  for (count = 0; count < len; count++)
+  for (; count < warmup; count++)
+    {
+      rollsum_scan_step (s1, s2, 0, buf[count]);
+      if (rollsum_scan_is_split (s2))
+        return rollsum_scan_found (s1, s2, count, bits);
+    }
+
+  // Main loop, unrolled by 4; the split test must still happen after
+  // every byte since the recurrence is strictly serial.
+  for (; count + 4 <= len; count += 4)
     {
-      rollsum_roll (&r, buf[count]);
-      if ((r.s2 & (BUP_BLOBSIZE - 1)) == ((~0) & (BUP_BLOBSIZE - 1)))
-        {
-          if (bits)
-            {
-              unsigned rsum = rollsum_digest (&r);
-              *bits = BUP_BLOBBITS;
-              rsum >>= BUP_BLOBBITS;
-              for (*bits = BUP_BLOBBITS; (rsum >>= 1) & 1; (*bits)++)
-                ;
-            }
-          return count + 1;
-        }
+      const unsigned char *p = buf + count;
+      const unsigned char *d = p - BUP_WINDOWSIZE;
+
+      rollsum_scan_step (s1, s2, d[0], p[0]);
+      if (rollsum_scan_is_split (s2))
+        return rollsum_scan_found (s1, s2, count, bits);
+      rollsum_scan_step (s1, s2, d[1], p[1]);
+      if (rollsum_scan_is_split (s2))
+        return rollsum_scan_found (s1, s2, count + 1, bits);
+      rollsum_scan_step (s1, s2, d[2], p[2]);
+      if (rollsum_scan_is_split (s2))
+        return rollsum_scan_found (s1, s2, count + 2, bits);
+      rollsum_scan_step (s1, s2, d[3], p[3]);
+      if (rollsum_scan_is_split (s2))
+        return rollsum_scan_found (s1, s2, count + 3, bits);
     }
+
+  for (; count < len; count++)
+    {
+      rollsum_scan_step (s1, s2, buf[count - BUP_WINDOWSIZE], buf[count]);
+      if (rollsum_scan_is_split (s2))
+        return rollsum_scan_found (s1, s2, count, bits);
+    }
+
   return 0;
 }
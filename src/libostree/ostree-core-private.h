@@ -82,6 +82,10 @@ GBytes *_ostree_file_header_new (GFileInfo *file_info, GVariant *xattrs);
 
 GBytes *_ostree_zlib_file_header_new (GFileInfo *file_info, GVariant *xattrs);
 
+gboolean _ostree_zlib_content_bytes_parse_header (GBytes *content, gsize *out_payload_offset,
+                                                  GFileInfo **out_file_info, GVariant **out_xattrs,
+                                                  GError **error);
+
 gboolean _ostree_make_temporary_symlink_at (int tmp_dirfd, const char *target, char **out_name,
                                             GCancellable *cancellable, GError **error);
 
@@ -609,6 +609,49 @@ ostree_content_stream_parse (gboolean compressed, GInputStream *input, guint64 i
   return TRUE;
 }
 
+/*
+ * _ostree_zlib_content_bytes_parse_header:
+ * @content: Complete archive (`.filez`) content object
+ * @out_payload_offset: (out): Offset of the raw deflate payload in @content
+ * @out_file_info: (out): Normal metadata
+ * @out_xattrs: (out): Extended attributes
+ * @error: Error
+ *
+ * Like ostree_content_stream_parse() with @compressed set, but for an object
+ * that is already in memory (usually mmap()ed); rather than wrapping the
+ * payload in a decompressor stream, return where it starts so the caller can
+ * inflate it directly.
+ */
+gboolean
+_ostree_zlib_content_bytes_parse_header (GBytes *content, gsize *out_payload_offset,
+                                         GFileInfo **out_file_info, GVariant **out_xattrs,
+                                         GError **error)
+{
+  gsize len;
+  const guint8 *buf = g_bytes_get_data (content, &len);
+
+  guint32 archive_header_size;
+  if (len < 8)
+    return glnx_throw (error, "File header truncated");
+  memcpy (&archive_header_size, buf, sizeof (archive_header_size));
+  archive_header_size = GUINT32_FROM_BE (archive_header_size);
+  /* The header is followed by 4 bytes of padding */
+  if (archive_header_size > len - 8)
+    return glnx_throw (error, "File header size %u exceeds size %" G_GSIZE_FORMAT,
+                       (guint)archive_header_size, len);
+  else if (archive_header_size == 0)
+    return glnx_throw (error, "File header size is zero");
+
+  g_autoptr (GBytes) header_bytes = g_bytes_new_from_bytes (content, 8, archive_header_size);
+  g_autoptr (GVariant) file_header = g_variant_ref_sink (
+      g_variant_new_from_bytes (_OSTREE_ZLIB_FILE_HEADER_GVARIANT_FORMAT, header_bytes, FALSE));
+  if (!zlib_file_header_parse (file_header, out_file_info, out_xattrs, error))
+    return FALSE;
+
+  *out_payload_offset = 8 + archive_header_size;
+  return TRUE;
+}
+
 /**
  * ostree_content_file_parse_at:
  * @compressed: Whether or not the stream is zlib-compressed
@@ -814,54 +857,74 @@ ostree_fs_get_all_xattrs_at (int dfd, const char *path, GCancellable *cancellabl
   return ret;
 }
 
-/**
- * ostree_checksum_file_from_input:
- * @file_info: File information
- * @xattrs: (allow-none): Optional extended attributes
- * @in: (allow-none): File content, should be %NULL for symbolic links
- * @objtype: Object type
- * @out_csum: (out) (array fixed-size=32): Return location for binary checksum
- * @cancellable: Cancellable
- * @error: Error
- *
- * Compute the OSTree checksum for a given input.
+/* Shared implementation of ostree_checksum_file_from_input() and
+ * ostree_checksum_file_at(); the content is read from @fd if it is not -1,
+ * otherwise from @in.
  */
-gboolean
-ostree_checksum_file_from_input (GFileInfo *file_info, GVariant *xattrs, GInputStream *in,
-                                 OstreeObjectType objtype, guchar **out_csum,
-                                 GCancellable *cancellable, GError **error)
+static gboolean
+checksum_file_impl (GFileInfo *file_info, GVariant *xattrs, GInputStream *in, int fd,
+                    OstreeObjectType objtype, guint8 out_digest[OSTREE_SHA256_DIGEST_LEN],
+                    GCancellable *cancellable, GError **error)
 {
-
   g_auto (OtChecksum) checksum = {
     0,
   };
   ot_checksum_init (&checksum);
 
+  gboolean have_content;
   if (OSTREE_OBJECT_TYPE_IS_META (objtype))
-    {
-      if (!ot_gio_splice_update_checksum (NULL, in, &checksum, cancellable, error))
-        return FALSE;
-    }
+    have_content = TRUE;
   else if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
     {
       g_autoptr (GVariant) dirmeta = ostree_create_directory_metadata (file_info, xattrs);
       ot_checksum_update (&checksum, g_variant_get_data (dirmeta), g_variant_get_size (dirmeta));
+      have_content = FALSE;
     }
   else
     {
       g_autoptr (GBytes) file_header = _ostree_file_header_new (file_info, xattrs);
 
       ot_checksum_update_bytes (&checksum, file_header);
+      have_content = g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR;
+    }
 
-      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+  if (have_content)
+    {
+      if (fd != -1)
         {
-          if (!ot_gio_splice_update_checksum (NULL, in, &checksum, cancellable, error))
+          if (!ot_checksum_update_fd (&checksum, fd, cancellable, error))
             return FALSE;
         }
+      else if (!ot_gio_splice_update_checksum (NULL, in, &checksum, cancellable, error))
+        return FALSE;
     }
 
-  *out_csum = g_malloc (OSTREE_SHA256_DIGEST_LEN);
-  ot_checksum_get_digest (&checksum, *out_csum, OSTREE_SHA256_DIGEST_LEN);
+  ot_checksum_get_digest (&checksum, out_digest, OSTREE_SHA256_DIGEST_LEN);
+  return TRUE;
+}
+
+/**
+ * ostree_checksum_file_from_input:
+ * @file_info: File information
+ * @xattrs: (allow-none): Optional extended attributes
+ * @in: (allow-none): File content, should be %NULL for symbolic links
+ * @objtype: Object type
+ * @out_csum: (out) (array fixed-size=32): Return location for binary checksum
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Compute the OSTree checksum for a given input.
+ */
+gboolean
+ostree_checksum_file_from_input (GFileInfo *file_info, GVariant *xattrs, GInputStream *in,
+                                 OstreeObjectType objtype, guchar **out_csum,
+                                 GCancellable *cancellable, GError **error)
+{
+  guint8 digest[OSTREE_SHA256_DIGEST_LEN];
+  if (!checksum_file_impl (file_info, xattrs, in, -1, objtype, digest, cancellable, error))
+    return FALSE;
+
+  *out_csum = g_memdup2 (digest, sizeof (digest));
   return TRUE;
 }
 
@@ -952,13 +1015,12 @@ ostree_checksum_file_at (int dfd, const char *path, struct stat *stbuf, OstreeOb
 
   const gboolean canonicalize_perms = ((flags & OSTREE_CHECKSUM_FLAGS_CANONICAL_PERMISSIONS) != 0);
 
-  g_autoptr (GInputStream) in = NULL;
+  /* Regular files are read straight from the fd, without a GInputStream */
+  glnx_autofd int fd = -1;
   if (S_ISREG (stbuf->st_mode))
     {
-      glnx_autofd int fd = -1;
       if (!glnx_openat_rdonly (dfd, path, FALSE, &fd, error))
         return FALSE;
-      in = g_unix_input_stream_new (g_steal_fd (&fd), TRUE);
       if (canonicalize_perms)
         {
           g_file_info_set_attribute_uint32 (file_info, "unix::uid", 0);
@@ -976,16 +1038,121 @@ ostree_checksum_file_at (int dfd, const char *path, struct stat *stbuf, OstreeOb
   g_autoptr (GVariant) xattrs = NULL;
   if (!ignore_xattrs && objtype == OSTREE_OBJECT_TYPE_FILE)
     {
-      if (!glnx_dfd_name_get_all_xattrs (dfd, path, &xattrs, cancellable, error))
+      /* Prefer the fd we already have over another path lookup */
+      if (fd != -1)
+        {
+          if (!glnx_fd_get_all_xattrs (fd, &xattrs, cancellable, error))
+            return FALSE;
+        }
+      else if (!glnx_dfd_name_get_all_xattrs (dfd, path, &xattrs, cancellable, error))
         return FALSE;
     }
 
-  g_autofree guchar *csum_bytes = NULL;
-  if (!ostree_checksum_file_from_input (file_info, xattrs, in, objtype, &csum_bytes, cancellable,
-                                        error))
+  guint8 digest[OSTREE_SHA256_DIGEST_LEN];
+  if (!checksum_file_impl (file_info, xattrs, NULL, fd, objtype, digest, cancellable, error))
     return FALSE;
 
-  *out_checksum = ostree_checksum_from_bytes (csum_bytes);
+  *out_checksum = ostree_checksum_from_bytes (digest);
+  return TRUE;
+}
+
+typedef struct
+{
+  int dfd;
+  const char *const *paths;
+  guint n_paths;
+  OstreeObjectType objtype;
+  OstreeChecksumFlags flags;
+  char **checksums;
+  GCancellable *cancellable;
+  gint next_path; /* atomic */
+  gint failed;    /* atomic */
+  GMutex lock;
+  GError *error; /* protected by lock */
+} ChecksumFilesData;
+
+static gpointer
+checksum_files_worker (gpointer datap)
+{
+  ChecksumFilesData *data = datap;
+
+  while (!g_atomic_int_get (&data->failed))
+    {
+      const guint i = (guint)g_atomic_int_add (&data->next_path, 1);
+      if (i >= data->n_paths)
+        break;
+
+      g_autoptr (GError) local_error = NULL;
+      if (!ostree_checksum_file_at (data->dfd, data->paths[i], NULL, data->objtype, data->flags,
+                                    &data->checksums[i], data->cancellable, &local_error))
+        {
+          g_mutex_lock (&data->lock);
+          if (data->error == NULL)
+            data->error = g_steal_pointer (&local_error);
+          g_mutex_unlock (&data->lock);
+          g_atomic_int_set (&data->failed, 1);
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * ostree_checksum_files_at:
+ * @dfd: Directory file descriptor
+ * @paths: (array zero-terminated=1): Subpaths
+ * @objtype: Object type
+ * @flags: Flags
+ * @out_checksums: (out) (array zero-terminated=1) (transfer full): Return location for hex
+ * checksums, in the same order as @paths
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Compute the OSTree checksum for each of @paths, like calling
+ * ostree_checksum_file_at() with a %NULL stat buffer on each of them, but
+ * spread across a number of threads scaled to the number of processors.
+ * On error, no checksums are returned.
+ *
+ * Since: 2024.8
+ */
+gboolean
+ostree_checksum_files_at (int dfd, const char *const *paths, OstreeObjectType objtype,
+                          OstreeChecksumFlags flags, char ***out_checksums,
+                          GCancellable *cancellable, GError **error)
+{
+  g_return_val_if_fail (paths != NULL, FALSE);
+  g_return_val_if_fail (out_checksums != NULL, FALSE);
+
+  ChecksumFilesData data = {
+    0,
+  };
+  data.dfd = dfd;
+  data.paths = paths;
+  data.n_paths = g_strv_length ((char **)paths);
+  data.objtype = objtype;
+  data.flags = flags;
+  data.checksums = g_new0 (char *, data.n_paths + 1);
+  data.cancellable = cancellable;
+  g_mutex_init (&data.lock);
+
+  /* The calling thread is one of the workers */
+  const guint n_threads = MIN (g_get_num_processors (), data.n_paths);
+  g_autoptr (GPtrArray) threads = g_ptr_array_new ();
+  for (guint i = 1; i < n_threads; i++)
+    g_ptr_array_add (threads, g_thread_new ("ostree-checksum", checksum_files_worker, &data));
+  checksum_files_worker (&data);
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+
+  g_mutex_clear (&data.lock);
+  g_auto (GStrv) checksums = g_steal_pointer (&data.checksums);
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+
+  *out_checksums = g_steal_pointer (&checksums);
   return TRUE;
 }
 
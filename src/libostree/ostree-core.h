@@ -173,6 +173,13 @@ typedef enum
  *    Unix epoch in UTC, big-endian) when the commit was committed
  *  - key: `ostree.commit.version`, value: `s`, the `version` value from the
  *    commit's metadata if it was defined. Since: 2022.2
+ *  - key: `ostree.commit.detached-metadata`, value: `a{sv}`, the commit's
+ *    detached metadata, empty if it has none; only present if the
+ *    `core.summary-detached-metadata` repo config option is set. Since: 2024.8
+ *  - key: `ostree.commit.ancestors`, value: `aay`, the checksums of the
+ *    commit's ancestors, its parent first; only present if the
+ *    `core.summary-ancestor-depth` repo config option is set, and holding at
+ *    most that many. Since: 2024.8
  */
 #define OSTREE_SUMMARY_GVARIANT_STRING "(a(s(taya{sv}))a{sv})"
 #define OSTREE_SUMMARY_GVARIANT_FORMAT G_VARIANT_TYPE (OSTREE_SUMMARY_GVARIANT_STRING)
@@ -458,6 +465,11 @@ gboolean ostree_checksum_file_at (int dfd, const char *path, struct stat *stbuf,
                                   OstreeObjectType objtype, OstreeChecksumFlags flags,
                                   char **out_checksum, GCancellable *cancellable, GError **error);
 
+_OSTREE_PUBLIC
+gboolean ostree_checksum_files_at (int dfd, const char *const *paths, OstreeObjectType objtype,
+                                   OstreeChecksumFlags flags, char ***out_checksums,
+                                   GCancellable *cancellable, GError **error);
+
 _OSTREE_PUBLIC
 void ostree_checksum_file_async (GFile *f, OstreeObjectType objtype, int io_priority,
                                  GCancellable *cancellable, GAsyncReadyCallback callback,
@@ -87,11 +87,14 @@ struct OstreeFetcher
   GMainContext *mainctx;
   CURLM *multi;
   GSource *timer_event;
+  GSource *rate_limit_resume; /* Unpauses requests stalled by rate_limit */
   int curl_running;
   GHashTable *outstanding_requests; /* Set<GTask> */
   GHashTable *sockets;              /* Set<SockInfo> */
 
   guint64 bytes_transferred;
+  OstreeFetcherRateLimit rate_limit;
+  OstreeFetcherMirrorFailures mirror_failures;
 };
 
 /* Information associated with a request */
@@ -119,6 +122,7 @@ struct FetcherRequest
 
   CURL *easy;
   char error[CURL_ERROR_SIZE];
+  gboolean paused; /* Stalled by the fetcher's rate limit */
 
   OstreeFetcher *fetcher;
 };
@@ -192,9 +196,11 @@ _ostree_fetcher_finalize (GObject *object)
   g_hash_table_unref (self->outstanding_requests);
   g_hash_table_unref (self->sockets);
   g_clear_pointer (&self->timer_event, destroy_and_unref_source);
+  g_clear_pointer (&self->rate_limit_resume, destroy_and_unref_source);
   if (self->mainctx)
     g_main_context_unref (self->mainctx);
   g_clear_pointer (&self->custom_user_agent, g_free);
+  _ostree_fetcher_mirror_failures_clear (&self->mirror_failures);
 
   G_OBJECT_CLASS (_ostree_fetcher_parent_class)->finalize (object);
 }
@@ -235,6 +241,7 @@ _ostree_fetcher_init (OstreeFetcher *self)
   curl_multi_setopt (self->multi, CURLMOPT_SOCKETDATA, self);
   curl_multi_setopt (self->multi, CURLMOPT_TIMERFUNCTION, update_timeout_cb);
   curl_multi_setopt (self->multi, CURLMOPT_TIMERDATA, self);
+  _ostree_fetcher_mirror_failures_init (&self->mirror_failures);
 #if CURL_AT_LEAST_VERSION(7, 30, 0)
   /* Let's do something reasonable here. */
   curl_multi_setopt (self->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, 8);
@@ -342,6 +349,8 @@ check_multi_info (OstreeFetcher *fetcher)
               g_task_return_new_error (
                   task, G_IO_ERROR, retry_all ? G_IO_ERROR_TIMED_OUT : G_IO_ERROR,
                   "While fetching %s: [%u] %s", eff_url, curlres, curl_easy_strerror (curlres));
+              _ostree_fetcher_mirror_failures_record (&req->fetcher->mirror_failures,
+                                                      req->mirrorlist->pdata[req->idx]);
               _ostree_fetcher_journal_failure (req->fetcher->remote_name, eff_url,
                                                curl_easy_strerror (curlres));
             }
@@ -364,6 +373,11 @@ check_multi_info (OstreeFetcher *fetcher)
               GIOErrorEnum giocode
                   = _ostree_fetcher_http_status_code_to_io_error (response, retry_all);
 
+              if (!((req->flags & OSTREE_FETCHER_REQUEST_OPTIONAL_CONTENT) > 0
+                    && giocode == G_IO_ERROR_NOT_FOUND))
+                _ostree_fetcher_mirror_failures_record (&req->fetcher->mirror_failures,
+                                                        req->mirrorlist->pdata[req->idx]);
+
               if (req->idx + 1 == req->mirrorlist->len)
                 {
                   g_autofree char *response_msg = g_strdup_printf (
@@ -547,6 +561,26 @@ sock_cb (CURL *easy, curl_socket_t s, int what, void *cbp, void *sockp)
   return 0;
 }
 
+static gboolean
+rate_limit_resume_cb (gpointer data)
+{
+  OstreeFetcher *fetcher = data;
+
+  g_clear_pointer (&fetcher->rate_limit_resume, destroy_and_unref_source);
+
+  GLNX_HASH_TABLE_FOREACH (fetcher->outstanding_requests, GTask *, task)
+    {
+      FetcherRequest *req = g_task_get_task_data (task);
+      if (!req->paused)
+        continue;
+      /* This may call write_cb() right away, which may pause it again */
+      req->paused = FALSE;
+      curl_easy_pause (req->easy, CURLPAUSE_CONT);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
 /* CURLOPT_WRITEFUNCTION */
 static size_t
 write_cb (void *ptr, size_t size, size_t nmemb, void *data)
@@ -560,6 +594,22 @@ write_cb (void *ptr, size_t size, size_t nmemb, void *data)
   if (req->caught_write_error)
     return -1;
 
+  /* If we're over the bandwidth cap, stall the transfer; curl hands us the
+   * same data again once it's unpaused. */
+  OstreeFetcher *fetcher = req->fetcher;
+  guint delay_ms = _ostree_fetcher_rate_limit_delay_ms (&fetcher->rate_limit);
+  if (delay_ms > 0)
+    {
+      req->paused = TRUE;
+      if (fetcher->rate_limit_resume == NULL)
+        {
+          fetcher->rate_limit_resume = g_timeout_source_new (delay_ms);
+          g_source_set_callback (fetcher->rate_limit_resume, rate_limit_resume_cb, fetcher, NULL);
+          g_source_attach (fetcher->rate_limit_resume, fetcher->mainctx);
+        }
+      return CURL_WRITEFUNC_PAUSE;
+    }
+
   if (req->max_size > 0)
     {
       if (realsize > req->max_size || (realsize + req->current_size) > req->max_size)
@@ -590,6 +640,7 @@ write_cb (void *ptr, size_t size, size_t nmemb, void *data)
 
   req->current_size += realsize;
   req->fetcher->bytes_transferred += realsize;
+  _ostree_fetcher_rate_limit_consume (&req->fetcher->rate_limit, realsize);
 
   return realsize;
 }
@@ -699,6 +750,29 @@ _ostree_fetcher_set_max_outstanding_fetcher_requests (OstreeFetcher *self,
   self->opt_max_outstanding_fetcher_requests = opt_max_outstanding_fetcher_requests;
 }
 
+/* With a bandwidth cap, requests are slow on purpose; don't abort them */
+static void
+apply_low_speed_limit (FetcherRequest *req)
+{
+  long low_speed_limit = req->fetcher->rate_limit.rate > 0 ? 0 : req->fetcher->opt_low_speed_limit;
+  CURLcode rc = curl_easy_setopt (req->easy, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit);
+  g_assert_cmpint (rc, ==, CURLM_OK);
+}
+
+void
+_ostree_fetcher_set_max_bandwidth (OstreeFetcher *self, guint64 bytes_per_second)
+{
+  gboolean was_limited = self->rate_limit.rate > 0;
+
+  _ostree_fetcher_rate_limit_set_rate (&self->rate_limit, bytes_per_second);
+
+  /* Requests in flight may now be capped, or not anymore */
+  if (was_limited == (bytes_per_second > 0))
+    return;
+  GLNX_HASH_TABLE_FOREACH (self->outstanding_requests, GTask *, task)
+    apply_low_speed_limit (g_task_get_task_data (task));
+}
+
 void
 _ostree_fetcher_set_cookie_jar (OstreeFetcher *self, const char *jar_path)
 {
@@ -947,8 +1021,7 @@ initiate_next_curl_request (FetcherRequest *req, GTask *task)
   g_assert_cmpint (rc, ==, CURLM_OK);
   rc = curl_easy_setopt (req->easy, CURLOPT_CONNECTTIMEOUT, 30L);
   g_assert_cmpint (rc, ==, CURLM_OK);
-  rc = curl_easy_setopt (req->easy, CURLOPT_LOW_SPEED_LIMIT, req->fetcher->opt_low_speed_limit);
-  g_assert_cmpint (rc, ==, CURLM_OK);
+  apply_low_speed_limit (req);
   rc = curl_easy_setopt (req->easy, CURLOPT_LOW_SPEED_TIME, req->fetcher->opt_low_speed_time);
   g_assert_cmpint (rc, ==, CURLM_OK);
   /* closure bindings -> task */
@@ -1109,3 +1182,9 @@ _ostree_fetcher_bytes_transferred (OstreeFetcher *self)
 {
   return self->bytes_transferred;
 }
+
+GHashTable *
+_ostree_fetcher_get_mirror_failures (OstreeFetcher *self)
+{
+  return _ostree_fetcher_mirror_failures_dup (&self->mirror_failures);
+}
@@ -76,6 +76,8 @@ typedef struct
   guint64 total_downloaded;
 
   guint32 opt_max_outstanding_fetcher_requests;
+  OstreeFetcherRateLimit rate_limit;
+  OstreeFetcherMirrorFailures mirror_failures;
 
   GError *oob_error;
 
@@ -168,6 +170,8 @@ thread_closure_unref (ThreadClosure *thread_closure)
       g_clear_pointer (&thread_closure->output_stream_set, g_hash_table_unref);
       g_mutex_clear (&thread_closure->output_stream_set_lock);
 
+      _ostree_fetcher_mirror_failures_clear (&thread_closure->mirror_failures);
+
       g_clear_pointer (&thread_closure->oob_error, g_error_free);
 
       g_free (thread_closure->remote_name);
@@ -368,6 +372,13 @@ session_thread_set_max_outstanding_fetcher_requests (ThreadClosure *thread_closu
   thread_closure->opt_max_outstanding_fetcher_requests = GPOINTER_TO_UINT (data);
 }
 
+static void
+session_thread_set_max_bandwidth_cb (ThreadClosure *thread_closure, gpointer data)
+{
+  guint64 *bytes_per_second = data;
+  _ostree_fetcher_rate_limit_set_rate (&thread_closure->rate_limit, *bytes_per_second);
+}
+
 static void
 session_thread_set_extra_user_agent_cb (ThreadClosure *thread_closure, gpointer data)
 {
@@ -412,6 +423,13 @@ _ostree_fetcher_set_max_outstanding_fetcher_requests (OstreeFetcher *self,
                            GUINT_TO_POINTER (opt_max_outstanding_fetcher_requests), NULL);
 }
 
+void
+_ostree_fetcher_set_max_bandwidth (OstreeFetcher *self, guint64 bytes_per_second)
+{
+  session_thread_idle_add (self->thread_closure, session_thread_set_max_bandwidth_cb,
+                           g_memdup2 (&bytes_per_second, sizeof (bytes_per_second)), g_free);
+}
+
 static void on_request_sent (GObject *object, GAsyncResult *result, gpointer user_data);
 
 static void
@@ -659,6 +677,7 @@ _ostree_fetcher_constructed (GObject *object)
   self->thread_closure->output_stream_set
       = g_hash_table_new_full (NULL, NULL, (GDestroyNotify)NULL, (GDestroyNotify)g_object_unref);
   g_mutex_init (&self->thread_closure->output_stream_set_lock);
+  _ostree_fetcher_mirror_failures_init (&self->thread_closure->mirror_failures);
 
   if (g_getenv ("OSTREE_DEBUG_HTTP"))
     {
@@ -882,24 +901,52 @@ remove_pending (OstreeFetcherPendingURI *pending)
   pending_uri_unref (pending);
 }
 
+static gboolean
+on_rate_limit_resume (gpointer user_data)
+{
+  GTask *task = user_data;
+  OstreeFetcherPendingURI *pending = g_task_get_task_data (task);
+
+  g_input_stream_read_bytes_async (pending->request_body, 8192, G_PRIORITY_DEFAULT,
+                                   g_task_get_cancellable (task), on_stream_read,
+                                   g_object_ref (task));
+  return G_SOURCE_REMOVE;
+}
+
+/* Read the next chunk of the response body, once the bandwidth cap allows it */
+static void
+read_next_chunk (GTask *task)
+{
+  OstreeFetcherPendingURI *pending = g_task_get_task_data (task);
+  ThreadClosure *thread_closure = pending->thread_closure;
+
+  guint delay_ms = _ostree_fetcher_rate_limit_delay_ms (&thread_closure->rate_limit);
+  if (delay_ms > 0)
+    {
+      g_autoptr (GSource) source = g_timeout_source_new (delay_ms);
+      g_source_set_callback (source, on_rate_limit_resume, g_object_ref (task), g_object_unref);
+      g_source_attach (source, thread_closure->main_context);
+      return;
+    }
+
+  on_rate_limit_resume (task);
+}
+
 static void
 on_out_splice_complete (GObject *object, GAsyncResult *result, gpointer user_data)
 {
   GTask *task = G_TASK (user_data);
   OstreeFetcherPendingURI *pending;
-  GCancellable *cancellable;
   gssize bytes_written;
   GError *local_error = NULL;
 
   pending = g_task_get_task_data (task);
-  cancellable = g_task_get_cancellable (task);
 
   bytes_written = g_output_stream_splice_finish ((GOutputStream *)object, result, &local_error);
   if (bytes_written < 0)
     goto out;
 
-  g_input_stream_read_bytes_async (pending->request_body, 8192, G_PRIORITY_DEFAULT, cancellable,
-                                   on_stream_read, g_object_ref (task));
+  read_next_chunk (task);
 
 out:
   if (local_error)
@@ -1001,6 +1048,7 @@ on_stream_read (GObject *object, GAsyncResult *result, gpointer user_data)
         }
 
       pending->current_size += bytes_read;
+      _ostree_fetcher_rate_limit_consume (&pending->thread_closure->rate_limit, bytes_read);
 
       /* We do this instead of _write_bytes_async() as that's not
        * guaranteed to do a complete write.
@@ -1042,7 +1090,14 @@ on_request_sent (GObject *object, GAsyncResult *result, gpointer user_data)
            (local_error != NULL) ? local_error->message : "none");
 
   if (!pending->request_body)
-    goto out;
+    {
+      if (SOUP_IS_REQUEST_HTTP (object)
+          && !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        _ostree_fetcher_mirror_failures_record (
+            &pending->thread_closure->mirror_failures,
+            pending->mirrorlist->pdata[pending->mirrorlist_idx]);
+      goto out;
+    }
   g_assert_no_error (local_error);
 
   if (SOUP_IS_REQUEST_HTTP (object))
@@ -1057,6 +1112,13 @@ on_request_sent (GObject *object, GAsyncResult *result, gpointer user_data)
         }
       else if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
         {
+          if (msg->status_code != SOUP_STATUS_CANCELLED
+              && !((pending->flags & OSTREE_FETCHER_REQUEST_OPTIONAL_CONTENT) > 0
+                   && msg->status_code == SOUP_STATUS_NOT_FOUND))
+            _ostree_fetcher_mirror_failures_record (
+                &pending->thread_closure->mirror_failures,
+                pending->mirrorlist->pdata[pending->mirrorlist_idx]);
+
           /* is there another mirror we can try? */
           if (pending->mirrorlist_idx + 1 < pending->mirrorlist->len)
             {
@@ -1317,3 +1379,11 @@ _ostree_fetcher_bytes_transferred (OstreeFetcher *self)
 
   return ret;
 }
+
+GHashTable *
+_ostree_fetcher_get_mirror_failures (OstreeFetcher *self)
+{
+  g_return_val_if_fail (OSTREE_IS_FETCHER (self), NULL);
+
+  return _ostree_fetcher_mirror_failures_dup (&self->thread_closure->mirror_failures);
+}
@@ -85,6 +85,8 @@ struct OstreeFetcher
 
   guint64 bytes_transferred;
   guint32 opt_max_outstanding_fetcher_requests;
+  OstreeFetcherRateLimit rate_limit;
+  OstreeFetcherMirrorFailures mirror_failures;
 };
 
 enum
@@ -246,6 +248,7 @@ _ostree_fetcher_finalize (GObject *object)
   g_clear_object (&self->tls_database);
   g_clear_pointer (&self->extra_headers, g_variant_unref);
   g_clear_pointer (&self->user_agent, g_free);
+  _ostree_fetcher_mirror_failures_clear (&self->mirror_failures);
 
   G_OBJECT_CLASS (_ostree_fetcher_parent_class)->finalize (object);
 }
@@ -283,6 +286,7 @@ static void
 _ostree_fetcher_init (OstreeFetcher *self)
 {
   self->sessions = g_hash_table_new (g_direct_hash, g_direct_equal);
+  _ostree_fetcher_mirror_failures_init (&self->mirror_failures);
 }
 
 OstreeFetcher *
@@ -381,6 +385,12 @@ _ostree_fetcher_set_extra_user_agent (OstreeFetcher *self, const char *extra_use
     self->user_agent = g_strdup_printf ("%s %s", OSTREE_FETCHER_USERAGENT_STRING, extra_user_agent);
 }
 
+void
+_ostree_fetcher_set_max_bandwidth (OstreeFetcher *self, guint64 bytes_per_second)
+{
+  _ostree_fetcher_rate_limit_set_rate (&self->rate_limit, bytes_per_second);
+}
+
 void
 _ostree_fetcher_set_low_speed_time (OstreeFetcher *self, guint32 opt_low_speed_time)
 {
@@ -446,6 +456,36 @@ finish_stream (FetcherRequest *request, GCancellable *cancellable, GError **erro
 
 static void on_stream_read (GObject *object, GAsyncResult *result, gpointer user_data);
 
+static gboolean
+on_rate_limit_resume (gpointer user_data)
+{
+  GTask *task = user_data;
+  FetcherRequest *request = g_task_get_task_data (task);
+
+  g_input_stream_read_bytes_async (request->response_body, 8192, G_PRIORITY_DEFAULT,
+                                   g_task_get_cancellable (task), on_stream_read,
+                                   g_object_ref (task));
+  return G_SOURCE_REMOVE;
+}
+
+/* Read the next chunk of the response body, once the bandwidth cap allows it */
+static void
+read_next_chunk (GTask *task)
+{
+  FetcherRequest *request = g_task_get_task_data (task);
+
+  guint delay_ms = _ostree_fetcher_rate_limit_delay_ms (&request->fetcher->rate_limit);
+  if (delay_ms > 0)
+    {
+      g_autoptr (GSource) source = g_timeout_source_new (delay_ms);
+      g_source_set_callback (source, on_rate_limit_resume, g_object_ref (task), g_object_unref);
+      g_source_attach (source, g_task_get_context (task));
+      return;
+    }
+
+  on_rate_limit_resume (task);
+}
+
 static void
 on_out_splice_complete (GObject *object, GAsyncResult *result, gpointer user_data)
 {
@@ -463,9 +503,7 @@ on_out_splice_complete (GObject *object, GAsyncResult *result, gpointer user_dat
   FetcherRequest *request = g_task_get_task_data (task);
   request->fetcher->bytes_transferred += bytes_written;
 
-  GCancellable *cancellable = g_task_get_cancellable (task);
-  g_input_stream_read_bytes_async (request->response_body, 8192, G_PRIORITY_DEFAULT, cancellable,
-                                   on_stream_read, g_object_ref (task));
+  read_next_chunk (task);
 }
 
 static void
@@ -566,6 +604,7 @@ on_stream_read (GObject *object, GAsyncResult *result, gpointer user_data)
         }
 
       request->current_size += bytes_read;
+      _ostree_fetcher_rate_limit_consume (&request->fetcher->rate_limit, bytes_read);
 
       /* We do this instead of _write_bytes_async() as that's not
        * guaranteed to do a complete write.
@@ -594,6 +633,10 @@ on_request_sent (GObject *object, GAsyncResult *result, gpointer user_data)
 
   if (!request->response_body)
     {
+      if (request->message && !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        _ostree_fetcher_mirror_failures_record (
+            &request->fetcher->mirror_failures,
+            request->mirrorlist->pdata[request->mirrorlist_idx]);
       g_task_return_error (task, local_error);
       return;
     }
@@ -610,6 +653,12 @@ on_request_sent (GObject *object, GAsyncResult *result, gpointer user_data)
         }
       else if (!SOUP_STATUS_IS_SUCCESSFUL (status))
         {
+          if (!((request->flags & OSTREE_FETCHER_REQUEST_OPTIONAL_CONTENT) > 0
+                && status == SOUP_STATUS_NOT_FOUND))
+            _ostree_fetcher_mirror_failures_record (
+                &request->fetcher->mirror_failures,
+                request->mirrorlist->pdata[request->mirrorlist_idx]);
+
           /* is there another mirror we can try? */
           if (request->mirrorlist_idx + 1 < request->mirrorlist->len)
             {
@@ -876,3 +925,9 @@ _ostree_fetcher_bytes_transferred (OstreeFetcher *self)
 {
   return self->bytes_transferred;
 }
+
+GHashTable *
+_ostree_fetcher_get_mirror_failures (OstreeFetcher *self)
+{
+  return _ostree_fetcher_mirror_failures_dup (&self->mirror_failures);
+}
@@ -241,3 +241,82 @@ _ostree_fetcher_http_status_code_to_io_error (guint status_code, gboolean should
       return should_retry ? G_IO_ERROR_TIMED_OUT : G_IO_ERROR_FAILED;
     }
 }
+
+/* The bucket holds a quarter of a second of traffic, but at least this much */
+#define RATE_LIMIT_MIN_BURST (16 * 1024)
+/* Don't sleep longer than this at once, so lifting the cap takes effect promptly */
+#define RATE_LIMIT_MAX_DELAY_MS 100
+
+/* Set the bandwidth cap in bytes per second; 0 removes it. */
+void
+_ostree_fetcher_rate_limit_set_rate (OstreeFetcherRateLimit *self, guint64 rate)
+{
+  self->rate = rate;
+  self->tokens = 0;
+  self->last_fill = g_get_monotonic_time ();
+}
+
+/* Returns how many milliseconds to wait before receiving more data, or 0 if
+ * it may be received now. */
+guint
+_ostree_fetcher_rate_limit_delay_ms (OstreeFetcherRateLimit *self)
+{
+  if (self->rate == 0)
+    return 0;
+
+  gint64 now = g_get_monotonic_time ();
+  gdouble burst = MAX (self->rate / 4, RATE_LIMIT_MIN_BURST);
+  gdouble filled = (gdouble)self->rate * (now - self->last_fill) / G_USEC_PER_SEC;
+  self->tokens = MIN (self->tokens + filled, burst);
+  self->last_fill = now;
+
+  if (self->tokens > 0)
+    return 0;
+
+  gdouble delay_ms = (1 - self->tokens) * 1000 / self->rate;
+  return CLAMP ((guint)delay_ms, 1, RATE_LIMIT_MAX_DELAY_MS);
+}
+
+/* Account for @n_bytes received. Transfers may overdraw the bucket, which
+ * delays the next ones accordingly. */
+void
+_ostree_fetcher_rate_limit_consume (OstreeFetcherRateLimit *self, gsize n_bytes)
+{
+  if (self->rate > 0)
+    self->tokens -= n_bytes;
+}
+
+void
+_ostree_fetcher_mirror_failures_init (OstreeFetcherMirrorFailures *self)
+{
+  g_mutex_init (&self->lock);
+  self->counts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+void
+_ostree_fetcher_mirror_failures_clear (OstreeFetcherMirrorFailures *self)
+{
+  g_clear_pointer (&self->counts, g_hash_table_unref);
+  g_mutex_clear (&self->lock);
+}
+
+/* Note a failed request to @mirror; may be called from any thread. */
+void
+_ostree_fetcher_mirror_failures_record (OstreeFetcherMirrorFailures *self,
+                                        OstreeFetcherURI *mirror)
+{
+  g_autofree char *key = _ostree_fetcher_uri_to_string (mirror);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->lock);
+  guint count = GPOINTER_TO_UINT (g_hash_table_lookup (self->counts, key));
+  g_hash_table_replace (self->counts, g_steal_pointer (&key), GUINT_TO_POINTER (count + 1));
+}
+
+GHashTable *
+_ostree_fetcher_mirror_failures_dup (OstreeFetcherMirrorFailures *self)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->lock);
+  GHashTable *ret = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  GLNX_HASH_TABLE_FOREACH_KV (self->counts, const char *, key, gpointer, count)
+    g_hash_table_replace (ret, g_strdup (key), count);
+  return ret;
+}
@@ -59,6 +59,39 @@ gboolean _ostree_fetcher_should_retry_request (const GError *error, guint n_retr
 
 GIOErrorEnum _ostree_fetcher_http_status_code_to_io_error (guint status_code, gboolean retry_all);
 
+/* A token bucket, shared by all requests of a fetcher to enforce
+ * _ostree_fetcher_set_max_bandwidth(). Only used from the thread running the
+ * fetcher's requests. */
+typedef struct
+{
+  guint64 rate;     /* Bytes per second, 0 if unlimited */
+  gdouble tokens;   /* Bytes which may be received now, negative if overdrawn */
+  gint64 last_fill; /* Monotonic time of the last refill */
+} OstreeFetcherRateLimit;
+
+void _ostree_fetcher_rate_limit_set_rate (OstreeFetcherRateLimit *self, guint64 rate);
+
+guint _ostree_fetcher_rate_limit_delay_ms (OstreeFetcherRateLimit *self);
+
+void _ostree_fetcher_rate_limit_consume (OstreeFetcherRateLimit *self, gsize n_bytes);
+
+/* Failed requests per mirror, keyed by _ostree_fetcher_uri_to_string() of
+ * its base URI; see _ostree_fetcher_get_mirror_failures(). */
+typedef struct
+{
+  GMutex lock;
+  GHashTable *counts; /* (element-type utf8 guint) */
+} OstreeFetcherMirrorFailures;
+
+void _ostree_fetcher_mirror_failures_init (OstreeFetcherMirrorFailures *self);
+
+void _ostree_fetcher_mirror_failures_clear (OstreeFetcherMirrorFailures *self);
+
+void _ostree_fetcher_mirror_failures_record (OstreeFetcherMirrorFailures *self,
+                                             OstreeFetcherURI *mirror);
+
+GHashTable *_ostree_fetcher_mirror_failures_dup (OstreeFetcherMirrorFailures *self);
+
 G_END_DECLS
 
 #endif
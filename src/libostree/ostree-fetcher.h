@@ -109,6 +109,8 @@ void
 _ostree_fetcher_set_max_outstanding_fetcher_requests (OstreeFetcher *self,
                                                       guint32 opt_max_outstanding_fetcher_requests);
 
+void _ostree_fetcher_set_max_bandwidth (OstreeFetcher *self, guint64 bytes_per_second);
+
 void _ostree_fetcher_set_tls_database (OstreeFetcher *self, const char *tlsdb_path);
 
 void _ostree_fetcher_set_extra_headers (OstreeFetcher *self, GVariant *extra_headers);
@@ -117,6 +119,8 @@ void _ostree_fetcher_set_extra_user_agent (OstreeFetcher *self, const char *extr
 
 guint64 _ostree_fetcher_bytes_transferred (OstreeFetcher *self);
 
+GHashTable *_ostree_fetcher_get_mirror_failures (OstreeFetcher *self);
+
 void _ostree_fetcher_request_to_tmpfile (OstreeFetcher *self, GPtrArray *mirrorlist,
                                          const char *filename, OstreeFetcherRequestFlags flags,
                                          const char *if_none_match, guint64 if_modified_since,
@@ -44,6 +44,12 @@ struct OstreeGpgVerifier
   GList *keyrings;
   GPtrArray *keyring_data;
   GPtrArray *key_ascii_files;
+
+  char *fingerprint; /* See _ostree_gpg_verifier_get_fingerprint() */
+  int cache_dfd;     /* See _ostree_gpg_verifier_set_cache_dir() */
+
+  GMutex home_dir_lock;
+  char *home_dir; /* GnuPG home directory with the keys imported, see ensure_home_dir() */
 };
 
 G_DEFINE_TYPE (OstreeGpgVerifier, _ostree_gpg_verifier, G_TYPE_OBJECT)
@@ -57,6 +63,16 @@ ostree_gpg_verifier_finalize (GObject *object)
   if (self->key_ascii_files)
     g_ptr_array_unref (self->key_ascii_files);
   g_clear_pointer (&self->keyring_data, g_ptr_array_unref);
+  g_free (self->fingerprint);
+  glnx_close_fd (&self->cache_dfd);
+
+  if (self->home_dir != NULL)
+    {
+      ot_gpgme_kill_agent (self->home_dir);
+      (void)glnx_shutil_rm_rf_at (AT_FDCWD, self->home_dir, NULL, NULL);
+      g_free (self->home_dir);
+    }
+  g_mutex_clear (&self->home_dir_lock);
 
   G_OBJECT_CLASS (_ostree_gpg_verifier_parent_class)->finalize (object);
 }
@@ -76,19 +92,20 @@ static void
 _ostree_gpg_verifier_init (OstreeGpgVerifier *self)
 {
   self->keyring_data = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  self->cache_dfd = -1;
+  g_mutex_init (&self->home_dir_lock);
 }
 
 static void
 verify_result_finalized_cb (gpointer data, GObject *finalized_verify_result)
 {
-  g_autofree gchar *tmp_dir = data; /* assume ownership */
+  OstreeGpgVerifier *self = data; /* assume ownership */
 
-  /* XXX OstreeGpgVerifyResult could do this cleanup in its own
-   *     finalize() method, but I didn't want this keyring hack
-   *     bleeding into multiple classes. */
+  /* XXX OstreeGpgVerifyResult could hold the verifier itself, but
+   *     I didn't want this keyring hack bleeding into multiple
+   *     classes. */
 
-  ot_gpgme_kill_agent (tmp_dir);
-  (void)glnx_shutil_rm_rf_at (AT_FDCWD, tmp_dir, NULL, NULL);
+  g_object_unref (self);
 }
 
 static gboolean
@@ -261,6 +278,246 @@ out:
   return ret;
 }
 
+static void
+checksum_update_data (GChecksum *checksum, const guint8 *buf, gsize len)
+{
+  guint64 len_be = GUINT64_TO_BE (len);
+  g_checksum_update (checksum, (const guint8 *)&len_be, sizeof (len_be));
+  g_checksum_update (checksum, buf, len);
+}
+
+static gboolean
+checksum_file_contents (GChecksum *checksum, const char *path, GError **error)
+{
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (AT_FDCWD, path, &fd, error))
+    return FALSE;
+
+  /* Missing files are recorded as such, to tell them apart from empty ones */
+  if (fd == -1)
+    {
+      g_checksum_update (checksum, (const guint8 *)"\0", 1);
+      return TRUE;
+    }
+
+  g_autoptr (GBytes) contents = ot_fd_readall_or_mmap (fd, 0, error);
+  if (!contents)
+    return FALSE;
+  gsize len;
+  const guint8 *buf = g_bytes_get_data (contents, &len);
+  g_checksum_update (checksum, (const guint8 *)"\1", 1);
+  checksum_update_data (checksum, buf, len);
+  return TRUE;
+}
+
+/* Returns a checksum identifying the keys of @self: the contents of the
+ * keyring files, keyring data and ASCII key files we import.  It's computed
+ * on the first call, which must be before @self is shared between threads.
+ */
+const char *
+_ostree_gpg_verifier_get_fingerprint (OstreeGpgVerifier *self, GError **error)
+{
+  if (self->fingerprint != NULL)
+    return self->fingerprint;
+
+  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  for (GList *link = self->keyrings; link != NULL; link = link->next)
+    {
+      if (!checksum_file_contents (checksum, gs_file_get_path_cached (link->data), error))
+        return NULL;
+    }
+  for (guint i = 0; i < self->keyring_data->len; i++)
+    {
+      GBytes *keyringd = self->keyring_data->pdata[i];
+      gsize len;
+      const guint8 *buf = g_bytes_get_data (keyringd, &len);
+      checksum_update_data (checksum, buf, len);
+    }
+  if (self->key_ascii_files)
+    {
+      for (guint i = 0; i < self->key_ascii_files->len; i++)
+        {
+          if (!checksum_file_contents (checksum, self->key_ascii_files->pdata[i], error))
+            return NULL;
+        }
+    }
+
+  self->fingerprint = g_strdup (g_checksum_get_string (checksum));
+  return self->fingerprint;
+}
+
+/* Keep the keyring imported for the current fingerprint in the directory
+ * @dfd, taking ownership of it, so other processes using the same keys can
+ * skip importing them.
+ */
+void
+_ostree_gpg_verifier_set_cache_dir (OstreeGpgVerifier *self, int dfd)
+{
+  glnx_close_fd (&self->cache_dfd);
+  self->cache_dfd = dfd;
+}
+
+/* Drop the keyrings cached for other fingerprints than ours. */
+static gboolean
+prune_cache_dir (OstreeGpgVerifier *self, GCancellable *cancellable, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    0,
+  };
+  if (!glnx_dirfd_iterator_init_at (self->cache_dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (!(g_str_has_suffix (dent->d_name, ".gpg") || g_str_has_suffix (dent->d_name, ".sha256"))
+          || (g_str_has_prefix (dent->d_name, self->fingerprint)
+              && dent->d_name[strlen (self->fingerprint)] == '.'))
+        continue;
+      if (!glnx_unlinkat (dfd_iter.fd, dent->d_name, 0, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Each cached keyring <fingerprint>.gpg comes with a <fingerprint>.sha256
+ * holding the checksum of its contents, which we check before using it;
+ * anything that doesn't match is ignored (and replaced).  Sets @out_keyring
+ * to %NULL if there's no usable cached keyring.
+ */
+static gboolean
+load_cached_keyring (OstreeGpgVerifier *self, const char *name, const char *sum_name,
+                     GBytes **out_keyring, GCancellable *cancellable, GError **error)
+{
+  *out_keyring = NULL;
+
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (self->cache_dfd, name, &fd, error))
+    return FALSE;
+  if (fd == -1)
+    return TRUE;
+
+  g_autoptr (GBytes) keyring = ot_fd_readall_or_mmap (fd, 0, error);
+  if (!keyring)
+    return FALSE;
+
+  g_autoptr (GError) local_error = NULL;
+  g_autofree char *expected
+      = glnx_file_get_contents_utf8_at (self->cache_dfd, sum_name, NULL, cancellable, &local_error);
+  if (expected == NULL)
+    {
+      g_debug ("Ignoring cached GPG keyring %s: %s", name, local_error->message);
+      return TRUE;
+    }
+  g_autofree char *actual = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, keyring);
+  if (!g_str_equal (g_strstrip (expected), actual))
+    {
+      g_debug ("Ignoring cached GPG keyring %s: checksum mismatch", name);
+      return TRUE;
+    }
+
+  *out_keyring = g_steal_pointer (&keyring);
+  return TRUE;
+}
+
+static gboolean
+save_cached_keyring (OstreeGpgVerifier *self, const char *pubring_path, const char *name,
+                     const char *sum_name, GCancellable *cancellable, GError **error)
+{
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (AT_FDCWD, pubring_path, TRUE, &fd, error))
+    return FALSE;
+  g_autoptr (GBytes) keyring = ot_fd_readall_or_mmap (fd, 0, error);
+  if (!keyring)
+    return FALSE;
+  g_autofree char *sum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, keyring);
+
+  gsize len;
+  const guint8 *buf = g_bytes_get_data (keyring, &len);
+  if (!glnx_file_replace_contents_at (self->cache_dfd, name, buf, len, GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, error))
+    return FALSE;
+  if (!glnx_file_replace_contents_at (self->cache_dfd, sum_name, (guint8 *)sum, strlen (sum),
+                                      GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return FALSE;
+
+  return prune_cache_dir (self, cancellable, error);
+}
+
+/* Set up self->home_dir, a GnuPG home directory with all the keys in its
+ * pubring.gpg, once for all verifications.  GPGME has no API for using
+ * multiple keyrings (aka, gpg --keyring), so we concatenate all the keyring
+ * files into one pubring.gpg in a temporary directory, then import the ASCII
+ * keys into it.  If we have a cache directory, we copy the pubring.gpg from
+ * there when one was made from the same keys and is intact, and save it
+ * there otherwise.
+ */
+static gboolean
+ensure_home_dir (OstreeGpgVerifier *self, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->home_dir_lock);
+  if (self->home_dir != NULL)
+    return TRUE;
+
+  g_autofree char *cached_name = NULL;
+  g_autofree char *cached_sum_name = NULL;
+  g_autoptr (GBytes) cached = NULL;
+  if (self->cache_dfd != -1 && self->fingerprint != NULL)
+    {
+      cached_name = g_strconcat (self->fingerprint, ".gpg", NULL);
+      cached_sum_name = g_strconcat (self->fingerprint, ".sha256", NULL);
+      if (!load_cached_keyring (self, cached_name, cached_sum_name, &cached, cancellable, error))
+        return FALSE;
+    }
+
+  g_auto (gpgme_ctx_t) context = ot_gpgme_new_ctx (NULL, error);
+  if (context == NULL)
+    return FALSE;
+
+  g_autofree char *tmp_dir = NULL;
+  g_autoptr (GOutputStream) pubring_stream = NULL;
+  if (!ot_gpgme_ctx_tmp_home_dir (context, &tmp_dir, cached ? NULL : &pubring_stream,
+                                  cancellable, error))
+    return FALSE;
+  g_autofree char *pubring_path = g_build_filename (tmp_dir, "pubring.gpg", NULL);
+
+  if (cached)
+    {
+      g_debug ("Using cached GPG keyring %s", cached_name);
+      gsize len;
+      const guint8 *buf = g_bytes_get_data (cached, &len);
+      if (!glnx_file_replace_contents_at (AT_FDCWD, pubring_path, buf, len,
+                                          GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+        goto fail;
+    }
+  else
+    {
+      if (!_ostree_gpg_verifier_import_keys (self, context, pubring_stream, cancellable, error))
+        goto fail;
+
+      /* Failing to cache the keyring isn't fatal */
+      g_autoptr (GError) local_error = NULL;
+      if (cached_name != NULL
+          && !save_cached_keyring (self, pubring_path, cached_name, cached_sum_name, cancellable,
+                                   &local_error))
+        g_debug ("Caching GPG keyring: %s", local_error->message);
+    }
+
+  self->home_dir = g_steal_pointer (&tmp_dir);
+  return TRUE;
+
+fail:
+  ot_gpgme_kill_agent (tmp_dir);
+  (void)glnx_shutil_rm_rf_at (AT_FDCWD, tmp_dir, NULL, NULL);
+  return FALSE;
+}
+
 OstreeGpgVerifyResult *
 _ostree_gpg_verifier_check_signature (OstreeGpgVerifier *self, GBytes *signed_data,
                                       GBytes *signatures, GCancellable *cancellable, GError **error)
@@ -269,16 +526,9 @@ _ostree_gpg_verifier_check_signature (OstreeGpgVerifier *self, GBytes *signed_da
   gpgme_error_t gpg_error = 0;
   g_auto (gpgme_data_t) data_buffer = NULL;
   g_auto (gpgme_data_t) signature_buffer = NULL;
-  g_autofree char *tmp_dir = NULL;
-  g_autoptr (GOutputStream) target_stream = NULL;
   OstreeGpgVerifyResult *result = NULL;
   gboolean success = FALSE;
 
-  /* GPGME has no API for using multiple keyrings (aka, gpg --keyring),
-   * so we concatenate all the keyring files into one pubring.gpg in a
-   * temporary directory, then tell GPGME to use that directory as the
-   * home directory. */
-
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     goto out;
 
@@ -286,11 +536,18 @@ _ostree_gpg_verifier_check_signature (OstreeGpgVerifier *self, GBytes *signed_da
   if (result == NULL)
     goto out;
 
-  if (!ot_gpgme_ctx_tmp_home_dir (result->context, &tmp_dir, &target_stream, cancellable, error))
+  if (!ensure_home_dir (self, cancellable, error))
     goto out;
 
-  if (!_ostree_gpg_verifier_import_keys (self, result->context, target_stream, cancellable, error))
-    goto out;
+  /* Not documented, but gpgme_ctx_set_engine_info() accepts NULL for
+   * the executable file name, which leaves the old setting unchanged. */
+  gpg_error = gpgme_ctx_set_engine_info (result->context, GPGME_PROTOCOL_OpenPGP, NULL,
+                                         self->home_dir);
+  if (gpg_error != GPG_ERR_NO_ERROR)
+    {
+      ot_gpgme_throw (gpg_error, error, "gpgme_ctx_set_engine_info");
+      goto out;
+    }
 
   /* Both the signed data and signature GBytes instances will outlive the
    * gpgme_data_t structs, so we can safely reuse the GBytes memory buffer
@@ -329,20 +586,16 @@ _ostree_gpg_verifier_check_signature (OstreeGpgVerifier *self, GBytes *signed_da
 out:
   if (success)
     {
-      /* Keep the temporary directory around for the life of the result
-       * object so its GPGME context remains valid.  It may yet have to
-       * extract user details from signing keys and will need to access
-       * the fabricated pubring.gpg keyring. */
-      g_object_weak_ref (G_OBJECT (result), verify_result_finalized_cb, g_strdup (tmp_dir));
+      /* Keep the verifier, and so its home directory, around for the
+       * life of the result object so its GPGME context remains valid.
+       * It may yet have to extract user details from signing keys and
+       * will need to access the fabricated pubring.gpg keyring. */
+      g_object_weak_ref (G_OBJECT (result), verify_result_finalized_cb, g_object_ref (self));
     }
   else
     {
       /* Destroy the result object on error. */
       g_clear_object (&result);
-
-      /* Try to clean up the temporary directory. */
-      if (tmp_dir != NULL)
-        (void)glnx_shutil_rm_rf_at (AT_FDCWD, tmp_dir, NULL, NULL);
     }
 
   return result;
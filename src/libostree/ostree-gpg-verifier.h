@@ -75,4 +75,8 @@ gboolean _ostree_gpg_verifier_add_keyfile_dir_at (OstreeGpgVerifier *self, int d
                                                   const char *path, GCancellable *cancellable,
                                                   GError **error);
 
+const char *_ostree_gpg_verifier_get_fingerprint (OstreeGpgVerifier *self, GError **error);
+
+void _ostree_gpg_verifier_set_cache_dir (OstreeGpgVerifier *self, int dfd);
+
 G_END_DECLS
@@ -30,6 +30,7 @@
 #include "ostree-core-private.h"
 #include "ostree-repo-file.h"
 #include "ostree-repo-private.h"
+#include "ostree-sdt-private.h"
 #include "ostree-sepolicy-private.h"
 
 #define WHITEOUT_PREFIX ".wh."
@@ -89,14 +90,17 @@ checkout_object_for_uncompressed_cache (OstreeRepo *self, const char *loose_path
   if (!glnx_fchmod (tmpf.fd, file_mode, error))
     return FALSE;
 
-  if (self->uncompressed_objects_dir_fd == -1)
+  if (g_atomic_int_get (&self->uncompressed_objects_dir_fd) == -1)
     {
+      glnx_autofd int dfd = -1;
       if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, "uncompressed-objects-cache",
                                    DEFAULT_DIRECTORY_MODE, cancellable, error))
         return FALSE;
-      if (!glnx_opendirat (self->repo_dir_fd, "uncompressed-objects-cache", TRUE,
-                           &self->uncompressed_objects_dir_fd, error))
+      if (!glnx_opendirat (self->repo_dir_fd, "uncompressed-objects-cache", TRUE, &dfd, error))
         return FALSE;
+      /* Another thread checking out may have gotten here first */
+      if (g_atomic_int_compare_and_exchange (&self->uncompressed_objects_dir_fd, -1, dfd))
+        dfd = -1;
     }
 
   if (!_ostree_repo_ensure_loose_objdir_at (self->uncompressed_objects_dir_fd, loose_path,
@@ -129,8 +133,9 @@ write_regular_file_content (OstreeRepo *self, OstreeRepoCheckoutAtOptions *optio
       int infd = g_file_descriptor_based_get_fd ((GFileDescriptorBased *)input);
       guint64 len = g_file_info_get_size (file_info);
 
-      if (glnx_regfile_copy_bytes (infd, outfd, (off_t)len) < 0)
-        return glnx_throw_errno_prefix (error, "regfile copy");
+      /* Objects of sparse files are sparse too; keep the holes */
+      if (!ot_regfile_copy_sparse (infd, outfd, (off_t)len, error))
+        return FALSE;
     }
   else
     {
@@ -1140,9 +1145,11 @@ checkout_tree_at_recurse (OstreeRepo *self, OstreeRepoCheckoutAtOptions *options
         char tmp_checksum[OSTREE_SHA256_STRING_LEN + 1];
         _ostree_checksum_inplace_from_bytes_v (contents_csum_v, tmp_checksum);
 
+        OSTREE_PROBE2 (checkout_file_start, tmp_checksum, fname);
         if (!checkout_one_file_at (self, options, state, tmp_checksum, destination_dfd, fname,
                                    cancellable, error))
           return FALSE;
+        OSTREE_PROBE2 (checkout_file_done, tmp_checksum, fname);
 
         pop_path_element (options, state, fname, FALSE);
       }
@@ -1261,6 +1268,112 @@ compare_verity_digests (GVariant *metadata_composefs, const guchar *fsverity_dig
   return TRUE;
 }
 
+/* Generated images are kept in the repo cache directory, keyed by the
+ * commit and the version of the composefs digest metadata they match,
+ * because redeploying a commit (e.g. to change kernel arguments, or for a
+ * rollback) would otherwise need to walk the whole tree again.  Only
+ * commits with a composefs digest are cached, as that is what a cached
+ * image is validated against.
+ */
+static char *
+composefs_cache_path (const char *checksum)
+{
+  return g_strconcat (_OSTREE_COMPOSEFS_CACHE_DIR, "/", checksum, ".v0", NULL);
+}
+
+/* Put a copy of the image in @fd at @destination_path, preferring a
+ * hardlink to @fd's @link_dfd/@link_path (i.e. sharing the inode, including
+ * any fs-verity data), and otherwise a (possibly reflinked) copy.
+ */
+static gboolean
+link_or_copy_composefs (OstreeRepo *self, int fd, int link_dfd, const char *link_path,
+                        int destination_dfd, const char *destination_path, GError **error)
+{
+  if (!ot_ensure_unlinked_at (destination_dfd, destination_path, error))
+    return FALSE;
+  if (linkat (link_dfd, link_path, destination_dfd, destination_path, 0) == 0)
+    return TRUE;
+  if (!G_IN_SET (errno, EXDEV, EMLINK, EPERM))
+    return glnx_throw_errno_prefix (error, "linkat(%s)", destination_path);
+
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (destination_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+  if (glnx_regfile_copy_bytes (fd, tmpf.fd, (off_t)-1) < 0)
+    return glnx_throw_errno_prefix (error, "regfile copy");
+  if (!glnx_fchmod (tmpf.fd, 0644, error))
+    return FALSE;
+  if (!_ostree_tmpf_fsverity (self, &tmpf, NULL, error))
+    return FALSE;
+  return glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, destination_dfd,
+                               destination_path, error);
+}
+
+/* If a valid image for @checksum, matching the commit's composefs digest
+ * @metadata_composefs, is cached, put it at @destination_path and set
+ * @out_found.
+ */
+static gboolean
+checkout_cached_composefs (OstreeRepo *self, GVariant *metadata_composefs, int destination_dfd,
+                           const char *destination_path, const char *checksum,
+                           gboolean *out_found, GError **error)
+{
+  *out_found = FALSE;
+
+  if (self->cache_dir_fd == -1)
+    return TRUE;
+
+  g_autofree char *cache_path = composefs_cache_path (checksum);
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (self->cache_dir_fd, cache_path, &fd, error))
+    return FALSE;
+  if (fd == -1)
+    return TRUE;
+
+  guchar fsverity_digest[OSTREE_SHA256_DIGEST_LEN];
+  g_autoptr (GError) local_error = NULL;
+  if (!_ostree_composefs_measure_image (fd, fsverity_digest, error))
+    return FALSE;
+  if (!compare_verity_digests (metadata_composefs, fsverity_digest, &local_error))
+    {
+      g_debug ("Discarding cached composefs image: %s", local_error->message);
+      return ot_ensure_unlinked_at (self->cache_dir_fd, cache_path, error);
+    }
+
+  if (!link_or_copy_composefs (self, fd, self->cache_dir_fd, cache_path, destination_dfd,
+                               destination_path, error))
+    return FALSE;
+
+  g_debug ("Using cached composefs image for %s", checksum);
+  *out_found = TRUE;
+  return TRUE;
+}
+
+/* Add the newly generated image at @destination_path to the cache; this is
+ * best-effort, as it's just an optimization.
+ */
+static void
+cache_composefs (OstreeRepo *self, int destination_dfd, const char *destination_path,
+                 const char *checksum)
+{
+  if (self->cache_dir_fd == -1)
+    return;
+
+  g_autoptr (GError) local_error = NULL;
+  g_autofree char *cache_path = composefs_cache_path (checksum);
+  glnx_autofd int fd = -1;
+  if (!glnx_shutil_mkdir_p_at (self->cache_dir_fd, _OSTREE_COMPOSEFS_CACHE_DIR,
+                               DEFAULT_DIRECTORY_MODE, NULL, &local_error)
+      || !glnx_openat_rdonly (destination_dfd, destination_path, TRUE, &fd, &local_error)
+      || !link_or_copy_composefs (self, fd, destination_dfd, destination_path, self->cache_dir_fd,
+                                  cache_path, &local_error))
+    g_debug ("Failed to cache composefs image for %s: %s", checksum, local_error->message);
+}
+
 #endif
 
 /**
@@ -1274,6 +1387,10 @@ compare_verity_digests (GVariant *metadata_composefs, const guchar *fsverity_dig
  * @error: Error
  *
  * Create a composefs filesystem metadata blob from an OSTree commit.
+ *
+ * Images for commits with a composefs digest are cached in the repository,
+ * so checking out the same commit again (e.g. when redeploying it) reuses
+ * the previously generated image.
  */
 gboolean
 ostree_repo_checkout_composefs (OstreeRepo *self, GVariant *options, int destination_dfd,
@@ -1284,12 +1401,6 @@ ostree_repo_checkout_composefs (OstreeRepo *self, GVariant *options, int destina
   /* Force this for now */
   g_assert (options == NULL);
 
-  g_auto (GLnxTmpfile) tmpf = {
-    0,
-  };
-  if (!glnx_open_tmpfile_linkable_at (destination_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
-    return FALSE;
-
   g_autoptr (GVariant) commit_variant = NULL;
   if (!ostree_repo_load_commit (self, checksum, &commit_variant, NULL, error))
     return FALSE;
@@ -1298,6 +1409,21 @@ ostree_repo_checkout_composefs (OstreeRepo *self, GVariant *options, int destina
   g_autoptr (GVariant) metadata_composefs = g_variant_lookup_value (
       metadata, OSTREE_COMPOSEFS_DIGEST_KEY_V0, G_VARIANT_TYPE_BYTESTRING);
 
+  /* Without a digest there is nothing to validate a cached image against */
+  gboolean found_cached = FALSE;
+  if (metadata_composefs != NULL
+      && !checkout_cached_composefs (self, metadata_composefs, destination_dfd, destination_path,
+                                     checksum, &found_cached, error))
+    return FALSE;
+  if (found_cached)
+    return TRUE; /* Note early return */
+
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (destination_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
   g_autoptr (GFile) commit_root = NULL;
   if (!ostree_repo_read_commit (self, checksum, &commit_root, NULL, cancellable, error))
     return FALSE;
@@ -1326,6 +1452,9 @@ ostree_repo_checkout_composefs (OstreeRepo *self, GVariant *options, int destina
                              error))
     return FALSE;
 
+  if (metadata_composefs != NULL)
+    cache_composefs (self, destination_dfd, destination_path, checksum);
+
   return TRUE;
 #else
   return composefs_not_supported (error);
@@ -32,11 +32,13 @@
 #include <sys/ioctl.h>
 #include <sys/statvfs.h>
 #include <sys/xattr.h>
+#include <zlib.h>
 
 #include "ostree-checksum-input-stream.h"
 #include "ostree-core-private.h"
 #include "ostree-repo-file-enumerator.h"
 #include "ostree-repo-private.h"
+#include "ostree-sdt-private.h"
 #include "ostree-sepolicy-private.h"
 #include "ostree-varint.h"
 #include "ostree.h"
@@ -71,10 +73,11 @@
 static int
 commit_dest_dfd (OstreeRepo *self)
 {
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   if (self->per_object_fsync)
     return self->objects_dir_fd;
-  else if (self->in_transaction && !self->disable_fsync)
-    return self->commit_stagedir.fd;
+  else if (txn->active && !self->disable_fsync)
+    return txn->stagedir.fd;
   else
     return self->objects_dir_fd;
 }
@@ -87,8 +90,9 @@ commit_dest_dfd (OstreeRepo *self)
 static int
 commit_tmp_dfd (OstreeRepo *self)
 {
-  if (self->in_transaction)
-    return self->commit_stagedir.fd;
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  if (txn->active)
+    return txn->stagedir.fd;
   else
     return self->tmp_dir_fd;
 }
@@ -301,8 +305,10 @@ commit_loose_regfile_object (OstreeRepo *self, const char *checksum, GLnxTmpfile
    */
   if (!self->disable_fsync && self->per_object_fsync)
     {
+      OSTREE_PROBE2 (fsync_start, self, checksum);
       if (fsync (tmpf->fd) == -1)
         return glnx_throw_errno_prefix (error, "fsync");
+      OSTREE_PROBE2 (fsync_done, self, checksum);
     }
 
   if (!_ostree_repo_commit_tmpf_final (self, checksum, OSTREE_OBJECT_TYPE_FILE, tmpf, cancellable,
@@ -339,6 +345,9 @@ content_size_cache_entry_free (gpointer entry)
     g_slice_free (OstreeContentSizeCacheEntry, entry);
 }
 
+/* Object sizes are collected per transaction (see OstreeTransaction), so
+ * concurrent transactions each get the sizes of their own commits.
+ */
 void
 _ostree_repo_setup_generate_sizes (OstreeRepo *self, OstreeRepoCommitModifier *modifier)
 {
@@ -346,34 +355,41 @@ _ostree_repo_setup_generate_sizes (OstreeRepo *self, OstreeRepoCommitModifier *m
     {
       if (ostree_repo_get_mode (self) == OSTREE_REPO_MODE_ARCHIVE)
         {
-          self->generate_sizes = TRUE;
+          OstreeTransaction *txn = _ostree_repo_get_txn (self);
 
+          g_mutex_lock (&self->txn_lock);
+          txn->generate_sizes = TRUE;
           /* Clear any stale data in the object sizes hash table */
-          if (self->object_sizes != NULL)
-            g_hash_table_remove_all (self->object_sizes);
+          if (txn->object_sizes != NULL)
+            g_hash_table_remove_all (txn->object_sizes);
+          g_mutex_unlock (&self->txn_lock);
         }
       else
         g_debug ("Not generating sizes for non-archive repo");
     }
 }
 
-static void
-repo_ensure_size_entries (OstreeRepo *self)
+static gboolean
+repo_generating_sizes (OstreeRepo *self)
 {
-  if (G_UNLIKELY (self->object_sizes == NULL))
-    self->object_sizes
-        = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, content_size_cache_entry_free);
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->txn_lock);
+  return txn->generate_sizes;
 }
 
+/* Whether sizes are being generated and there's no entry for this object yet */
 static gboolean
-repo_has_size_entry (OstreeRepo *self, OstreeObjectType objtype, const gchar *checksum)
+repo_needs_size_entry (OstreeRepo *self, OstreeObjectType objtype, const gchar *checksum)
 {
   /* Only file, dirtree and dirmeta objects appropriate for size metadata */
   if (objtype > OSTREE_OBJECT_TYPE_DIR_META)
-    return TRUE;
+    return FALSE;
 
-  repo_ensure_size_entries (self);
-  return (g_hash_table_lookup (self->object_sizes, checksum) != NULL);
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->txn_lock);
+  if (!txn->generate_sizes)
+    return FALSE;
+  return (txn->object_sizes == NULL || !g_hash_table_contains (txn->object_sizes, checksum));
 }
 
 static void
@@ -384,8 +400,12 @@ repo_store_size_entry (OstreeRepo *self, OstreeObjectType objtype, const gchar *
   if (objtype > OSTREE_OBJECT_TYPE_DIR_META)
     return;
 
-  repo_ensure_size_entries (self);
-  g_hash_table_replace (self->object_sizes, g_strdup (checksum),
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->txn_lock);
+  if (G_UNLIKELY (txn->object_sizes == NULL))
+    txn->object_sizes
+        = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, content_size_cache_entry_free);
+  g_hash_table_replace (txn->object_sizes, g_strdup (checksum),
                         content_size_cache_entry_new (objtype, unpacked, archived));
 }
 
@@ -404,7 +424,10 @@ compare_ascii_checksums_for_sorting (gconstpointer a_pp, gconstpointer b_pp)
 static void
 add_size_index_to_metadata (OstreeRepo *self, GVariantBuilder *builder)
 {
-  if (self->object_sizes && g_hash_table_size (self->object_sizes) > 0)
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->txn_lock);
+
+  if (txn->object_sizes && g_hash_table_size (txn->object_sizes) > 0)
     {
       GVariantBuilder index_builder;
       g_variant_builder_init (&index_builder,
@@ -412,7 +435,7 @@ add_size_index_to_metadata (OstreeRepo *self, GVariantBuilder *builder)
 
       /* Sort the checksums so we can bsearch if desired */
       g_autoptr (GPtrArray) sorted_keys = g_ptr_array_new ();
-      GLNX_HASH_TABLE_FOREACH (self->object_sizes, const char *, e_checksum)
+      GLNX_HASH_TABLE_FOREACH (txn->object_sizes, const char *, e_checksum)
         g_ptr_array_add (sorted_keys, (gpointer)e_checksum);
       g_ptr_array_sort (sorted_keys, compare_ascii_checksums_for_sorting);
 
@@ -426,7 +449,7 @@ add_size_index_to_metadata (OstreeRepo *self, GVariantBuilder *builder)
           g_string_append_len (buffer, (char *)csum, sizeof (csum));
 
           OstreeContentSizeCacheEntry *e_size
-              = g_hash_table_lookup (self->object_sizes, e_checksum);
+              = g_hash_table_lookup (txn->object_sizes, e_checksum);
           _ostree_write_varuint64 (buffer, e_size->archived);
           _ostree_write_varuint64 (buffer, e_size->unpacked);
           g_string_append_c (buffer, (gchar)e_size->objtype);
@@ -439,7 +462,7 @@ add_size_index_to_metadata (OstreeRepo *self, GVariantBuilder *builder)
                              g_variant_builder_end (&index_builder));
 
       /* Clear the object sizes hash table for a subsequent commit. */
-      g_hash_table_remove_all (self->object_sizes);
+      g_hash_table_remove_all (txn->object_sizes);
     }
 }
 
@@ -534,27 +557,28 @@ _ostree_repo_bare_content_commit (OstreeRepo *self, OstreeRepoBareContent *barew
                                   char *checksum_buf, size_t buflen, GCancellable *cancellable,
                                   GError **error)
 {
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   OstreeRealRepoBareContent *real = (OstreeRealRepoBareContent *)barewrite;
   g_assert (real->initialized);
 
-  if ((self->min_free_space_percent > 0 || self->min_free_space_mb > 0) && self->in_transaction)
+  if ((self->min_free_space_percent > 0 || self->min_free_space_mb > 0) && txn->active)
     {
       struct stat st_buf;
       if (!glnx_fstat (real->tmpf.fd, &st_buf, error))
         return FALSE;
 
       g_mutex_lock (&self->txn_lock);
-      g_assert_cmpint (self->txn.blocksize, >, 0);
+      g_assert_cmpint (txn->blocksize, >, 0);
 
-      const fsblkcnt_t object_blocks = (st_buf.st_size / self->txn.blocksize) + 1;
-      if (object_blocks > self->txn.max_blocks)
+      const fsblkcnt_t object_blocks = (st_buf.st_size / txn->blocksize) + 1;
+      if (object_blocks > txn->max_blocks)
         {
-          self->cleanup_stagedir = TRUE;
+          txn->cleanup_stagedir = TRUE;
           g_mutex_unlock (&self->txn_lock);
           return throw_min_free_space_error (self, st_buf.st_size, error);
         }
       /* This is the main bit that needs mutex protection */
-      self->txn.max_blocks -= object_blocks;
+      txn->max_blocks -= object_blocks;
       g_mutex_unlock (&self->txn_lock);
     }
 
@@ -587,6 +611,44 @@ _ostree_repo_bare_content_cleanup (OstreeRepoBareContent *regwrite)
   real->initialized = FALSE;
 }
 
+/* Holes in sparse objects are created at this granularity */
+#define SPARSE_BLOCK_SIZE 4096
+
+static gboolean
+is_all_zeroes (const guint8 *buf, gsize len)
+{
+  return len == 0 || (buf[0] == 0 && memcmp (buf, buf + 1, len - 1) == 0);
+}
+
+/* Write @buf at @offset of @fd, but leave blocks which are all zeroes
+ * as holes.
+ */
+static gboolean
+write_skipping_zeroes (int fd, const guint8 *buf, gsize len, guint64 offset, GError **error)
+{
+  while (len > 0)
+    {
+      gsize n = MIN (len, SPARSE_BLOCK_SIZE - (offset % SPARSE_BLOCK_SIZE));
+      if (!is_all_zeroes (buf, n))
+        {
+          gsize written = 0;
+          while (written < n)
+            {
+              gssize r = TEMP_FAILURE_RETRY (
+                  pwrite (fd, buf + written, n - written, offset + written));
+              if (r < 0)
+                return glnx_throw_errno_prefix (error, "pwrite");
+              written += r;
+            }
+        }
+      buf += n;
+      len -= n;
+      offset += n;
+    }
+
+  return TRUE;
+}
+
 /* Allocate an O_TMPFILE, write everything from @input to it, but
  * not exceeding @length.
  */
@@ -605,6 +667,8 @@ create_regular_tmpfile_linkable_with_content (OstreeRepo *self, guint64 length,
 
   // Try to do a reflink if possible; if we hit this case we're operating on trusted local input.
   gboolean did_clone = FALSE;
+  /* If the input is a sparse file, so is the object */
+  gboolean sparse = FALSE;
   if (G_IS_FILE_DESCRIPTOR_BASED (original_input))
     {
       int infd = g_file_descriptor_based_get_fd ((GFileDescriptorBased *)original_input);
@@ -612,8 +676,12 @@ create_regular_tmpfile_linkable_with_content (OstreeRepo *self, guint64 length,
         {
           did_clone = TRUE;
         }
+      else if (!ot_fd_has_holes (infd, length, &sparse, error))
+        return FALSE;
     }
-  else
+
+  /* Preallocate to reduce fragmentation, except where we want holes */
+  if (!did_clone && !sparse)
     {
       if (!glnx_try_fallocate (tmpf.fd, 0, length, error))
         return FALSE;
@@ -638,11 +706,21 @@ create_regular_tmpfile_linkable_with_content (OstreeRepo *self, guint64 length,
                            "Unexpected EOF with %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT
                            " bytes remaining",
                            remaining, length);
-      if (!did_clone && glnx_loop_write (tmpf.fd, buf, bytes_read) < 0)
+      if (sparse)
+        {
+          if (!write_skipping_zeroes (tmpf.fd, (guint8 *)buf, bytes_read, length - remaining,
+                                      error))
+            return FALSE;
+        }
+      else if (!did_clone && glnx_loop_write (tmpf.fd, buf, bytes_read) < 0)
         return glnx_throw_errno_prefix (error, "write");
       remaining -= bytes_read;
     }
 
+  /* Extend the file over a trailing hole */
+  if (sparse && ftruncate (tmpf.fd, length) < 0)
+    return glnx_throw_errno_prefix (error, "ftruncate");
+
   if (!glnx_fchmod (tmpf.fd, 0644, error))
     return FALSE;
 
@@ -774,10 +852,11 @@ _try_clone_from_payload_link (OstreeRepo *self, OstreeRepo *dest_repo, const cha
                               GFileInfo *file_info, GLnxTmpfile *tmpf, GCancellable *cancellable,
                               GError **error)
 {
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   gboolean reflinks_supported = FALSE;
   int dfd_searches[] = { -1, self->objects_dir_fd };
-  if (self->commit_stagedir.initialized)
-    dfd_searches[0] = self->commit_stagedir.fd;
+  if (txn->stagedir.initialized)
+    dfd_searches[0] = txn->stagedir.fd;
 
   /* The two repositories are on different devices */
   if (self->device != dest_repo->device)
@@ -862,10 +941,13 @@ write_content_object (OstreeRepo *self, const char *expected_checksum, GInputStr
                       GFileInfo *file_info, GVariant *xattrs, guchar **out_csum,
                       GCancellable *cancellable, GError **error)
 {
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   g_assert (expected_checksum != NULL || out_csum != NULL);
 
   GLNX_AUTO_PREFIX_ERROR ("Writing content object", error);
 
+  OSTREE_PROBE2 (write_content_start, self, expected_checksum);
+
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
@@ -956,20 +1038,20 @@ write_content_object (OstreeRepo *self, const char *expected_checksum, GInputStr
   (void)file_input_owned; // Conditionally owned
 
   /* Free space check; only applies during transactions */
-  if ((self->min_free_space_percent > 0 || self->min_free_space_mb > 0) && self->in_transaction)
+  if ((self->min_free_space_percent > 0 || self->min_free_space_mb > 0) && txn->active)
     {
       g_mutex_lock (&self->txn_lock);
-      g_assert_cmpint (self->txn.blocksize, >, 0);
-      const fsblkcnt_t object_blocks = (size / self->txn.blocksize) + 1;
-      if (object_blocks > self->txn.max_blocks)
+      g_assert_cmpint (txn->blocksize, >, 0);
+      const fsblkcnt_t object_blocks = (size / txn->blocksize) + 1;
+      if (object_blocks > txn->max_blocks)
         {
-          guint64 bytes_required = (guint64)object_blocks * self->txn.blocksize;
-          self->cleanup_stagedir = TRUE;
+          guint64 bytes_required = (guint64)object_blocks * txn->blocksize;
+          txn->cleanup_stagedir = TRUE;
           g_mutex_unlock (&self->txn_lock);
           return throw_min_free_space_error (self, bytes_required, error);
         }
       /* This is the main bit that needs mutex protection */
-      self->txn.max_blocks -= object_blocks;
+      txn->max_blocks -= object_blocks;
       g_mutex_unlock (&self->txn_lock);
     }
 
@@ -1078,7 +1160,7 @@ write_content_object (OstreeRepo *self, const char *expected_checksum, GInputStr
   g_assert (actual_checksum != NULL); /* Pacify static analysis */
 
   /* Update size metadata if configured and entry missing */
-  if (self->generate_sizes && !repo_has_size_entry (self, OSTREE_OBJECT_TYPE_FILE, actual_checksum))
+  if (repo_needs_size_entry (self, OSTREE_OBJECT_TYPE_FILE, actual_checksum))
     {
       struct stat stbuf;
 
@@ -1100,7 +1182,7 @@ write_content_object (OstreeRepo *self, const char *expected_checksum, GInputStr
   if (have_obj)
     {
       g_mutex_lock (&self->txn_lock);
-      self->txn.stats.content_objects_total++;
+      txn->stats.content_objects_total++;
       g_mutex_unlock (&self->txn_lock);
 
       if (!_create_payload_link (self, actual_checksum, actual_payload_checksum, file_info,
@@ -1109,6 +1191,7 @@ write_content_object (OstreeRepo *self, const char *expected_checksum, GInputStr
 
       if (out_csum)
         *out_csum = ostree_checksum_to_bytes (actual_checksum);
+      OSTREE_PROBE3 (write_content_done, self, actual_checksum, FALSE);
       /* Note early return */
       return TRUE;
     }
@@ -1175,10 +1258,10 @@ write_content_object (OstreeRepo *self, const char *expected_checksum, GInputStr
 
   /* Update statistics */
   g_mutex_lock (&self->txn_lock);
-  self->txn.stats.content_objects_written++;
+  txn->stats.content_objects_written++;
   if (g_file_info_has_attribute (file_info, "standard::size"))
-    self->txn.stats.content_bytes_written += g_file_info_get_size (file_info);
-  self->txn.stats.content_objects_total++;
+    txn->stats.content_bytes_written += g_file_info_get_size (file_info);
+  txn->stats.content_objects_total++;
   g_mutex_unlock (&self->txn_lock);
 
   if (out_csum)
@@ -1187,6 +1270,7 @@ write_content_object (OstreeRepo *self, const char *expected_checksum, GInputStr
       *out_csum = ostree_checksum_to_bytes (actual_checksum);
     }
 
+  OSTREE_PROBE3 (write_content_done, self, actual_checksum, TRUE);
   return TRUE;
 }
 
@@ -1299,6 +1383,7 @@ static gboolean
 write_metadata_object (OstreeRepo *self, OstreeObjectType objtype, const char *expected_checksum,
                        GBytes *buf, guchar **out_csum, GCancellable *cancellable, GError **error)
 {
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   g_assert (expected_checksum != NULL || out_csum != NULL);
 
   GLNX_AUTO_PREFIX_ERROR ("Writing metadata object", error);
@@ -1342,11 +1427,11 @@ write_metadata_object (OstreeRepo *self, OstreeObjectType objtype, const char *e
       if (have_obj)
         {
           /* Update size metadata if needed */
-          if (self->generate_sizes && !repo_has_size_entry (self, objtype, actual_checksum))
+          if (repo_needs_size_entry (self, objtype, actual_checksum))
             repo_store_size_entry (self, objtype, actual_checksum, len, len);
 
           g_mutex_lock (&self->txn_lock);
-          self->txn.stats.metadata_objects_total++;
+          txn->stats.metadata_objects_total++;
           g_mutex_unlock (&self->txn_lock);
 
           if (out_csum)
@@ -1367,7 +1452,7 @@ write_metadata_object (OstreeRepo *self, OstreeObjectType objtype, const char *e
   const guint8 *bufp = g_bytes_get_data (buf, &len);
 
   /* Update size metadata if needed */
-  if (self->generate_sizes && !repo_has_size_entry (self, objtype, actual_checksum))
+  if (repo_needs_size_entry (self, objtype, actual_checksum))
     repo_store_size_entry (self, objtype, actual_checksum, len, len);
 
   /* Write the metadata to a temporary file */
@@ -1408,8 +1493,8 @@ write_metadata_object (OstreeRepo *self, OstreeObjectType objtype, const char *e
 
   /* Update the stats, note we both wrote one and add to total */
   g_mutex_lock (&self->txn_lock);
-  self->txn.stats.metadata_objects_written++;
-  self->txn.stats.metadata_objects_total++;
+  txn->stats.metadata_objects_written++;
+  txn->stats.metadata_objects_total++;
   g_mutex_unlock (&self->txn_lock);
 
   if (out_csum)
@@ -1533,9 +1618,10 @@ devino_cache_lookup (OstreeRepo *self, OstreeRepoCommitModifier *modifier, guint
   OstreeDevIno dev_ino_key;
   OstreeDevIno *dev_ino_val;
   GHashTable *cache;
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
 
-  if (self->loose_object_devino_hash)
-    cache = self->loose_object_devino_hash;
+  if (txn->loose_object_devino_hash)
+    cache = txn->loose_object_devino_hash;
   else if (modifier && modifier->devino_cache)
     cache = modifier->devino_cache;
   else
@@ -1579,13 +1665,79 @@ ostree_repo_scan_hardlinks (OstreeRepo *self, GCancellable *cancellable, GError
   g_assert (self != NULL);
   g_assert (OSTREE_IS_REPO (self));
 
-  if (!self->in_transaction)
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  if (!txn->active)
     return glnx_throw (error, "Failed to scan hardlinks, not in a transaction");
 
-  if (!self->loose_object_devino_hash)
-    self->loose_object_devino_hash = (GHashTable *)ostree_repo_devino_cache_new ();
-  g_hash_table_remove_all (self->loose_object_devino_hash);
-  return scan_loose_devino (self, self->loose_object_devino_hash, cancellable, error);
+  if (!txn->loose_object_devino_hash)
+    txn->loose_object_devino_hash = (GHashTable *)ostree_repo_devino_cache_new ();
+  g_hash_table_remove_all (txn->loose_object_devino_hash);
+  return scan_loose_devino (self, txn->loose_object_devino_hash, cancellable, error);
+}
+
+/* Start @txn: take a shared repo lock, reserve free space and allocate a
+ * staging directory. On failure, the caller must abort @txn.
+ */
+static gboolean
+transaction_prepare (OstreeRepo *self, OstreeTransaction *txn, gboolean *out_transaction_resume,
+                     GCancellable *cancellable, GError **error)
+{
+  memset (&txn->stats, 0, sizeof (OstreeRepoTransactionStats));
+
+  txn->locked = ostree_repo_lock_push (self, OSTREE_REPO_LOCK_SHARED, cancellable, error);
+  if (!txn->locked)
+    return FALSE;
+
+  txn->active = TRUE;
+  txn->cleanup_stagedir = FALSE;
+
+  struct statvfs stvfsbuf;
+  if (TEMP_FAILURE_RETRY (fstatvfs (self->repo_dir_fd, &stvfsbuf)) < 0)
+    return glnx_throw_errno_prefix (error, "fstatvfs");
+
+  g_mutex_lock (&self->txn_lock);
+  txn->blocksize = stvfsbuf.f_bsize;
+  guint64 reserved_bytes = 0;
+  if (!ostree_repo_get_min_free_space_bytes (self, &reserved_bytes, error))
+    {
+      g_mutex_unlock (&self->txn_lock);
+      return FALSE;
+    }
+  txn->reserved_blocks = reserved_bytes / txn->blocksize;
+
+  /* Use the appropriate free block count if we're unprivileged */
+  guint64 bfree = (getuid () != 0 ? stvfsbuf.f_bavail : stvfsbuf.f_bfree);
+  if (bfree > txn->reserved_blocks)
+    txn->max_blocks = bfree - txn->reserved_blocks;
+  else
+    {
+      txn->max_blocks = 0;
+      /* Don't throw_min_free_space_error here; reason being that
+       * this transaction could be just committing metadata objects
+       * which are relatively small in size and we do not really
+       * want to block them via min-free-space-* value. Metadata
+       * objects helps in housekeeping and hence should be kept
+       * out of the strict min-free-space values.
+       *
+       * The main drivers for writing content objects will always honor
+       * the min-free-space value and throw_min_free_space_error in
+       * case of overstepping the number of reserved blocks.
+       */
+    }
+  g_mutex_unlock (&self->txn_lock);
+
+  /* Each concurrent transaction gets its own staging directory, since
+   * _ostree_repo_allocate_tmpdir() skips locked ones.
+   */
+  gboolean ret_transaction_resume = FALSE;
+  if (!_ostree_repo_allocate_tmpdir (self->tmp_dir_fd, self->stagedir_prefix, &txn->stagedir,
+                                     &txn->stagedir_lock, &ret_transaction_resume, cancellable,
+                                     error))
+    return FALSE;
+
+  if (out_transaction_resume)
+    *out_transaction_resume = ret_transaction_resume;
+  return TRUE;
 }
 
 /**
@@ -1606,10 +1758,11 @@ ostree_repo_scan_hardlinks (OstreeRepo *self, GCancellable *cancellable, GError
  * repository if interrupted during ostree_repo_commit_transaction(), and
  * further writing refs is also not currently atomic.
  *
- * There can be at most one transaction active on a repo at a time per instance
- * of `OstreeRepo`; however, it is safe to have multiple threads writing objects
- * on a single `OstreeRepo` instance as long as their lifetime is bounded by the
- * transaction.
+ * There can be at most one transaction started this way on a repo at a time
+ * per instance of `OstreeRepo`; however, it is safe to have multiple threads
+ * writing objects on a single `OstreeRepo` instance as long as their lifetime is
+ * bounded by the transaction. To run independent transactions in parallel on
+ * one instance, see ostree_transaction_new().
  *
  * Locking: Acquires a `shared` lock; release via commit or abort
  * Multithreading: This function is *not* MT safe; only one transaction can be
@@ -1622,7 +1775,7 @@ ostree_repo_prepare_transaction (OstreeRepo *self, gboolean *out_transaction_res
   g_assert (self != NULL);
   g_assert (OSTREE_IS_REPO (self));
 
-  if (self->in_transaction)
+  if (self->txn.active)
     return glnx_throw (error, "Failed to prepare transaction, another transaction is in progress");
 
   g_debug ("Preparing transaction in repository %p", self);
@@ -1633,62 +1786,13 @@ ostree_repo_prepare_transaction (OstreeRepo *self, gboolean *out_transaction_res
   g_autoptr (OstreeRepoAutoTransaction) txn = _ostree_repo_auto_transaction_new (self);
   g_assert (txn != NULL);
 
-  memset (&self->txn.stats, 0, sizeof (OstreeRepoTransactionStats));
-
-  self->txn_locked = ostree_repo_lock_push (self, OSTREE_REPO_LOCK_SHARED, cancellable, error);
-  if (!self->txn_locked)
-    return FALSE;
-
-  self->in_transaction = TRUE;
-  self->cleanup_stagedir = FALSE;
-
-  struct statvfs stvfsbuf;
-  if (TEMP_FAILURE_RETRY (fstatvfs (self->repo_dir_fd, &stvfsbuf)) < 0)
-    return glnx_throw_errno_prefix (error, "fstatvfs");
-
-  g_mutex_lock (&self->txn_lock);
-  self->txn.blocksize = stvfsbuf.f_bsize;
-  guint64 reserved_bytes = 0;
-  if (!ostree_repo_get_min_free_space_bytes (self, &reserved_bytes, error))
-    {
-      g_mutex_unlock (&self->txn_lock);
-      return FALSE;
-    }
-  self->reserved_blocks = reserved_bytes / self->txn.blocksize;
-
-  /* Use the appropriate free block count if we're unprivileged */
-  guint64 bfree = (getuid () != 0 ? stvfsbuf.f_bavail : stvfsbuf.f_bfree);
-  if (bfree > self->reserved_blocks)
-    self->txn.max_blocks = bfree - self->reserved_blocks;
-  else
-    {
-      self->txn.max_blocks = 0;
-      /* Don't throw_min_free_space_error here; reason being that
-       * this transaction could be just committing metadata objects
-       * which are relatively small in size and we do not really
-       * want to block them via min-free-space-* value. Metadata
-       * objects helps in housekeeping and hence should be kept
-       * out of the strict min-free-space values.
-       *
-       * The main drivers for writing content objects will always honor
-       * the min-free-space value and throw_min_free_space_error in
-       * case of overstepping the number of reserved blocks.
-       */
-    }
-  g_mutex_unlock (&self->txn_lock);
-
-  gboolean ret_transaction_resume = FALSE;
-  if (!_ostree_repo_allocate_tmpdir (self->tmp_dir_fd, self->stagedir_prefix,
-                                     &self->commit_stagedir, &self->commit_stagedir_lock,
-                                     &ret_transaction_resume, cancellable, error))
+  if (!transaction_prepare (self, &self->txn, out_transaction_resume, cancellable, error))
     return FALSE;
 
   /* Success: do not abort the transaction when returning. */
   g_clear_object (&txn->repo);
   (void)txn;
 
-  if (out_transaction_resume)
-    *out_transaction_resume = ret_transaction_resume;
   return TRUE;
 }
 
@@ -1704,6 +1808,8 @@ fsync_object_dirs (OstreeRepo *self, GCancellable *cancellable, GError **error)
   if (self->disable_fsync)
     return TRUE; /* No fsync?  Nothing to do then. */
 
+  OSTREE_PROBE1 (fsync_objdirs_start, self);
+
   if (!glnx_dirfd_iterator_init_at (self->objects_dir_fd, ".", FALSE, &dfd_iter, error))
     return FALSE;
   while (TRUE)
@@ -1734,6 +1840,7 @@ fsync_object_dirs (OstreeRepo *self, GCancellable *cancellable, GError **error)
   if (fsync (self->objects_dir_fd) == -1)
     return glnx_throw_errno_prefix (error, "fsync");
 
+  OSTREE_PROBE1 (fsync_objdirs_done, self);
   return TRUE;
 }
 
@@ -1744,14 +1851,15 @@ fsync_object_dirs (OstreeRepo *self, GCancellable *cancellable, GError **error)
  * https://github.com/ostreedev/ostree/issues/1184
  */
 static gboolean
-rename_pending_loose_objects (OstreeRepo *self, GCancellable *cancellable, GError **error)
+rename_pending_loose_objects (OstreeRepo *self, OstreeTransaction *txn, GCancellable *cancellable,
+                              GError **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("rename pending", error);
   g_auto (GLnxDirFdIterator) dfd_iter = {
     0,
   };
 
-  if (!glnx_dirfd_iterator_init_at (self->commit_stagedir.fd, ".", FALSE, &dfd_iter, error))
+  if (!glnx_dirfd_iterator_init_at (txn->stagedir.fd, ".", FALSE, &dfd_iter, error))
     return FALSE;
 
   /* Iterate over the outer checksum dir */
@@ -1810,8 +1918,8 @@ rename_pending_loose_objects (OstreeRepo *self, GCancellable *cancellable, GErro
  * ostree_repo_prepare_transaction().
  */
 static gboolean
-cleanup_txn_dir (OstreeRepo *self, int dfd, const char *path, GCancellable *cancellable,
-                 GError **error)
+cleanup_txn_dir (OstreeRepo *self, OstreeTransaction *txn, int dfd, const char *path,
+                 GCancellable *cancellable, GError **error)
 {
   const char *errprefix = glnx_strjoina ("Cleaning up txn dir ", path);
   GLNX_AUTO_PREFIX_ERROR (errprefix, error);
@@ -1829,10 +1937,10 @@ cleanup_txn_dir (OstreeRepo *self, int dfd, const char *path, GCancellable *canc
 
   /* If however this is the staging directory for the *current*
    * boot, then don't delete it now - we may end up reusing it, as
-   * is the point. Delete *only if* we have hit min-free-space* checks
+   * is the point. Delete *only if* @txn has hit min-free-space* checks
    * as we don't want to hold onto caches in that case.
    */
-  if (g_str_has_prefix (path, self->stagedir_prefix) && !self->cleanup_stagedir)
+  if (g_str_has_prefix (path, self->stagedir_prefix) && !txn->cleanup_stagedir)
     return TRUE; /* Note early return */
 
   /* But, crucially we can now clean up staging directories
@@ -1851,7 +1959,8 @@ cleanup_txn_dir (OstreeRepo *self, int dfd, const char *path, GCancellable *canc
  * https://github.com/ostreedev/ostree/issues/713
  */
 static gboolean
-cleanup_tmpdir (OstreeRepo *self, GCancellable *cancellable, GError **error)
+cleanup_tmpdir (OstreeRepo *self, OstreeTransaction *txn, GCancellable *cancellable,
+                GError **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("tmpdir cleanup", error);
   const guint64 curtime_secs = g_get_real_time () / 1000000;
@@ -1885,7 +1994,7 @@ cleanup_tmpdir (OstreeRepo *self, GCancellable *cancellable, GError **error)
       /* Handle transaction tmpdirs */
       if (_ostree_repo_has_staging_prefix (dent->d_name) && S_ISDIR (stbuf.st_mode))
         {
-          if (!cleanup_txn_dir (self, dfd_iter.fd, dent->d_name, cancellable, error))
+          if (!cleanup_txn_dir (self, txn, dfd_iter.fd, dent->d_name, cancellable, error))
             return FALSE;
           continue; /* We've handled this, move on */
         }
@@ -1916,12 +2025,12 @@ cleanup_tmpdir (OstreeRepo *self, GCancellable *cancellable, GError **error)
 }
 
 static void
-ensure_txn_refs (OstreeRepo *self)
+ensure_txn_refs (OstreeTransaction *txn)
 {
-  if (self->txn.refs == NULL)
-    self->txn.refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-  if (self->txn.collection_refs == NULL)
-    self->txn.collection_refs
+  if (txn->refs == NULL)
+    txn->refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  if (txn->collection_refs == NULL)
+    txn->collection_refs
         = g_hash_table_new_full (ostree_collection_ref_hash, ostree_collection_ref_equal,
                                  (GDestroyNotify)ostree_collection_ref_free, g_free);
 }
@@ -1999,6 +2108,41 @@ ostree_repo_mark_commit_partial (OstreeRepo *self, const char *checksum, gboolea
                                                  OSTREE_REPO_COMMIT_STATE_NORMAL, error);
 }
 
+static void
+transaction_set_ref (OstreeRepo *self, OstreeTransaction *txn, const char *remote,
+                     const char *ref, const char *checksum)
+{
+  g_assert (txn->active == TRUE);
+
+  char *refspec;
+  if (remote)
+    refspec = g_strdup_printf ("%s:%s", remote, ref);
+  else
+    refspec = g_strdup (ref);
+
+  g_mutex_lock (&self->txn_lock);
+  ensure_txn_refs (txn);
+  g_hash_table_replace (txn->refs, refspec, g_strdup (checksum));
+  g_mutex_unlock (&self->txn_lock);
+}
+
+static void
+transaction_set_collection_ref (OstreeRepo *self, OstreeTransaction *txn,
+                                const OstreeCollectionRef *ref, const char *checksum)
+{
+  g_assert (txn->active == TRUE);
+  g_assert (ref != NULL);
+
+  // TODO(lucab): introduce a method with error-returning in order to deprecate
+  // this one, because it can silently fail.
+  g_return_if_fail (checksum == NULL || ostree_validate_checksum_string (checksum, NULL));
+
+  g_mutex_lock (&self->txn_lock);
+  ensure_txn_refs (txn);
+  g_hash_table_replace (txn->collection_refs, ostree_collection_ref_dup (ref), g_strdup (checksum));
+  g_mutex_unlock (&self->txn_lock);
+}
+
 /**
  * ostree_repo_transaction_set_refspec:
  * @self: An #OstreeRepo
@@ -2016,11 +2160,13 @@ ostree_repo_transaction_set_refspec (OstreeRepo *self, const char *refspec, cons
 {
   g_assert (self != NULL);
   g_assert (OSTREE_IS_REPO (self));
-  g_assert (self->in_transaction == TRUE);
+
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  g_assert (txn->active == TRUE);
 
   g_mutex_lock (&self->txn_lock);
-  ensure_txn_refs (self);
-  g_hash_table_replace (self->txn.refs, g_strdup (refspec), g_strdup (checksum));
+  ensure_txn_refs (txn);
+  g_hash_table_replace (txn->refs, g_strdup (refspec), g_strdup (checksum));
   g_mutex_unlock (&self->txn_lock);
 }
 
@@ -2059,18 +2205,8 @@ ostree_repo_transaction_set_ref (OstreeRepo *self, const char *remote, const cha
 {
   g_assert (self != NULL);
   g_assert (OSTREE_IS_REPO (self));
-  g_assert (self->in_transaction == TRUE);
-
-  char *refspec;
-  if (remote)
-    refspec = g_strdup_printf ("%s:%s", remote, ref);
-  else
-    refspec = g_strdup (ref);
 
-  g_mutex_lock (&self->txn_lock);
-  ensure_txn_refs (self);
-  g_hash_table_replace (self->txn.refs, refspec, g_strdup (checksum));
-  g_mutex_unlock (&self->txn_lock);
+  transaction_set_ref (self, _ostree_repo_get_txn (self), remote, ref, checksum);
 }
 
 /**
@@ -2100,18 +2236,8 @@ ostree_repo_transaction_set_collection_ref (OstreeRepo *self, const OstreeCollec
 {
   g_assert (self != NULL);
   g_assert (OSTREE_IS_REPO (self));
-  g_assert (self->in_transaction == TRUE);
-  g_assert (ref != NULL);
-
-  // TODO(lucab): introduce a method with error-returning in order to deprecate
-  // this one, because it can silently fail.
-  g_return_if_fail (checksum == NULL || ostree_validate_checksum_string (checksum, NULL));
 
-  g_mutex_lock (&self->txn_lock);
-  ensure_txn_refs (self);
-  g_hash_table_replace (self->txn.collection_refs, ostree_collection_ref_dup (ref),
-                        g_strdup (checksum));
-  g_mutex_unlock (&self->txn_lock);
+  transaction_set_collection_ref (self, _ostree_repo_get_txn (self), ref, checksum);
 }
 
 /**
@@ -2189,36 +2315,40 @@ ostree_repo_set_collection_ref_immediate (OstreeRepo *self, const OstreeCollecti
   return _ostree_repo_write_ref (self, NULL, ref, checksum, NULL, cancellable, error);
 }
 
-/**
- * ostree_repo_commit_transaction:
- * @self: An #OstreeRepo
- * @out_stats: (allow-none) (out): A set of statistics of things
- * that happened during this transaction.
- * @cancellable: Cancellable
- * @error: Error
- *
- * Complete the transaction. Any refs set with
- * ostree_repo_transaction_set_ref() or
- * ostree_repo_transaction_set_refspec() will be written out.
- *
- * Note that if multiple threads are performing writes, all such threads must
- * have terminated before this function is invoked.
- *
- * Locking: Releases `shared` lock acquired by `ostree_repo_prepare_transaction()`
- * Multithreading: This function is *not* MT safe; only one transaction can be
- * active at a time.
+/* Write out the refs of @txn; this is the only part of committing that is
+ * serialized between the transactions of a repo, so that the summary is
+ * regenerated from a consistent set of refs.
  */
-gboolean
-ostree_repo_commit_transaction (OstreeRepo *self, OstreeRepoTransactionStats *out_stats,
-                                GCancellable *cancellable, GError **error)
+static gboolean
+transaction_update_refs (OstreeRepo *self, OstreeTransaction *txn, GCancellable *cancellable,
+                         GError **error)
 {
-  g_assert (self != NULL);
-  g_assert (OSTREE_IS_REPO (self));
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->txn_commit_lock);
 
-  if (!self->in_transaction)
-    return glnx_throw (error, "Failed to commit transaction, no transaction in progress");
+  if (txn->refs)
+    if (!_ostree_repo_update_refs (self, txn->refs, cancellable, error))
+      return FALSE;
 
-  g_debug ("Committing transaction in repository %p", self);
+  if (txn->collection_refs)
+    if (!_ostree_repo_update_collection_refs (self, txn->collection_refs, cancellable, error))
+      return FALSE;
+
+  /* Update the summary if auto-update-summary is set, because doing so was
+   * delayed for each ref change during the transaction.
+   */
+  if (!txn->disable_auto_summary && (txn->refs || txn->collection_refs)
+      && !_ostree_repo_maybe_regenerate_summary (self, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+transaction_commit (OstreeRepo *self, OstreeTransaction *txn, OstreeRepoTransactionStats *out_stats,
+                    GCancellable *cancellable, GError **error)
+{
+  if (!txn->active)
+    return glnx_throw (error, "Failed to commit transaction, no transaction in progress");
 
   if ((self->test_error_flags & OSTREE_REPO_TEST_ERROR_PRE_COMMIT) > 0)
     return glnx_throw (error, "OSTREE_REPO_TEST_ERROR_PRE_COMMIT specified");
@@ -2228,115 +2358,122 @@ ostree_repo_commit_transaction (OstreeRepo *self, OstreeRepoTransactionStats *ou
    */
   if (!self->disable_fsync && g_getenv ("OSTREE_SUPPRESS_SYNCFS") == NULL)
     {
+      OSTREE_PROBE1 (syncfs_start, self);
       if (syncfs (self->tmp_dir_fd) < 0)
         return glnx_throw_errno_prefix (error, "syncfs");
+      OSTREE_PROBE1 (syncfs_done, self);
     }
 
-  if (!rename_pending_loose_objects (self, cancellable, error))
+  if (!rename_pending_loose_objects (self, txn, cancellable, error))
     return FALSE;
 
   if (!fsync_object_dirs (self, cancellable, error))
     return FALSE;
 
-  g_debug ("txn commit %s", glnx_basename (self->commit_stagedir.path));
-  if (!glnx_tmpdir_delete (&self->commit_stagedir, cancellable, error))
+  g_debug ("txn commit %s", glnx_basename (txn->stagedir.path));
+  if (!glnx_tmpdir_delete (&txn->stagedir, cancellable, error))
     return FALSE;
-  glnx_release_lock_file (&self->commit_stagedir_lock);
+  glnx_release_lock_file (&txn->stagedir_lock);
 
   /* This performs a global cleanup */
-  if (!cleanup_tmpdir (self, cancellable, error))
+  if (!cleanup_tmpdir (self, txn, cancellable, error))
     return FALSE;
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_remove_all (self->loose_object_devino_hash);
-
-  if (self->txn.refs)
-    if (!_ostree_repo_update_refs (self, self->txn.refs, cancellable, error))
-      return FALSE;
-
-  if (self->txn.collection_refs)
-    if (!_ostree_repo_update_collection_refs (self, self->txn.collection_refs, cancellable, error))
-      return FALSE;
+  if (txn->loose_object_devino_hash)
+    g_hash_table_remove_all (txn->loose_object_devino_hash);
 
-  /* Update the summary if auto-update-summary is set, because doing so was
-   * delayed for each ref change during the transaction.
-   */
-  if (!self->txn.disable_auto_summary && (self->txn.refs || self->txn.collection_refs)
-      && !_ostree_repo_maybe_regenerate_summary (self, cancellable, error))
+  if (!transaction_update_refs (self, txn, cancellable, error))
     return FALSE;
 
-  g_clear_pointer (&self->txn.refs, g_hash_table_destroy);
-  g_clear_pointer (&self->txn.collection_refs, g_hash_table_destroy);
+  g_clear_pointer (&txn->refs, g_hash_table_destroy);
+  g_clear_pointer (&txn->collection_refs, g_hash_table_destroy);
 
-  self->in_transaction = FALSE;
+  txn->active = FALSE;
 
   if (!ot_ensure_unlinked_at (self->repo_dir_fd, "transaction", 0))
     return FALSE;
 
-  if (self->txn_locked)
+  if (txn->locked)
     {
       if (!ostree_repo_lock_pop (self, OSTREE_REPO_LOCK_SHARED, cancellable, error))
         return FALSE;
-      self->txn_locked = FALSE;
+      txn->locked = FALSE;
     }
 
   if (out_stats)
-    *out_stats = self->txn.stats;
+    *out_stats = txn->stats;
 
   return TRUE;
 }
 
 /**
- * ostree_repo_abort_transaction:
+ * ostree_repo_commit_transaction:
  * @self: An #OstreeRepo
+ * @out_stats: (allow-none) (out): A set of statistics of things
+ * that happened during this transaction.
  * @cancellable: Cancellable
  * @error: Error
  *
- * Abort the active transaction; any staged objects and ref changes will be
- * discarded. You *must* invoke this if you have chosen not to invoke
- * ostree_repo_commit_transaction(). Calling this function when not in a
- * transaction will do nothing and return successfully.
+ * Complete the transaction. Any refs set with
+ * ostree_repo_transaction_set_ref() or
+ * ostree_repo_transaction_set_refspec() will be written out.
+ *
+ * Note that if multiple threads are performing writes, all such threads must
+ * have terminated before this function is invoked.
+ *
+ * Locking: Releases `shared` lock acquired by `ostree_repo_prepare_transaction()`
+ * Multithreading: This function is *not* MT safe; only one transaction can be
+ * active at a time.
  */
 gboolean
-ostree_repo_abort_transaction (OstreeRepo *self, GCancellable *cancellable, GError **error)
+ostree_repo_commit_transaction (OstreeRepo *self, OstreeRepoTransactionStats *out_stats,
+                                GCancellable *cancellable, GError **error)
 {
   g_assert (self != NULL);
   g_assert (OSTREE_IS_REPO (self));
 
+  g_debug ("Committing transaction in repository %p", self);
+
+  return transaction_commit (self, &self->txn, out_stats, cancellable, error);
+}
+
+static gboolean
+transaction_abort (OstreeRepo *self, OstreeTransaction *txn, GError **error)
+{
   g_autoptr (GError) cleanup_error = NULL;
 
   /* Always ignore the cancellable to avoid the chance that, if it gets
    * canceled, the transaction may not be fully cleaned up.
    * See https://github.com/ostreedev/ostree/issues/1491 .
    */
-  cancellable = NULL;
+  GCancellable *cancellable = NULL;
 
   /* Note early return */
-  if (!self->in_transaction)
+  if (!txn->active)
     return TRUE;
 
   g_debug ("Aborting transaction in repository %p", self);
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_remove_all (self->loose_object_devino_hash);
+  if (txn->loose_object_devino_hash)
+    g_hash_table_remove_all (txn->loose_object_devino_hash);
 
-  g_clear_pointer (&self->txn.refs, g_hash_table_destroy);
-  g_clear_pointer (&self->txn.collection_refs, g_hash_table_destroy);
+  g_clear_pointer (&txn->refs, g_hash_table_destroy);
+  g_clear_pointer (&txn->collection_refs, g_hash_table_destroy);
 
-  glnx_tmpdir_unset (&self->commit_stagedir);
-  glnx_release_lock_file (&self->commit_stagedir_lock);
+  glnx_tmpdir_unset (&txn->stagedir);
+  glnx_release_lock_file (&txn->stagedir_lock);
 
   /* Do not propagate failures from cleanup_tmpdir() immediately, as we want
    * to clean up the rest of the internal transaction state first. */
-  cleanup_tmpdir (self, cancellable, &cleanup_error);
+  cleanup_tmpdir (self, txn, cancellable, &cleanup_error);
 
-  self->in_transaction = FALSE;
+  txn->active = FALSE;
 
-  if (self->txn_locked)
+  if (txn->locked)
     {
       if (!ostree_repo_lock_pop (self, OSTREE_REPO_LOCK_SHARED, cancellable, error))
         return FALSE;
-      self->txn_locked = FALSE;
+      txn->locked = FALSE;
     }
 
   /* Propagate cleanup_tmpdir() failure. */
@@ -2350,23 +2487,326 @@ ostree_repo_abort_transaction (OstreeRepo *self, GCancellable *cancellable, GErr
 }
 
 /**
- * ostree_repo_write_metadata:
- * @self: Repo
- * @objtype: Object type
- * @expected_checksum: (nullable): If provided, validate content against this checksum
- * @object: Metadata
- * @out_csum: (out) (array fixed-size=32) (optional): Binary checksum
+ * ostree_repo_abort_transaction:
+ * @self: An #OstreeRepo
  * @cancellable: Cancellable
  * @error: Error
  *
- * Store the metadata object @object.  Return the checksum
- * as @out_csum.
- *
- * If @expected_checksum is not %NULL, verify it against the
- * computed checksum.
- */
-gboolean
-ostree_repo_write_metadata (OstreeRepo *self, OstreeObjectType objtype,
+ * Abort the active transaction; any staged objects and ref changes will be
+ * discarded. You *must* invoke this if you have chosen not to invoke
+ * ostree_repo_commit_transaction(). Calling this function when not in a
+ * transaction will do nothing and return successfully.
+ */
+gboolean
+ostree_repo_abort_transaction (OstreeRepo *self, GCancellable *cancellable, GError **error)
+{
+  g_assert (self != NULL);
+  g_assert (OSTREE_IS_REPO (self));
+
+  return transaction_abort (self, &self->txn, error);
+}
+
+/* Drops the references of transactions still pushed when a thread exits */
+static void
+thread_default_txns_free (gpointer data)
+{
+  g_slist_free_full (data, (GDestroyNotify)ostree_transaction_unref);
+}
+
+static GPrivate thread_default_txns = G_PRIVATE_INIT (thread_default_txns_free);
+
+/* Return the transaction pushed with ostree_transaction_push_thread_default()
+ * for @self in this thread, if any.
+ */
+OstreeTransaction *
+_ostree_repo_get_thread_txn (OstreeRepo *self)
+{
+  for (GSList *l = g_private_get (&thread_default_txns); l != NULL; l = l->next)
+    {
+      OstreeTransaction *txn = l->data;
+      if (txn->repo == self)
+        return txn;
+    }
+  return NULL;
+}
+
+/* Return the transaction that writes to @self from this thread belong to;
+ * this is the repo's default one, which may be inactive, unless another one
+ * has been pushed as thread default.
+ */
+OstreeTransaction *
+_ostree_repo_get_txn (OstreeRepo *self)
+{
+  OstreeTransaction *txn = _ostree_repo_get_thread_txn (self);
+  return txn != NULL ? txn : &self->txn;
+}
+
+/* Return the staging directory of the transaction writes from this thread go
+ * to, or -1 if there's no active one.
+ */
+int
+_ostree_repo_get_txn_stagedir_fd (OstreeRepo *self)
+{
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  if (!txn->active || !txn->stagedir.initialized)
+    return -1;
+  return txn->stagedir.fd;
+}
+
+/**
+ * ostree_transaction_new:
+ * @repo: An #OstreeRepo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Start a new transaction on @repo. Unlike ostree_repo_prepare_transaction(),
+ * any number of these can be active at the same time on one #OstreeRepo
+ * instance, e.g. one per thread of a server accepting uploads. Each has its own
+ * staging directory, statistics and refs; they are only coordinated when
+ * objects are moved into the repository and refs are written out by
+ * ostree_transaction_commit().
+ *
+ * Objects are written through the usual #OstreeRepo functions, from a thread
+ * where the transaction has been made the default with
+ * ostree_transaction_push_thread_default(). Objects staged in a transaction
+ * are not visible to other transactions until it is committed.
+ *
+ * Locking: Acquires a `shared` lock; release via commit or abort
+ *
+ * Returns: (transfer full): A new transaction, or %NULL on error
+ * Since: 2024.8
+ */
+OstreeTransaction *
+ostree_transaction_new (OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  g_return_val_if_fail (OSTREE_IS_REPO (repo), NULL);
+
+  g_autoptr (OstreeTransaction) txn = g_new0 (OstreeTransaction, 1);
+  txn->refcount = 1;
+  txn->repo = g_object_ref (repo);
+
+  g_debug ("Preparing transaction %p in repository %p", txn, repo);
+
+  /* On failure, unreffing aborts it */
+  if (!transaction_prepare (repo, txn, NULL, cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&txn);
+}
+
+/**
+ * ostree_transaction_ref:
+ * @txn: An #OstreeTransaction
+ *
+ * Returns: (transfer full): @txn
+ * Since: 2024.8
+ */
+OstreeTransaction *
+ostree_transaction_ref (OstreeTransaction *txn)
+{
+  g_return_val_if_fail (txn != NULL && txn->repo != NULL, NULL);
+
+  g_atomic_int_inc (&txn->refcount);
+  return txn;
+}
+
+/**
+ * ostree_transaction_unref:
+ * @txn: (transfer full): An #OstreeTransaction
+ *
+ * Drop a reference to @txn. If it was the last one and @txn has been neither
+ * committed nor aborted, it is aborted.
+ *
+ * Since: 2024.8
+ */
+void
+ostree_transaction_unref (OstreeTransaction *txn)
+{
+  if (txn == NULL)
+    return;
+  if (!g_atomic_int_dec_and_test (&txn->refcount))
+    return;
+
+  g_autoptr (GError) error = NULL;
+  if (!transaction_abort (txn->repo, txn, &error))
+    g_critical ("Failed to abort transaction: %s", error->message);
+
+  g_clear_pointer (&txn->object_sizes, g_hash_table_unref);
+  g_clear_pointer (&txn->loose_object_devino_hash, g_hash_table_unref);
+  g_object_unref (txn->repo);
+  g_free (txn);
+}
+
+G_DEFINE_BOXED_TYPE (OstreeTransaction, ostree_transaction, ostree_transaction_ref,
+                     ostree_transaction_unref);
+
+/**
+ * ostree_transaction_get_repo:
+ * @txn: An #OstreeTransaction
+ *
+ * Returns: (transfer none): The repository @txn writes to
+ * Since: 2024.8
+ */
+OstreeRepo *
+ostree_transaction_get_repo (OstreeTransaction *txn)
+{
+  return txn->repo;
+}
+
+/**
+ * ostree_transaction_push_thread_default:
+ * @txn: An #OstreeTransaction
+ *
+ * Make @txn the transaction that writes to its repository from the calling
+ * thread go to, including ostree_repo_transaction_set_ref() and similar, until
+ * ostree_transaction_pop_thread_default() is called. Asynchronous writes such
+ * as ostree_repo_write_content_async() started from this thread also go to
+ * @txn.
+ *
+ * Multithreading: The thread default is per thread; a transaction may be pushed
+ * in several threads at once.
+ *
+ * Since: 2024.8
+ */
+void
+ostree_transaction_push_thread_default (OstreeTransaction *txn)
+{
+  g_return_if_fail (txn != NULL);
+
+  GSList *stack = g_private_get (&thread_default_txns);
+  g_private_set (&thread_default_txns, g_slist_prepend (stack, ostree_transaction_ref (txn)));
+}
+
+/**
+ * ostree_transaction_pop_thread_default:
+ * @txn: An #OstreeTransaction
+ *
+ * Undo a previous call to ostree_transaction_push_thread_default() in the
+ * calling thread.
+ *
+ * Since: 2024.8
+ */
+void
+ostree_transaction_pop_thread_default (OstreeTransaction *txn)
+{
+  GSList *stack = g_private_get (&thread_default_txns);
+  g_return_if_fail (stack != NULL && stack->data == txn);
+
+  g_private_set (&thread_default_txns, g_slist_delete_link (stack, stack));
+  ostree_transaction_unref (txn);
+}
+
+/**
+ * ostree_transaction_set_ref:
+ * @txn: An #OstreeTransaction
+ * @remote: (allow-none): A remote for the ref
+ * @ref: The ref to write
+ * @checksum: (nullable): The checksum to point it to
+ *
+ * Like ostree_repo_transaction_set_ref(), but for @txn.
+ *
+ * Multithreading: This function is MT safe.
+ *
+ * Since: 2024.8
+ */
+void
+ostree_transaction_set_ref (OstreeTransaction *txn, const char *remote, const char *ref,
+                            const char *checksum)
+{
+  transaction_set_ref (txn->repo, txn, remote, ref, checksum);
+}
+
+/**
+ * ostree_transaction_set_collection_ref:
+ * @txn: An #OstreeTransaction
+ * @ref: The collection–ref to write
+ * @checksum: (nullable): The checksum to point it to
+ *
+ * Like ostree_repo_transaction_set_collection_ref(), but for @txn.
+ *
+ * Multithreading: This function is MT safe.
+ *
+ * Since: 2024.8
+ */
+void
+ostree_transaction_set_collection_ref (OstreeTransaction *txn, const OstreeCollectionRef *ref,
+                                       const char *checksum)
+{
+  transaction_set_collection_ref (txn->repo, txn, ref, checksum);
+}
+
+/**
+ * ostree_transaction_commit:
+ * @txn: An #OstreeTransaction
+ * @out_stats: (allow-none) (out): A set of statistics of things
+ * that happened during this transaction.
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_commit_transaction(), but for @txn. Other transactions on
+ * the same repository may keep writing objects meanwhile; only the ref updates
+ * of concurrent commits are serialized.
+ *
+ * Locking: Releases `shared` lock acquired by ostree_transaction_new()
+ * Multithreading: All writes to @txn must have completed before this function
+ * is invoked.
+ *
+ * Since: 2024.8
+ */
+gboolean
+ostree_transaction_commit (OstreeTransaction *txn, OstreeRepoTransactionStats *out_stats,
+                           GCancellable *cancellable, GError **error)
+{
+  g_return_val_if_fail (txn != NULL, FALSE);
+
+  g_debug ("Committing transaction %p in repository %p", txn, txn->repo);
+
+  /* Make sure ref updates see this transaction, so that the summary is only
+   * regenerated once at the end.
+   */
+  ostree_transaction_push_thread_default (txn);
+  gboolean ret = transaction_commit (txn->repo, txn, out_stats, cancellable, error);
+  ostree_transaction_pop_thread_default (txn);
+  return ret;
+}
+
+/**
+ * ostree_transaction_abort:
+ * @txn: An #OstreeTransaction
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_abort_transaction(), but for @txn. Calling this function
+ * on a transaction that was already committed or aborted does nothing.
+ *
+ * Since: 2024.8
+ */
+gboolean
+ostree_transaction_abort (OstreeTransaction *txn, GCancellable *cancellable, GError **error)
+{
+  g_return_val_if_fail (txn != NULL, FALSE);
+
+  return transaction_abort (txn->repo, txn, error);
+}
+
+/**
+ * ostree_repo_write_metadata:
+ * @self: Repo
+ * @objtype: Object type
+ * @expected_checksum: (nullable): If provided, validate content against this checksum
+ * @object: Metadata
+ * @out_csum: (out) (array fixed-size=32) (optional): Binary checksum
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Store the metadata object @object.  Return the checksum
+ * as @out_csum.
+ *
+ * If @expected_checksum is not %NULL, verify it against the
+ * computed checksum.
+ */
+gboolean
+ostree_repo_write_metadata (OstreeRepo *self, OstreeObjectType objtype,
                             const char *expected_checksum, GVariant *object, guchar **out_csum,
                             GCancellable *cancellable, GError **error)
 {
@@ -2383,7 +2823,7 @@ ostree_repo_write_metadata (OstreeRepo *self, OstreeObjectType objtype,
       if (have_obj)
         {
           /* Update size metadata if needed */
-          if (self->generate_sizes && !repo_has_size_entry (self, objtype, expected_checksum))
+          if (repo_needs_size_entry (self, objtype, expected_checksum))
             {
               /* Make sure we have a fully serialized object */
               g_autoptr (GVariant) trusted = g_variant_get_normal_form (object);
@@ -2478,6 +2918,7 @@ typedef struct
   char *expected_checksum;
   GVariant *object;
   GCancellable *cancellable;
+  OstreeTransaction *txn; /* Thread default of the caller, if any */
   guchar *result_csum;
 } WriteMetadataAsyncData;
 
@@ -2488,6 +2929,7 @@ write_metadata_async_data_free (gpointer user_data)
 
   g_clear_object (&data->repo);
   g_clear_object (&data->cancellable);
+  g_clear_pointer (&data->txn, ostree_transaction_unref);
   g_variant_unref (data->object);
   g_free (data->result_csum);
   g_free (data->expected_checksum);
@@ -2500,8 +2942,16 @@ write_metadata_thread (GTask *task, GObject *object, gpointer datap, GCancellabl
   GError *error = NULL;
   WriteMetadataAsyncData *data = datap;
 
-  if (!ostree_repo_write_metadata (data->repo, data->objtype, data->expected_checksum, data->object,
-                                   &data->result_csum, cancellable, &error))
+  int prev_ioprio = _ostree_repo_begin_background_io (data->repo, data->txn);
+  if (data->txn)
+    ostree_transaction_push_thread_default (data->txn);
+  gboolean ret = ostree_repo_write_metadata (data->repo, data->objtype, data->expected_checksum,
+                                             data->object, &data->result_csum, cancellable, &error);
+  if (data->txn)
+    ostree_transaction_pop_thread_default (data->txn);
+  _ostree_restore_ioprio (prev_ioprio);
+
+  if (!ret)
     g_task_return_error (task, error);
   else
     g_task_return_pointer (task, data, NULL);
@@ -2535,6 +2985,8 @@ ostree_repo_write_metadata_async (OstreeRepo *self, OstreeObjectType objtype,
   asyncdata->expected_checksum = g_strdup (expected_checksum);
   asyncdata->object = g_variant_ref (object);
   asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  OstreeTransaction *txn = _ostree_repo_get_thread_txn (self);
+  asyncdata->txn = txn ? ostree_transaction_ref (txn) : NULL;
 
   task = g_task_new (G_OBJECT (self), cancellable, callback, user_data);
   g_task_set_task_data (task, asyncdata, write_metadata_async_data_free);
@@ -2637,7 +3089,7 @@ ostree_repo_write_content (OstreeRepo *self, const char *expected_checksum,
    * If size metadata is needed, fall through to write_content_object()
    * where the entries are made.
    */
-  if (expected_checksum && !self->generate_sizes)
+  if (expected_checksum && !repo_generating_sizes (self))
     {
       gboolean have_obj;
       if (!_ostree_repo_has_loose_object (self, expected_checksum, OSTREE_OBJECT_TYPE_FILE,
@@ -2773,6 +3225,7 @@ typedef struct
   GInputStream *object;
   guint64 file_object_length;
   GCancellable *cancellable;
+  OstreeTransaction *txn; /* Thread default of the caller, if any */
 
   guchar *result_csum;
 } WriteContentAsyncData;
@@ -2784,6 +3237,7 @@ write_content_async_data_free (gpointer user_data)
 
   g_clear_object (&data->repo);
   g_clear_object (&data->cancellable);
+  g_clear_pointer (&data->txn, ostree_transaction_unref);
   g_clear_object (&data->object);
   g_free (data->result_csum);
   g_free (data->expected_checksum);
@@ -2796,9 +3250,17 @@ write_content_thread (GTask *task, GObject *object, gpointer datap, GCancellable
   GError *error = NULL;
   WriteContentAsyncData *data = datap;
 
-  if (!ostree_repo_write_content (data->repo, data->expected_checksum, data->object,
-                                  data->file_object_length, &data->result_csum, cancellable,
-                                  &error))
+  int prev_ioprio = _ostree_repo_begin_background_io (data->repo, data->txn);
+  if (data->txn)
+    ostree_transaction_push_thread_default (data->txn);
+  gboolean ret = ostree_repo_write_content (data->repo, data->expected_checksum, data->object,
+                                            data->file_object_length, &data->result_csum,
+                                            cancellable, &error);
+  if (data->txn)
+    ostree_transaction_pop_thread_default (data->txn);
+  _ostree_restore_ioprio (prev_ioprio);
+
+  if (!ret)
     g_task_return_error (task, error);
   else
     g_task_return_pointer (task, data, NULL);
@@ -2831,6 +3293,8 @@ ostree_repo_write_content_async (OstreeRepo *self, const char *expected_checksum
   asyncdata->object = g_object_ref (object);
   asyncdata->file_object_length = length;
   asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  OstreeTransaction *txn = _ostree_repo_get_thread_txn (self);
+  asyncdata->txn = txn ? ostree_transaction_ref (txn) : NULL;
 
   task = g_task_new (G_OBJECT (self), cancellable, callback, user_data);
   g_task_set_task_data (task, asyncdata, (GDestroyNotify)write_content_async_data_free);
@@ -2868,6 +3332,422 @@ ostree_repo_write_content_finish (OstreeRepo *self, GAsyncResult *result, guchar
   return TRUE;
 }
 
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (z_stream, inflateEnd)
+
+/* Inflate @buf, the raw deflate payload of an archive content object, which
+ * must expand to exactly @expected_size bytes. The uncompressed data is fed to
+ * @checksum (and @payload_checksum if non-%NULL) and, unless @out_fd is -1,
+ * written to @out_fd. Unlike ostree_content_stream_parse() this drives zlib
+ * directly, with no GConverter/GInputStream layers in between.
+ */
+static gboolean
+inflate_archive_payload (const guint8 *buf, gsize len, guint64 expected_size, int out_fd,
+                         OtChecksum *checksum, OtChecksum *payload_checksum,
+                         GCancellable *cancellable, GError **error)
+{
+  /* ostree_raw_file_to_archive_z2_stream() writes no deflate stream at all
+   * for empty files without an input stream */
+  if (len == 0 && expected_size == 0)
+    return TRUE;
+
+  g_auto (z_stream) zs = {
+    0,
+  };
+  if (inflateInit2 (&zs, -MAX_WBITS) != Z_OK)
+    return glnx_throw (error, "Failed to initialize zlib");
+
+  const gsize out_size = CLAMP (expected_size, 1, 1048576);
+  g_autofree guint8 *out_buf = g_malloc (out_size);
+  guint64 total = 0;
+  int res = Z_OK;
+  while (res != Z_STREAM_END)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      /* avail_in is only 32 bit */
+      if (zs.avail_in == 0 && len > 0)
+        {
+          zs.next_in = (Bytef *)buf;
+          zs.avail_in = MIN (len, G_MAXUINT32);
+          buf += zs.avail_in;
+          len -= zs.avail_in;
+        }
+      zs.next_out = out_buf;
+      zs.avail_out = out_size;
+
+      res = inflate (&zs, Z_NO_FLUSH);
+      /* We always provide fresh output space, so this means we ran out of input */
+      if (res == Z_BUF_ERROR)
+        return glnx_throw (error,
+                           "Unexpected EOF with %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT
+                           " bytes remaining",
+                           expected_size - total, expected_size);
+      else if (res != Z_OK && res != Z_STREAM_END)
+        return glnx_throw (error, "Decompressing: %s", zs.msg ? zs.msg : "invalid data");
+
+      const gsize n = out_size - zs.avail_out;
+      if (n > expected_size - total)
+        return glnx_throw (error, "Content exceeds header size %" G_GUINT64_FORMAT,
+                           expected_size);
+      ot_checksum_update (checksum, out_buf, n);
+      if (payload_checksum)
+        ot_checksum_update (payload_checksum, out_buf, n);
+      if (out_fd != -1 && glnx_loop_write (out_fd, out_buf, n) < 0)
+        return glnx_throw_errno_prefix (error, "write");
+      total += n;
+    }
+
+  /* Anything after the end of the deflate stream would be stored too */
+  if (zs.avail_in > 0 || len > 0)
+    return glnx_throw (error, "Trailing data after compressed content");
+
+  if (total != expected_size)
+    return glnx_throw (error,
+                       "Header size %" G_GUINT64_FORMAT
+                       " does not match content size %" G_GUINT64_FORMAT,
+                       expected_size, total);
+
+  return TRUE;
+}
+
+/* Archive repo half of write_archive_content_tmpf(); verify the object and
+ * link @tmpf into place as is. This avoids recompressing the content, which is
+ * what ostree_repo_write_content() would do.
+ */
+static gboolean
+link_archive_content_tmpf (OstreeRepo *self, const char *expected_checksum, GLnxTmpfile *tmpf,
+                           GBytes *content, gsize payload_offset, GFileInfo *file_info,
+                           GVariant *xattrs, GCancellable *cancellable, GError **error)
+{
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  gsize len;
+  const guint8 *buf = g_bytes_get_data (content, &len);
+
+  OSTREE_PROBE2 (write_content_start, self, expected_checksum);
+
+  /* Free space check; only applies during transactions */
+  if ((self->min_free_space_percent > 0 || self->min_free_space_mb > 0) && txn->active)
+    {
+      g_mutex_lock (&self->txn_lock);
+      g_assert_cmpint (txn->blocksize, >, 0);
+      const fsblkcnt_t object_blocks = (len / txn->blocksize) + 1;
+      if (object_blocks > txn->max_blocks)
+        {
+          guint64 bytes_required = (guint64)object_blocks * txn->blocksize;
+          txn->cleanup_stagedir = TRUE;
+          g_mutex_unlock (&self->txn_lock);
+          return throw_min_free_space_error (self, bytes_required, error);
+        }
+      txn->max_blocks -= object_blocks;
+      g_mutex_unlock (&self->txn_lock);
+    }
+
+  /* The content is only linked into place verbatim, so unlike the write path
+   * the header must be byte for byte what write_content_object() would have
+   * written, and the payload must have the size the header claims. */
+  g_autoptr (GBytes) stored_header = g_bytes_new_from_bytes (content, 0, payload_offset);
+  g_autoptr (GBytes) stored_header_data = g_bytes_new_from_bytes (content, 8, payload_offset - 8);
+  g_autoptr (GVariant) stored_header_v = g_variant_ref_sink (g_variant_new_from_bytes (
+      _OSTREE_ZLIB_FILE_HEADER_GVARIANT_FORMAT, stored_header_data, FALSE));
+  g_autoptr (GBytes) zlib_file_header = _ostree_zlib_file_header_new (file_info, xattrs);
+  if (!g_variant_is_normal_form (stored_header_v)
+      || !g_bytes_equal (stored_header, zlib_file_header))
+    return glnx_throw (error, "Corrupted file object %s; non-canonical header", expected_checksum);
+
+  g_auto (OtChecksum) checksum = {
+    0,
+  };
+  ot_checksum_init (&checksum);
+  g_autoptr (GBytes) file_header = _ostree_file_header_new (file_info, xattrs);
+  ot_checksum_update_bytes (&checksum, file_header);
+
+  goffset unpacked_size;
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    {
+      unpacked_size = g_file_info_get_size (file_info);
+      if (!inflate_archive_payload (buf + payload_offset, len - payload_offset, unpacked_size, -1,
+                                    &checksum, NULL, cancellable, error))
+        return glnx_prefix_error (error, "Corrupted file object %s", expected_checksum);
+    }
+  else
+    {
+      /* Symlinks are just the header */
+      if (len != payload_offset)
+        return glnx_throw (error, "Corrupted file object %s; trailing data after symlink",
+                           expected_checksum);
+      unpacked_size = strlen (g_file_info_get_symlink_target (file_info));
+    }
+
+  char actual_checksum[OSTREE_SHA256_STRING_LEN + 1];
+  ot_checksum_get_hexdigest (&checksum, actual_checksum, sizeof (actual_checksum));
+  if (!_ostree_compare_object_checksum (OSTREE_OBJECT_TYPE_FILE, expected_checksum,
+                                        actual_checksum, error))
+    return FALSE;
+
+  if (repo_needs_size_entry (self, OSTREE_OBJECT_TYPE_FILE, actual_checksum))
+    repo_store_size_entry (self, OSTREE_OBJECT_TYPE_FILE, actual_checksum, unpacked_size,
+                           g_bytes_get_size (content));
+
+  gboolean have_obj;
+  if (!_ostree_repo_has_loose_object (self, actual_checksum, OSTREE_OBJECT_TYPE_FILE, &have_obj,
+                                      cancellable, error))
+    return FALSE;
+  if (!have_obj)
+    {
+      if (!glnx_fchmod (tmpf->fd, 0644, error))
+        return FALSE;
+      if (!_ostree_repo_commit_tmpf_final (self, actual_checksum, OSTREE_OBJECT_TYPE_FILE, tmpf,
+                                           cancellable, error))
+        return FALSE;
+    }
+
+  g_mutex_lock (&self->txn_lock);
+  if (!have_obj)
+    {
+      txn->stats.content_objects_written++;
+      txn->stats.content_bytes_written += unpacked_size;
+    }
+  txn->stats.content_objects_total++;
+  g_mutex_unlock (&self->txn_lock);
+
+  OSTREE_PROBE3 (write_content_done, self, actual_checksum, !have_obj);
+  return TRUE;
+}
+
+/* Bare repo half of write_archive_content_tmpf() for regular files; this is
+ * the equivalent of write_content_object(), but inflates the payload straight
+ * into the new object's tmpfile and checksums it along the way.
+ */
+static gboolean
+write_bare_regfile_from_archive (OstreeRepo *self, const char *expected_checksum, GBytes *content,
+                                 gsize payload_offset, GFileInfo *file_info, GVariant *xattrs,
+                                 GCancellable *cancellable, GError **error)
+{
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  const guint64 size = g_file_info_get_size (file_info);
+  const guint32 uid = g_file_info_get_attribute_uint32 (file_info, "unix::uid");
+  const guint32 gid = g_file_info_get_attribute_uint32 (file_info, "unix::gid");
+  const guint32 mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+
+  OSTREE_PROBE2 (write_content_start, self, expected_checksum);
+
+  /* Free space check; only applies during transactions */
+  if ((self->min_free_space_percent > 0 || self->min_free_space_mb > 0) && txn->active)
+    {
+      g_mutex_lock (&self->txn_lock);
+      g_assert_cmpint (txn->blocksize, >, 0);
+      const fsblkcnt_t object_blocks = (size / txn->blocksize) + 1;
+      if (object_blocks > txn->max_blocks)
+        {
+          guint64 bytes_required = (guint64)object_blocks * txn->blocksize;
+          txn->cleanup_stagedir = TRUE;
+          g_mutex_unlock (&self->txn_lock);
+          return throw_min_free_space_error (self, bytes_required, error);
+        }
+      txn->max_blocks -= object_blocks;
+      g_mutex_unlock (&self->txn_lock);
+    }
+
+  /* Same as write_content_object(); we only need the payload checksum if we
+   * may end up creating a payload link. */
+  gboolean reflinks_supported = FALSE;
+  if (xattrs != NULL && !_check_support_reflink (self, &reflinks_supported, error))
+    return FALSE;
+
+  g_auto (OtChecksum) checksum = {
+    0,
+  };
+  g_auto (OtChecksum) payload_checksum = {
+    0,
+  };
+  ot_checksum_init (&checksum);
+  if (reflinks_supported)
+    ot_checksum_init (&payload_checksum);
+  g_autoptr (GBytes) file_header = _ostree_file_header_new (file_info, xattrs);
+  ot_checksum_update_bytes (&checksum, file_header);
+
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (commit_tmp_dfd (self), ".", O_WRONLY | O_CLOEXEC, &tmpf,
+                                      error))
+    return FALSE;
+  if (!glnx_try_fallocate (tmpf.fd, 0, size, error))
+    return FALSE;
+
+  gsize len;
+  const guint8 *buf = g_bytes_get_data (content, &len);
+  if (!inflate_archive_payload (buf + payload_offset, len - payload_offset, size, tmpf.fd,
+                                &checksum, reflinks_supported ? &payload_checksum : NULL,
+                                cancellable, error))
+    return glnx_prefix_error (error, "Corrupted file object %s", expected_checksum);
+
+  char actual_checksum[OSTREE_SHA256_STRING_LEN + 1];
+  ot_checksum_get_hexdigest (&checksum, actual_checksum, sizeof (actual_checksum));
+  if (!_ostree_compare_object_checksum (OSTREE_OBJECT_TYPE_FILE, expected_checksum,
+                                        actual_checksum, error))
+    return FALSE;
+
+  char actual_payload_checksum_buf[OSTREE_SHA256_STRING_LEN + 1];
+  const char *actual_payload_checksum = NULL;
+  if (reflinks_supported)
+    {
+      ot_checksum_get_hexdigest (&payload_checksum, actual_payload_checksum_buf,
+                                 sizeof (actual_payload_checksum_buf));
+      actual_payload_checksum = actual_payload_checksum_buf;
+    }
+
+  if (repo_needs_size_entry (self, OSTREE_OBJECT_TYPE_FILE, actual_checksum))
+    repo_store_size_entry (self, OSTREE_OBJECT_TYPE_FILE, actual_checksum, size, size);
+
+  gboolean have_obj;
+  if (!_ostree_repo_has_loose_object (self, actual_checksum, OSTREE_OBJECT_TYPE_FILE, &have_obj,
+                                      cancellable, error))
+    return FALSE;
+  if (!have_obj)
+    {
+      if (actual_payload_checksum
+          && !_try_clone_from_payload_link (self, self, actual_payload_checksum, file_info, &tmpf,
+                                            cancellable, error))
+        return FALSE;
+
+      if (!commit_loose_regfile_object (self, actual_checksum, &tmpf, uid, gid, mode, xattrs,
+                                        cancellable, error))
+        return FALSE;
+    }
+
+  if (!_create_payload_link (self, actual_checksum, actual_payload_checksum, file_info,
+                             cancellable, error))
+    return FALSE;
+
+  g_mutex_lock (&self->txn_lock);
+  if (!have_obj)
+    {
+      txn->stats.content_objects_written++;
+      txn->stats.content_bytes_written += size;
+    }
+  txn->stats.content_objects_total++;
+  g_mutex_unlock (&self->txn_lock);
+
+  OSTREE_PROBE3 (write_content_done, self, actual_checksum, !have_obj);
+  return TRUE;
+}
+
+/* Given an archive-format (i.e. `.filez`) content object in @tmpf, as
+ * downloaded from an archive remote, verify it against @expected_checksum and
+ * store it. Archive repos link @tmpf into place as is; bare repos inflate the
+ * mmap()ed object directly into the final file. Either way this skips the
+ * stream stack of ostree_content_stream_parse() + ostree_repo_write_content().
+ */
+static gboolean
+write_archive_content_tmpf (OstreeRepo *self, const char *expected_checksum, GLnxTmpfile *tmpf,
+                            GCancellable *cancellable, GError **error)
+{
+  g_assert (G_IN_SET (self->mode, OSTREE_REPO_MODE_ARCHIVE, OSTREE_REPO_MODE_BARE,
+                      OSTREE_REPO_MODE_BARE_USER, OSTREE_REPO_MODE_BARE_USER_ONLY));
+
+  GLNX_AUTO_PREFIX_ERROR ("Writing content object", error);
+
+  g_autoptr (GBytes) content = ot_fd_readall_or_mmap (tmpf->fd, 0, error);
+  if (!content)
+    return FALSE;
+
+  gsize payload_offset;
+  g_autoptr (GFileInfo) file_info = NULL;
+  g_autoptr (GVariant) xattrs = NULL;
+  if (!_ostree_zlib_content_bytes_parse_header (content, &payload_offset, &file_info, &xattrs,
+                                                error))
+    return FALSE;
+
+  if (self->mode == OSTREE_REPO_MODE_ARCHIVE)
+    return link_archive_content_tmpf (self, expected_checksum, tmpf, content, payload_offset,
+                                      file_info, xattrs, cancellable, error);
+  else if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    return write_bare_regfile_from_archive (self, expected_checksum, content, payload_offset,
+                                            file_info, xattrs, cancellable, error);
+  else
+    {
+      /* Symlinks have no payload; the generic path is fine for those */
+      g_autofree guchar *csum = NULL;
+      return write_content_object (self, expected_checksum, NULL, file_info, xattrs, &csum,
+                                   cancellable, error);
+    }
+}
+
+typedef struct
+{
+  char *expected_checksum;
+  GLnxTmpfile tmpf;
+  OstreeTransaction *txn;
+} WriteArchiveContentTmpfData;
+
+static void
+write_archive_content_tmpf_data_free (gpointer user_data)
+{
+  WriteArchiveContentTmpfData *data = user_data;
+
+  g_free (data->expected_checksum);
+  glnx_tmpfile_clear (&data->tmpf);
+  g_clear_pointer (&data->txn, ostree_transaction_unref);
+  g_free (data);
+}
+
+static void
+write_archive_content_tmpf_thread (GTask *task, GObject *object, gpointer datap,
+                                   GCancellable *cancellable)
+{
+  GError *error = NULL;
+  WriteArchiveContentTmpfData *data = datap;
+
+  int prev_ioprio = _ostree_repo_begin_background_io ((OstreeRepo *)object, data->txn);
+  if (data->txn)
+    ostree_transaction_push_thread_default (data->txn);
+  gboolean ret = write_archive_content_tmpf ((OstreeRepo *)object, data->expected_checksum,
+                                             &data->tmpf, cancellable, &error);
+  if (data->txn)
+    ostree_transaction_pop_thread_default (data->txn);
+  _ostree_restore_ioprio (prev_ioprio);
+  if (!ret)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Asynchronous version of write_archive_content_tmpf(); ownership of @tmpf is
+ * transferred. */
+void
+_ostree_repo_write_archive_content_tmpf_async (OstreeRepo *self, const char *expected_checksum,
+                                               GLnxTmpfile *tmpf, GCancellable *cancellable,
+                                               GAsyncReadyCallback callback, gpointer user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  WriteArchiveContentTmpfData *asyncdata;
+
+  asyncdata = g_new0 (WriteArchiveContentTmpfData, 1);
+  asyncdata->expected_checksum = g_strdup (expected_checksum);
+  asyncdata->tmpf = *tmpf;
+  tmpf->initialized = FALSE; /* Transfer ownership */
+  OstreeTransaction *txn = _ostree_repo_get_thread_txn (self);
+  asyncdata->txn = txn ? ostree_transaction_ref (txn) : NULL;
+
+  task = g_task_new (G_OBJECT (self), cancellable, callback, user_data);
+  g_task_set_task_data (task, asyncdata, (GDestroyNotify)write_archive_content_tmpf_data_free);
+  g_task_set_source_tag (task, _ostree_repo_write_archive_content_tmpf_async);
+  g_task_run_in_thread (task, (GTaskThreadFunc)write_archive_content_tmpf_thread);
+}
+
+gboolean
+_ostree_repo_write_archive_content_tmpf_finish (OstreeRepo *self, GAsyncResult *result,
+                                                GError **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (
+      g_async_result_is_tagged (result, _ostree_repo_write_archive_content_tmpf_async), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 /**
  * ostree_repo_write_commit:
  * @self: Repo
@@ -2996,15 +3876,16 @@ ostree_repo_read_commit_detached_metadata (OstreeRepo *self, const char *checksu
                                            GVariant **out_metadata, GCancellable *cancellable,
                                            GError **error)
 {
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   g_assert (out_metadata != NULL);
 
   char buf[_OSTREE_LOOSE_PATH_MAX];
   _ostree_loose_path (buf, checksum, OSTREE_OBJECT_TYPE_COMMIT_META, self->mode);
 
-  if (self->commit_stagedir.initialized)
+  if (txn->stagedir.initialized)
     {
       glnx_autofd int fd = -1;
-      if (!ot_openat_ignore_enoent (self->commit_stagedir.fd, buf, &fd, error))
+      if (!ot_openat_ignore_enoent (txn->stagedir.fd, buf, &fd, error))
         return FALSE;
       if (fd != -1)
         return ot_variant_read_fd (fd, 0, G_VARIANT_TYPE ("a{sv}"), TRUE, out_metadata, error);
@@ -3042,9 +3923,10 @@ ostree_repo_write_commit_detached_metadata (OstreeRepo *self, const char *checks
                                             GVariant *metadata, GCancellable *cancellable,
                                             GError **error)
 {
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   int dest_dfd;
-  if (self->in_transaction)
-    dest_dfd = self->commit_stagedir.fd;
+  if (txn->active)
+    dest_dfd = txn->stagedir.fd;
   else
     dest_dfd = self->objects_dir_fd;
 
@@ -3076,6 +3958,23 @@ ostree_repo_write_commit_detached_metadata (OstreeRepo *self, const char *checks
   return TRUE;
 }
 
+/* Dirtrees with at least this many entries are serialized straight to a
+ * temporary file with OtVariantBuilder rather than built in memory.
+ */
+#define DIRTREE_STREAMING_MIN_ENTRIES 4096
+
+/* Returns the keys of @table sorted with strcmp(); the list must be freed
+ * with g_slist_free(), but the keys are owned by @table.
+ */
+static GSList *
+sorted_hash_table_keys (GHashTable *table)
+{
+  GSList *sorted = NULL;
+  GLNX_HASH_TABLE_FOREACH (table, const char *, name)
+    sorted = g_slist_prepend (sorted, (char *)name);
+  return g_slist_sort (sorted, (GCompareFunc)strcmp);
+}
+
 /* This generates an in-memory OSTREE_OBJECT_TYPE_DIR_TREE variant, using the
  * content objects and subdirectories. The input hashes will be sorted
  */
@@ -3088,30 +3987,21 @@ create_tree_variant_from_hashes (GHashTable *file_checksums, GHashTable *dir_con
   GVariantBuilder dirs_builder;
   g_variant_builder_init (&dirs_builder, G_VARIANT_TYPE ("a(sayay)"));
 
-  GSList *sorted_filenames = NULL;
-  GLNX_HASH_TABLE_FOREACH (file_checksums, const char *, name)
-    {
-      /* Should have been validated earlier, but be paranoid */
-      g_assert (ot_util_filename_validate (name, NULL));
-
-      sorted_filenames = g_slist_prepend (sorted_filenames, (char *)name);
-    }
-  sorted_filenames = g_slist_sort (sorted_filenames, (GCompareFunc)strcmp);
+  GSList *sorted_filenames = sorted_hash_table_keys (file_checksums);
   for (GSList *iter = sorted_filenames; iter; iter = iter->next)
     {
       const char *name = iter->data;
       const char *value;
 
+      /* Should have been validated earlier, but be paranoid */
+      g_assert (ot_util_filename_validate (name, NULL));
+
       value = g_hash_table_lookup (file_checksums, name);
       g_variant_builder_add (&files_builder, "(s@ay)", name, ostree_checksum_to_bytes_v (value));
     }
   g_slist_free (sorted_filenames);
-  sorted_filenames = NULL;
-
-  GLNX_HASH_TABLE_FOREACH (dir_metadata_checksums, const char *, name)
-    sorted_filenames = g_slist_prepend (sorted_filenames, (char *)name);
-  sorted_filenames = g_slist_sort (sorted_filenames, (GCompareFunc)strcmp);
 
+  sorted_filenames = sorted_hash_table_keys (dir_metadata_checksums);
   for (GSList *iter = sorted_filenames; iter; iter = iter->next)
     {
       const char *name = iter->data;
@@ -3122,9 +4012,7 @@ create_tree_variant_from_hashes (GHashTable *file_checksums, GHashTable *dir_con
                              ostree_checksum_to_bytes_v (content_checksum),
                              ostree_checksum_to_bytes_v (meta_checksum));
     }
-
   g_slist_free (sorted_filenames);
-  sorted_filenames = NULL;
 
   GVariant *serialized_tree
       = g_variant_new ("(@a(say)@a(sayay))", g_variant_builder_end (&files_builder),
@@ -3132,6 +4020,135 @@ create_tree_variant_from_hashes (GHashTable *file_checksums, GHashTable *dir_con
   return g_variant_ref_sink (serialized_tree);
 }
 
+/* Like create_tree_variant_from_hashes() followed by
+ * ostree_repo_write_metadata(), but for very large directories: the
+ * dirtree is serialized directly into the object tempfile, computing its
+ * checksum along the way, so it never needs to be held in memory (twice,
+ * counting the normal form).
+ */
+static gboolean
+write_tree_streaming_from_hashes (OstreeRepo *self, GHashTable *file_checksums,
+                                  GHashTable *dir_contents_checksums,
+                                  GHashTable *dir_metadata_checksums, guchar **out_csum,
+                                  GCancellable *cancellable, GError **error)
+{
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  const OstreeObjectType objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+
+  GLNX_AUTO_PREFIX_ERROR ("Writing metadata object", error);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (commit_tmp_dfd (self), ".", O_RDWR | O_CLOEXEC, &tmpf,
+                                      error))
+    return FALSE;
+
+  g_auto (OtChecksum) checksum = {
+    0,
+  };
+  ot_checksum_init (&checksum);
+  g_autoptr (OtVariantBuilder) builder
+      = ot_variant_builder_new (OSTREE_TREE_GVARIANT_FORMAT, tmpf.fd);
+  ot_variant_builder_set_checksum (builder, &checksum);
+
+  if (!ot_variant_builder_open (builder, G_VARIANT_TYPE ("a(say)"), error))
+    return FALSE;
+  GSList *sorted_filenames = sorted_hash_table_keys (file_checksums);
+  for (GSList *iter = sorted_filenames; iter; iter = iter->next)
+    {
+      const char *name = iter->data;
+      const char *value = g_hash_table_lookup (file_checksums, name);
+
+      g_assert (ot_util_filename_validate (name, NULL));
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error)
+          || !ot_variant_builder_add (builder, error, "(s@ay)", name,
+                                   ostree_checksum_to_bytes_v (value)))
+        {
+          g_slist_free (sorted_filenames);
+          return FALSE;
+        }
+    }
+  g_slist_free (sorted_filenames);
+  if (!ot_variant_builder_close (builder, error))
+    return FALSE;
+
+  if (!ot_variant_builder_open (builder, G_VARIANT_TYPE ("a(sayay)"), error))
+    return FALSE;
+  sorted_filenames = sorted_hash_table_keys (dir_metadata_checksums);
+  for (GSList *iter = sorted_filenames; iter; iter = iter->next)
+    {
+      const char *name = iter->data;
+      const char *content_checksum = g_hash_table_lookup (dir_contents_checksums, name);
+      const char *meta_checksum = g_hash_table_lookup (dir_metadata_checksums, name);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error)
+          || !ot_variant_builder_add (builder, error, "(s@ay@ay)", name,
+                                   ostree_checksum_to_bytes_v (content_checksum),
+                                   ostree_checksum_to_bytes_v (meta_checksum)))
+        {
+          g_slist_free (sorted_filenames);
+          return FALSE;
+        }
+    }
+  g_slist_free (sorted_filenames);
+  if (!ot_variant_builder_close (builder, error))
+    return FALSE;
+
+  if (!ot_variant_builder_end (builder, error))
+    return FALSE;
+
+  /* We never had the tree as a GVariant, so do the checks that
+   * ostree_repo_write_metadata() does on the result instead; this maps the
+   * tempfile rather than reading it into memory.
+   */
+  g_autoptr (GVariant) tree = NULL;
+  if (!ot_variant_read_fd (tmpf.fd, 0, OSTREE_TREE_GVARIANT_FORMAT, FALSE, &tree, error))
+    return FALSE;
+  if (!g_variant_is_normal_form (tree))
+    return glnx_throw (error, "Streamed dirtree is not in normal form");
+  if (!ostree_validate_structureof_dirtree (tree, error))
+    return FALSE;
+
+  char actual_checksum[OSTREE_SHA256_STRING_LEN + 1];
+  ot_checksum_get_hexdigest (&checksum, actual_checksum, sizeof (actual_checksum));
+
+  struct stat stbuf;
+  if (!glnx_fstat (tmpf.fd, &stbuf, error))
+    return FALSE;
+
+  /* Update size metadata if needed */
+  if (repo_needs_size_entry (self, objtype, actual_checksum))
+    repo_store_size_entry (self, objtype, actual_checksum, stbuf.st_size, stbuf.st_size);
+
+  gboolean have_obj;
+  if (!_ostree_repo_has_loose_object (self, actual_checksum, objtype, &have_obj, cancellable,
+                                      error))
+    return FALSE;
+  if (!have_obj)
+    {
+      if (!glnx_fchmod (tmpf.fd, 0644, error))
+        return FALSE;
+      if (!_ostree_repo_commit_tmpf_final (self, actual_checksum, objtype, &tmpf, cancellable,
+                                           error))
+        return FALSE;
+    }
+
+  g_mutex_lock (&self->txn_lock);
+  if (!have_obj)
+    txn->stats.metadata_objects_written++;
+  txn->stats.metadata_objects_total++;
+  g_mutex_unlock (&self->txn_lock);
+
+  if (out_csum)
+    *out_csum = ostree_checksum_to_bytes (actual_checksum);
+  return TRUE;
+}
+
 /* If any filtering is set up, perform it, and return modified file info in
  * @out_modified_info. Note that if no filtering is applied, @out_modified_info
  * will simply be another reference (with incremented refcount) to @file_info.
@@ -3459,6 +4476,7 @@ write_content_to_mtree_internal (OstreeRepo *self, OstreeRepoFile *repo_dir,
                                  OstreeMutableTree *mtree, OstreeRepoCommitModifier *modifier,
                                  GPtrArray *path, GCancellable *cancellable, GError **error)
 {
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   g_assert (dir_enum != NULL || dfd_iter != NULL);
 
   GFileType file_type = g_file_info_get_file_type (child_info);
@@ -3501,7 +4519,7 @@ write_content_to_mtree_internal (OstreeRepo *self, OstreeRepoFile *repo_dir,
                 return FALSE;
             }
           g_mutex_lock (&self->txn_lock);
-          self->txn.stats.devino_cache_hits++;
+          txn->stats.devino_cache_hits++;
           g_mutex_unlock (&self->txn_lock);
           return TRUE; /* Early return */
         }
@@ -3631,7 +4649,7 @@ write_content_to_mtree_internal (OstreeRepo *self, OstreeRepoFile *repo_dir,
         return FALSE;
 
       g_mutex_lock (&self->txn_lock);
-      self->txn.stats.devino_cache_hits++;
+      txn->stats.devino_cache_hits++;
       g_mutex_unlock (&self->txn_lock);
     }
   /* Next fast path - we can "adopt" the file */
@@ -4046,12 +5064,24 @@ ostree_repo_write_mtree (OstreeRepo *self, OstreeMutableTree *mtree, GFile **out
                                     OSTREE_REPO_FILE (child_file))));
         }
 
-      serialized_tree = create_tree_variant_from_hashes (
-          ostree_mutable_tree_get_files (mtree), dir_contents_checksums, dir_metadata_checksums);
+      GHashTable *files = ostree_mutable_tree_get_files (mtree);
+      if (g_hash_table_size (files) + g_hash_table_size (dir_metadata_checksums)
+          >= DIRTREE_STREAMING_MIN_ENTRIES)
+        {
+          if (!write_tree_streaming_from_hashes (self, files, dir_contents_checksums,
+                                                 dir_metadata_checksums, &contents_csum,
+                                                 cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          serialized_tree = create_tree_variant_from_hashes (files, dir_contents_checksums,
+                                                             dir_metadata_checksums);
 
-      if (!ostree_repo_write_metadata (self, OSTREE_OBJECT_TYPE_DIR_TREE, NULL, serialized_tree,
-                                       &contents_csum, cancellable, error))
-        return FALSE;
+          if (!ostree_repo_write_metadata (self, OSTREE_OBJECT_TYPE_DIR_TREE, NULL,
+                                           serialized_tree, &contents_csum, cancellable, error))
+            return FALSE;
+        }
 
       ostree_checksum_inplace_from_bytes (contents_csum, contents_checksum_buf);
       ostree_mutable_tree_set_contents_checksum (mtree, contents_checksum_buf);
@@ -4313,9 +5343,10 @@ import_one_object_direct (OstreeRepo *dest_repo, OstreeRepo *src_repo, const cha
       = src_repo->owner_uid == dest_repo->owner_uid && src_repo->device == dest_repo->device;
 
   /* Find our target dfd */
+  OstreeTransaction *dest_txn = _ostree_repo_get_txn (dest_repo);
   int dest_dfd;
-  if (dest_repo->commit_stagedir.initialized)
-    dest_dfd = dest_repo->commit_stagedir.fd;
+  if (dest_txn->stagedir.initialized)
+    dest_dfd = dest_txn->stagedir.fd;
   else
     dest_dfd = dest_repo->objects_dir_fd;
 
@@ -4376,8 +5407,8 @@ import_one_object_direct (OstreeRepo *dest_repo, OstreeRepo *src_repo, const cha
       if (!glnx_open_tmpfile_linkable_at (dest_dfd, ".", O_WRONLY | O_CLOEXEC, &tmp_dest, error))
         return FALSE;
 
-      if (glnx_regfile_copy_bytes (src_fd, tmp_dest.fd, (off_t)-1) < 0)
-        return glnx_throw_errno_prefix (error, "regfile copy");
+      if (!ot_regfile_copy_sparse (src_fd, tmp_dest.fd, (off_t)-1, error))
+        return FALSE;
 
       /* Only chown for true bare repos */
       if (dest_repo->mode == OSTREE_REPO_MODE_BARE)
@@ -4620,7 +5651,9 @@ _ostree_repo_transaction_write_repo_metadata (OstreeRepo *self, GVariant *additi
 {
   g_assert (self != NULL);
   g_assert (OSTREE_IS_REPO (self));
-  g_assert (self->in_transaction == TRUE);
+
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  g_assert (txn->active == TRUE);
 
   const char *collection_id = ostree_repo_get_collection_id (self);
   if (collection_id == NULL)
@@ -242,6 +242,34 @@ ostree_composefs_target_write (OstreeComposefsTarget *target, int fd, guchar **o
 #endif
 }
 
+/* Compute the fs-verity digest of the composefs image in @fd, using
+ * the kernel's measurement if verity is enabled on it.
+ */
+gboolean
+_ostree_composefs_measure_image (int fd, guchar *out_digest, GError **error)
+{
+#ifdef HAVE_COMPOSEFS
+#ifdef HAVE_LINUX_FSVERITY_H
+  char buf[sizeof (struct fsverity_digest) + OSTREE_SHA256_DIGEST_LEN];
+  struct fsverity_digest *d = (struct fsverity_digest *)&buf;
+  d->digest_size = OSTREE_SHA256_DIGEST_LEN;
+
+  if (ioctl (fd, FS_IOC_MEASURE_VERITY, d) == 0 && d->digest_size == OSTREE_SHA256_DIGEST_LEN
+      && d->digest_algorithm == FS_VERITY_HASH_ALG_SHA256)
+    {
+      memcpy (out_digest, d->digest, OSTREE_SHA256_DIGEST_LEN);
+      return TRUE;
+    }
+#endif
+
+  if (lcfs_compute_fsverity_from_fd (out_digest, fd) < 0)
+    return glnx_throw_errno_prefix (error, "Computing composefs image digest");
+  return TRUE;
+#else
+  return composefs_not_supported (error);
+#endif
+}
+
 #ifdef HAVE_COMPOSEFS
 static gboolean
 _ostree_composefs_set_xattrs (struct lcfs_node_s *node, GVariant *xattrs, GCancellable *cancellable,
@@ -0,0 +1,285 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* A content-addressed cache of static delta superblocks and parts, stored
+ * in the repository's cache directory (see ostree_repo_set_cache_dir()).
+ * Pointing several repositories at the same cache directory lets them share
+ * deltas downloaded by any of them.
+ *
+ * Entries are stored as deltas/XX/YYYY... where XXYYYY... is the SHA256 of
+ * the file, and are only ever added atomically after having been verified,
+ * so readers don't need any locking to see a consistent file. The
+ * deltas/.lock file is held shared by readers and exclusively while pruning,
+ * so that an entry isn't evicted between being found and being used. Least
+ * recently used entries are evicted first, using the mtime, which is updated
+ * on every cache hit.
+ */
+
+#include "config.h"
+
+#include <sys/file.h>
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+
+#define DELTA_CACHE_LOCK _OSTREE_DELTA_CACHE_DIR "/.lock"
+
+gboolean
+_ostree_repo_delta_cache_enabled (OstreeRepo *self)
+{
+  return self->cache_dir_fd != -1 && self->delta_cache_max_size_mb > 0;
+}
+
+static char *
+delta_cache_path (const char *checksum)
+{
+  return g_strdup_printf ("%s/%c%c/%s", _OSTREE_DELTA_CACHE_DIR, checksum[0], checksum[1],
+                          checksum + 2);
+}
+
+static gboolean
+delta_cache_lock (OstreeRepo *self, int operation, GLnxLockFile *out_lock, GError **error)
+{
+  if (!glnx_shutil_mkdir_p_at (self->cache_dir_fd, _OSTREE_DELTA_CACHE_DIR, 0775, NULL, error))
+    return FALSE;
+  return glnx_make_lock_file (self->cache_dir_fd, DELTA_CACHE_LOCK, operation, out_lock, error);
+}
+
+/* Look up @checksum in the delta cache. If found, @out_fd is set to a
+ * read-only fd for it; otherwise it's set to -1. Note the content isn't
+ * verified here; callers must check it against @checksum.
+ */
+gboolean
+_ostree_repo_delta_cache_lookup (OstreeRepo *self, const char *checksum, int *out_fd,
+                                 GError **error)
+{
+  *out_fd = -1;
+
+  if (!_ostree_repo_delta_cache_enabled (self))
+    return TRUE;
+
+  g_auto (GLnxLockFile) lock = {
+    0,
+  };
+  if (!delta_cache_lock (self, LOCK_SH, &lock, error))
+    return FALSE;
+
+  g_autofree char *path = delta_cache_path (checksum);
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (self->cache_dir_fd, path, &fd, error))
+    return FALSE;
+  if (fd == -1)
+    return TRUE;
+
+  /* Mark it as recently used; this isn't fatal, e.g. for a cache
+   * directory owned by someone else.
+   */
+  if (futimens (fd, NULL) < 0)
+    g_debug ("Updating timestamp of cached delta %s: %s", checksum, g_strerror (errno));
+
+  g_debug ("Found %s in delta cache", checksum);
+  *out_fd = g_steal_fd (&fd);
+  return TRUE;
+}
+
+/* Check whether @checksum is in the delta cache, without opening it or
+ * marking it as used. It may still be evicted before it's looked up.
+ */
+gboolean
+_ostree_repo_delta_cache_contains (OstreeRepo *self, const char *checksum, gboolean *out_found,
+                                   GError **error)
+{
+  *out_found = FALSE;
+
+  if (!_ostree_repo_delta_cache_enabled (self))
+    return TRUE;
+
+  g_autofree char *path = delta_cache_path (checksum);
+  if (!glnx_fstatat_allow_noent (self->cache_dir_fd, path, NULL, 0, error))
+    return FALSE;
+  *out_found = (errno == 0);
+  return TRUE;
+}
+
+/* Add the content of @fd (from offset zero) to the delta cache; the caller
+ * must have verified that it matches @checksum.
+ */
+gboolean
+_ostree_repo_delta_cache_store (OstreeRepo *self, const char *checksum, int fd,
+                                GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Storing in delta cache", error);
+
+  if (!_ostree_repo_delta_cache_enabled (self))
+    return TRUE;
+
+  g_autofree char *path = delta_cache_path (checksum);
+  if (!glnx_fstatat_allow_noent (self->cache_dir_fd, path, NULL, 0, error))
+    return FALSE;
+  if (errno == 0)
+    return TRUE;
+
+  /* The deltas/XX prefix of the path */
+  g_autofree char *dir = g_strndup (path, strlen (_OSTREE_DELTA_CACHE_DIR) + 3);
+  if (!glnx_shutil_mkdir_p_at (self->cache_dir_fd, dir, 0775, cancellable, error))
+    return FALSE;
+
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (self->cache_dir_fd, dir, O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+  if (glnx_regfile_copy_bytes (fd, tmpf.fd, (off_t)-1) < 0)
+    return glnx_throw_errno_prefix (error, "regfile copy");
+  /* Other users of a shared cache need to be able to read it */
+  if (fchmod (tmpf.fd, 0644) < 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST, self->cache_dir_fd,
+                             path, error))
+    return FALSE;
+
+  g_debug ("Stored %s in delta cache", checksum);
+  return TRUE;
+}
+
+/* Remove @checksum from the delta cache, e.g. because its content turned
+ * out not to match.
+ */
+gboolean
+_ostree_repo_delta_cache_evict (OstreeRepo *self, const char *checksum, GError **error)
+{
+  if (!_ostree_repo_delta_cache_enabled (self))
+    return TRUE;
+
+  g_autofree char *path = delta_cache_path (checksum);
+  return ot_ensure_unlinked_at (self->cache_dir_fd, path, error);
+}
+
+typedef struct
+{
+  char *path;
+  guint64 size;
+  struct timespec mtime;
+} DeltaCacheEntry;
+
+static void
+delta_cache_entry_clear (DeltaCacheEntry *entry)
+{
+  g_free (entry->path);
+}
+
+static int
+compare_entries_by_mtime (gconstpointer a, gconstpointer b)
+{
+  const DeltaCacheEntry *entry_a = a;
+  const DeltaCacheEntry *entry_b = b;
+
+  if (entry_a->mtime.tv_sec != entry_b->mtime.tv_sec)
+    return entry_a->mtime.tv_sec < entry_b->mtime.tv_sec ? -1 : 1;
+  if (entry_a->mtime.tv_nsec != entry_b->mtime.tv_nsec)
+    return entry_a->mtime.tv_nsec < entry_b->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+/* Evict the least recently used entries until the cache fits in the
+ * configured core.delta-cache-max-size.
+ */
+gboolean
+_ostree_repo_delta_cache_prune (OstreeRepo *self, GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Pruning delta cache", error);
+
+  if (!_ostree_repo_delta_cache_enabled (self))
+    return TRUE;
+
+  g_auto (GLnxLockFile) lock = {
+    0,
+  };
+  if (!delta_cache_lock (self, LOCK_EX, &lock, error))
+    return FALSE;
+
+  g_autoptr (GArray) entries = g_array_new (FALSE, FALSE, sizeof (DeltaCacheEntry));
+  g_array_set_clear_func (entries, (GDestroyNotify)delta_cache_entry_clear);
+  guint64 total_size = 0;
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    0,
+  };
+  if (!glnx_dirfd_iterator_init_at (self->cache_dir_fd, _OSTREE_DELTA_CACHE_DIR, FALSE, &dfd_iter,
+                                    error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+      if (dent->d_type != DT_DIR || strlen (dent->d_name) != 2)
+        continue;
+
+      g_auto (GLnxDirFdIterator) subdir_iter = {
+        0,
+      };
+      if (!glnx_dirfd_iterator_init_at (dfd_iter.fd, dent->d_name, FALSE, &subdir_iter, error))
+        return FALSE;
+
+      while (TRUE)
+        {
+          struct dirent *sub_dent;
+          if (!glnx_dirfd_iterator_next_dent (&subdir_iter, &sub_dent, cancellable, error))
+            return FALSE;
+          if (sub_dent == NULL)
+            break;
+
+          struct stat stbuf;
+          if (!glnx_fstatat_allow_noent (subdir_iter.fd, sub_dent->d_name, &stbuf,
+                                         AT_SYMLINK_NOFOLLOW, error))
+            return FALSE;
+          if (errno == ENOENT || !S_ISREG (stbuf.st_mode))
+            continue;
+
+          DeltaCacheEntry entry = {
+            g_strconcat (dent->d_name, "/", sub_dent->d_name, NULL),
+            stbuf.st_size,
+            stbuf.st_mtim,
+          };
+          g_array_append_val (entries, entry);
+          total_size += stbuf.st_size;
+        }
+    }
+
+  const guint64 max_size = self->delta_cache_max_size_mb * 1024 * 1024;
+  if (total_size <= max_size)
+    return TRUE;
+
+  g_array_sort (entries, compare_entries_by_mtime);
+  for (guint i = 0; i < entries->len && total_size > max_size; i++)
+    {
+      DeltaCacheEntry *entry = &g_array_index (entries, DeltaCacheEntry, i);
+      if (!ot_ensure_unlinked_at (dfd_iter.fd, entry->path, error))
+        return FALSE;
+      g_debug ("Evicted %s from delta cache", entry->path);
+      total_size -= entry->size;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,419 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* An object inventory lets a mirror find out which objects it is missing
+ * without walking the tree of every commit it pulls.
+ *
+ * The dirtree, dirmeta and content objects of the repository are split into
+ * 256 buckets by the first byte of their checksum. Each bucket is stored as
+ * a sorted OSTREE_INVENTORY_BUCKET_GVARIANT_FORMAT array, and an index lists
+ * the number of objects and the SHA256 of each bucket file, along with the
+ * commits whose trees are complete. The SHA256 of the index is in turn stored
+ * in the summary, so a (signed) summary covers the whole inventory.
+ *
+ * All files are named after their SHA256, as inventory/<sha256>.index and
+ * inventory/<sha256>.bucket, so they are never modified once written.  When
+ * regenerating, the files of the index the current summary refers to are
+ * kept, so that clients which just fetched that summary can still use it.
+ *
+ * A mirror computes the same buckets for its own objects, fetches only the
+ * buckets whose digest differs, and then fetches the objects listed in those
+ * buckets that it doesn't have. These are all plain files, so they can be
+ * served by any static HTTP server.
+ */
+
+#include "config.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+
+typedef struct
+{
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  guint8 objtype;
+} InventoryEntry;
+
+static int
+compare_entries (gconstpointer a, gconstpointer b)
+{
+  const InventoryEntry *entry_a = a;
+  const InventoryEntry *entry_b = b;
+
+  int r = memcmp (entry_a->csum, entry_b->csum, sizeof (entry_a->csum));
+  if (r != 0)
+    return r;
+  return (int)entry_a->objtype - (int)entry_b->objtype;
+}
+
+static int
+compare_checksums (gconstpointer a_pp, gconstpointer b_pp)
+{
+  return strcmp (*(const char **)a_pp, *(const char **)b_pp);
+}
+
+static gboolean
+objtype_is_inventoried (OstreeObjectType objtype)
+{
+  switch (objtype)
+    {
+    case OSTREE_OBJECT_TYPE_FILE:
+    case OSTREE_OBJECT_TYPE_DIR_TREE:
+    case OSTREE_OBJECT_TYPE_DIR_META:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+static GVariant *
+bucket_to_variant (GArray *entries)
+{
+  g_auto (GVariantBuilder) builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_builder_init (&builder, OSTREE_INVENTORY_BUCKET_GVARIANT_FORMAT);
+
+  g_array_sort (entries, compare_entries);
+  for (guint i = 0; i < entries->len; i++)
+    {
+      const InventoryEntry *entry = &g_array_index (entries, InventoryEntry, i);
+      g_variant_builder_add (&builder, "(y@ay)", entry->objtype,
+                             ot_gvariant_new_bytearray (entry->csum, sizeof (entry->csum)));
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* Compute the inventory buckets of @self; returns an array of
+ * OSTREE_INVENTORY_N_BUCKETS variants. Objects of parent repositories are
+ * included if @include_parents is set.
+ */
+GPtrArray *
+_ostree_repo_inventory_build_buckets (OstreeRepo *self, gboolean include_parents,
+                                      GCancellable *cancellable, GError **error)
+{
+  OstreeRepoListObjectsFlags flags = OSTREE_REPO_LIST_OBJECTS_ALL;
+  if (!include_parents)
+    flags |= OSTREE_REPO_LIST_OBJECTS_NO_PARENTS;
+
+  g_autoptr (GHashTable) objects = NULL;
+  if (!ostree_repo_list_objects (self, flags, &objects, cancellable, error))
+    return NULL;
+
+  g_autoptr (GPtrArray) entries
+      = g_ptr_array_new_full (OSTREE_INVENTORY_N_BUCKETS, (GDestroyNotify)g_array_unref);
+  for (guint i = 0; i < OSTREE_INVENTORY_N_BUCKETS; i++)
+    g_ptr_array_add (entries, g_array_new (FALSE, FALSE, sizeof (InventoryEntry)));
+
+  GLNX_HASH_TABLE_FOREACH (objects, GVariant *, object)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+      if (!objtype_is_inventoried (objtype))
+        continue;
+
+      InventoryEntry entry = {
+        .objtype = objtype,
+      };
+      ostree_checksum_inplace_to_bytes (checksum, entry.csum);
+      g_array_append_val (entries->pdata[entry.csum[0]], entry);
+    }
+
+  g_autoptr (GPtrArray) buckets
+      = g_ptr_array_new_full (OSTREE_INVENTORY_N_BUCKETS, (GDestroyNotify)g_variant_unref);
+  for (guint i = 0; i < OSTREE_INVENTORY_N_BUCKETS; i++)
+    g_ptr_array_add (buckets, bucket_to_variant (entries->pdata[i]));
+
+  return g_steal_pointer (&buckets);
+}
+
+/* The digest of a bucket, or of the index, as found in the index and the
+ * summary respectively; an `ay` of the SHA256 of its serialized form.
+ */
+GVariant *
+_ostree_inventory_digest (GVariant *variant)
+{
+  g_autoptr (GBytes) bytes = g_variant_get_data_as_bytes (variant);
+  guint8 digest[OSTREE_SHA256_DIGEST_LEN];
+  ot_checksum_bytes (bytes, digest);
+  return g_variant_ref_sink (ot_gvariant_new_bytearray (digest, sizeof (digest)));
+}
+
+/* The path of the index or bucket (depending on @suffix) with @digest, which
+ * must be a valid SHA256.
+ */
+char *
+_ostree_inventory_get_path (GVariant *digest, const char *suffix)
+{
+  g_autofree char *checksum = ostree_checksum_from_bytes_v (digest);
+  return g_strdup_printf ("%s/%s.%s", _OSTREE_INVENTORY_DIR, checksum, suffix);
+}
+
+/* Check that @index is a well-formed inventory index. */
+gboolean
+_ostree_inventory_validate_index (GVariant *index, GError **error)
+{
+  if (!g_variant_is_of_type (index, OSTREE_INVENTORY_INDEX_GVARIANT_FORMAT))
+    return glnx_throw (error, "Invalid inventory index");
+
+  g_autoptr (GVariant) buckets = g_variant_get_child_value (index, 0);
+  if (g_variant_n_children (buckets) != OSTREE_INVENTORY_N_BUCKETS)
+    return glnx_throw (error, "Invalid inventory index: %" G_GSIZE_FORMAT " buckets",
+                       g_variant_n_children (buckets));
+
+  for (guint i = 0; i < OSTREE_INVENTORY_N_BUCKETS; i++)
+    {
+      g_autoptr (GVariant) digest = NULL;
+      g_variant_get_child (buckets, i, "(u@ay)", NULL, &digest);
+      if (g_variant_n_children (digest) != OSTREE_SHA256_DIGEST_LEN)
+        return glnx_throw (error, "Invalid inventory index: bad digest for bucket %02x", i);
+    }
+
+  return TRUE;
+}
+
+/* Append to @out_missing the object names from @remote_bucket which aren't
+ * in @local_bucket; both must be sorted, as produced by
+ * _ostree_repo_inventory_build_buckets().
+ */
+gboolean
+_ostree_inventory_bucket_diff (GVariant *remote_bucket, GVariant *local_bucket,
+                               GPtrArray *out_missing, GError **error)
+{
+  const gsize n_remote = g_variant_n_children (remote_bucket);
+  const gsize n_local = g_variant_n_children (local_bucket);
+  gsize j = 0;
+  InventoryEntry prev = {
+    .objtype = 0,
+  };
+
+  for (gsize i = 0; i < n_remote; i++)
+    {
+      g_autoptr (GVariant) csum_v = NULL;
+      InventoryEntry remote;
+      g_variant_get_child (remote_bucket, i, "(y@ay)", &remote.objtype, &csum_v);
+
+      const guchar *csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (csum == NULL)
+        return FALSE;
+      memcpy (remote.csum, csum, sizeof (remote.csum));
+      if (!objtype_is_inventoried (remote.objtype))
+        return glnx_throw (error, "Invalid object type %u in inventory", remote.objtype);
+      if (i > 0 && compare_entries (&prev, &remote) >= 0)
+        return glnx_throw (error, "Inventory bucket is not sorted");
+      prev = remote;
+
+      int r = 1;
+      while (j < n_local)
+        {
+          g_autoptr (GVariant) local_csum_v = NULL;
+          InventoryEntry local;
+          g_variant_get_child (local_bucket, j, "(y@ay)", &local.objtype, &local_csum_v);
+          memcpy (local.csum, ostree_checksum_bytes_peek (local_csum_v), sizeof (local.csum));
+
+          r = compare_entries (&local, &remote);
+          if (r >= 0)
+            break;
+          j++;
+        }
+
+      if (r != 0)
+        {
+          g_autofree char *checksum = ostree_checksum_from_bytes (remote.csum);
+          g_ptr_array_add (out_missing, g_variant_ref_sink (ostree_object_name_serialize (
+                                            checksum, (OstreeObjectType)remote.objtype)));
+        }
+    }
+
+  return TRUE;
+}
+
+/* Add the file names of the index with @index_digest, and of its buckets, to
+ * @names; a missing or invalid index is skipped.
+ */
+static gboolean
+add_index_file_names (OstreeRepo *self, GVariant *index_digest, GHashTable *names,
+                      GError **error)
+{
+  g_autofree char *index_path
+      = _ostree_inventory_get_path (index_digest, _OSTREE_INVENTORY_INDEX_SUFFIX);
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (self->repo_dir_fd, index_path, &fd, error))
+    return FALSE;
+  if (fd == -1)
+    return TRUE;
+  g_autoptr (GVariant) index = NULL;
+  if (!ot_variant_read_fd (fd, 0, OSTREE_INVENTORY_INDEX_GVARIANT_FORMAT, FALSE, &index, error))
+    return FALSE;
+  if (!_ostree_inventory_validate_index (index, NULL))
+    return TRUE;
+
+  g_hash_table_add (names, g_strdup (glnx_basename (index_path)));
+  g_autoptr (GVariant) buckets = g_variant_get_child_value (index, 0);
+  for (guint i = 0; i < OSTREE_INVENTORY_N_BUCKETS; i++)
+    {
+      g_autoptr (GVariant) digest = NULL;
+      g_variant_get_child (buckets, i, "(u@ay)", NULL, &digest);
+      g_autofree char *path = _ostree_inventory_get_path (digest, _OSTREE_INVENTORY_BUCKET_SUFFIX);
+      g_hash_table_add (names, g_strdup (glnx_basename (path)));
+    }
+
+  return TRUE;
+}
+
+/* Return the inventory digest of the current summary of @self, if any */
+static gboolean
+load_summary_inventory_digest (OstreeRepo *self, GVariant **out_digest, GError **error)
+{
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (self->repo_dir_fd, "summary", &fd, error))
+    return FALSE;
+  if (fd == -1)
+    return TRUE;
+  g_autoptr (GVariant) summary = NULL;
+  if (!ot_variant_read_fd (fd, 0, OSTREE_SUMMARY_GVARIANT_FORMAT, FALSE, &summary, error))
+    return FALSE;
+  g_autoptr (GVariant) additional_metadata = g_variant_get_child_value (summary, 1);
+  g_autoptr (GVariant) digest = g_variant_lookup_value (
+      additional_metadata, OSTREE_SUMMARY_INVENTORY, G_VARIANT_TYPE_BYTESTRING);
+  if (digest != NULL && ostree_checksum_bytes_peek_validate (digest, NULL) != NULL)
+    *out_digest = g_steal_pointer (&digest);
+  return TRUE;
+}
+
+static gboolean
+write_inventory_file (OstreeRepo *self, GVariant *variant, GVariant *digest, const char *suffix,
+                      GCancellable *cancellable, GError **error)
+{
+  g_autofree char *path = _ostree_inventory_get_path (digest, suffix);
+  if (!glnx_fstatat_allow_noent (self->repo_dir_fd, path, NULL, 0, error))
+    return FALSE;
+  /* Named after the contents, so there's nothing to do if it exists */
+  if (errno == 0)
+    return TRUE;
+
+  return _ostree_repo_file_replace_contents (self, self->repo_dir_fd, path,
+                                             g_variant_get_data (variant),
+                                             g_variant_get_size (variant), cancellable, error);
+}
+
+/* Write out inventory/ for @self, and return the digest of the new index to
+ * put in the summary. Files which neither the new index nor the one of the
+ * current summary refer to are removed.
+ */
+gboolean
+_ostree_repo_write_inventory (OstreeRepo *self, GVariant **out_index_digest,
+                              GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Writing inventory", error);
+
+  g_autoptr (GPtrArray) buckets
+      = _ostree_repo_inventory_build_buckets (self, FALSE, cancellable, error);
+  if (buckets == NULL)
+    return FALSE;
+
+  if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, _OSTREE_INVENTORY_DIR, 0775, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GHashTable) keep = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr (GVariant) old_index_digest = NULL;
+  if (!load_summary_inventory_digest (self, &old_index_digest, error))
+    return FALSE;
+  if (old_index_digest != NULL && !add_index_file_names (self, old_index_digest, keep, error))
+    return FALSE;
+
+  g_auto (GVariantBuilder) buckets_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_builder_init (&buckets_builder, G_VARIANT_TYPE ("a(uay)"));
+  for (guint i = 0; i < OSTREE_INVENTORY_N_BUCKETS; i++)
+    {
+      GVariant *bucket = buckets->pdata[i];
+      g_autoptr (GVariant) digest = _ostree_inventory_digest (bucket);
+      if (!write_inventory_file (self, bucket, digest, _OSTREE_INVENTORY_BUCKET_SUFFIX,
+                                 cancellable, error))
+        return FALSE;
+
+      g_autofree char *path = _ostree_inventory_get_path (digest, _OSTREE_INVENTORY_BUCKET_SUFFIX);
+      g_hash_table_add (keep, g_strdup (glnx_basename (path)));
+      g_variant_builder_add (&buckets_builder, "(u@ay)", (guint32)g_variant_n_children (bucket),
+                             digest);
+    }
+
+  /* Commits which aren't partial have all their objects in the inventory, so
+   * a mirror which has synced it doesn't need to walk their trees.  They're
+   * sorted so that the index only changes if the set does.
+   */
+  g_autoptr (GHashTable) commits = NULL;
+  if (!ostree_repo_list_commit_objects_starting_with (self, "", &commits, cancellable, error))
+    return FALSE;
+  g_autoptr (GPtrArray) complete_commits = g_ptr_array_new ();
+  GLNX_HASH_TABLE_FOREACH (commits, GVariant *, object)
+    {
+      const char *checksum;
+      ostree_object_name_deserialize (object, &checksum, NULL);
+
+      g_autofree char *commitpartial_path = _ostree_get_commitpartial_path (checksum);
+      if (!glnx_fstatat_allow_noent (self->repo_dir_fd, commitpartial_path, NULL, 0, error))
+        return FALSE;
+      if (errno == 0)
+        continue;
+
+      g_ptr_array_add (complete_commits, (char *)checksum);
+    }
+  g_ptr_array_sort (complete_commits, compare_checksums);
+  g_auto (GVariantBuilder) commits_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_builder_init (&commits_builder, G_VARIANT_TYPE ("aay"));
+  for (guint i = 0; i < complete_commits->len; i++)
+    g_variant_builder_add_value (&commits_builder,
+                                 ostree_checksum_to_bytes_v (complete_commits->pdata[i]));
+
+  g_auto (GVariantDict) metadata = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_dict_init (&metadata, NULL);
+  g_variant_dict_insert_value (&metadata, OSTREE_INVENTORY_COMPLETE_COMMITS,
+                               g_variant_builder_end (&commits_builder));
+
+  g_autoptr (GVariant) index = g_variant_ref_sink (g_variant_new (
+      "(@a(uay)@a{sv})", g_variant_builder_end (&buckets_builder), g_variant_dict_end (&metadata)));
+  g_autoptr (GVariant) index_digest = _ostree_inventory_digest (index);
+  if (!write_inventory_file (self, index, index_digest, _OSTREE_INVENTORY_INDEX_SUFFIX,
+                             cancellable, error))
+    return FALSE;
+  g_autofree char *index_path
+      = _ostree_inventory_get_path (index_digest, _OSTREE_INVENTORY_INDEX_SUFFIX);
+  g_hash_table_add (keep, g_strdup (glnx_basename (index_path)));
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    0,
+  };
+  if (!glnx_dirfd_iterator_init_at (self->repo_dir_fd, _OSTREE_INVENTORY_DIR, FALSE, &dfd_iter,
+                                    error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+      if (g_hash_table_contains (keep, dent->d_name))
+        continue;
+      if (!glnx_unlinkat (dfd_iter.fd, dent->d_name, 0, error))
+        return FALSE;
+    }
+
+  *out_index_digest = g_steal_pointer (&index_digest);
+  return TRUE;
+}
@@ -31,9 +31,20 @@ G_BEGIN_DECLS
 #define OSTREE_DELTAPART_VERSION (0)
 
 #define _OSTREE_SUMMARY_CACHE_DIR "summaries"
+#define _OSTREE_MIRRORLIST_CACHE_DIR "mirrorlists"
+#define _OSTREE_DELTA_CACHE_DIR "deltas"
+#define _OSTREE_COMPOSEFS_CACHE_DIR "composefs"
+#define _OSTREE_GPG_CACHE_DIR "gpg"
+#define _OSTREE_INVENTORY_DIR "inventory"
 #define _OSTREE_CACHE_DIR "cache"
 
-#define _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS 2
+/* Delta parts are expensive to process, so besides a cap on their number we
+ * limit the sum of the uncompressed sizes of the parts between the start of
+ * their fetch and the end of their application. A single part is always
+ * allowed, regardless of its size.
+ */
+#define _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS 8
+#define _OSTREE_MAX_OUTSTANDING_DELTAPART_USIZE (64 * 1024 * 1024)
 
 /* We want some parallelism with disk writes, but we also
  * want to avoid starting tens or hundreds of threads
@@ -55,6 +66,17 @@ G_BEGIN_DECLS
 #define OSTREE_SUMMARY_MODE "ostree.summary.mode"
 #define OSTREE_SUMMARY_TOMBSTONE_COMMITS "ostree.summary.tombstone-commits"
 #define OSTREE_SUMMARY_INDEXED_DELTAS "ostree.summary.indexed-deltas"
+#define OSTREE_SUMMARY_INVENTORY "ostree.summary.inventory"
+
+/* The object inventory; see ostree-repo-inventory.c. The index is an array
+ * of (number of objects, SHA256 of the bucket file) for each bucket, and a
+ * metadata dict. Files are named after their SHA256, with these suffixes. */
+#define OSTREE_INVENTORY_N_BUCKETS 256
+#define OSTREE_INVENTORY_INDEX_GVARIANT_FORMAT G_VARIANT_TYPE ("(a(uay)a{sv})")
+#define OSTREE_INVENTORY_BUCKET_GVARIANT_FORMAT G_VARIANT_TYPE ("a(yay)")
+#define OSTREE_INVENTORY_COMPLETE_COMMITS "ostree.inventory.complete-commits"
+#define _OSTREE_INVENTORY_INDEX_SUFFIX "index"
+#define _OSTREE_INVENTORY_BUCKET_SUFFIX "bucket"
 
 #define _OSTREE_PAYLOAD_LINK_PREFIX "../"
 #define _OSTREE_PAYLOAD_LINK_PREFIX_LEN (sizeof (_OSTREE_PAYLOAD_LINK_PREFIX) - 1)
@@ -63,6 +85,8 @@ G_BEGIN_DECLS
  * in a summary file. */
 #define OSTREE_COMMIT_TIMESTAMP "ostree.commit.timestamp"
 #define OSTREE_COMMIT_VERSION "ostree.commit.version"
+#define OSTREE_COMMIT_DETACHED_METADATA "ostree.commit.detached-metadata"
+#define OSTREE_COMMIT_ANCESTORS "ostree.commit.ancestors"
 
 // The metadata key for composefs
 #define OSTREE_COMPOSEFS_META_PREFIX "ostree.composefs"
@@ -103,16 +127,35 @@ typedef enum
   OSTREE_REPO_SYSROOT_KIND_IS_SYSROOT_OSTREE, /* We match /ostree/repo */
 } OstreeRepoSysrootKind;
 
-typedef struct
+/* The state of one transaction. Each #OstreeRepo embeds one for
+ * ostree_repo_prepare_transaction(); ostree_transaction_new() allocates
+ * more, which hold a reference to the repo. The refs, stats, block
+ * accounting and object sizes are protected by the repo's txn_lock.
+ */
+struct OstreeTransaction
 {
+  gint refcount;    /* Only used for ostree_transaction_new() */
+  OstreeRepo *repo; /* Owned, likewise */
+  gboolean active;
+  gboolean locked; /* Holds a shared repo lock */
+  GLnxTmpDir stagedir;
+  GLnxLockFile stagedir_lock;
   GHashTable *refs;            /* (element-type utf8 utf8) */
   GHashTable *collection_refs; /* (element-type OstreeCollectionRef utf8) */
   OstreeRepoTransactionStats stats;
   /* Implementation of min-free-space-percent */
   gulong blocksize;
+  guint64 reserved_blocks;
   fsblkcnt_t max_blocks;
+  gboolean cleanup_stagedir; /* Set once min-free-space was hit */
   gboolean disable_auto_summary;
-} OstreeRepoTxn;
+  gint n_background_pulls; /* atomic; see _ostree_repo_begin_background_io() */
+  /* Sizes of the objects written for the next commit, if generate_sizes is
+   * set; see _ostree_repo_setup_generate_sizes(). */
+  gboolean generate_sizes;
+  GHashTable *object_sizes; /* (element-type utf8 OstreeContentSizeCacheEntry) */
+  GHashTable *loose_object_devino_hash; /* See ostree_repo_scan_hardlinks() */
+};
 
 typedef struct
 {
@@ -164,8 +207,6 @@ struct OstreeRepo
   GObject parent;
 
   char *stagedir_prefix;
-  GLnxTmpDir commit_stagedir;
-  GLnxLockFile commit_stagedir_lock;
 
   /* A cached fd-relative version, distinct from the case where we may have a
    * user-provided absolute path.
@@ -185,15 +226,19 @@ struct OstreeRepo
   OstreeRepoLock lock;
 
   GMutex txn_lock;
-  OstreeRepoTxn txn;
-  gboolean txn_locked;
+  OstreeTransaction txn; /* The default transaction */
+  GMutex txn_commit_lock; /* Serializes ref updates when transactions commit */
   _OstreeFeatureSupport fs_verity_wanted;
   _OstreeFeatureSupport fs_verity_supported;
   OtTristate composefs_wanted;
   gboolean composefs_supported;
 
-  GMutex cache_lock;
-  guint dirmeta_cache_refcount;
+  GMutex cache_lock; /* Protects updated_uncompressed_dirs */
+  /* Protects dirmeta_cache; read-mostly, so lookups from several threads
+   * don't contend. The refcount is also read atomically without it.
+   */
+  GRWLock dirmeta_cache_lock;
+  gint dirmeta_cache_refcount;
   /* char * checksum → GVariant * for dirmeta objects, used in the checkout path */
   GHashTable *dirmeta_cache;
 
@@ -202,40 +247,33 @@ struct OstreeRepo
   gboolean is_on_fuse; /* TRUE if the repository is on a FUSE filesystem */
   OstreeRepoSysrootKind sysroot_kind;
   GError *writable_error;
-  gboolean in_transaction;
   gboolean disable_fsync;
   gboolean per_object_fsync;
   gboolean disable_xattrs;
   guint zlib_compression_level;
-  GHashTable *loose_object_devino_hash;
   GHashTable *updated_uncompressed_dirs;
 
-  /* FIXME: The object sizes hash table is really per-commit state, not repo
-   * state. Using a single table for the repo means that commits cannot be
-   * built simultaneously if they're adding size information. This data should
-   * probably be in OstreeMutableTree, but that's gone by the time the actual
-   * commit is constructed. At that point the only commit state is in the root
-   * OstreeRepoFile.
-   */
-  GHashTable *object_sizes;
-
   /* Cache the repo's device/inode to use for comparisons elsewhere */
   dev_t device;
   ino_t inode;
-  uid_t owner_uid;              /* Cache of repo's owner uid */
-  guint min_free_space_percent; /* See the min-free-space-percent config option */
-  guint64 min_free_space_mb;    /* See the min-free-space-size config option */
-  guint64 reserved_blocks;
-  gboolean cleanup_stagedir;
+  uid_t owner_uid;                 /* Cache of repo's owner uid */
+  guint min_free_space_percent;    /* See the min-free-space-percent config option */
+  guint64 min_free_space_mb;       /* See the min-free-space-size config option */
+  guint64 delta_cache_max_size_mb; /* See the delta-cache-max-size config option */
 
   guint test_error_flags; /* OstreeRepoTestErrorFlags */
 
   GKeyFile *config;
   GHashTable *remotes;
   GMutex remotes_lock;
+  GMutex gpg_verifiers_lock; /* Protects gpg_verifiers */
+  /* remote name → OstreeGpgVerifier *, see _ostree_repo_gpg_verify_data_internal() */
+  GHashTable *gpg_verifiers;
+  GMutex pull_throttle_lock;  /* Protects the following two */
+  guint pull_throttle_serial; /* Bumped by ostree_repo_set_pull_throttle() */
+  GVariant *pull_throttle_options;
   OstreeRepoMode mode;
   gboolean enable_uncompressed_cache;
-  gboolean generate_sizes;
   guint64 tmp_expiry_seconds;
   gchar *collection_id;
   gboolean add_remotes_config_dir; /* Add new remotes in remotes.d dir */
@@ -282,6 +320,12 @@ gboolean _ostree_repo_allocate_tmpdir (int tmpdir_dfd, const char *tmpdir_prefix
 
 gboolean _ostree_repo_has_staging_prefix (const char *filename);
 
+OstreeTransaction *_ostree_repo_get_txn (OstreeRepo *self);
+
+OstreeTransaction *_ostree_repo_get_thread_txn (OstreeRepo *self);
+
+int _ostree_repo_get_txn_stagedir_fd (OstreeRepo *self);
+
 gboolean _ostree_repo_try_lock_tmpdir (int tmpdir_dfd, const char *tmpdir_name,
                                        GLnxLockFile *file_lock_out, gboolean *out_did_lock,
                                        GError **error);
@@ -307,6 +351,16 @@ gboolean _ostree_repo_update_refs (OstreeRepo *self, GHashTable *refs, GCancella
 gboolean _ostree_repo_update_collection_refs (OstreeRepo *self, GHashTable *refs,
                                               GCancellable *cancellable, GError **error);
 
+guint _ostree_repo_get_pull_throttle_serial (OstreeRepo *self);
+
+GVariant *_ostree_repo_get_pull_throttle (OstreeRepo *self, guint *inout_serial);
+
+int _ostree_set_idle_ioprio (void);
+
+void _ostree_restore_ioprio (int prev_ioprio);
+
+int _ostree_repo_begin_background_io (OstreeRepo *self, OstreeTransaction *txn);
+
 gboolean _ostree_repo_file_replace_contents (OstreeRepo *self, int dfd, const char *path,
                                              const guint8 *buf, gsize len,
                                              GCancellable *cancellable, GError **error);
@@ -361,6 +415,14 @@ gboolean _ostree_repo_commit_tmpf_final (OstreeRepo *self, const char *checksum,
                                          OstreeObjectType objtype, GLnxTmpfile *tmpf,
                                          GCancellable *cancellable, GError **error);
 
+void _ostree_repo_write_archive_content_tmpf_async (OstreeRepo *self,
+                                                    const char *expected_checksum,
+                                                    GLnxTmpfile *tmpf, GCancellable *cancellable,
+                                                    GAsyncReadyCallback callback,
+                                                    gpointer user_data);
+gboolean _ostree_repo_write_archive_content_tmpf_finish (OstreeRepo *self, GAsyncResult *result,
+                                                         GError **error);
+
 typedef struct
 {
   gboolean initialized;
@@ -394,6 +456,27 @@ gboolean _ostree_repo_load_file_bare (OstreeRepo *self, const char *checksum, in
 
 gboolean _ostree_repo_update_mtime (OstreeRepo *self, GError **error);
 
+gboolean _ostree_repo_delta_cache_enabled (OstreeRepo *self);
+gboolean _ostree_repo_delta_cache_lookup (OstreeRepo *self, const char *checksum, int *out_fd,
+                                          GError **error);
+gboolean _ostree_repo_delta_cache_contains (OstreeRepo *self, const char *checksum,
+                                            gboolean *out_found, GError **error);
+gboolean _ostree_repo_delta_cache_store (OstreeRepo *self, const char *checksum, int fd,
+                                         GCancellable *cancellable, GError **error);
+gboolean _ostree_repo_delta_cache_evict (OstreeRepo *self, const char *checksum, GError **error);
+gboolean _ostree_repo_delta_cache_prune (OstreeRepo *self, GCancellable *cancellable,
+                                         GError **error);
+
+GPtrArray *_ostree_repo_inventory_build_buckets (OstreeRepo *self, gboolean include_parents,
+                                                 GCancellable *cancellable, GError **error);
+GVariant *_ostree_inventory_digest (GVariant *variant);
+char *_ostree_inventory_get_path (GVariant *digest, const char *suffix);
+gboolean _ostree_inventory_validate_index (GVariant *index, GError **error);
+gboolean _ostree_inventory_bucket_diff (GVariant *remote_bucket, GVariant *local_bucket,
+                                        GPtrArray *out_missing, GError **error);
+gboolean _ostree_repo_write_inventory (OstreeRepo *self, GVariant **out_index_digest,
+                                       GCancellable *cancellable, GError **error);
+
 gboolean _ostree_repo_add_remote (OstreeRepo *self, OstreeRemote *remote);
 gboolean _ostree_repo_remove_remote (OstreeRepo *self, OstreeRemote *remote);
 OstreeRemote *_ostree_repo_get_remote (OstreeRepo *self, const char *name, GError **error);
@@ -473,6 +556,8 @@ gboolean ostree_composefs_target_write (OstreeComposefsTarget *target, int fd,
                                         guchar **out_fsverity_digest, GCancellable *cancellable,
                                         GError **error);
 
+gboolean _ostree_composefs_measure_image (int fd, guchar *out_digest, GError **error);
+
 gboolean _ostree_repo_checkout_composefs (OstreeRepo *self, OstreeComposefsTarget *target,
                                           OstreeRepoFile *source, GCancellable *cancellable,
                                           GError **error);
@@ -136,12 +136,10 @@ exit:
   return TRUE;
 }
 
+/* Delete cached summaries for remotes which no longer exist */
 static gboolean
-_ostree_repo_prune_tmp (OstreeRepo *self, GCancellable *cancellable, GError **error)
+prune_summary_cache (OstreeRepo *self, GCancellable *cancellable, GError **error)
 {
-  if (self->cache_dir_fd == -1)
-    return TRUE;
-
   g_auto (GLnxDirFdIterator) dfd_iter = {
     0,
   };
@@ -188,6 +186,65 @@ _ostree_repo_prune_tmp (OstreeRepo *self, GCancellable *cancellable, GError **er
   return TRUE;
 }
 
+/* Delete cached composefs images for commits which no longer exist */
+static gboolean
+prune_composefs_cache (OstreeRepo *self, GCancellable *cancellable, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    0,
+  };
+  gboolean exists;
+  if (!ot_dfd_iter_init_allow_noent (self->cache_dir_fd, _OSTREE_COMPOSEFS_CACHE_DIR, &dfd_iter,
+                                     &exists, error))
+    return FALSE;
+  /* Note early return */
+  if (!exists)
+    return TRUE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+      /* We only ever create regular files here */
+      if (dent->d_type != DT_REG)
+        continue;
+
+      /* Entries are named CHECKSUM.vN */
+      g_autofree char *checksum = g_strndup (dent->d_name, OSTREE_SHA256_STRING_LEN);
+      gboolean has_commit = FALSE;
+      if (ostree_validate_checksum_string (checksum, NULL)
+          && !ostree_repo_has_object (self, OSTREE_OBJECT_TYPE_COMMIT, checksum, &has_commit,
+                                      cancellable, error))
+        return FALSE;
+
+      if (!has_commit)
+        {
+          if (!glnx_unlinkat (dfd_iter.fd, dent->d_name, 0, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+_ostree_repo_prune_tmp (OstreeRepo *self, GCancellable *cancellable, GError **error)
+{
+  if (self->cache_dir_fd == -1)
+    return TRUE;
+
+  if (!prune_summary_cache (self, cancellable, error))
+    return FALSE;
+  if (!prune_composefs_cache (self, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 /**
  * ostree_repo_prune_static_deltas:
  * @self: Repo
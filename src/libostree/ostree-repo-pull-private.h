@@ -45,6 +45,7 @@ typedef struct
 
   GPtrArray *meta_mirrorlist;    /* List of base URIs for fetching metadata */
   GPtrArray *content_mirrorlist; /* List of base URIs for fetching content */
+  GPtrArray *mirrorlist_urls;    /* Mirrorlists the above came from, if any */
   OstreeRepo *remote_repo_local;
   GPtrArray *localcache_repos; /* Array<OstreeRepo> */
 
@@ -58,6 +59,13 @@ typedef struct
   guint32 low_speed_time;
   gboolean retry_all;
   guint32 max_outstanding_fetcher_requests;
+  guint64 max_bandwidth; /* Bytes per second across all fetches, 0 for no cap */
+  gboolean background;   /* See set_background() */
+  int prev_ioprio;       /* Of the pulling thread, before entering background mode */
+  /* The transaction whose writers use the idle I/O priority */
+  OstreeTransaction *background_txn;
+  guint throttle_serial; /* See _ostree_repo_get_pull_throttle() */
+  GSource *throttle_src;
 
   gboolean dry_run;
   gboolean dry_run_emitted_progress;
@@ -95,10 +103,22 @@ typedef struct
 
   GHashTable *static_delta_targets; /* Set<checksum> of commits fetched via static delta */
 
+  gboolean inventory;                     /* Reconcile objects using the remote's inventory */
+  GPtrArray *inventory_missing;           /* Array<ObjectName> to fetch from the inventory */
+  GHashTable *inventory_complete_commits; /* Set<checksum> of commits with all objects synced */
+  GHashTable *inventory_unscanned;        /* Set<ObjectName> of inventory fetches not scanned */
+
+  GVariant *journal_target;    /* (sas) remote and commits of the journal, NULL if not kept */
+  GHashTable *journal_pending; /* Map<ObjectName,path> queued by tree scans, not yet written */
+  GSource *journal_src;
+  gboolean journal_writing; /* A write of the journal is in progress in a worker thread */
+
   GHashTable *expected_commit_sizes;           /* Maps commit checksum to known size */
   GHashTable *commit_to_depth;                 /* Maps parent commit checksum maximum depth */
   GHashTable *scanned_metadata;                /* Maps object name to itself */
   GHashTable *fetched_detached_metadata;       /* Map<checksum,GVariant> */
+  GHashTable *summary_detached_metadata;       /* Map<checksum,GVariant> from the summary */
+  GHashTable *summary_parents;                 /* Map<checksum,checksum> from the summary */
   GHashTable *requested_metadata;              /* Maps object name to itself */
   GHashTable *requested_content;               /* Maps checksum to itself */
   GHashTable *requested_fallback_content;      /* Maps checksum to itself */
@@ -107,12 +127,16 @@ typedef struct
   GHashTable *pending_fetch_delta_indexes;     /* Set<FetchDeltaIndexData> */
   GHashTable *pending_fetch_delta_superblocks; /* Set<FetchDeltaSuperData> */
   GHashTable *pending_fetch_deltaparts;        /* Set<FetchStaticDeltaData> */
+  /* Map<checksum,guint> of parts across all deltas to how many other deltas are waiting on them */
+  GHashTable *requested_deltaparts;
   guint n_outstanding_metadata_fetches;
   guint n_outstanding_metadata_write_requests;
   guint n_outstanding_content_fetches;
   guint n_outstanding_content_write_requests;
   guint n_outstanding_deltapart_fetches;
   guint n_outstanding_deltapart_write_requests;
+  guint n_deltaparts_in_flight;     /* Fetched parts, from fetch start to applied */
+  guint64 deltapart_usize_in_flight; /* Sum of their uncompressed sizes */
   guint n_total_deltaparts;
   guint n_total_delta_fallbacks;
   guint64 fetched_deltapart_size; /* How much of the delta we have now */
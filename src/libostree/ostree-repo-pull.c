@@ -35,6 +35,7 @@
 #include "ostree-core-private.h"
 #include "ostree-metalink.h"
 #include "ostree-repo-static-delta-private.h"
+#include "ostree-sdt-private.h"
 
 #include "ostree-repo-finder-config.h"
 #include "ostree-repo-finder-mount.h"
@@ -53,6 +54,11 @@
 #define OSTREE_MESSAGE_FETCH_COMPLETE_ID \
   SD_ID128_MAKE (75, ba, 3d, eb, 0a, f0, 41, a9, a4, 62, 72, ff, 85, d9, e7, 3e)
 
+/* See pull_journal_write() */
+#define PULL_JOURNAL_NAME "pull-journal"
+#define PULL_JOURNAL_GVARIANT_FORMAT G_VARIANT_TYPE ("((sas)aaya(yays))")
+#define PULL_JOURNAL_INTERVAL_SECONDS 30
+
 #define OSTREE_REPO_PULL_CONTENT_PRIORITY (OSTREE_FETCHER_DEFAULT_PRIORITY)
 #define OSTREE_REPO_PULL_METADATA_PRIORITY (OSTREE_REPO_PULL_CONTENT_PRIORITY - 100)
 
@@ -66,6 +72,9 @@
 #define OPT_RETRYALL_DEFAULT TRUE
 #define OPT_OSTREE_MAX_OUTSTANDING_FETCHER_REQUESTS_DEFAULT 8
 
+/* requested_deltaparts value for a part which has been applied already */
+#define DELTAPART_APPLIED G_MAXUINT
+
 typedef struct
 {
   OtPullData *pull_data;
@@ -91,6 +100,9 @@ typedef struct
   char *to_revision;
   guint i;
   guint64 size;
+  guint64 usize;
+  gboolean in_flight; /* Counted in n_deltaparts_in_flight */
+  gboolean cached;    /* Found in the delta cache when queued */
   guint n_retries_remaining;
 } FetchStaticDeltaData;
 
@@ -133,6 +145,7 @@ static void start_fetch_deltapart (OtPullData *pull_data, FetchStaticDeltaData *
 static void start_fetch_delta_superblock (OtPullData *pull_data, FetchDeltaSuperData *fetch_data);
 static void start_fetch_delta_index (OtPullData *pull_data, FetchDeltaIndexData *fetch_data);
 static gboolean fetcher_queue_is_full (OtPullData *pull_data);
+static gboolean deltapart_queue_is_full (OtPullData *pull_data, FetchStaticDeltaData *fetch);
 static void queue_scan_one_metadata_object (OtPullData *pull_data, const char *csum,
                                             OstreeObjectType objtype, const char *path,
                                             guint recursion_depth, const OstreeCollectionRef *ref);
@@ -342,6 +355,9 @@ check_outstanding_requests_handle_error (OtPullData *pull_data, GError **errorp)
       while (!fetcher_queue_is_full (pull_data) && g_hash_table_iter_next (&hiter, &key, &value))
         {
           FetchStaticDeltaData *fetch = key;
+          /* A smaller part may still fit in the budget */
+          if (deltapart_queue_is_full (pull_data, fetch))
+            continue;
           g_hash_table_iter_steal (&hiter);
           /* Takes ownership */
           start_fetch_deltapart (pull_data, fetch);
@@ -369,10 +385,11 @@ check_outstanding_requests_handle_error (OtPullData *pull_data, GError **errorp)
     }
 }
 
-/* We have a total-request limit, as well has a hardcoded max of 2 for delta
- * parts. The logic for the delta one is that processing them is expensive, and
- * doing multiple simultaneously could risk space/memory on smaller devices. We
- * also throttle on outstanding writes in case fetches are faster.
+/* We have a total-request limit, and we also throttle on outstanding writes in
+ * case fetches are faster. Delta parts are additionally limited by
+ * deltapart_queue_is_full(); that limit deliberately doesn't apply here, so
+ * that superblocks for other refs, fallback objects etc. keep flowing while
+ * parts are being fetched and applied.
  */
 static gboolean
 fetcher_queue_is_full (OtPullData *pull_data)
@@ -381,13 +398,38 @@ fetcher_queue_is_full (OtPullData *pull_data)
       = ((pull_data->n_outstanding_metadata_fetches + pull_data->n_outstanding_content_fetches
           + pull_data->n_outstanding_deltapart_fetches)
          == pull_data->max_outstanding_fetcher_requests);
-  const gboolean deltas_full
-      = (pull_data->n_outstanding_deltapart_fetches == _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS);
   const gboolean writes_full = ((pull_data->n_outstanding_metadata_write_requests
                                  + pull_data->n_outstanding_content_write_requests
                                  + pull_data->n_outstanding_deltapart_write_requests)
                                 >= _OSTREE_MAX_OUTSTANDING_WRITE_REQUESTS);
-  return fetch_full || deltas_full || writes_full;
+  return fetch_full || writes_full;
+}
+
+/* Processing delta parts is expensive, and doing many simultaneously could
+ * risk space/memory on smaller devices. So parts count against a budget from
+ * the start of their fetch until they're applied, which lets the fetch of one
+ * part overlap with the decompression and application of others.
+ */
+static gboolean
+deltapart_queue_is_full (OtPullData *pull_data, FetchStaticDeltaData *fetch)
+{
+  if (pull_data->n_deltaparts_in_flight == 0)
+    return FALSE;
+  if (pull_data->n_deltaparts_in_flight >= _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS)
+    return TRUE;
+  return pull_data->deltapart_usize_in_flight + fetch->usize
+         > _OSTREE_MAX_OUTSTANDING_DELTAPART_USIZE;
+}
+
+static void
+deltapart_release_budget (OtPullData *pull_data, FetchStaticDeltaData *fetch)
+{
+  if (!fetch->in_flight)
+    return;
+  g_assert_cmpuint (pull_data->n_deltaparts_in_flight, >, 0);
+  pull_data->n_deltaparts_in_flight--;
+  pull_data->deltapart_usize_in_flight -= fetch->usize;
+  fetch->in_flight = FALSE;
 }
 
 static void
@@ -610,6 +652,29 @@ async_import_one_local_content_object_finish (OtPullData *pull_data, GAsyncResul
   return g_task_propagate_boolean ((GTask *)result, error);
 }
 
+/* Record that a tree scan queued @checksum, so that a restarted pull can
+ * re-queue it if it isn't written by then; see pull_journal_write().
+ */
+static void
+journal_pending_add (OtPullData *pull_data, const char *checksum, OstreeObjectType objtype,
+                     const char *path)
+{
+  if (pull_data->journal_pending == NULL)
+    return;
+  g_hash_table_replace (pull_data->journal_pending,
+                        g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype)),
+                        g_strdup (path));
+}
+
+static void
+journal_pending_remove (OtPullData *pull_data, const char *checksum, OstreeObjectType objtype)
+{
+  if (pull_data->journal_pending == NULL)
+    return;
+  g_autoptr (GVariant) object = ostree_object_name_serialize (checksum, objtype);
+  g_hash_table_remove (pull_data->journal_pending, object);
+}
+
 static void
 on_local_object_imported (GObject *object, GAsyncResult *result, gpointer user_data)
 {
@@ -620,6 +685,9 @@ on_local_object_imported (GObject *object, GAsyncResult *result, gpointer user_d
   if (!async_import_one_local_content_object_finish (pull_data, result, error))
     goto out;
 
+  ImportLocalAsyncData *iataskdata = g_task_get_task_data ((GTask *)result);
+  journal_pending_remove (pull_data, iataskdata->checksum, OSTREE_OBJECT_TYPE_FILE);
+
 out:
   pull_data->n_imported_content++;
   g_assert_cmpint (pull_data->n_outstanding_content_write_requests, >, 0);
@@ -705,6 +773,7 @@ scan_dirtree_object (OtPullData *pull_data, const char *checksum, const char *pa
               async_import_one_local_content_object (pull_data, localcache_repo, file_checksum,
                                                      cancellable, on_local_object_imported,
                                                      pull_data);
+              journal_pending_add (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, NULL);
               g_hash_table_add (pull_data->requested_content, g_steal_pointer (&file_checksum));
               did_import_from_cache_repo = TRUE;
               break;
@@ -714,6 +783,7 @@ scan_dirtree_object (OtPullData *pull_data, const char *checksum, const char *pa
         continue; /* Note early continue */
 
       /* Not available locally, queue a HTTP request */
+      journal_pending_add (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, NULL);
       g_hash_table_add (pull_data->requested_content, file_checksum);
       enqueue_one_object_request (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, path, FALSE,
                                   FALSE, NULL);
@@ -745,6 +815,15 @@ scan_dirtree_object (OtPullData *pull_data, const char *checksum, const char *pa
         return glnx_prefix_error (error, "Parsing dirtree %s meta child %s", checksum, dirname);
 
       g_autofree char *subpath = g_strconcat (path, dirname, "/", NULL);
+      if (pull_data->journal_pending != NULL)
+        {
+          char tree_checksum[OSTREE_SHA256_STRING_LEN + 1];
+          char meta_checksum[OSTREE_SHA256_STRING_LEN + 1];
+          ostree_checksum_inplace_from_bytes (tree_csum_bytes, tree_checksum);
+          ostree_checksum_inplace_from_bytes (meta_csum_bytes, meta_checksum);
+          journal_pending_add (pull_data, tree_checksum, OSTREE_OBJECT_TYPE_DIR_TREE, subpath);
+          journal_pending_add (pull_data, meta_checksum, OSTREE_OBJECT_TYPE_DIR_META, subpath);
+        }
       queue_scan_one_metadata_object_c (pull_data, tree_csum_bytes, OSTREE_OBJECT_TYPE_DIR_TREE,
                                         subpath, recursion_depth + 1, NULL);
       queue_scan_one_metadata_object_c (pull_data, meta_csum_bytes, OSTREE_OBJECT_TYPE_DIR_META,
@@ -802,11 +881,17 @@ fetch_ref_contents (OtPullData *pull_data, const char *main_collection_id,
   return TRUE;
 }
 
+/* @out_detached_metadata is set to the commit's detached metadata if the
+ * summary includes it (an empty a{sv} meaning there is none), or %NULL; the
+ * same goes for @out_ancestors and the `aay` list of the commit's ancestors.
+ */
 static gboolean
 lookup_commit_checksum_and_collection_from_summary (OtPullData *pull_data,
                                                     const OstreeCollectionRef *ref,
                                                     char **out_checksum, gsize *out_size,
-                                                    char **out_collection_id, GError **error)
+                                                    char **out_collection_id,
+                                                    GVariant **out_detached_metadata,
+                                                    GVariant **out_ancestors, GError **error)
 {
   g_autoptr (GVariant) additional_metadata = g_variant_get_child_value (pull_data->summary, 1);
   const gchar *main_collection_id;
@@ -849,7 +934,8 @@ lookup_commit_checksum_and_collection_from_summary (OtPullData *pull_data,
   g_autoptr (GVariant) reftargetdata = g_variant_get_child_value (refdata, 1);
   guint64 commit_size;
   g_autoptr (GVariant) commit_csum_v = NULL;
-  g_variant_get (reftargetdata, "(t@ay@a{sv})", &commit_size, &commit_csum_v, NULL);
+  g_autoptr (GVariant) commit_metadata = NULL;
+  g_variant_get (reftargetdata, "(t@ay@a{sv})", &commit_size, &commit_csum_v, &commit_metadata);
 
   if (resolved_collection_id != NULL
       && !ostree_validate_collection_id (resolved_collection_id, error))
@@ -860,6 +946,83 @@ lookup_commit_checksum_and_collection_from_summary (OtPullData *pull_data,
   *out_checksum = ostree_checksum_from_bytes_v (commit_csum_v);
   *out_size = commit_size;
   *out_collection_id = g_strdup (resolved_collection_id);
+  *out_detached_metadata = g_variant_lookup_value (
+      commit_metadata, OSTREE_COMMIT_DETACHED_METADATA, G_VARIANT_TYPE_VARDICT);
+  *out_ancestors
+      = g_variant_lookup_value (commit_metadata, OSTREE_COMMIT_ANCESTORS, G_VARIANT_TYPE ("aay"));
+  return TRUE;
+}
+
+/* Record the chain of @ancestors of @checksum listed in the summary, mapping
+ * each commit to its parent. */
+static gboolean
+record_summary_ancestors (OtPullData *pull_data, const char *checksum, GVariant *ancestors,
+                          GError **error)
+{
+  g_autofree char *child = g_strdup (checksum);
+  const gsize n_ancestors = g_variant_n_children (ancestors);
+  for (gsize i = 0; i < n_ancestors; i++)
+    {
+      g_autoptr (GVariant) csum_v = g_variant_get_child_value (ancestors, i);
+      if (!ostree_validate_structureof_csum_v (csum_v, error))
+        return glnx_prefix_error (error, "Ancestors of %s in summary", checksum);
+
+      char *parent = ostree_checksum_from_bytes_v (csum_v);
+      g_hash_table_replace (pull_data->summary_parents, g_steal_pointer (&child), parent);
+      child = g_strdup (parent);
+    }
+
+  return TRUE;
+}
+
+/* Request the ancestors of @checksum listed in the summary which are within
+ * the depth we're pulling up front, rather than one by one as we scan each
+ * commit and find its parent.  scan_commit_object() checks each of them
+ * against the parent of its child when that arrives.
+ */
+static void
+queue_summary_ancestors (OtPullData *pull_data, const char *checksum)
+{
+  int depth = pull_data->maxdepth;
+  const char *parent = g_hash_table_lookup (pull_data->summary_parents, checksum);
+
+  while (parent != NULL && depth != 0)
+    {
+      depth = (depth > 0) ? depth - 1 : -1;
+      if (!g_hash_table_contains (pull_data->commit_to_depth, parent))
+        {
+          g_hash_table_insert (pull_data->commit_to_depth, g_strdup (parent),
+                               GINT_TO_POINTER (depth));
+          queue_scan_one_metadata_object (pull_data, parent, OSTREE_OBJECT_TYPE_COMMIT, NULL, 1,
+                                          NULL);
+        }
+      parent = g_hash_table_lookup (pull_data->summary_parents, parent);
+    }
+}
+
+/* If the summary included the detached metadata of @checksum, store it as if
+ * we had fetched it, saving a request before we can fetch and verify the
+ * commit.
+ */
+static gboolean
+use_summary_detached_metadata (OtPullData *pull_data, const char *checksum,
+                               GCancellable *cancellable, GError **error)
+{
+  GVariant *metadata = g_hash_table_lookup (pull_data->summary_detached_metadata, checksum);
+  if (metadata == NULL)
+    return TRUE;
+
+  if (g_variant_n_children (metadata) == 0)
+    {
+      g_hash_table_insert (pull_data->fetched_detached_metadata, g_strdup (checksum), NULL);
+      return TRUE;
+    }
+
+  if (!ostree_repo_write_commit_detached_metadata (pull_data->repo, checksum, metadata,
+                                                   cancellable, error))
+    return FALSE;
+  g_hash_table_insert (pull_data->fetched_detached_metadata, g_strdup (checksum),
+                       g_variant_ref (metadata));
   return TRUE;
 }
 
@@ -886,20 +1049,30 @@ content_fetch_on_write_complete (GObject *object, GAsyncResult *result, gpointer
   g_autofree char *checksum = NULL;
   g_autofree char *checksum_obj = NULL;
 
-  if (!ostree_repo_write_content_finish ((OstreeRepo *)object, result, &csum, error))
-    goto out;
-
-  checksum = ostree_checksum_from_bytes (csum);
-
   ostree_object_name_deserialize (fetch_data->object, &expected_checksum, &objtype);
   g_assert (objtype == OSTREE_OBJECT_TYPE_FILE);
 
+  if (g_async_result_is_tagged (result, _ostree_repo_write_archive_content_tmpf_async))
+    {
+      /* This verified the checksum already */
+      if (!_ostree_repo_write_archive_content_tmpf_finish ((OstreeRepo *)object, result, error))
+        goto out;
+      checksum = g_strdup (expected_checksum);
+    }
+  else
+    {
+      if (!ostree_repo_write_content_finish ((OstreeRepo *)object, result, &csum, error))
+        goto out;
+      checksum = ostree_checksum_from_bytes (csum);
+    }
+
   checksum_obj = ostree_object_to_string (checksum, objtype);
   g_debug ("write of %s complete", checksum_obj);
 
   if (!_ostree_compare_object_checksum (objtype, expected_checksum, checksum, error))
     goto out;
 
+  journal_pending_remove (pull_data, checksum, objtype);
   pull_data->n_fetched_content++;
   /* Was this a delta fallback? */
   if (g_hash_table_remove (pull_data->requested_fallback_content, expected_checksum))
@@ -934,12 +1107,15 @@ content_fetch_on_complete (GObject *object, GAsyncResult *result, gpointer user_
   OstreeObjectType objtype;
   gboolean free_fetch_data = TRUE;
 
-  if (!_ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, NULL, NULL, NULL, error))
-    goto out;
-
   ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
   g_assert (objtype == OSTREE_OBJECT_TYPE_FILE);
 
+  gboolean fetched
+      = _ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, NULL, NULL, NULL, error);
+  OSTREE_PROBE4 (fetch_done, checksum, objtype, FALSE, fetched);
+  if (!fetched)
+    goto out;
+
   checksum_obj = ostree_object_to_string (checksum, objtype);
   g_debug ("fetch of %s complete", checksum_obj);
 
@@ -957,6 +1133,20 @@ content_fetch_on_complete (GObject *object, GAsyncResult *result, gpointer user_
         goto out;
       pull_data->n_fetched_content++;
     }
+  else if (G_IN_SET (pull_data->repo->mode, OSTREE_REPO_MODE_ARCHIVE, OSTREE_REPO_MODE_BARE,
+                     OSTREE_REPO_MODE_BARE_USER, OSTREE_REPO_MODE_BARE_USER_ONLY)
+           && !verifying_bareuseronly)
+    {
+      /* For archive repos what we downloaded is already in the format we
+       * store; verify it and link it into place rather than decompressing it
+       * and compressing it all over again. For bare repos, this inflates it
+       * directly into the final object without the stream stack below.
+       */
+      pull_data->n_outstanding_content_write_requests++;
+      _ostree_repo_write_archive_content_tmpf_async (pull_data->repo, checksum, &tmpf, cancellable,
+                                                     content_fetch_on_write_complete, fetch_data);
+      free_fetch_data = FALSE;
+    }
   else
     {
       struct stat stbuf;
@@ -1034,8 +1224,16 @@ on_metadata_written (GObject *object, GAsyncResult *result, gpointer user_data)
       goto out;
     }
 
-  queue_scan_one_metadata_object_c (pull_data, csum, objtype, fetch_data->path, 0,
-                                    fetch_data->requested_ref);
+  /* Objects fetched because they were missing from the inventory only need
+   * to be scanned if a commit we're scanning refers to them; see
+   * scan_one_metadata_object().
+   */
+  if (pull_data->inventory_unscanned != NULL
+      && g_hash_table_remove (pull_data->inventory_unscanned, fetch_data->object))
+    g_debug ("not scanning %s from inventory", stringified_object);
+  else
+    queue_scan_one_metadata_object_c (pull_data, csum, objtype, fetch_data->path, 0,
+                                      fetch_data->requested_ref);
 
 out:
   g_assert (pull_data->n_outstanding_metadata_write_requests > 0);
@@ -1080,7 +1278,10 @@ meta_fetch_on_complete (GObject *object, GAsyncResult *result, gpointer user_dat
   g_debug ("fetch of %s%s complete", checksum_obj,
            fetch_data->is_detached_meta ? " (detached)" : "");
 
-  if (!_ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, NULL, NULL, NULL, error))
+  gboolean fetched
+      = _ostree_fetcher_request_to_tmpfile_finish (fetcher, result, &tmpf, NULL, NULL, NULL, error);
+  OSTREE_PROBE4 (fetch_done, checksum, objtype, fetch_data->is_detached_meta, fetched);
+  if (!fetched)
     {
       if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
         {
@@ -1237,9 +1438,18 @@ on_static_delta_written (GObject *object, GAsyncResult *result, gpointer user_da
   if (!_ostree_static_delta_part_execute_finish (pull_data->repo, result, error))
     goto out;
 
+  /* Other deltas of this pull which share this part are done too now */
+  const guint n_shared = GPOINTER_TO_UINT (
+      g_hash_table_lookup (pull_data->requested_deltaparts, fetch_data->expected_checksum));
+  pull_data->fetched_deltapart_size += n_shared * fetch_data->size;
+  pull_data->n_fetched_deltaparts += n_shared;
+  g_hash_table_replace (pull_data->requested_deltaparts, g_strdup (fetch_data->expected_checksum),
+                        GUINT_TO_POINTER (DELTAPART_APPLIED));
+
 out:
   g_assert (pull_data->n_outstanding_deltapart_write_requests > 0);
   pull_data->n_outstanding_deltapart_write_requests--;
+  deltapart_release_budget (pull_data, fetch_data);
   /* No need to retry on failure to write locally. */
   check_outstanding_requests_handle_error (pull_data, &local_error);
   /* Always free state */
@@ -1256,7 +1466,6 @@ static_deltapart_fetch_on_complete (GObject *object, GAsyncResult *result, gpoin
     0,
   };
   g_autoptr (GInputStream) in = NULL;
-  g_autoptr (GVariant) part = NULL;
   g_autoptr (GError) local_error = NULL;
   GError **error = &local_error;
   gboolean free_fetch_data = TRUE;
@@ -1269,14 +1478,11 @@ static_deltapart_fetch_on_complete (GObject *object, GAsyncResult *result, gpoin
   /* Transfer ownership of the fd */
   in = g_unix_input_stream_new (g_steal_fd (&tmpf.fd), TRUE);
 
-  /* TODO - make async */
-  if (!_ostree_static_delta_part_open (in, NULL, 0, fetch_data->expected_checksum, &part,
-                                       pull_data->cancellable, error))
-    goto out;
-
-  _ostree_static_delta_part_execute_async (pull_data->repo, fetch_data->objects, part,
-                                           pull_data->cancellable, on_static_delta_written,
-                                           fetch_data);
+  /* Checksumming and decompressing the part happens in the worker thread
+   * too, so the main loop can keep fetching meanwhile. */
+  _ostree_static_delta_part_open_and_execute_async (
+      pull_data->repo, fetch_data->objects, in, fetch_data->expected_checksum, FALSE,
+      pull_data->cancellable, on_static_delta_written, fetch_data);
   pull_data->n_outstanding_deltapart_write_requests++;
   free_fetch_data = FALSE;
 
@@ -1286,6 +1492,8 @@ out:
 
   if (local_error == NULL)
     pull_data->n_fetched_deltaparts++;
+  else
+    deltapart_release_budget (pull_data, fetch_data);
 
   if (_ostree_fetcher_should_retry_request (local_error, fetch_data->n_retries_remaining--))
     enqueue_one_static_delta_part_request_s (pull_data, g_steal_pointer (&fetch_data));
@@ -1600,9 +1808,28 @@ scan_commit_object (OtPullData *pull_data, const char *checksum, guint recursion
   /* If we found a legacy transaction flag, assume all commits are partial */
   gboolean is_partial = commitstate_is_partial (pull_data, commitstate);
 
+  /* If the remote's inventory says it has all the objects of this commit, we
+   * already requested the ones we're missing in sync_inventory().
+   */
+  if (is_partial && pull_data->inventory_complete_commits != NULL
+      && g_hash_table_contains (pull_data->inventory_complete_commits, checksum))
+    {
+      g_debug ("not scanning tree of %s, synced from inventory", checksum);
+      is_partial = FALSE;
+    }
+
+  g_autofree char *parent_checksum = ostree_commit_get_parent (commit);
+
+  /* We may have requested ancestors listed in the summary already; make sure
+   * they really are the history of this commit.
+   */
+  const char *summary_parent = g_hash_table_lookup (pull_data->summary_parents, checksum);
+  if (summary_parent != NULL && g_strcmp0 (parent_checksum, summary_parent) != 0)
+    return glnx_throw (error, "Commit %s has parent %s, but the summary lists %s", checksum,
+                       parent_checksum ?: "(none)", summary_parent);
+
   if (pull_data->maxdepth == -1 || depth > 0)
     {
-      g_autofree char *parent_checksum = ostree_commit_get_parent (commit);
       if (parent_checksum)
         {
           int parent_depth = (depth > 0) ? depth - 1 : -1;
@@ -1695,7 +1922,10 @@ scan_one_metadata_object (OtPullData *pull_data, const char *checksum, OstreeObj
   /* It may happen that we've already looked at this object (think shared
    * dirtree subtrees), if that's the case, we're done */
   if (g_hash_table_lookup (pull_data->scanned_metadata, object))
-    return TRUE;
+    {
+      journal_pending_remove (pull_data, checksum, objtype);
+      return TRUE;
+    }
 
   gboolean is_requested = g_hash_table_lookup (pull_data->requested_metadata, object) != NULL;
   /* Determine if we already have the object */
@@ -1703,6 +1933,12 @@ scan_one_metadata_object (OtPullData *pull_data, const char *checksum, OstreeObj
   if (!ostree_repo_has_object (pull_data->repo, objtype, checksum, &is_stored, cancellable, error))
     return FALSE;
 
+  /* An object we're fetching because of the inventory which turns out to be
+   * part of a tree we're scanning; make sure it's scanned once it's written.
+   */
+  if (is_requested && !is_stored && pull_data->inventory_unscanned != NULL)
+    g_hash_table_remove (pull_data->inventory_unscanned, object);
+
   /* Are we pulling an object we don't have from a local repo? */
   if (!is_stored && pull_data->remote_repo_local)
     {
@@ -1791,13 +2027,22 @@ scan_one_metadata_object (OtPullData *pull_data, const char *checksum, OstreeObj
         }
     }
 
+  if (objtype == OSTREE_OBJECT_TYPE_COMMIT
+      && !g_hash_table_contains (pull_data->fetched_detached_metadata, checksum))
+    {
+      if (!use_summary_detached_metadata (pull_data, checksum, cancellable, error))
+        return FALSE;
+    }
+
   if (!is_stored && !is_requested)
     {
       gboolean do_fetch_detached;
 
       g_hash_table_add (pull_data->requested_metadata, g_variant_ref (object));
 
-      do_fetch_detached = (objtype == OSTREE_OBJECT_TYPE_COMMIT);
+      do_fetch_detached = (objtype == OSTREE_OBJECT_TYPE_COMMIT
+                           && !g_hash_table_contains (pull_data->fetched_detached_metadata,
+                                                      checksum));
       enqueue_one_object_request (pull_data, checksum, objtype, path, do_fetch_detached, FALSE,
                                   ref);
     }
@@ -1828,6 +2073,9 @@ scan_one_metadata_object (OtPullData *pull_data, const char *checksum, OstreeObj
       pull_data->n_scanned_metadata++;
     }
 
+  if (is_stored)
+    journal_pending_remove (pull_data, checksum, objtype);
+
   return TRUE;
 }
 
@@ -1845,6 +2093,7 @@ enqueue_one_object_request_s (OtPullData *pull_data, FetchObjectData *fetch_data
     {
       g_debug ("queuing fetch of %s.%s%s", checksum, ostree_object_type_to_string (objtype),
                fetch_data->is_detached_meta ? " (detached)" : "");
+      OSTREE_PROBE3 (fetch_queued, checksum, objtype, fetch_data->is_detached_meta);
 
       if (is_meta)
         {
@@ -1900,6 +2149,7 @@ start_fetch (OtPullData *pull_data, FetchObjectData *fetch)
 
   g_debug ("starting fetch of %s.%s%s", expected_checksum, ostree_object_type_to_string (objtype),
            fetch->is_detached_meta ? " (detached)" : "");
+  OSTREE_PROBE3 (fetch_start, expected_checksum, objtype, fetch->is_detached_meta);
 
   gboolean is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
   if (is_meta)
@@ -1969,31 +2219,18 @@ load_remote_repo_config (OtPullData *pull_data, GKeyFile **out_keyfile, GCancell
 }
 
 static gboolean
-process_one_static_delta_fallback (OtPullData *pull_data, gboolean delta_byteswap,
-                                   GVariant *fallback_object, GCancellable *cancellable,
-                                   GError **error)
+process_one_static_delta_fallback (OtPullData *pull_data,
+                                   const OstreeStaticDeltaFallbackEntry *fallback,
+                                   GCancellable *cancellable, GError **error)
 {
-  guint8 objtype_y;
-  g_autoptr (GVariant) csum_v = NULL;
-  guint64 compressed_size, uncompressed_size;
-
-  g_variant_get (fallback_object, "(y@aytt)", &objtype_y, &csum_v, &compressed_size,
-                 &uncompressed_size);
-
-  if (!ostree_validate_structureof_objtype (objtype_y, error))
-    return FALSE;
-  if (!ostree_validate_structureof_csum_v (csum_v, error))
-    return FALSE;
-
-  compressed_size = maybe_swap_endian_u64 (delta_byteswap, compressed_size);
-  uncompressed_size = maybe_swap_endian_u64 (delta_byteswap, uncompressed_size);
+  const guint64 compressed_size = fallback->compressed_size;
 
   pull_data->n_total_delta_fallbacks += 1;
   pull_data->total_deltapart_size += compressed_size;
-  pull_data->total_deltapart_usize += uncompressed_size;
+  pull_data->total_deltapart_usize += fallback->uncompressed_size;
 
-  OstreeObjectType objtype = (OstreeObjectType)objtype_y;
-  g_autofree char *checksum = ostree_checksum_from_bytes_v (csum_v);
+  OstreeObjectType objtype = fallback->objtype;
+  g_autofree char *checksum = ostree_checksum_from_bytes (fallback->checksum);
 
   gboolean is_stored;
   if (!ostree_repo_has_object (pull_data->repo, objtype, checksum, &is_stored, cancellable, error))
@@ -2034,7 +2271,7 @@ process_one_static_delta_fallback (OtPullData *pull_data, gboolean delta_byteswa
 static void
 enqueue_one_static_delta_part_request_s (OtPullData *pull_data, FetchStaticDeltaData *fetch_data)
 {
-  if (fetcher_queue_is_full (pull_data))
+  if (fetcher_queue_is_full (pull_data) || deltapart_queue_is_full (pull_data, fetch_data))
     {
       g_debug ("queuing fetch of static delta %s-%s part %u", fetch_data->from_revision ?: "empty",
                fetch_data->to_revision, fetch_data->i);
@@ -2047,15 +2284,57 @@ enqueue_one_static_delta_part_request_s (OtPullData *pull_data, FetchStaticDelta
     }
 }
 
+/* Apply a part found in the delta cache; returns FALSE if it has been
+ * evicted since it was queued, in which case it needs to be fetched.
+ */
+static gboolean
+start_cached_deltapart (OtPullData *pull_data, FetchStaticDeltaData *fetch)
+{
+  g_autoptr (GError) local_error = NULL;
+  glnx_autofd int cached_fd = -1;
+
+  fetch->cached = FALSE;
+  if (!_ostree_repo_delta_cache_lookup (pull_data->repo, fetch->expected_checksum, &cached_fd,
+                                        &local_error))
+    {
+      g_debug ("%s", local_error->message);
+      return FALSE;
+    }
+  if (cached_fd == -1)
+    return FALSE;
+
+  g_debug ("applying cached deltapart %s", fetch->expected_checksum);
+  g_autoptr (GInputStream) in = g_unix_input_stream_new (g_steal_fd (&cached_fd), TRUE);
+  _ostree_static_delta_part_open_and_execute_async (pull_data->repo, fetch->objects, in,
+                                                    fetch->expected_checksum, TRUE,
+                                                    pull_data->cancellable,
+                                                    on_static_delta_written, fetch);
+  pull_data->n_outstanding_deltapart_write_requests++;
+  pull_data->fetched_deltapart_size += fetch->size;
+  pull_data->n_fetched_deltaparts++;
+  return TRUE;
+}
+
+/* Parts found in the delta cache go through the same queue as fetched ones,
+ * so they count against the same budget; they just skip the fetch.
+ */
 static void
 start_fetch_deltapart (OtPullData *pull_data, FetchStaticDeltaData *fetch)
 {
+  g_assert (!fetch->in_flight);
+  fetch->in_flight = TRUE;
+  pull_data->n_deltaparts_in_flight++;
+  pull_data->deltapart_usize_in_flight += fetch->usize;
+  g_assert_cmpint (pull_data->n_deltaparts_in_flight, <=,
+                   _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS);
+
+  if (fetch->cached && start_cached_deltapart (pull_data, fetch))
+    return;
+
   g_autofree char *deltapart_path = _ostree_get_relative_static_delta_part_path (
       fetch->from_revision, fetch->to_revision, fetch->i);
   g_debug ("starting fetch of deltapart %s", deltapart_path);
   pull_data->n_outstanding_deltapart_fetches++;
-  g_assert_cmpint (pull_data->n_outstanding_deltapart_fetches, <=,
-                   _OSTREE_MAX_OUTSTANDING_DELTAPART_REQUESTS);
   _ostree_fetcher_request_to_tmpfile (pull_data->fetcher, pull_data->content_mirrorlist,
                                       deltapart_path, 0, NULL, 0, fetch->size,
                                       OSTREE_FETCHER_DEFAULT_PRIORITY, pull_data->cancellable,
@@ -2067,12 +2346,13 @@ process_one_static_delta (OtPullData *pull_data, const char *from_revision, cons
                           GVariant *delta_superblock, const OstreeCollectionRef *ref,
                           GCancellable *cancellable, GError **error)
 {
-  gboolean delta_byteswap = _ostree_delta_needs_byteswap (delta_superblock);
-
-  /* Parsing OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT */
+  /* Parsing OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT; the part headers and
+   * fallbacks are walked once into a native index. */
   g_autoptr (GVariant) metadata = g_variant_get_child_value (delta_superblock, 0);
-  g_autoptr (GVariant) headers = g_variant_get_child_value (delta_superblock, 6);
-  g_autoptr (GVariant) fallback_objects = g_variant_get_child_value (delta_superblock, 7);
+  g_autoptr (OstreeStaticDeltaIndex) index
+      = _ostree_static_delta_index_new (delta_superblock, error);
+  if (!index)
+    return FALSE;
 
   /* Gather free space so we can do a check below */
   struct statvfs stvfsbuf;
@@ -2080,13 +2360,10 @@ process_one_static_delta (OtPullData *pull_data, const char *from_revision, cons
     return glnx_throw_errno_prefix (error, "fstatvfs");
 
   /* First process the fallbacks */
-  guint n = g_variant_n_children (fallback_objects);
-  for (guint i = 0; i < n; i++)
+  for (guint i = 0; i < index->n_fallbacks; i++)
     {
-      g_autoptr (GVariant) fallback_object = g_variant_get_child_value (fallback_objects, i);
-
-      if (!process_one_static_delta_fallback (pull_data, delta_byteswap, fallback_object,
-                                              cancellable, error))
+      if (!process_one_static_delta_fallback (pull_data, &index->fallbacks[i], cancellable,
+                                              error))
         return FALSE;
     }
 
@@ -2139,47 +2416,54 @@ process_one_static_delta (OtPullData *pull_data, const char *from_revision, cons
         }
     }
 
-  n = g_variant_n_children (headers);
-  pull_data->n_total_deltaparts += n;
+  pull_data->n_total_deltaparts += index->n_parts;
 
-  for (guint i = 0; i < n; i++)
+  for (guint i = 0; i < index->n_parts; i++)
     {
+      const OstreeStaticDeltaPartEntry *entry = &index->parts[i];
       gboolean have_all = FALSE;
-
-      g_autoptr (GVariant) header = g_variant_get_child_value (headers, i);
-      g_autoptr (GVariant) csum_v = NULL;
-      g_autoptr (GVariant) objects = NULL;
       g_autoptr (GBytes) inline_part_bytes = NULL;
-      guint32 version;
-      guint64 size, usize;
-      g_variant_get (header, "(u@aytt@ay)", &version, &csum_v, &size, &usize, &objects);
-      version = maybe_swap_endian_u32 (delta_byteswap, version);
-      size = maybe_swap_endian_u64 (delta_byteswap, size);
-      usize = maybe_swap_endian_u64 (delta_byteswap, usize);
 
-      if (version > OSTREE_DELTAPART_VERSION)
-        return glnx_throw (error, "Delta part has too new version %u", version);
+      if (entry->version > OSTREE_DELTAPART_VERSION)
+        return glnx_throw (error, "Delta part has too new version %u", entry->version);
 
-      const guchar *csum = ostree_checksum_bytes_peek_validate (csum_v, error);
-      if (!csum)
-        return FALSE;
-
-      if (!_ostree_repo_static_delta_part_have_all_objects (pull_data->repo, objects, &have_all,
-                                                            cancellable, error))
+      if (!_ostree_repo_static_delta_have_all_objects (pull_data->repo, entry->objects,
+                                                       entry->n_objects, &have_all, cancellable,
+                                                       error))
         return FALSE;
 
-      pull_data->total_deltapart_size += size;
-      pull_data->total_deltapart_usize += usize;
+      pull_data->total_deltapart_size += entry->size;
+      pull_data->total_deltapart_usize += entry->usize;
 
       if (have_all)
         {
           g_debug ("Have all objects from static delta %s-%s part %u", from_revision ?: "empty",
                    to_revision, i);
-          pull_data->fetched_deltapart_size += size;
+          pull_data->fetched_deltapart_size += entry->size;
           pull_data->n_fetched_deltaparts++;
           continue;
         }
 
+      /* Deltas for different refs may well share parts; only fetch once */
+      g_autofree char *part_checksum = ostree_checksum_from_bytes (entry->checksum);
+      gpointer n_shared;
+      if (g_hash_table_lookup_extended (pull_data->requested_deltaparts, part_checksum, NULL,
+                                        &n_shared))
+        {
+          g_debug ("Static delta %s-%s part %u already requested", from_revision ?: "empty",
+                   to_revision, i);
+          /* Counted as fetched once the part has been applied */
+          if (GPOINTER_TO_UINT (n_shared) == DELTAPART_APPLIED)
+            {
+              pull_data->fetched_deltapart_size += entry->size;
+              pull_data->n_fetched_deltaparts++;
+            }
+          else
+            g_hash_table_replace (pull_data->requested_deltaparts, g_steal_pointer (&part_checksum),
+                                  GUINT_TO_POINTER (GPOINTER_TO_UINT (n_shared) + 1));
+          continue;
+        }
+
       g_autofree char *deltapart_path
           = _ostree_get_relative_static_delta_part_path (from_revision, to_revision, i);
 
@@ -2194,13 +2478,17 @@ process_one_static_delta (OtPullData *pull_data, const char *from_revision, cons
       if (pull_data->dry_run)
         continue;
 
+      g_hash_table_replace (pull_data->requested_deltaparts, g_strdup (part_checksum),
+                            GUINT_TO_POINTER (0));
+
       FetchStaticDeltaData *fetch_data = g_new0 (FetchStaticDeltaData, 1);
       fetch_data->from_revision = g_strdup (from_revision);
       fetch_data->to_revision = g_strdup (to_revision);
       fetch_data->pull_data = pull_data;
-      fetch_data->objects = g_variant_ref (objects);
-      fetch_data->expected_checksum = ostree_checksum_from_bytes_v (csum_v);
-      fetch_data->size = size;
+      fetch_data->objects = _ostree_static_delta_index_dup_part_objects (index, i);
+      fetch_data->expected_checksum = g_steal_pointer (&part_checksum);
+      fetch_data->size = entry->size;
+      fetch_data->usize = entry->usize;
       fetch_data->i = i;
       fetch_data->n_retries_remaining = pull_data->n_network_retries;
 
@@ -2222,11 +2510,19 @@ process_one_static_delta (OtPullData *pull_data, const char *from_revision, cons
                                                    inline_delta_part, pull_data->cancellable,
                                                    on_static_delta_written, fetch_data);
           pull_data->n_outstanding_deltapart_write_requests++;
+          continue;
         }
-      else
+
+      /* The part is only opened once it's dequeued, so we don't hold an fd
+       * for each queued part. */
+      if (!_ostree_repo_delta_cache_contains (pull_data->repo, fetch_data->expected_checksum,
+                                              &fetch_data->cached, error))
         {
-          enqueue_one_static_delta_part_request_s (pull_data, g_steal_pointer (&fetch_data));
+          fetch_static_delta_data_free (fetch_data);
+          return FALSE;
         }
+
+      enqueue_one_static_delta_part_request_s (pull_data, g_steal_pointer (&fetch_data));
     }
 
   /* The free space check is here since at this point we've parsed the delta not
@@ -2408,6 +2704,87 @@ set_required_deltas_error (GError **error, const char *from_revision, const char
                "Static deltas required, but none found for %s to %s", from_revision, to_revision);
 }
 
+/* Returns the expected checksum of the superblock for the delta from
+ * @from_revision to @to_revision from the summary, or %NULL if unknown.
+ */
+static const guchar *
+lookup_delta_superblock_digest (OtPullData *pull_data, const char *from_revision,
+                                const char *to_revision)
+{
+  g_autofree gchar *delta
+      = g_strconcat (from_revision ?: "", from_revision ? "-" : "", to_revision, NULL);
+  return g_hash_table_lookup (pull_data->summary_deltas_checksums, delta);
+}
+
+static gboolean
+handle_delta_superblock (OtPullData *pull_data, const char *from_revision,
+                         const char *to_revision, const OstreeCollectionRef *ref,
+                         GBytes *delta_superblock_data, GError **error)
+{
+  g_autoptr (GVariant) delta_superblock = NULL;
+  const guchar *expected_summary_digest
+      = lookup_delta_superblock_digest (pull_data, from_revision, to_revision);
+  guint8 actual_summary_digest[OSTREE_SHA256_DIGEST_LEN];
+
+  ot_checksum_bytes (delta_superblock_data, actual_summary_digest);
+
+#ifndef OSTREE_DISABLE_GPGME
+  /* At this point we've GPG verified the data, so in theory
+   * could trust that they provided the right data, but let's
+   * make this a hard error.
+   */
+  if (pull_data->gpg_verify_summary && !expected_summary_digest)
+    {
+      g_set_error (error, OSTREE_GPG_ERROR, OSTREE_GPG_ERROR_NO_SIGNATURE,
+                   "GPG verification enabled, but no summary signatures found (use "
+                   "gpg-verify-summary=false in remote config to disable)");
+      return FALSE;
+    }
+#endif /* OSTREE_DISABLE_GPGME */
+
+  if (expected_summary_digest
+      && memcmp (expected_summary_digest, actual_summary_digest, sizeof (actual_summary_digest)))
+    {
+      g_autofree gchar *delta
+          = g_strconcat (from_revision ?: "", from_revision ? "-" : "", to_revision, NULL);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Invalid checksum for static delta %s",
+                   delta);
+      return FALSE;
+    }
+
+  delta_superblock = g_variant_ref_sink (g_variant_new_from_bytes (
+      (GVariantType *)OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT, delta_superblock_data, FALSE));
+
+  g_hash_table_add (pull_data->static_delta_targets, g_strdup (to_revision));
+  return process_one_static_delta (pull_data, from_revision, to_revision, delta_superblock, ref,
+                                   pull_data->cancellable, error);
+}
+
+/* Superblocks are only cached if the summary tells us their checksum */
+static void
+store_delta_superblock_in_cache (OtPullData *pull_data, const char *from_revision,
+                                 const char *to_revision, GBytes *delta_superblock_data)
+{
+  const guchar *digest = lookup_delta_superblock_digest (pull_data, from_revision, to_revision);
+  if (digest == NULL || !_ostree_repo_delta_cache_enabled (pull_data->repo))
+    return;
+
+  g_autoptr (GError) local_error = NULL;
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  ostree_checksum_inplace_from_bytes (digest, checksum);
+  if (!glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &tmpf, &local_error)
+      || glnx_loop_write (tmpf.fd, g_bytes_get_data (delta_superblock_data, NULL),
+                          g_bytes_get_size (delta_superblock_data))
+             < 0
+      || !_ostree_repo_delta_cache_store (pull_data->repo, checksum, tmpf.fd,
+                                          pull_data->cancellable, &local_error))
+    g_debug ("Failed to cache delta superblock %s: %s", checksum,
+             local_error ? local_error->message : g_strerror (errno));
+}
+
 static void
 on_superblock_fetched (GObject *src, GAsyncResult *res, gpointer data)
 
@@ -2438,45 +2815,12 @@ on_superblock_fetched (GObject *src, GAsyncResult *res, gpointer data)
     }
   else
     {
-      g_autoptr (GVariant) delta_superblock = NULL;
-      g_autofree gchar *delta
-          = g_strconcat (from_revision ?: "", from_revision ? "-" : "", to_revision, NULL);
-      const guchar *expected_summary_digest
-          = g_hash_table_lookup (pull_data->summary_deltas_checksums, delta);
-      guint8 actual_summary_digest[OSTREE_SHA256_DIGEST_LEN];
-
-      ot_checksum_bytes (delta_superblock_data, actual_summary_digest);
-
-#ifndef OSTREE_DISABLE_GPGME
-      /* At this point we've GPG verified the data, so in theory
-       * could trust that they provided the right data, but let's
-       * make this a hard error.
-       */
-      if (pull_data->gpg_verify_summary && !expected_summary_digest)
-        {
-          g_set_error (error, OSTREE_GPG_ERROR, OSTREE_GPG_ERROR_NO_SIGNATURE,
-                       "GPG verification enabled, but no summary signatures found (use "
-                       "gpg-verify-summary=false in remote config to disable)");
-          goto out;
-        }
-#endif /* OSTREE_DISABLE_GPGME */
-
-      if (expected_summary_digest
-          && memcmp (expected_summary_digest, actual_summary_digest,
-                     sizeof (actual_summary_digest)))
-        {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Invalid checksum for static delta %s",
-                       delta);
-          goto out;
-        }
-
-      delta_superblock = g_variant_ref_sink (g_variant_new_from_bytes (
-          (GVariantType *)OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT, delta_superblock_data, FALSE));
-
-      g_hash_table_add (pull_data->static_delta_targets, g_strdup (to_revision));
-      if (!process_one_static_delta (pull_data, from_revision, to_revision, delta_superblock,
-                                     fetch_data->requested_ref, pull_data->cancellable, error))
+      if (!handle_delta_superblock (pull_data, from_revision, to_revision,
+                                    fetch_data->requested_ref, delta_superblock_data, error))
         goto out;
+
+      store_delta_superblock_in_cache (pull_data, from_revision, to_revision,
+                                       delta_superblock_data);
     }
 
 out:
@@ -2525,12 +2869,62 @@ enqueue_one_static_delta_superblock_request_s (OtPullData *pull_data,
     }
 }
 
+/* Use a cached superblock for the delta, if any; sets @out_handled to
+ * %FALSE if it needs to be fetched.
+ */
+static gboolean
+try_cached_delta_superblock (OtPullData *pull_data, const char *from_revision,
+                             const char *to_revision, const OstreeCollectionRef *ref,
+                             gboolean *out_handled, GError **error)
+{
+  *out_handled = FALSE;
+
+  const guchar *digest = lookup_delta_superblock_digest (pull_data, from_revision, to_revision);
+  if (digest == NULL)
+    return TRUE;
+
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  ostree_checksum_inplace_from_bytes (digest, checksum);
+  glnx_autofd int fd = -1;
+  if (!_ostree_repo_delta_cache_lookup (pull_data->repo, checksum, &fd, error))
+    return FALSE;
+  if (fd == -1)
+    return TRUE;
+
+  g_autoptr (GBytes) delta_superblock_data
+      = glnx_fd_readall_bytes (fd, pull_data->cancellable, error);
+  if (!delta_superblock_data)
+    return FALSE;
+
+  /* If the entry is corrupted, drop it and fetch from the network instead */
+  guint8 actual_digest[OSTREE_SHA256_DIGEST_LEN];
+  ot_checksum_bytes (delta_superblock_data, actual_digest);
+  if (memcmp (digest, actual_digest, sizeof (actual_digest)) != 0)
+    {
+      g_debug ("Ignoring corrupted cached delta superblock %s", checksum);
+      return _ostree_repo_delta_cache_evict (pull_data->repo, checksum, error);
+    }
+
+  if (!handle_delta_superblock (pull_data, from_revision, to_revision, ref, delta_superblock_data,
+                                error))
+    return FALSE;
+
+  *out_handled = TRUE;
+  return TRUE;
+}
+
 /* Start a request for a static delta */
-static void
+static gboolean
 enqueue_one_static_delta_superblock_request (OtPullData *pull_data, const char *from_revision,
                                              const char *to_revision,
-                                             const OstreeCollectionRef *ref)
+                                             const OstreeCollectionRef *ref, GError **error)
 {
+  gboolean handled;
+  if (!try_cached_delta_superblock (pull_data, from_revision, to_revision, ref, &handled, error))
+    return FALSE;
+  if (handled)
+    return TRUE;
+
   FetchDeltaSuperData *fdata = g_new0 (FetchDeltaSuperData, 1);
   fdata->pull_data = pull_data;
   fdata->from_revision = g_strdup (from_revision);
@@ -2539,6 +2933,7 @@ enqueue_one_static_delta_superblock_request (OtPullData *pull_data, const char *
   fdata->n_retries_remaining = pull_data->n_network_retries;
 
   enqueue_one_static_delta_superblock_request_s (pull_data, g_steal_pointer (&fdata));
+  return TRUE;
 }
 
 static gboolean
@@ -3109,26 +3504,153 @@ _ostree_preload_metadata_file (OstreeRepo *self, OstreeFetcher *fetcher, GPtrArr
     }
 }
 
-static gboolean
-fetch_mirrorlist (OstreeFetcher *fetcher, const char *mirrorlist_url, guint n_network_retries,
-                  GPtrArray **out_mirrorlist, GCancellable *cancellable, GError **error)
+/* Fetched mirrorlists are cached in the repo cache dir, keyed by the checksum
+ * of their URL. Along with the contents and the time they were fetched, we
+ * keep some history for each mirror, which is used to rank them on later
+ * pulls: (consecutive failures, successes, latency in usec of the last
+ * successful probe). Mirrors are keyed by their normalized URI, and the
+ * history expires along with the contents.
+ */
+#define OSTREE_MIRRORLIST_CACHE_GVARIANT_STRING "(tsa{s(uut)})"
+#define OSTREE_MIRRORLIST_CACHE_LIFETIME_SECS (60 * 60)
+
+typedef struct
 {
-  g_autoptr (GPtrArray) ret_mirrorlist
-      = g_ptr_array_new_with_free_func ((GDestroyNotify)_ostree_fetcher_uri_free);
+  guint32 consecutive_failures;
+  guint32 successes;
+  guint64 latency_usec;
+} MirrorHistory;
 
-  g_autoptr (OstreeFetcherURI) mirrorlist = _ostree_fetcher_uri_parse (mirrorlist_url, error);
-  if (!mirrorlist)
+static char *
+mirrorlist_cache_path (const char *mirrorlist_url)
+{
+  g_autofree char *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, mirrorlist_url, -1);
+  return g_build_filename (_OSTREE_MIRRORLIST_CACHE_DIR, checksum, NULL);
+}
+
+/* This is a best-effort cache; any failure to load it is treated as a miss. */
+static void
+load_cached_mirrorlist (OstreeRepo *self, const char *mirrorlist_url, char **out_contents,
+                        guint64 *out_fetch_time, GHashTable *out_history)
+{
+  *out_contents = NULL;
+  *out_fetch_time = 0;
+
+  if (self->cache_dir_fd == -1)
+    return;
+
+  g_autofree char *path = mirrorlist_cache_path (mirrorlist_url);
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (self->cache_dir_fd, path, TRUE, &fd, NULL))
+    return;
+
+  g_autoptr (GBytes) bytes = ot_fd_readall_or_mmap (fd, 0, NULL);
+  if (!bytes)
+    return;
+
+  g_autoptr (GVariant) cached = g_variant_ref_sink (g_variant_new_from_bytes (
+      G_VARIANT_TYPE (OSTREE_MIRRORLIST_CACHE_GVARIANT_STRING), bytes, FALSE));
+  g_autoptr (GVariantIter) history_iter = NULL;
+  const char *contents;
+  g_variant_get (cached, "(t&sa{s(uut)})", out_fetch_time, &contents, &history_iter);
+
+  const char *mirror;
+  MirrorHistory h;
+  while (g_variant_iter_loop (history_iter, "{&s(uut)}", &mirror, &h.consecutive_failures,
+                              &h.successes, &h.latency_usec))
+    g_hash_table_replace (out_history, g_strdup (mirror), g_memdup2 (&h, sizeof (h)));
+
+  *out_contents = g_strdup (contents);
+}
+
+static void
+save_cached_mirrorlist (OstreeRepo *self, const char *mirrorlist_url, guint64 fetch_time,
+                        const char *contents, GHashTable *history, GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+
+  if (self->cache_dir_fd == -1)
+    return;
+
+  g_autoptr (GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a{s(uut)}"));
+  GLNX_HASH_TABLE_FOREACH_KV (history, const char *, mirror, MirrorHistory *, h)
+    g_variant_builder_add (builder, "{s(uut)}", mirror, h->consecutive_failures, h->successes,
+                           h->latency_usec);
+  g_autoptr (GVariant) cached = g_variant_ref_sink (
+      g_variant_new (OSTREE_MIRRORLIST_CACHE_GVARIANT_STRING, fetch_time, contents, builder));
+
+  g_autofree char *path = mirrorlist_cache_path (mirrorlist_url);
+  if (!glnx_shutil_mkdir_p_at (self->cache_dir_fd, _OSTREE_MIRRORLIST_CACHE_DIR,
+                               DEFAULT_DIRECTORY_MODE, cancellable, &local_error)
+      || !glnx_file_replace_contents_at (self->cache_dir_fd, path, g_variant_get_data (cached),
+                                         g_variant_get_size (cached),
+                                         GLNX_FILE_REPLACE_NODATASYNC, cancellable, &local_error))
+    g_debug ("Failed to cache mirrorlist '%s': %s", mirrorlist_url, local_error->message);
+}
+
+/* Known-good mirrors first, fastest first; then mirrors we know nothing
+ * about, in mirrorlist order; then mirrors which failed last time. */
+static gint
+compare_mirrors_by_history (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  GHashTable *history = user_data;
+  const MirrorHistory *ha = g_hash_table_lookup (history, *(const char **)a);
+  const MirrorHistory *hb = g_hash_table_lookup (history, *(const char **)b);
+  const MirrorHistory unknown = { 0, };
+
+  if (ha == NULL)
+    ha = &unknown;
+  if (hb == NULL)
+    hb = &unknown;
+
+  if (ha->consecutive_failures != hb->consecutive_failures)
+    return ha->consecutive_failures < hb->consecutive_failures ? -1 : 1;
+  if ((ha->successes > 0) != (hb->successes > 0))
+    return ha->successes > 0 ? -1 : 1;
+  if (ha->latency_usec != hb->latency_usec)
+    return ha->latency_usec < hb->latency_usec ? -1 : 1;
+  return 0;
+}
+
+static gboolean
+fetch_mirrorlist (OstreeRepo *self, OstreeFetcher *fetcher, const char *mirrorlist_url,
+                  guint n_network_retries, GPtrArray **out_mirrorlist, GCancellable *cancellable,
+                  GError **error)
+{
+  g_autoptr (GPtrArray) ret_mirrorlist
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)_ostree_fetcher_uri_free);
+
+  g_autoptr (OstreeFetcherURI) mirrorlist = _ostree_fetcher_uri_parse (mirrorlist_url, error);
+  if (!mirrorlist)
     return FALSE;
 
+  g_autoptr (GHashTable) cached_history
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   g_autofree char *contents = NULL;
-  if (!fetch_uri_contents_utf8_sync (fetcher, mirrorlist, n_network_retries, &contents, cancellable,
-                                     error))
-    return glnx_prefix_error (error, "While fetching mirrorlist '%s'", mirrorlist_url);
+  guint64 fetch_time = 0;
+  const guint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  gboolean cache_dirty = FALSE;
+
+  load_cached_mirrorlist (self, mirrorlist_url, &contents, &fetch_time, cached_history);
+  if (contents != NULL && fetch_time <= now
+      && now - fetch_time < OSTREE_MIRRORLIST_CACHE_LIFETIME_SECS)
+    g_debug ("Using cached mirrorlist for '%s'", mirrorlist_url);
+  else
+    {
+      g_clear_pointer (&contents, g_free);
+      g_hash_table_remove_all (cached_history);
+      if (!fetch_uri_contents_utf8_sync (fetcher, mirrorlist, n_network_retries, &contents,
+                                         cancellable, error))
+        return glnx_prefix_error (error, "While fetching mirrorlist '%s'", mirrorlist_url);
+      fetch_time = now;
+      cache_dirty = TRUE;
+    }
 
   /* go through each mirror in mirrorlist and do a quick sanity check that it
    * works so that we don't waste the fetcher's time when it goes through them
    * */
   g_auto (GStrv) lines = g_strsplit (contents, "\n", -1);
+  g_autoptr (GPtrArray) mirrors = g_ptr_array_new_with_free_func (g_free);
   g_debug ("Scanning mirrorlist from '%s'", mirrorlist_url);
   for (char **iter = lines; iter && *iter; iter++)
     {
@@ -3158,21 +3680,56 @@ fetch_mirrorlist (OstreeFetcher *fetcher, const char *mirrorlist_url, guint n_ne
           continue;
         }
 
+      g_ptr_array_add (mirrors, _ostree_fetcher_uri_to_string (mirror_uri));
+    }
+
+  /* Rank the mirrors based on how they did on previous pulls */
+  g_ptr_array_sort_with_data (mirrors, compare_mirrors_by_history, cached_history);
+
+  /* Only keep history for mirrors which are still listed */
+  g_autoptr (GHashTable) history = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  for (guint i = 0; i < mirrors->len; i++)
+    {
+      const char *mirror_uri_str = mirrors->pdata[i];
+      MirrorHistory *h = g_hash_table_lookup (cached_history, mirror_uri_str);
+      g_hash_table_replace (history, g_strdup (mirror_uri_str),
+                            h ? g_memdup2 (h, sizeof (*h)) : g_new0 (MirrorHistory, 1));
+    }
+
+  for (guint i = 0; i < mirrors->len; i++)
+    {
+      const char *mirror_uri_str = mirrors->pdata[i];
+      MirrorHistory *h = g_hash_table_lookup (history, mirror_uri_str);
+      g_autoptr (OstreeFetcherURI) mirror_uri = _ostree_fetcher_uri_parse (mirror_uri_str, NULL);
+      g_assert (mirror_uri != NULL);
+
       /* We keep sanity checking until we hit a working mirror; there's no need
        * to waste resources checking the remaining ones. At the same time,
        * guaranteeing that the first mirror in the list works saves the fetcher
-       * time from always iterating through a few bad first mirrors. */
-      if (ret_mirrorlist->len == 0)
+       * time from always iterating through a few bad first mirrors. A mirror
+       * which worked the last time it was probed is trusted without probing
+       * again. */
+      if (ret_mirrorlist->len == 0 && !(h->successes > 0 && h->consecutive_failures == 0))
         {
           GError *local_error = NULL;
-          g_autoptr (OstreeFetcherURI) config_uri
-              = _ostree_fetcher_uri_new_subpath (mirror_uri, "config");
-
-          if (fetch_uri_contents_utf8_sync (fetcher, config_uri, n_network_retries, NULL,
-                                            cancellable, &local_error))
-            g_ptr_array_add (ret_mirrorlist, g_steal_pointer (&mirror_uri));
+          g_autoptr (GPtrArray) probe_mirrorlist = g_ptr_array_new ();
+          g_ptr_array_add (probe_mirrorlist, mirror_uri); /* no transfer */
+          const gint64 probe_start = g_get_monotonic_time ();
+
+          cache_dirty = TRUE;
+          if (fetch_mirrored_uri_contents_utf8_sync (fetcher, probe_mirrorlist, "config",
+                                                     n_network_retries, NULL, cancellable,
+                                                     &local_error))
+            {
+              h->consecutive_failures = 0;
+              h->successes++;
+              h->latency_usec = g_get_monotonic_time () - probe_start;
+              g_ptr_array_add (ret_mirrorlist, g_steal_pointer (&mirror_uri));
+            }
           else
             {
+              /* The fetcher noted the failure for this mirror; it's counted
+               * along with the rest of the pull's by record_mirror_failures() */
               g_debug ("Failed to fetch config from mirror '%s': %s", mirror_uri_str,
                        local_error->message);
               g_clear_error (&local_error);
@@ -3184,6 +3741,9 @@ fetch_mirrorlist (OstreeFetcher *fetcher, const char *mirrorlist_url, guint n_ne
         }
     }
 
+  if (cache_dirty)
+    save_cached_mirrorlist (self, mirrorlist_url, fetch_time, contents, history, cancellable);
+
   if (ret_mirrorlist->len == 0)
     return glnx_throw (error, "No valid mirrors were found in mirrorlist '%s'", mirrorlist_url);
 
@@ -3191,11 +3751,45 @@ fetch_mirrorlist (OstreeFetcher *fetcher, const char *mirrorlist_url, guint n_ne
   return TRUE;
 }
 
+/* Count each mirror of @mirrorlist_url which had failed requests in
+ * @failures, including the config probes of fetch_mirrorlist(), as having
+ * failed once more, so that it is ranked down (and probed again) on the next
+ * pull. */
+static void
+record_mirror_failures (OstreeRepo *self, const char *mirrorlist_url, GHashTable *failures,
+                        GCancellable *cancellable)
+{
+  g_autoptr (GHashTable) history = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autofree char *contents = NULL;
+  guint64 fetch_time = 0;
+  gboolean cache_dirty = FALSE;
+
+  load_cached_mirrorlist (self, mirrorlist_url, &contents, &fetch_time, history);
+  if (contents == NULL)
+    return;
+
+  GLNX_HASH_TABLE_FOREACH_KV (history, const char *, mirror, MirrorHistory *, h)
+    {
+      if (!g_hash_table_contains (failures, mirror))
+        continue;
+
+      g_debug ("Recording failed requests to mirror '%s'", mirror);
+      h->consecutive_failures++;
+      cache_dirty = TRUE;
+    }
+
+  if (cache_dirty)
+    save_cached_mirrorlist (self, mirrorlist_url, fetch_time, contents, history, cancellable);
+}
+
+/* If @out_mirrorlist_urls is given, the URL of the mirrorlist used (if any)
+ * is added to it. */
 static gboolean
 compute_effective_mirrorlist (OstreeRepo *self, const char *remote_name_or_baseurl,
                               const char *url_override, OstreeFetcher *fetcher,
                               guint n_network_retries, GPtrArray **out_mirrorlist,
-                              GCancellable *cancellable, GError **error)
+                              GPtrArray *out_mirrorlist_urls, GCancellable *cancellable,
+                              GError **error)
 {
   g_autofree char *baseurl = NULL;
 
@@ -3206,8 +3800,14 @@ compute_effective_mirrorlist (OstreeRepo *self, const char *remote_name_or_baseu
 
   if (g_str_has_prefix (baseurl, "mirrorlist="))
     {
-      if (!fetch_mirrorlist (fetcher, baseurl + strlen ("mirrorlist="), n_network_retries,
-                             out_mirrorlist, cancellable, error))
+      const char *mirrorlist_url = baseurl + strlen ("mirrorlist=");
+      /* Added first, so failed probes are recorded even if no mirror works */
+      if (out_mirrorlist_urls != NULL
+          && !g_ptr_array_find_with_equal_func (out_mirrorlist_urls, mirrorlist_url, g_str_equal,
+                                                NULL))
+        g_ptr_array_add (out_mirrorlist_urls, g_strdup (mirrorlist_url));
+      if (!fetch_mirrorlist (self, fetcher, mirrorlist_url, n_network_retries, out_mirrorlist,
+                             cancellable, error))
         return FALSE;
     }
   else
@@ -3229,6 +3829,130 @@ compute_effective_mirrorlist (OstreeRepo *self, const char *remote_name_or_baseu
 /* Create the fetcher by unioning options from the remote config, plus
  * any options specific to this pull (such as extra headers).
  */
+/* Use the remote's object inventory (see ostree-repo-inventory.c) to find
+ * the dirtree, dirmeta and content objects we don't have, fetching only the
+ * inventory buckets which differ from ours. The objects found are added to
+ * pull_data->inventory_missing, and the commits the remote has all the
+ * objects of to pull_data->inventory_complete_commits, so that we don't need
+ * to walk their trees.
+ */
+static gboolean
+sync_inventory (OtPullData *pull_data, GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Syncing inventory", error);
+
+  g_autoptr (GVariant) additional_metadata = g_variant_get_child_value (pull_data->summary, 1);
+  g_autoptr (GVariant) expected_digest = g_variant_lookup_value (
+      additional_metadata, OSTREE_SUMMARY_INVENTORY, G_VARIANT_TYPE_BYTESTRING);
+  if (expected_digest == NULL)
+    {
+      g_debug ("Remote has no inventory, scanning commits instead");
+      return TRUE;
+    }
+  if (!ostree_checksum_bytes_peek_validate (expected_digest, error))
+    return FALSE;
+
+  g_autofree char *index_path
+      = _ostree_inventory_get_path (expected_digest, _OSTREE_INVENTORY_INDEX_SUFFIX);
+  g_autoptr (GBytes) index_bytes = NULL;
+  if (!_ostree_fetcher_mirrored_request_to_membuf (
+          pull_data->fetcher, pull_data->meta_mirrorlist, index_path, 0, NULL, 0,
+          pull_data->n_network_retries, &index_bytes, NULL, NULL, NULL,
+          pull_data->max_metadata_size, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GVariant) index = g_variant_ref_sink (
+      g_variant_new_from_bytes (OSTREE_INVENTORY_INDEX_GVARIANT_FORMAT, index_bytes, FALSE));
+  g_autoptr (GVariant) index_digest = _ostree_inventory_digest (index);
+  if (!g_variant_equal (index_digest, expected_digest))
+    return glnx_throw (error, "Index doesn't match the digest in the summary");
+  if (!_ostree_inventory_validate_index (index, error))
+    return FALSE;
+
+  g_autoptr (GPtrArray) local_buckets
+      = _ostree_repo_inventory_build_buckets (pull_data->repo, TRUE, cancellable, error);
+  if (local_buckets == NULL)
+    return FALSE;
+
+  g_autoptr (GVariant) remote_buckets = g_variant_get_child_value (index, 0);
+  g_autoptr (GPtrArray) missing = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  guint n_fetched_buckets = 0;
+  for (guint i = 0; i < OSTREE_INVENTORY_N_BUCKETS; i++)
+    {
+      GVariant *local_bucket = local_buckets->pdata[i];
+      g_autoptr (GVariant) local_digest = _ostree_inventory_digest (local_bucket);
+      g_autoptr (GVariant) remote_digest = NULL;
+      g_variant_get_child (remote_buckets, i, "(u@ay)", NULL, &remote_digest);
+      if (g_variant_equal (local_digest, remote_digest))
+        continue;
+
+      g_autofree char *path
+          = _ostree_inventory_get_path (remote_digest, _OSTREE_INVENTORY_BUCKET_SUFFIX);
+      g_autoptr (GBytes) bucket_bytes = NULL;
+      if (!_ostree_fetcher_mirrored_request_to_membuf (
+              pull_data->fetcher, pull_data->meta_mirrorlist, path, 0, NULL, 0,
+              pull_data->n_network_retries, &bucket_bytes, NULL, NULL, NULL,
+              pull_data->max_metadata_size, cancellable, error))
+        return FALSE;
+
+      g_autoptr (GVariant) remote_bucket = g_variant_ref_sink (
+          g_variant_new_from_bytes (OSTREE_INVENTORY_BUCKET_GVARIANT_FORMAT, bucket_bytes, FALSE));
+      g_autoptr (GVariant) bucket_digest = _ostree_inventory_digest (remote_bucket);
+      if (!g_variant_equal (bucket_digest, remote_digest))
+        return glnx_throw (error, "Bucket %02x doesn't match the index", i);
+      if (!_ostree_inventory_bucket_diff (remote_bucket, local_bucket, missing, error))
+        return glnx_prefix_error (error, "Bucket %02x", i);
+      n_fetched_buckets++;
+    }
+
+  g_autoptr (GHashTable) complete_commits
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr (GVariant) index_metadata = g_variant_get_child_value (index, 1);
+  g_autoptr (GVariant) commits = g_variant_lookup_value (
+      index_metadata, OSTREE_INVENTORY_COMPLETE_COMMITS, G_VARIANT_TYPE ("aay"));
+  const gsize n_commits = commits ? g_variant_n_children (commits) : 0;
+  for (gsize i = 0; i < n_commits; i++)
+    {
+      g_autoptr (GVariant) csum_v = g_variant_get_child_value (commits, i);
+      const guchar *csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (csum == NULL)
+        return FALSE;
+      g_hash_table_add (complete_commits, ostree_checksum_from_bytes (csum));
+    }
+
+  g_debug ("Inventory: fetched %u of %u buckets, %u objects missing", n_fetched_buckets,
+           OSTREE_INVENTORY_N_BUCKETS, missing->len);
+
+  pull_data->inventory_missing = g_steal_pointer (&missing);
+  pull_data->inventory_complete_commits = g_steal_pointer (&complete_commits);
+  pull_data->inventory_unscanned = g_hash_table_new_full (
+      ostree_hash_object_name, g_variant_equal, (GDestroyNotify)g_variant_unref, NULL);
+  return TRUE;
+}
+
+/* Start fetching the objects sync_inventory() found to be missing. */
+static void
+enqueue_inventory_requests (OtPullData *pull_data)
+{
+  for (guint i = 0; i < pull_data->inventory_missing->len; i++)
+    {
+      GVariant *object = pull_data->inventory_missing->pdata[i];
+      const char *checksum;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+        {
+          g_hash_table_add (pull_data->requested_metadata, g_variant_ref (object));
+          g_hash_table_add (pull_data->inventory_unscanned, g_variant_ref (object));
+        }
+      else
+        g_hash_table_add (pull_data->requested_content, g_strdup (checksum));
+
+      enqueue_one_object_request (pull_data, checksum, objtype, NULL, FALSE, FALSE, NULL);
+    }
+}
+
 static gboolean
 reinitialize_fetcher (OtPullData *pull_data, const char *remote_name, GError **error)
 {
@@ -3239,10 +3963,60 @@ reinitialize_fetcher (OtPullData *pull_data, const char *remote_name, GError **e
       pull_data->max_outstanding_fetcher_requests, &pull_data->fetcher_security_state, error);
   if (pull_data->fetcher == NULL)
     return FALSE;
+  _ostree_fetcher_set_max_bandwidth (pull_data->fetcher, pull_data->max_bandwidth);
 
   return TRUE;
 }
 
+/* In background mode, the pulling thread and the repo's worker threads
+ * writing objects and applying deltas for the pull's transaction use the idle
+ * I/O priority, so they only get disk time nobody else wants.
+ */
+static void
+set_background (OtPullData *pull_data, gboolean background)
+{
+  if (background == pull_data->background)
+    return;
+
+  pull_data->background = background;
+  if (background)
+    {
+      pull_data->background_txn = _ostree_repo_get_txn (pull_data->repo);
+      g_atomic_int_inc (&pull_data->background_txn->n_background_pulls);
+      pull_data->prev_ioprio = _ostree_set_idle_ioprio ();
+    }
+  else
+    {
+      (void)g_atomic_int_dec_and_test (&pull_data->background_txn->n_background_pulls);
+      pull_data->background_txn = NULL;
+      _ostree_restore_ioprio (pull_data->prev_ioprio);
+    }
+}
+
+/* Apply changes made with ostree_repo_set_pull_throttle() */
+static gboolean
+check_pull_throttle (gpointer user_data)
+{
+  OtPullData *pull_data = user_data;
+
+  g_autoptr (GVariant) options
+      = _ostree_repo_get_pull_throttle (pull_data->repo, &pull_data->throttle_serial);
+  if (options == NULL)
+    return G_SOURCE_CONTINUE;
+
+  gboolean background;
+  if (g_variant_lookup (options, "max-bandwidth-bytes", "t", &pull_data->max_bandwidth))
+    {
+      g_debug ("Bandwidth cap changed to %" G_GUINT64_FORMAT " bytes/s", pull_data->max_bandwidth);
+      if (pull_data->fetcher)
+        _ostree_fetcher_set_max_bandwidth (pull_data->fetcher, pull_data->max_bandwidth);
+    }
+  if (g_variant_lookup (options, "background", "b", &background))
+    set_background (pull_data, background);
+
+  return G_SOURCE_CONTINUE;
+}
+
 static gboolean
 initiate_delta_request (OtPullData *pull_data, const OstreeCollectionRef *ref,
                         const char *to_revision, const char *delta_from_revision, GError **error)
@@ -3269,8 +4043,9 @@ initiate_delta_request (OtPullData *pull_data, const OstreeCollectionRef *ref,
       }
       break;
     case DELTA_SEARCH_RESULT_FROM:
-      enqueue_one_static_delta_superblock_request (pull_data, deltares.from_revision, to_revision,
-                                                   ref);
+      if (!enqueue_one_static_delta_superblock_request (pull_data, deltares.from_revision,
+                                                        to_revision, ref, error))
+        return FALSE;
       break;
     case DELTA_SEARCH_RESULT_SCRATCH:
       {
@@ -3281,8 +4056,9 @@ initiate_delta_request (OtPullData *pull_data, const OstreeCollectionRef *ref,
         if (delta_from_revision != NULL)
           queue_scan_one_metadata_object (pull_data, to_revision, OSTREE_OBJECT_TYPE_COMMIT, NULL,
                                           0, ref);
-        else
-          enqueue_one_static_delta_superblock_request (pull_data, NULL, to_revision, ref);
+        else if (!enqueue_one_static_delta_superblock_request (pull_data, NULL, to_revision, ref,
+                                                               error))
+          return FALSE;
       }
       break;
     case DELTA_SEARCH_RESULT_UNCHANGED:
@@ -3303,6 +4079,314 @@ initiate_delta_request (OtPullData *pull_data, const OstreeCollectionRef *ref,
   return TRUE;
 }
 
+/* A pull which is interrupted, by a crash or by losing the network, leaves
+ * its staging directory behind for the next transaction in the same boot to
+ * pick up; see _ostree_repo_allocate_tmpdir().  Alongside the objects, we keep
+ * a journal there of the dirtrees we've scanned, and of the objects queued
+ * from them which aren't written yet.  A pull of the same commits resuming
+ * that transaction then starts from the queue in the journal, rather than
+ * walking every tree and checking for every object again.  The journal goes
+ * away with the staging directory once the transaction is committed.
+ *
+ * Everything a scanned dirtree refers to is either written or pending, and
+ * both are only updated from the main loop, so any snapshot is consistent.
+ * Delta parts don't need an entry; ones we've already applied are skipped
+ * anyway, because we have all of their objects.
+ *
+ * The snapshot is taken on the main loop; syncing the staged objects and
+ * writing the journal happens in a worker thread while the pull goes on.
+ */
+typedef struct
+{
+  int stagedir_fd;
+  gboolean disable_fsync;
+  GVariant *journal;
+  guint n_scanned;
+  guint n_pending;
+} PullJournalWriteData;
+
+static void
+pull_journal_write_data_free (PullJournalWriteData *data)
+{
+  glnx_close_fd (&data->stagedir_fd);
+  g_clear_pointer (&data->journal, g_variant_unref);
+  g_free (data);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PullJournalWriteData, pull_journal_write_data_free)
+
+/* Sets @out_data to NULL if there's no journal to write */
+static gboolean
+pull_journal_snapshot (OtPullData *pull_data, PullJournalWriteData **out_data, GError **error)
+{
+  *out_data = NULL;
+
+  int stagedir_fd = _ostree_repo_get_txn_stagedir_fd (pull_data->repo);
+  if (pull_data->journal_pending == NULL || stagedir_fd < 0)
+    return TRUE;
+
+  /* Our own fd, in case the transaction goes away while we write */
+  glnx_autofd int dup_fd = fcntl (stagedir_fd, F_DUPFD_CLOEXEC, 3);
+  if (dup_fd < 0)
+    return glnx_throw_errno_prefix (error, "fcntl(F_DUPFD_CLOEXEC)");
+
+  g_auto (GVariantBuilder) scanned_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_builder_init (&scanned_builder, G_VARIANT_TYPE ("aay"));
+  guint n_scanned = 0;
+  GLNX_HASH_TABLE_FOREACH (pull_data->scanned_metadata, GVariant *, object)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+      if (objtype != OSTREE_OBJECT_TYPE_DIR_TREE)
+        continue;
+      g_variant_builder_add_value (&scanned_builder, ostree_checksum_to_bytes_v (checksum));
+      n_scanned++;
+    }
+
+  g_auto (GVariantBuilder) pending_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_variant_builder_init (&pending_builder, G_VARIANT_TYPE ("a(yays)"));
+  GLNX_HASH_TABLE_FOREACH_KV (pull_data->journal_pending, GVariant *, object, const char *, path)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+      g_variant_builder_add (&pending_builder, "(y@ays)", (guint8)objtype,
+                             ostree_checksum_to_bytes_v (checksum), path ?: "");
+    }
+
+  PullJournalWriteData *data = g_new0 (PullJournalWriteData, 1);
+  data->stagedir_fd = g_steal_fd (&dup_fd);
+  data->disable_fsync = pull_data->repo->disable_fsync;
+  data->journal = g_variant_ref_sink (g_variant_new (
+      "(@(sas)@aay@a(yays))", pull_data->journal_target, g_variant_builder_end (&scanned_builder),
+      g_variant_builder_end (&pending_builder)));
+  data->n_scanned = n_scanned;
+  data->n_pending = g_hash_table_size (pull_data->journal_pending);
+  *out_data = data;
+  return TRUE;
+}
+
+static gboolean
+pull_journal_write_snapshot (PullJournalWriteData *data, GCancellable *cancellable,
+                             GError **error)
+{
+  /* The journal must not make it to disk before the objects it vouches for */
+  GLnxFileReplaceFlags replaceflag = 0;
+  if (data->disable_fsync)
+    replaceflag = GLNX_FILE_REPLACE_NODATASYNC;
+  else if (syncfs (data->stagedir_fd) < 0)
+    return glnx_throw_errno_prefix (error, "syncfs");
+
+  if (!glnx_file_replace_contents_at (data->stagedir_fd, PULL_JOURNAL_NAME,
+                                      g_variant_get_data (data->journal),
+                                      g_variant_get_size (data->journal), replaceflag, cancellable,
+                                      error))
+    return glnx_prefix_error (error, "Writing pull journal");
+
+  g_debug ("wrote pull journal: %u scanned dirtrees, %u pending objects", data->n_scanned,
+           data->n_pending);
+  return TRUE;
+}
+
+/* Synchronously write the journal; used once the pull has stopped */
+static gboolean
+pull_journal_write (OtPullData *pull_data, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (PullJournalWriteData) data = NULL;
+  if (!pull_journal_snapshot (pull_data, &data, error))
+    return FALSE;
+  if (data == NULL)
+    return TRUE;
+
+  return pull_journal_write_snapshot (data, cancellable, error);
+}
+
+static void
+pull_journal_write_thread (GTask *task, gpointer source, gpointer task_data,
+                           GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  if (!pull_journal_write_snapshot (task_data, cancellable, &local_error))
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+on_pull_journal_written (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  OtPullData *pull_data = user_data;
+  g_autoptr (GError) local_error = NULL;
+
+  pull_data->journal_writing = FALSE;
+  /* Not fatal; a restarted pull would just have more to scan */
+  if (!g_task_propagate_boolean ((GTask *)result, &local_error))
+    g_debug ("%s", local_error->message);
+}
+
+static gboolean
+pull_journal_timeout (gpointer user_data)
+{
+  OtPullData *pull_data = user_data;
+  g_autoptr (GError) local_error = NULL;
+
+  /* Still busy with the previous one; this one will be picked up next time */
+  if (pull_data->journal_writing)
+    return G_SOURCE_CONTINUE;
+
+  PullJournalWriteData *data = NULL;
+  if (!pull_journal_snapshot (pull_data, &data, &local_error))
+    {
+      g_debug ("%s", local_error->message);
+      return G_SOURCE_CONTINUE;
+    }
+  if (data == NULL)
+    return G_SOURCE_CONTINUE;
+
+  g_autoptr (GTask) task
+      = g_task_new (NULL, pull_data->cancellable, on_pull_journal_written, pull_data);
+  g_task_set_source_tag (task, pull_journal_timeout);
+  g_task_set_task_data (task, data, (GDestroyNotify)pull_journal_write_data_free);
+  pull_data->journal_writing = TRUE;
+  g_task_run_in_thread (task, pull_journal_write_thread);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static int
+compare_strings (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Start keeping a journal for this pull of @commits from @remote */
+static void
+pull_journal_init (OtPullData *pull_data, const char *remote, GHashTable *commits)
+{
+  g_autofree char **sorted = (char **)g_hash_table_get_keys_as_array (commits, NULL);
+  qsort (sorted, g_hash_table_size (commits), sizeof (char *), compare_strings);
+
+  pull_data->journal_target = g_variant_ref_sink (g_variant_new ("(s^as)", remote, sorted));
+  pull_data->journal_pending = g_hash_table_new_full (
+      ostree_hash_object_name, g_variant_equal, (GDestroyNotify)g_variant_unref, g_free);
+}
+
+/* If we're resuming a transaction which has a journal for this same pull,
+ * queue up the work from it; see pull_journal_write().  A journal we can't
+ * use is ignored, and replaced by ours.
+ */
+static gboolean
+pull_journal_load (OtPullData *pull_data, GCancellable *cancellable, GError **error)
+{
+  int stagedir_fd = _ostree_repo_get_txn_stagedir_fd (pull_data->repo);
+  if (pull_data->journal_pending == NULL || !pull_data->legacy_transaction_resuming
+      || stagedir_fd < 0)
+    return TRUE;
+
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (stagedir_fd, PULL_JOURNAL_NAME, &fd, error))
+    return FALSE;
+  if (fd < 0)
+    return TRUE;
+
+  g_autoptr (GVariant) journal = NULL;
+  if (!ot_variant_read_fd (fd, 0, PULL_JOURNAL_GVARIANT_FORMAT, FALSE, &journal, error))
+    return glnx_prefix_error (error, "Reading pull journal");
+
+  g_autoptr (GVariant) target = g_variant_get_child_value (journal, 0);
+  if (!g_variant_equal (target, pull_data->journal_target))
+    {
+      g_debug ("ignoring pull journal for other commits");
+      return TRUE;
+    }
+
+  /* Validate everything before acting on any of it; skipping a scanned tree
+   * without queuing what it left pending would leave the pull incomplete.
+   */
+  g_autoptr (GVariant) scanned = g_variant_get_child_value (journal, 1);
+  g_autoptr (GVariant) pending = g_variant_get_child_value (journal, 2);
+  const guint n_scanned = g_variant_n_children (scanned);
+  const guint n_pending = g_variant_n_children (pending);
+  for (guint i = 0; i < n_scanned; i++)
+    {
+      g_autoptr (GVariant) csum_v = g_variant_get_child_value (scanned, i);
+      if (!ostree_validate_structureof_csum_v (csum_v, NULL))
+        {
+          g_debug ("ignoring invalid pull journal");
+          return TRUE;
+        }
+
+      /* Objects written straight to objects/ may have been pruned since, along
+       * with the trees referring to them.
+       */
+      g_autofree char *checksum = ostree_checksum_from_bytes_v (csum_v);
+      gboolean is_stored;
+      if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum,
+                                   &is_stored, cancellable, error))
+        return FALSE;
+      if (!is_stored)
+        {
+          g_debug ("ignoring pull journal, dirtree %s is missing", checksum);
+          return TRUE;
+        }
+    }
+  for (guint i = 0; i < n_pending; i++)
+    {
+      guint8 objtype;
+      g_autoptr (GVariant) csum_v = NULL;
+      g_variant_get_child (pending, i, "(y@ay&s)", &objtype, &csum_v, NULL);
+      if (!(objtype == OSTREE_OBJECT_TYPE_FILE || objtype == OSTREE_OBJECT_TYPE_DIR_TREE
+            || objtype == OSTREE_OBJECT_TYPE_DIR_META)
+          || !ostree_validate_structureof_csum_v (csum_v, NULL))
+        {
+          g_debug ("ignoring invalid pull journal");
+          return TRUE;
+        }
+    }
+
+  g_debug ("resuming pull from journal: %u scanned dirtrees, %u pending objects", n_scanned,
+           n_pending);
+
+  for (guint i = 0; i < n_pending; i++)
+    {
+      guint8 objtype;
+      g_autoptr (GVariant) csum_v = NULL;
+      const char *path;
+      g_variant_get_child (pending, i, "(y@ay&s)", &objtype, &csum_v, &path);
+      g_autofree char *checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      if (objtype != OSTREE_OBJECT_TYPE_FILE)
+        {
+          journal_pending_add (pull_data, checksum, objtype, path);
+          queue_scan_one_metadata_object (pull_data, checksum, objtype, path, 0, NULL);
+          continue;
+        }
+
+      gboolean is_stored;
+      if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_FILE, checksum, &is_stored,
+                                   cancellable, error))
+        return FALSE;
+      if (is_stored || g_hash_table_contains (pull_data->requested_content, checksum))
+        continue;
+
+      journal_pending_add (pull_data, checksum, OSTREE_OBJECT_TYPE_FILE, NULL);
+      enqueue_one_object_request (pull_data, checksum, OSTREE_OBJECT_TYPE_FILE, NULL, FALSE, FALSE,
+                                  NULL);
+      g_hash_table_add (pull_data->requested_content, g_steal_pointer (&checksum));
+    }
+
+  for (guint i = 0; i < n_scanned; i++)
+    {
+      g_autoptr (GVariant) csum_v = g_variant_get_child_value (scanned, i);
+      g_autofree char *checksum = ostree_checksum_from_bytes_v (csum_v);
+      g_hash_table_add (pull_data->scanned_metadata,
+                        g_variant_ref_sink (
+                            ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_DIR_TREE)));
+    }
+
+  return TRUE;
+}
+
 /*
  * initiate_request:
  * @ref: Optional ref name and collection ID
@@ -3490,6 +4574,18 @@ all_requested_refs_have_commit (
  *     is specified, `summary-bytes` must also be specified. Since: 2020.5
  *   * `disable-verify-bindings` (`b`): Disable verification of commit bindings.
  *     Since: 2020.9
+ *   * `inventory` (`b`): When mirroring all refs, use the object inventory
+ *     published by the remote (see the `core.generate-inventory` repo config
+ *     option) to fetch the objects missing locally, rather than walking the
+ *     tree of every new commit. Since: 2024.8
+ *   * `max-bandwidth-bytes` (`t`): Cap the download rate of all requests of
+ *     the pull taken together to this many bytes per second; 0 (the default)
+ *     means no cap. Since: 2024.8
+ *   * `background` (`b`): Do disk I/O with the idle I/O priority, so the pull
+ *     competes as little as possible with other processes. Since: 2024.8
+ *
+ * These last two can be changed while the pull is running with
+ * ostree_repo_set_pull_throttle().
  */
 gboolean
 ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_baseurl,
@@ -3533,6 +4629,7 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
   gboolean opt_retry_all_set = FALSE;
   gboolean opt_max_outstanding_fetcher_requests_set = FALSE;
   gboolean opt_ref_keyring_map_set = FALSE;
+  gboolean opt_background = FALSE;
   gboolean disable_sign_verify = FALSE;
   gboolean disable_sign_verify_summary = FALSE;
   gboolean need_summary = FALSE;
@@ -3613,6 +4710,9 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
       (void)g_variant_lookup (options, "summary-sig-bytes", "@ay", &summary_sig_bytes_v);
       (void)g_variant_lookup (options, "disable-verify-bindings", "b",
                               &pull_data->disable_verify_bindings);
+      (void)g_variant_lookup (options, "inventory", "b", &pull_data->inventory);
+      (void)g_variant_lookup (options, "max-bandwidth-bytes", "t", &pull_data->max_bandwidth);
+      (void)g_variant_lookup (options, "background", "b", &opt_background);
 
       if (pull_data->remote_refspec_name != NULL)
         pull_data->remote_name = g_strdup (pull_data->remote_refspec_name);
@@ -3692,6 +4792,13 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
   pull_data->repo = self;
   pull_data->progress = progress;
 
+  set_background (pull_data, opt_background);
+  pull_data->throttle_serial = _ostree_repo_get_pull_throttle_serial (self);
+  pull_data->throttle_src = g_timeout_source_new (250);
+  g_source_set_callback (pull_data->throttle_src, check_pull_throttle, pull_data, NULL);
+  g_source_attach (pull_data->throttle_src, pull_data->main_context);
+  g_source_unref (pull_data->throttle_src);
+
   pull_data->expected_commit_sizes = g_hash_table_new_full (
       g_str_hash, g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
   pull_data->commit_to_depth
@@ -3712,10 +4819,16 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
                                                        (GDestroyNotify)g_variant_unref, NULL);
   pull_data->fetched_detached_metadata = g_hash_table_new_full (
       g_str_hash, g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)variant_or_null_unref);
+  pull_data->summary_detached_metadata = g_hash_table_new_full (
+      g_str_hash, g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_variant_unref);
+  pull_data->summary_parents
+      = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify)g_free, g_free);
   pull_data->requested_content
       = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify)g_free, NULL);
   pull_data->requested_fallback_content
       = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify)g_free, NULL);
+  pull_data->requested_deltaparts
+      = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify)g_free, NULL);
   pull_data->requested_metadata = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
                                                          (GDestroyNotify)g_variant_unref, NULL);
   pull_data->pending_fetch_content = g_hash_table_new_full (
@@ -3844,11 +4957,13 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
                                       &metalink_url_str, error))
     goto out;
 
+  pull_data->mirrorlist_urls = g_ptr_array_new_with_free_func (g_free);
   if (!metalink_url_str)
     {
       if (!compute_effective_mirrorlist (self, remote_name_or_baseurl, url_override,
                                          pull_data->fetcher, pull_data->n_network_retries,
-                                         &pull_data->meta_mirrorlist, cancellable, error))
+                                         &pull_data->meta_mirrorlist, pull_data->mirrorlist_urls,
+                                         cancellable, error))
         goto out;
     }
   else
@@ -3906,7 +5021,8 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
       {
         if (!compute_effective_mirrorlist (self, remote_name_or_baseurl, contenturl,
                                            pull_data->fetcher, pull_data->n_network_retries,
-                                           &pull_data->content_mirrorlist, cancellable, error))
+                                           &pull_data->content_mirrorlist,
+                                           pull_data->mirrorlist_urls, cancellable, error))
           goto out;
       }
   }
@@ -4477,6 +5593,43 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
         }
     }
 
+  if (pull_data->inventory)
+    {
+      /* The inventory covers all objects of the remote, so it's only useful
+       * when mirroring it as a whole; local pulls just copy objects anyway. */
+      if (!require_summary_for_mirror || pull_data->dirs != NULL || pull_data->is_commit_only)
+        {
+          glnx_throw (error, "The inventory can only be used when mirroring all refs");
+          goto out;
+        }
+      if (pull_data->require_static_deltas)
+        {
+          glnx_throw (error, "The inventory can't be used with static deltas");
+          goto out;
+        }
+
+      if (pull_data->remote_repo_local == NULL)
+        {
+          /* The inventory is only an optimization; if it's unusable, for
+           * example because it was regenerated after we fetched the summary,
+           * the commits are scanned as usual.
+           */
+          g_autoptr (GError) local_error = NULL;
+          if (!sync_inventory (pull_data, cancellable, &local_error))
+            {
+              if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                {
+                  g_propagate_error (error, g_steal_pointer (&local_error));
+                  goto out;
+                }
+              g_debug ("%s; scanning commits instead", local_error->message);
+            }
+          /* Deltas would fetch the same objects again */
+          if (pull_data->inventory_missing != NULL)
+            pull_data->disable_static_deltas = TRUE;
+        }
+    }
+
   if (pull_data->require_static_deltas && !pull_data->has_indexed_deltas
       && !pull_data->summary_has_deltas)
     {
@@ -4544,11 +5697,22 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
               gsize commit_size = 0;
               guint64 *malloced_size;
               g_autofree gchar *collection_id = NULL;
+              g_autoptr (GVariant) detached_metadata = NULL;
+              g_autoptr (GVariant) ancestors = NULL;
 
               if (!lookup_commit_checksum_and_collection_from_summary (
-                      pull_data, ref, &checksum, &commit_size, &collection_id, error))
+                      pull_data, ref, &checksum, &commit_size, &collection_id, &detached_metadata,
+                      &ancestors, error))
+                goto out;
+
+              if (ancestors != NULL && pull_data->maxdepth != 0
+                  && !record_summary_ancestors (pull_data, checksum, ancestors, error))
                 goto out;
 
+              if (detached_metadata != NULL)
+                g_hash_table_insert (pull_data->summary_detached_metadata, g_strdup (checksum),
+                                     g_steal_pointer (&detached_metadata));
+
               ref_with_collection = ostree_collection_ref_new (collection_id, ref->ref_name);
 
               malloced_size = g_new0 (guint64, 1);
@@ -4655,6 +5819,29 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
   if (!reinitialize_fetcher (pull_data, remote_name_or_baseurl, error))
     goto out;
 
+  /* See pull_journal_write(); the journal only covers complete trees, of
+   * commits we know up front, in a transaction of our own.
+   */
+  if (!inherit_transaction && !pull_data->dry_run && !pull_data->is_commit_only
+      && pull_data->dirs == NULL && pull_data->remote_repo_local == NULL && !pull_data->inventory)
+    {
+      g_autoptr (GHashTable) journal_commits = g_hash_table_new (g_str_hash, g_str_equal);
+      gboolean all_resolved = TRUE;
+      GLNX_HASH_TABLE_FOREACH_V (commits_to_fetch, const char *, commit)
+        {
+          g_hash_table_add (journal_commits, (char *)commit);
+        }
+      GLNX_HASH_TABLE_FOREACH_V (requested_refs_to_fetch, const char *, to_revision)
+        {
+          if (to_revision == NULL)
+            all_resolved = FALSE;
+          else
+            g_hash_table_add (journal_commits, (char *)to_revision);
+        }
+      if (all_resolved && g_hash_table_size (journal_commits) > 0)
+        pull_journal_init (pull_data, remote_name_or_baseurl, journal_commits);
+    }
+
   pull_data->legacy_transaction_resuming = FALSE;
   if (!inherit_transaction
       && !ostree_repo_prepare_transaction (pull_data->repo, &pull_data->legacy_transaction_resuming,
@@ -4664,6 +5851,12 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
   if (pull_data->legacy_transaction_resuming)
     g_debug ("resuming legacy transaction");
 
+  if (!pull_journal_load (pull_data, cancellable, error))
+    goto out;
+
+  if (pull_data->inventory_missing != NULL)
+    enqueue_inventory_requests (pull_data);
+
   /* Initiate requests for explicit commit revisions */
   GLNX_HASH_TABLE_FOREACH_V (commits_to_fetch, const char *, commit)
     {
@@ -4677,6 +5870,8 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
     {
       if (!initiate_request (pull_data, ref, to_revision, error))
         goto out;
+      if (pull_data->maxdepth != 0)
+        queue_summary_ancestors (pull_data, to_revision);
     }
 
   if (pull_data->progress)
@@ -4692,6 +5887,14 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
       g_source_attach (update_timeout, pull_data->main_context);
     }
 
+  if (pull_data->journal_pending != NULL)
+    {
+      pull_data->journal_src = g_timeout_source_new_seconds (PULL_JOURNAL_INTERVAL_SECONDS);
+      g_source_set_callback (pull_data->journal_src, pull_journal_timeout, pull_data, NULL);
+      g_source_attach (pull_data->journal_src, pull_data->main_context);
+      g_source_unref (pull_data->journal_src);
+    }
+
   /* Now await work completion */
   while (!pull_termination_condition (pull_data))
     g_main_context_iteration (pull_data->main_context, TRUE);
@@ -4914,6 +6117,13 @@ ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_name_or_base
         }
     }
 
+  /* Keep the delta cache within its size limit; this isn't fatal for the pull */
+  {
+    g_autoptr (GError) local_error = NULL;
+    if (!_ostree_repo_delta_cache_prune (pull_data->repo, cancellable, &local_error))
+      g_debug ("%s", local_error->message);
+  }
+
   ret = TRUE;
 out:
   /* This is pretty ugly - we have two error locations, because we
@@ -4925,12 +6135,36 @@ out:
   else
     g_clear_error (&pull_data->cached_async_error);
 
+  /* Wait for a write in progress, so it can't replace the final journal */
+  g_clear_pointer (&pull_data->journal_src, g_source_destroy);
+  while (pull_data->journal_writing)
+    g_main_context_iteration (pull_data->main_context, TRUE);
+
+  /* Leave a journal for the next attempt to resume from */
+  if (!ret)
+    {
+      g_autoptr (GError) local_error = NULL;
+      if (!pull_journal_write (pull_data, NULL, &local_error))
+        g_debug ("%s", local_error->message);
+    }
   if (!inherit_transaction)
     ostree_repo_abort_transaction (pull_data->repo, cancellable, NULL);
   g_main_context_unref (pull_data->main_context);
   if (update_timeout)
     g_source_destroy (update_timeout);
   g_strfreev (configured_branches);
+  /* Requests which failed during the pull rank their mirrors down next time */
+  if (pull_data->fetcher != NULL && pull_data->mirrorlist_urls != NULL)
+    {
+      g_autoptr (GHashTable) failures = _ostree_fetcher_get_mirror_failures (pull_data->fetcher);
+      if (g_hash_table_size (failures) > 0)
+        {
+          for (guint i = 0; i < pull_data->mirrorlist_urls->len; i++)
+            record_mirror_failures (pull_data->repo, pull_data->mirrorlist_urls->pdata[i],
+                                    failures, NULL);
+        }
+    }
+  g_clear_pointer (&pull_data->mirrorlist_urls, g_ptr_array_unref);
   g_clear_object (&pull_data->fetcher);
   g_clear_pointer (&pull_data->extra_headers, g_variant_unref);
   g_clear_object (&pull_data->cancellable);
@@ -4953,6 +6187,8 @@ out:
   g_clear_pointer (&pull_data->expected_commit_sizes, g_hash_table_unref);
   g_clear_pointer (&pull_data->scanned_metadata, g_hash_table_unref);
   g_clear_pointer (&pull_data->fetched_detached_metadata, g_hash_table_unref);
+  g_clear_pointer (&pull_data->summary_detached_metadata, g_hash_table_unref);
+  g_clear_pointer (&pull_data->summary_parents, g_hash_table_unref);
   g_clear_pointer (&pull_data->summary_deltas_checksums, g_hash_table_unref);
   g_clear_pointer (&pull_data->ref_original_commits, g_hash_table_unref);
   g_free (pull_data->timestamp_check_from_rev);
@@ -4961,7 +6197,13 @@ out:
   g_clear_pointer (&pull_data->ref_keyring_map, g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_content, g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_fallback_content, g_hash_table_unref);
+  g_clear_pointer (&pull_data->requested_deltaparts, g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_metadata, g_hash_table_unref);
+  g_clear_pointer (&pull_data->inventory_missing, g_ptr_array_unref);
+  g_clear_pointer (&pull_data->inventory_complete_commits, g_hash_table_unref);
+  g_clear_pointer (&pull_data->inventory_unscanned, g_hash_table_unref);
+  g_clear_pointer (&pull_data->journal_target, g_variant_unref);
+  g_clear_pointer (&pull_data->journal_pending, g_hash_table_unref);
   g_clear_pointer (&pull_data->pending_fetch_content, g_hash_table_unref);
   g_clear_pointer (&pull_data->pending_fetch_metadata, g_hash_table_unref);
   g_clear_pointer (&pull_data->pending_fetch_delta_indexes, g_hash_table_unref);
@@ -4970,6 +6212,9 @@ out:
   g_queue_foreach (&pull_data->scan_object_queue, (GFunc)scan_object_queue_data_free, NULL);
   g_queue_clear (&pull_data->scan_object_queue);
   g_clear_pointer (&pull_data->idle_src, g_source_destroy);
+  g_clear_pointer (&pull_data->throttle_src, g_source_destroy);
+  g_clear_pointer (&pull_data->journal_src, g_source_destroy);
+  set_background (pull_data, FALSE);
   g_clear_pointer (&pull_data->dirs, g_ptr_array_unref);
   g_clear_pointer (&remote_config, g_key_file_unref);
   return ret;
@@ -6087,6 +7332,10 @@ copy_option (GVariantDict *master_options, GVariantDict *slave_options, const gc
  *     not being pulled will be ignored and any ref without a keyring remote
  *     will be verified with the keyring of the remote being pulled from.
  *     Since: 2019.2
+ *   * `max-bandwidth-bytes` (`t`): Cap on the download rate in bytes per
+ *     second; see ostree_repo_pull_with_options(). Since: 2024.8
+ *   * `background` (`b`): Use the idle I/O priority; see
+ *     ostree_repo_pull_with_options(). Since: 2024.8
  *
  * Since: 2018.6
  */
@@ -6212,6 +7461,8 @@ ostree_repo_pull_from_remotes_async (OstreeRepo *self, const OstreeRepoFinderRes
       copy_option (&options_dict, &local_options_dict, "update-frequency", G_VARIANT_TYPE ("u"));
       copy_option (&options_dict, &local_options_dict, "append-user-agent", G_VARIANT_TYPE ("s"));
       copy_option (&options_dict, &local_options_dict, "n-network-retries", G_VARIANT_TYPE ("u"));
+      copy_option (&options_dict, &local_options_dict, "max-bandwidth-bytes", G_VARIANT_TYPE ("t"));
+      copy_option (&options_dict, &local_options_dict, "background", G_VARIANT_TYPE ("b"));
       copy_option (&options_dict, &local_options_dict, "ref-keyring-map",
                    G_VARIANT_TYPE ("a(sss)"));
 
@@ -6411,7 +7662,7 @@ ostree_repo_remote_fetch_summary_with_options (OstreeRepo *self, const char *nam
       g_ptr_array_add (mirrorlist, g_steal_pointer (&uri));
     }
   else if (!compute_effective_mirrorlist (self, name, url_override, fetcher, n_network_retries,
-                                          &mirrorlist, cancellable, error))
+                                          &mirrorlist, NULL, cancellable, error))
     return FALSE;
 
   /* Send the ETag from the cache with the request for summary.sig to
@@ -210,6 +210,7 @@ resolve_refspec (OstreeRepo *self, const char *remote, const char *ref, gboolean
   __attribute__ ((unused)) GCancellable *cancellable = NULL;
   g_autofree char *ret_rev = NULL;
   glnx_autofd int target_fd = -1;
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
 
   g_return_val_if_fail (ref != NULL, FALSE);
 
@@ -218,7 +219,7 @@ resolve_refspec (OstreeRepo *self, const char *remote, const char *ref, gboolean
     {
       ret_rev = g_strdup (ref);
     }
-  else if (self->in_transaction)
+  else if (txn->active)
     {
       const char *refspec;
 
@@ -228,8 +229,8 @@ resolve_refspec (OstreeRepo *self, const char *remote, const char *ref, gboolean
         refspec = ref;
 
       g_mutex_lock (&self->txn_lock);
-      if (self->txn.refs)
-        ret_rev = g_strdup (g_hash_table_lookup (self->txn.refs, refspec));
+      if (txn->refs)
+        ret_rev = g_strdup (g_hash_table_lookup (txn->refs, refspec));
       g_mutex_unlock (&self->txn_lock);
     }
 
@@ -498,17 +499,18 @@ ostree_repo_resolve_collection_ref (OstreeRepo *self, const OstreeCollectionRef
 
   /* Check for the ref in the current transaction in case it hasn't been
    * written to disk, to match the behavior of ostree_repo_resolve_rev() */
-  if (self->in_transaction)
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  if (txn->active)
     {
       g_mutex_lock (&self->txn_lock);
-      if (self->txn.collection_refs)
+      if (txn->collection_refs)
         {
           const char *repo_collection_id = ostree_repo_get_collection_id (self);
           /* If the collection ID doesn't match it's a remote ref */
           if (!(flags & OSTREE_REPO_RESOLVE_REV_EXT_LOCAL_ONLY) || repo_collection_id == NULL
               || g_strcmp0 (repo_collection_id, ref->collection_id) == 0)
             {
-              ret_contents = g_strdup (g_hash_table_lookup (self->txn.collection_refs, ref));
+              ret_contents = g_strdup (g_hash_table_lookup (txn->collection_refs, ref));
             }
         }
       g_mutex_unlock (&self->txn_lock);
@@ -1114,7 +1116,8 @@ _ostree_repo_write_ref (OstreeRepo *self, const char *remote, const OstreeCollec
 
   /* Update the summary after updating the mtime so the summary doesn't look
    * out of date */
-  if (!self->in_transaction && !_ostree_repo_maybe_regenerate_summary (self, cancellable, error))
+  if (!_ostree_repo_get_txn (self)->active
+      && !_ostree_repo_maybe_regenerate_summary (self, cancellable, error))
     return FALSE;
 
   return TRUE;
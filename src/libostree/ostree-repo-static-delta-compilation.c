@@ -56,10 +56,42 @@ typedef struct
   GPtrArray *modes;
   GHashTable *xattr_set; /* GVariant(ayay) -> offset */
   GPtrArray *xattrs;
+  GVariant *content; /* Uncompressed, until compressed into part_tmpf */
   GLnxTmpfile part_tmpf;
   GVariant *header;
 } OstreeStaticDeltaPartBuilder;
 
+/* Compressing parts dominates the time to generate a delta, so finished
+ * parts are compressed in a thread pool while the next ones are being
+ * built. Each xz encoder needs a few hundred MB of memory, and queued parts
+ * hold their uncompressed content, so both are bounded.
+ */
+#define DELTA_PART_COMPRESS_MAX_THREADS 4
+
+typedef struct
+{
+  GThreadPool *pool;
+  GMutex lock;
+  GCond cond;
+  guint n_pending; /* Parts queued or being compressed */
+  guint max_pending;
+  GError *error; /* The first error from compressing a part */
+} DeltaPartCompressor;
+
+static void
+delta_part_compressor_clear (DeltaPartCompressor *compressor)
+{
+  if (compressor->pool)
+    {
+      /* Skip any queued parts, but wait for the running ones */
+      g_thread_pool_free (g_steal_pointer (&compressor->pool), TRUE, TRUE);
+      g_mutex_clear (&compressor->lock);
+      g_cond_clear (&compressor->cond);
+    }
+  g_clear_error (&compressor->error);
+}
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (DeltaPartCompressor, delta_part_compressor_clear)
+
 typedef struct
 {
   GPtrArray *parts;
@@ -75,6 +107,7 @@ typedef struct
   gboolean swap_endian;
   int parts_dfd;
   DeltaOpts delta_opts;
+  DeltaPartCompressor *compressor;
 } OstreeStaticDeltaBuilder;
 
 /* Get an input stream for a GVariant */
@@ -126,6 +159,7 @@ ostree_static_delta_part_builder_unref (OstreeStaticDeltaPartBuilder *part_build
   g_ptr_array_unref (part_builder->modes);
   g_hash_table_unref (part_builder->xattr_set);
   g_ptr_array_unref (part_builder->xattrs);
+  g_clear_pointer (&part_builder->content, g_variant_unref);
   glnx_tmpfile_clear (&part_builder->part_tmpf);
   if (part_builder->header)
     g_variant_unref (part_builder->header);
@@ -209,10 +243,11 @@ xattr_chunk_equals (const void *one, const void *two)
   return memcmp (g_variant_get_data (v1), g_variant_get_data (v2), l1) == 0;
 }
 
+/* Runs in the compressor thread pool */
 static gboolean
-finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
+compress_part (OstreeStaticDeltaBuilder *builder, OstreeStaticDeltaPartBuilder *part_builder,
+               GError **error)
 {
-  OstreeStaticDeltaPartBuilder *part_builder = builder->parts->pdata[builder->parts->len - 1];
   g_autofree guchar *part_checksum = NULL;
   g_autoptr (GBytes) objtype_checksum_array = NULL;
   g_autoptr (GBytes) checksum_bytes = NULL;
@@ -222,35 +257,11 @@ finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
   g_autoptr (GMemoryOutputStream) part_payload_out = NULL;
   g_autoptr (GConverterOutputStream) part_payload_compressor = NULL;
   g_autoptr (GConverter) compressor = NULL;
-  g_autoptr (GVariant) delta_part_content = NULL;
+  g_autoptr (GVariant) delta_part_content = g_steal_pointer (&part_builder->content);
   g_autoptr (GVariant) delta_part = NULL;
   g_autoptr (GVariant) delta_part_header = NULL;
-  g_auto (GVariantBuilder) mode_builder = OT_VARIANT_BUILDER_INITIALIZER;
-  g_auto (GVariantBuilder) xattr_builder = OT_VARIANT_BUILDER_INITIALIZER;
   guint8 compression_type_char;
 
-  g_variant_builder_init (&mode_builder, G_VARIANT_TYPE ("a(uuu)"));
-  g_variant_builder_init (&xattr_builder, G_VARIANT_TYPE ("aa(ayay)"));
-  guint j;
-
-  for (j = 0; j < part_builder->modes->len; j++)
-    g_variant_builder_add_value (&mode_builder, part_builder->modes->pdata[j]);
-
-  for (j = 0; j < part_builder->xattrs->len; j++)
-    g_variant_builder_add_value (&xattr_builder, part_builder->xattrs->pdata[j]);
-
-  {
-    g_autoptr (GBytes) payload_b
-        = g_string_free_to_bytes (g_steal_pointer (&part_builder->payload));
-    g_autoptr (GBytes) operations_b
-        = g_string_free_to_bytes (g_steal_pointer (&part_builder->operations));
-
-    delta_part_content = g_variant_new ("(a(uuu)aa(ayay)@ay@ay)", &mode_builder, &xattr_builder,
-                                        ot_gvariant_new_ay_bytes (payload_b),
-                                        ot_gvariant_new_ay_bytes (operations_b));
-    g_variant_ref_sink (delta_part_content);
-  }
-
   /* Hardcode xz for now */
   compressor = (GConverter *)_ostree_lzma_compressor_new (NULL);
   compression_type_char = 'x';
@@ -267,6 +278,7 @@ finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
       return FALSE;
   }
 
+  g_clear_object (&part_payload_in);
   g_clear_pointer (&delta_part_content, g_variant_unref);
 
   {
@@ -298,12 +310,97 @@ finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
   part_builder->header = g_variant_ref (delta_part_header);
   part_builder->compressed_size = g_variant_get_size (delta_part);
 
-  if (builder->delta_opts & DELTAOPT_FLAG_VERBOSE)
+  return TRUE;
+}
+
+static void
+compress_part_thread (gpointer data, gpointer user_data)
+{
+  OstreeStaticDeltaPartBuilder *part_builder = data;
+  OstreeStaticDeltaBuilder *builder = user_data;
+  DeltaPartCompressor *compressor = builder->compressor;
+  g_autoptr (GError) local_error = NULL;
+
+  /* Don't bother if another part already failed */
+  gboolean skip;
+  g_mutex_lock (&compressor->lock);
+  skip = compressor->error != NULL;
+  g_mutex_unlock (&compressor->lock);
+
+  gboolean ok = skip || compress_part (builder, part_builder, &local_error);
+
+  g_mutex_lock (&compressor->lock);
+  if (!ok && compressor->error == NULL)
+    compressor->error = g_steal_pointer (&local_error);
+  g_assert_cmpuint (compressor->n_pending, >, 0);
+  compressor->n_pending--;
+  g_cond_broadcast (&compressor->cond);
+  g_mutex_unlock (&compressor->lock);
+}
+
+/* Wait until there are at most @max_pending parts being compressed, and
+ * propagate any error from compressing them.
+ */
+static gboolean
+wait_for_compressed_parts (DeltaPartCompressor *compressor, guint max_pending, GError **error)
+{
+  g_mutex_lock (&compressor->lock);
+  while (compressor->n_pending > max_pending && compressor->error == NULL)
+    g_cond_wait (&compressor->cond, &compressor->lock);
+  gboolean ret = TRUE;
+  if (compressor->error)
+    {
+      g_propagate_error (error, g_error_copy (compressor->error));
+      ret = FALSE;
+    }
+  g_mutex_unlock (&compressor->lock);
+  return ret;
+}
+
+/* Serialize the current part and queue it for compression */
+static gboolean
+finish_part (OstreeStaticDeltaBuilder *builder, GError **error)
+{
+  OstreeStaticDeltaPartBuilder *part_builder = builder->parts->pdata[builder->parts->len - 1];
+  DeltaPartCompressor *compressor = builder->compressor;
+  g_auto (GVariantBuilder) mode_builder = OT_VARIANT_BUILDER_INITIALIZER;
+  g_auto (GVariantBuilder) xattr_builder = OT_VARIANT_BUILDER_INITIALIZER;
+
+  g_variant_builder_init (&mode_builder, G_VARIANT_TYPE ("a(uuu)"));
+  g_variant_builder_init (&xattr_builder, G_VARIANT_TYPE ("aa(ayay)"));
+  guint j;
+
+  for (j = 0; j < part_builder->modes->len; j++)
+    g_variant_builder_add_value (&mode_builder, part_builder->modes->pdata[j]);
+
+  for (j = 0; j < part_builder->xattrs->len; j++)
+    g_variant_builder_add_value (&xattr_builder, part_builder->xattrs->pdata[j]);
+
+  {
+    g_autoptr (GBytes) payload_b
+        = g_string_free_to_bytes (g_steal_pointer (&part_builder->payload));
+    g_autoptr (GBytes) operations_b
+        = g_string_free_to_bytes (g_steal_pointer (&part_builder->operations));
+
+    part_builder->content = g_variant_new ("(a(uuu)aa(ayay)@ay@ay)", &mode_builder,
+                                           &xattr_builder, ot_gvariant_new_ay_bytes (payload_b),
+                                           ot_gvariant_new_ay_bytes (operations_b));
+    g_variant_ref_sink (part_builder->content);
+  }
+
+  if (!wait_for_compressed_parts (compressor, compressor->max_pending - 1, error))
+    return FALSE;
+
+  g_mutex_lock (&compressor->lock);
+  compressor->n_pending++;
+  g_mutex_unlock (&compressor->lock);
+
+  if (!g_thread_pool_push (compressor->pool, part_builder, error))
     {
-      g_printerr ("part %u n:%u compressed:%" G_GUINT64_FORMAT " uncompressed:%" G_GUINT64_FORMAT
-                  "\n",
-                  builder->parts->len, part_builder->objects->len, part_builder->compressed_size,
-                  part_builder->uncompressed_size);
+      g_mutex_lock (&compressor->lock);
+      compressor->n_pending--;
+      g_mutex_unlock (&compressor->lock);
+      return FALSE;
     }
 
   return TRUE;
@@ -702,18 +799,16 @@ process_one_rollsum (OstreeRepo *repo, OstreeStaticDeltaBuilder *builder,
 
     {
       guint64 writing_offset = 0;
-      guint64 offset = 0, to_start = 0, from_start = 0;
-      GPtrArray *matchlist = rollsum->matches->matches;
+      GArray *matchlist = rollsum->matches->matches;
 
       g_assert (matchlist->len > 0);
       for (i = 0; i < matchlist->len; i++)
         {
-          GVariant *match = matchlist->pdata[i];
-          guint32 crc;
-
-          g_variant_get (match, "(uttt)", &crc, &offset, &to_start, &from_start);
+          const OstreeRollsumMatch *match = &g_array_index (matchlist, OstreeRollsumMatch, i);
+          const guint64 offset = match->size;
+          const guint64 from_start = match->from_start;
 
-          const guint64 prefix = to_start - writing_offset;
+          const guint64 prefix = match->to_start - writing_offset;
 
           if (prefix > 0)
             {
@@ -1282,6 +1377,10 @@ ostree_repo_static_delta_generate (OstreeRepo *self, OstreeStaticDeltaGenerateOp
   g_auto (GLnxTmpfile) descriptor_tmpf = {
     0,
   };
+  /* Declared after builder_parts, so that it's cleaned up first */
+  g_auto (DeltaPartCompressor) compressor = {
+    0,
+  };
   const char *opt_sign_name;
   const char **opt_key_ids;
 
@@ -1367,10 +1466,28 @@ ostree_repo_static_delta_generate (OstreeRepo *self, OstreeStaticDeltaGenerateOp
     }
   builder.parts_dfd = descriptor_dfd;
 
+  {
+    const guint n_threads = CLAMP (g_get_num_processors (), 1, DELTA_PART_COMPRESS_MAX_THREADS);
+    compressor.max_pending = n_threads + 1;
+    g_mutex_init (&compressor.lock);
+    g_cond_init (&compressor.cond);
+    compressor.pool = g_thread_pool_new (compress_part_thread, &builder, n_threads, FALSE, error);
+    if (!compressor.pool)
+      {
+        g_mutex_clear (&compressor.lock);
+        g_cond_clear (&compressor.cond);
+        return FALSE;
+      }
+    builder.compressor = &compressor;
+  }
+
   /* Ignore optimization flags */
   if (!generate_delta_lowlatency (self, from, to, delta_opts, &builder, cancellable, error))
     return FALSE;
 
+  if (!wait_for_compressed_parts (&compressor, 0, error))
+    return FALSE;
+
   if (!glnx_open_tmpfile_linkable_at (descriptor_dfd, ".", O_RDWR | O_CLOEXEC, &descriptor_tmpf,
                                       error))
     return FALSE;
@@ -1425,6 +1542,14 @@ ostree_repo_static_delta_generate (OstreeRepo *self, OstreeStaticDeltaGenerateOp
     {
       OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
 
+      if (delta_opts & DELTAOPT_FLAG_VERBOSE)
+        {
+          g_printerr ("part %u n:%u compressed:%" G_GUINT64_FORMAT
+                      " uncompressed:%" G_GUINT64_FORMAT "\n",
+                      i + 1, part_builder->objects->len, part_builder->compressed_size,
+                      part_builder->uncompressed_size);
+        }
+
       if (inline_parts)
         {
           g_autofree char *part_relpath = _ostree_get_relative_static_delta_part_path (from, to, i);
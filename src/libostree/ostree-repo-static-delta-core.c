@@ -250,22 +250,16 @@ ostree_repo_list_static_delta_indexes (OstreeRepo *self, GPtrArray **out_indexes
 }
 
 gboolean
-_ostree_repo_static_delta_part_have_all_objects (OstreeRepo *repo, GVariant *checksum_array,
-                                                 gboolean *out_have_all, GCancellable *cancellable,
-                                                 GError **error)
+_ostree_repo_static_delta_have_all_objects (OstreeRepo *repo, const guint8 *checksums,
+                                            guint n_checksums, gboolean *out_have_all,
+                                            GCancellable *cancellable, GError **error)
 {
-  guint8 *checksums_data = NULL;
-  guint n_checksums = 0;
   gboolean have_object = TRUE;
 
-  if (!_ostree_static_delta_parse_checksum_array (checksum_array, &checksums_data, &n_checksums,
-                                                  error))
-    return FALSE;
-
   for (guint i = 0; i < n_checksums; i++)
     {
-      guint8 objtype = *checksums_data;
-      const guint8 *csum = checksums_data + 1;
+      guint8 objtype = *checksums;
+      const guint8 *csum = checksums + 1;
       char tmp_checksum[OSTREE_SHA256_STRING_LEN + 1];
 
       if (G_UNLIKELY (!ostree_validate_structureof_objtype (objtype, error)))
@@ -280,13 +274,115 @@ _ostree_repo_static_delta_part_have_all_objects (OstreeRepo *repo, GVariant *che
       if (!have_object)
         break;
 
-      checksums_data += OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN;
+      checksums += OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN;
     }
 
   *out_have_all = have_object;
   return TRUE;
 }
 
+gboolean
+_ostree_repo_static_delta_part_have_all_objects (OstreeRepo *repo, GVariant *checksum_array,
+                                                 gboolean *out_have_all, GCancellable *cancellable,
+                                                 GError **error)
+{
+  guint8 *checksums_data = NULL;
+  guint n_checksums = 0;
+
+  if (!_ostree_static_delta_parse_checksum_array (checksum_array, &checksums_data, &n_checksums,
+                                                  error))
+    return FALSE;
+
+  return _ostree_repo_static_delta_have_all_objects (repo, checksums_data, n_checksums,
+                                                     out_have_all, cancellable, error);
+}
+
+/* Parse the part headers and fallback entries of @superblock into a native
+ * index; see the comment on OstreeStaticDeltaIndex. The checksums and object
+ * arrays are validated here, but not the part versions.
+ */
+OstreeStaticDeltaIndex *
+_ostree_static_delta_index_new (GVariant *superblock, GError **error)
+{
+  g_autoptr (OstreeStaticDeltaIndex) index = g_new0 (OstreeStaticDeltaIndex, 1);
+  index->superblock = g_variant_ref (superblock);
+  index->byteswap = _ostree_delta_needs_byteswap (superblock);
+
+  g_autoptr (GVariant) headers = g_variant_get_child_value (superblock, 6);
+  index->n_parts = g_variant_n_children (headers);
+  index->parts = g_new0 (OstreeStaticDeltaPartEntry, index->n_parts);
+  for (guint i = 0; i < index->n_parts; i++)
+    {
+      OstreeStaticDeltaPartEntry *part = &index->parts[i];
+      g_autoptr (GVariant) csum_v = NULL;
+      g_autoptr (GVariant) objects = NULL;
+      g_variant_get_child (headers, i, "(u@aytt@ay)", &part->version, &csum_v, &part->size,
+                           &part->usize, &objects);
+      part->version = maybe_swap_endian_u32 (index->byteswap, part->version);
+      part->size = maybe_swap_endian_u64 (index->byteswap, part->size);
+      part->usize = maybe_swap_endian_u64 (index->byteswap, part->usize);
+
+      part->checksum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!part->checksum)
+        return NULL;
+
+      guint8 *objects_data = NULL;
+      if (!_ostree_static_delta_parse_checksum_array (objects, &objects_data, &part->n_objects,
+                                                      error))
+        return NULL;
+      part->objects = objects_data;
+    }
+
+  g_autoptr (GVariant) fallbacks = g_variant_get_child_value (superblock, 7);
+  index->n_fallbacks = g_variant_n_children (fallbacks);
+  index->fallbacks = g_new0 (OstreeStaticDeltaFallbackEntry, index->n_fallbacks);
+  for (guint i = 0; i < index->n_fallbacks; i++)
+    {
+      OstreeStaticDeltaFallbackEntry *fallback = &index->fallbacks[i];
+      guint8 objtype_y;
+      g_autoptr (GVariant) csum_v = NULL;
+      g_variant_get_child (fallbacks, i, "(y@aytt)", &objtype_y, &csum_v,
+                           &fallback->compressed_size, &fallback->uncompressed_size);
+
+      if (!ostree_validate_structureof_objtype (objtype_y, error))
+        return NULL;
+      fallback->objtype = (OstreeObjectType)objtype_y;
+      fallback->checksum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!fallback->checksum)
+        return NULL;
+      fallback->compressed_size
+          = maybe_swap_endian_u64 (index->byteswap, fallback->compressed_size);
+      fallback->uncompressed_size
+          = maybe_swap_endian_u64 (index->byteswap, fallback->uncompressed_size);
+    }
+
+  return g_steal_pointer (&index);
+}
+
+void
+_ostree_static_delta_index_free (OstreeStaticDeltaIndex *index)
+{
+  g_variant_unref (index->superblock);
+  g_free (index->parts);
+  g_free (index->fallbacks);
+  g_free (index);
+}
+
+/* Returns a bytestring variant for the object array of part @i, as taken by
+ * _ostree_static_delta_part_execute(); this shares the superblock data.
+ */
+GVariant *
+_ostree_static_delta_index_dup_part_objects (OstreeStaticDeltaIndex *index, guint i)
+{
+  g_assert_cmpuint (i, <, index->n_parts);
+  const OstreeStaticDeltaPartEntry *part = &index->parts[i];
+
+  return g_variant_ref_sink (g_variant_new_from_data (
+      G_VARIANT_TYPE_BYTESTRING, part->objects,
+      (gsize)part->n_objects * OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN, TRUE,
+      (GDestroyNotify)g_variant_unref, g_variant_ref (index->superblock)));
+}
+
 static gboolean
 _ostree_repo_static_delta_is_signed (OstreeRepo *self, int fd, GPtrArray **out_value,
                                      GError **error)
@@ -532,28 +628,23 @@ ostree_repo_static_delta_execute_offline_with_signature (OstreeRepo *self, GFile
     return glnx_throw (error,
                        "Cannot execute delta offline: contains nonempty http fallback entries");
 
-  g_autoptr (GVariant) headers = g_variant_get_child_value (meta, 6);
-  const guint n = g_variant_n_children (headers);
-  for (guint i = 0; i < n; i++)
+  g_autoptr (OstreeStaticDeltaIndex) index = _ostree_static_delta_index_new (meta, error);
+  if (!index)
+    return FALSE;
+  for (guint i = 0; i < index->n_parts; i++)
     {
-      guint32 version;
-      guint64 size;
-      guint64 usize;
+      const OstreeStaticDeltaPartEntry *entry = &index->parts[i];
       char checksum[OSTREE_SHA256_STRING_LEN + 1];
-      g_autoptr (GVariant) csum_v = NULL;
-      g_autoptr (GVariant) objects = NULL;
       g_autoptr (GVariant) part = NULL;
       OstreeStaticDeltaOpenFlags delta_open_flags
           = skip_validation ? OSTREE_STATIC_DELTA_OPEN_FLAGS_SKIP_CHECKSUM : 0;
-      g_autoptr (GVariant) header = g_variant_get_child_value (headers, i);
-      g_variant_get (header, "(u@aytt@ay)", &version, &csum_v, &size, &usize, &objects);
 
-      if (version > OSTREE_DELTAPART_VERSION)
-        return glnx_throw (error, "Delta part has too new version %u", version);
+      if (entry->version > OSTREE_DELTAPART_VERSION)
+        return glnx_throw (error, "Delta part has too new version %u", entry->version);
 
       gboolean have_all;
-      if (!_ostree_repo_static_delta_part_have_all_objects (self, objects, &have_all, cancellable,
-                                                            error))
+      if (!_ostree_repo_static_delta_have_all_objects (self, entry->objects, entry->n_objects,
+                                                       &have_all, cancellable, error))
         return FALSE;
 
       /* If we already have these objects, don't bother executing the
@@ -562,10 +653,7 @@ ostree_repo_static_delta_execute_offline_with_signature (OstreeRepo *self, GFile
       if (have_all)
         continue;
 
-      const guchar *csum = ostree_checksum_bytes_peek_validate (csum_v, error);
-      if (!csum)
-        return FALSE;
-      ostree_checksum_inplace_from_bytes (csum, checksum);
+      ostree_checksum_inplace_from_bytes (entry->checksum, checksum);
 
       g_autofree char *deltapart_path
           = _ostree_get_relative_static_delta_part_path (from_checksum, to_checksum, i);
@@ -603,6 +691,7 @@ ostree_repo_static_delta_execute_offline_with_signature (OstreeRepo *self, GFile
             return FALSE;
         }
 
+      g_autoptr (GVariant) objects = _ostree_static_delta_index_dup_part_objects (index, i);
       if (!_ostree_static_delta_part_execute (self, objects, part, skip_validation, NULL,
                                               cancellable, error))
         return glnx_prefix_error (error, "Executing delta part %i", i);
@@ -160,6 +160,14 @@ void _ostree_static_delta_part_execute_async (OstreeRepo *repo, GVariant *header
                                               GVariant *part_payload, GCancellable *cancellable,
                                               GAsyncReadyCallback callback, gpointer user_data);
 
+void _ostree_static_delta_part_open_and_execute_async (OstreeRepo *repo, GVariant *header,
+                                                       GInputStream *part_in,
+                                                       const char *expected_checksum,
+                                                       gboolean from_delta_cache,
+                                                       GCancellable *cancellable,
+                                                       GAsyncReadyCallback callback,
+                                                       gpointer user_data);
+
 gboolean _ostree_static_delta_part_execute_finish (OstreeRepo *repo, GAsyncResult *result,
                                                    GError **error);
 
@@ -236,4 +244,49 @@ OstreeDeltaEndianness _ostree_delta_get_endianness (GVariant *superblock,
 
 gboolean _ostree_delta_needs_byteswap (GVariant *superblock);
 
+/* A native index of the part headers and fallback entries of a superblock,
+ * parsed once so that callers don't need to walk the GVariant (allocating
+ * a child per element) for every lookup. Sizes are already byteswapped if
+ * needed. The checksum and object pointers point into the superblock
+ * data (which is usually mmap()ed or the fetched buffer), and are valid as
+ * long as the index is.
+ */
+typedef struct
+{
+  guint32 version;
+  const guint8 *checksum; /* OSTREE_SHA256_DIGEST_LEN bytes */
+  guint64 size;
+  guint64 usize;
+  const guint8 *objects; /* n_objects * OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN bytes */
+  guint n_objects;
+} OstreeStaticDeltaPartEntry;
+
+typedef struct
+{
+  OstreeObjectType objtype;
+  const guint8 *checksum; /* OSTREE_SHA256_DIGEST_LEN bytes */
+  guint64 compressed_size;
+  guint64 uncompressed_size;
+} OstreeStaticDeltaFallbackEntry;
+
+typedef struct
+{
+  GVariant *superblock;
+  gboolean byteswap;
+  OstreeStaticDeltaPartEntry *parts;
+  guint n_parts;
+  OstreeStaticDeltaFallbackEntry *fallbacks;
+  guint n_fallbacks;
+} OstreeStaticDeltaIndex;
+
+OstreeStaticDeltaIndex *_ostree_static_delta_index_new (GVariant *superblock, GError **error);
+void _ostree_static_delta_index_free (OstreeStaticDeltaIndex *index);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OstreeStaticDeltaIndex, _ostree_static_delta_index_free)
+
+GVariant *_ostree_static_delta_index_dup_part_objects (OstreeStaticDeltaIndex *index, guint i);
+
+gboolean _ostree_repo_static_delta_have_all_objects (OstreeRepo *repo, const guint8 *checksums,
+                                                     guint n_checksums, gboolean *out_have_all,
+                                                     GCancellable *cancellable, GError **error);
+
 G_END_DECLS
@@ -32,6 +32,7 @@
 #include "ostree-lzma-decompressor.h"
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
+#include "ostree-sdt-private.h"
 #include "ostree-varint.h"
 #include "otutil.h"
 
@@ -184,6 +185,8 @@ _ostree_static_delta_part_execute (OstreeRepo *repo, GVariant *objects, GVariant
   state->async_error = error;
   state->stats_only = stats_only;
 
+  OSTREE_PROBE2 (delta_part_execute_start, repo, g_variant_get_size (part));
+
   if (!_ostree_static_delta_parse_checksum_array (objects, &checksums_data, &state->n_checksums,
                                                   error))
     goto out;
@@ -265,6 +268,7 @@ _ostree_static_delta_part_execute (OstreeRepo *repo, GVariant *objects, GVariant
 
   ret = TRUE;
 out:
+  OSTREE_PROBE3 (delta_part_execute_done, repo, n_executed, ret);
   _ostree_repo_bare_content_cleanup (&state->content_out);
   return ret;
 }
@@ -274,7 +278,12 @@ typedef struct
   OstreeRepo *repo;
   GVariant *header;
   GVariant *part;
+  /* Only for _ostree_static_delta_part_open_and_execute_async() */
+  GInputStream *part_in;
+  char *expected_checksum;
+  gboolean from_delta_cache;
   GCancellable *cancellable;
+  OstreeTransaction *txn;
 } StaticDeltaPartExecuteAsyncData;
 
 static void
@@ -284,17 +293,49 @@ static_delta_part_execute_async_data_free (gpointer user_data)
 
   g_clear_object (&data->repo);
   g_variant_unref (data->header);
-  g_variant_unref (data->part);
+  g_clear_pointer (&data->part, g_variant_unref);
+  g_clear_object (&data->part_in);
+  g_free (data->expected_checksum);
   g_clear_object (&data->cancellable);
+  g_clear_pointer (&data->txn, ostree_transaction_unref);
   g_free (data);
 }
 
 static void
-static_delta_part_execute_thread (GTask *task, GObject *object, gpointer datap,
-                                  GCancellable *cancellable)
+static_delta_part_open_and_execute (GTask *task, StaticDeltaPartExecuteAsyncData *data,
+                                    GCancellable *cancellable)
 {
   GError *error = NULL;
-  StaticDeltaPartExecuteAsyncData *data = datap;
+
+  if (data->part == NULL)
+    {
+      g_assert (data->part_in);
+      if (!_ostree_static_delta_part_open (data->part_in, NULL, 0, data->expected_checksum,
+                                           &data->part, cancellable, &error))
+        {
+          /* Make sure a bad entry doesn't keep failing pulls */
+          if (data->from_delta_cache)
+            {
+              g_autoptr (GError) local_error = NULL;
+              if (!_ostree_repo_delta_cache_evict (data->repo, data->expected_checksum,
+                                                   &local_error))
+                g_debug ("%s", local_error->message);
+              g_prefix_error (&error, "Cached delta part %s: ", data->expected_checksum);
+            }
+          g_task_return_error (task, error);
+          return;
+        }
+
+      /* Only now that it's verified can it be shared with others */
+      if (!data->from_delta_cache && G_IS_FILE_DESCRIPTOR_BASED (data->part_in))
+        {
+          g_autoptr (GError) local_error = NULL;
+          int fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased *)data->part_in);
+          if (!_ostree_repo_delta_cache_store (data->repo, data->expected_checksum, fd,
+                                               cancellable, &local_error))
+            g_debug ("%s", local_error->message);
+        }
+    }
 
   if (!_ostree_static_delta_part_execute (data->repo, data->header, data->part, FALSE, NULL,
                                           cancellable, &error))
@@ -303,6 +344,21 @@ static_delta_part_execute_thread (GTask *task, GObject *object, gpointer datap,
     g_task_return_boolean (task, TRUE);
 }
 
+static void
+static_delta_part_execute_thread (GTask *task, GObject *object, gpointer datap,
+                                  GCancellable *cancellable)
+{
+  StaticDeltaPartExecuteAsyncData *data = datap;
+
+  int prev_ioprio = _ostree_repo_begin_background_io (data->repo, data->txn);
+  if (data->txn)
+    ostree_transaction_push_thread_default (data->txn);
+  static_delta_part_open_and_execute (task, data, cancellable);
+  if (data->txn)
+    ostree_transaction_pop_thread_default (data->txn);
+  _ostree_restore_ioprio (prev_ioprio);
+}
+
 void
 _ostree_static_delta_part_execute_async (OstreeRepo *repo, GVariant *header, GVariant *part,
                                          GCancellable *cancellable, GAsyncReadyCallback callback,
@@ -316,6 +372,40 @@ _ostree_static_delta_part_execute_async (OstreeRepo *repo, GVariant *header, GVa
   asyncdata->header = g_variant_ref (header);
   asyncdata->part = g_variant_ref (part);
   asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  OstreeTransaction *txn = _ostree_repo_get_thread_txn (repo);
+  asyncdata->txn = txn ? ostree_transaction_ref (txn) : NULL;
+
+  task = g_task_new (G_OBJECT (repo), cancellable, callback, user_data);
+  g_task_set_task_data (task, asyncdata, (GDestroyNotify)static_delta_part_execute_async_data_free);
+  g_task_set_source_tag (task, _ostree_static_delta_part_execute_async);
+  g_task_run_in_thread (task, (GTaskThreadFunc)static_delta_part_execute_thread);
+}
+
+/* Like _ostree_static_delta_part_execute_async(), but also does the
+ * _ostree_static_delta_part_open() (i.e. checksumming and decompression) of
+ * @part_in in the worker thread, so that it doesn't block the caller's main
+ * loop. Complete with _ostree_static_delta_part_execute_finish().
+ */
+void
+_ostree_static_delta_part_open_and_execute_async (OstreeRepo *repo, GVariant *header,
+                                                  GInputStream *part_in,
+                                                  const char *expected_checksum,
+                                                  gboolean from_delta_cache,
+                                                  GCancellable *cancellable,
+                                                  GAsyncReadyCallback callback, gpointer user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  StaticDeltaPartExecuteAsyncData *asyncdata;
+
+  asyncdata = g_new0 (StaticDeltaPartExecuteAsyncData, 1);
+  asyncdata->repo = g_object_ref (repo);
+  asyncdata->header = g_variant_ref (header);
+  asyncdata->part_in = g_object_ref (part_in);
+  asyncdata->expected_checksum = g_strdup (expected_checksum);
+  asyncdata->from_delta_cache = from_delta_cache;
+  asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  OstreeTransaction *txn = _ostree_repo_get_thread_txn (repo);
+  asyncdata->txn = txn ? ostree_transaction_ref (txn) : NULL;
 
   task = g_task_new (G_OBJECT (repo), cancellable, callback, user_data);
   g_task_set_task_data (task, asyncdata, (GDestroyNotify)static_delta_part_execute_async_data_free);
@@ -41,6 +41,7 @@
 #include "ostree-repo-file.h"
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
+#include "ostree-sdt-private.h"
 #include "ostree-sign-private.h"
 #include "ostree-sysroot-private.h"
 #include "ot-fs-utils.h"
@@ -50,6 +51,7 @@
 #include <sys/file.h>
 #include <sys/statfs.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
 
 #define REPO_LOCK_DISABLED (-2)
 #define REPO_LOCK_BLOCKING (-1)
@@ -113,6 +115,23 @@ G_STATIC_ASSERT (sizeof (OstreeRepoPruneOptions)
  * with ostree_repo_write_mtree(), and finally create a commit with
  * ostree_repo_write_commit().
  *
+ * ## Thread safety
+ *
+ * Once opened, a single #OstreeRepo may be used to read from the repository
+ * from any number of threads at once; there is no need for a separate
+ * instance per thread. This covers in particular ostree_repo_resolve_rev(),
+ * ostree_repo_list_refs(), ostree_repo_has_object(), ostree_repo_load_variant()
+ * and the other ostree_repo_load_*() functions, ostree_repo_read_commit(),
+ * ostree_repo_traverse_commit() and ostree_repo_checkout_at(). These may also
+ * be called while another thread has a transaction open, in which case they
+ * may or may not see the objects and refs written so far.
+ *
+ * Objects returned by these functions, such as the #GFile from
+ * ostree_repo_read_commit(), must each only be used from one thread at a
+ * time. Modifying the repository configuration (e.g. with
+ * ostree_repo_write_config() or ostree_repo_reload_config()) must not be
+ * done concurrently with anything else.
+ *
  * ## Collection IDs
  *
  * A collection ID is a globally unique identifier which, if set, is used to
@@ -356,7 +375,10 @@ push_repo_lock (OstreeRepo *self, OstreeRepoLockType lock_type, gboolean blockin
 
       const char *next_state_name = lock_state_name (next_state);
       g_debug ("Locking repo %s", next_state_name);
-      if (!do_repo_lock (self->lock.fd, flags))
+      OSTREE_PROBE3 (repo_lock_start, self, next_state_name, blocking);
+      gboolean locked = do_repo_lock (self->lock.fd, flags);
+      OSTREE_PROBE3 (repo_lock_done, self, next_state_name, locked);
+      if (!locked)
         return glnx_throw_errno_prefix (error, "Locking repo %s failed", next_state_name);
     }
 
@@ -416,6 +438,7 @@ pop_repo_lock (OstreeRepo *self, OstreeRepoLockType lock_type, gboolean blocking
       g_debug ("Unlocking repo");
       if (!do_repo_unlock (self->lock.fd, flags))
         return glnx_throw_errno_prefix (error, "Unlocking repo failed");
+      OSTREE_PROBE2 (repo_lock_release, self, lock_state_name (next_state));
     }
   else if (info.state == next_state)
     {
@@ -428,6 +451,7 @@ pop_repo_lock (OstreeRepo *self, OstreeRepoLockType lock_type, gboolean blocking
       g_debug ("Returning lock state to shared");
       if (!do_repo_lock (self->lock.fd, next_state | flags))
         return glnx_throw_errno_prefix (error, "Setting repo lock to shared failed");
+      OSTREE_PROBE2 (repo_lock_release, self, lock_state_name (next_state));
     }
 
   /* Update state */
@@ -1145,8 +1169,8 @@ ostree_repo_finalize (GObject *object)
   g_clear_object (&self->repodir_fdrel);
   g_clear_object (&self->repodir);
   glnx_close_fd (&self->repo_dir_fd);
-  glnx_tmpdir_unset (&self->commit_stagedir);
-  glnx_release_lock_file (&self->commit_stagedir_lock);
+  glnx_tmpdir_unset (&self->txn.stagedir);
+  glnx_release_lock_file (&self->txn.stagedir_lock);
   glnx_close_fd (&self->tmp_dir_fd);
   glnx_close_fd (&self->cache_dir_fd);
   glnx_close_fd (&self->objects_dir_fd);
@@ -1155,19 +1179,20 @@ ostree_repo_finalize (GObject *object)
   g_weak_ref_clear (&self->sysroot);
   g_free (self->remotes_config_dir);
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_destroy (self->loose_object_devino_hash);
   if (self->updated_uncompressed_dirs)
     g_hash_table_destroy (self->updated_uncompressed_dirs);
   if (self->config)
     g_key_file_free (self->config);
   g_clear_pointer (&self->txn.refs, g_hash_table_destroy);
   g_clear_pointer (&self->txn.collection_refs, g_hash_table_destroy);
+  g_clear_pointer (&self->txn.object_sizes, g_hash_table_unref);
+  g_clear_pointer (&self->txn.loose_object_devino_hash, g_hash_table_unref);
   g_clear_error (&self->writable_error);
-  g_clear_pointer (&self->object_sizes, g_hash_table_unref);
   g_clear_pointer (&self->dirmeta_cache, g_hash_table_unref);
   g_mutex_clear (&self->cache_lock);
+  g_rw_lock_clear (&self->dirmeta_cache_lock);
   g_mutex_clear (&self->txn_lock);
+  g_mutex_clear (&self->txn_commit_lock);
   g_free (self->collection_id);
   g_strfreev (self->repo_finders);
   g_clear_pointer (&self->bls_append_values, g_hash_table_unref);
@@ -1175,6 +1200,12 @@ ostree_repo_finalize (GObject *object)
   g_clear_pointer (&self->remotes, g_hash_table_destroy);
   g_mutex_clear (&self->remotes_lock);
 
+  g_clear_pointer (&self->gpg_verifiers, g_hash_table_unref);
+  g_mutex_clear (&self->gpg_verifiers_lock);
+
+  g_clear_pointer (&self->pull_throttle_options, g_variant_unref);
+  g_mutex_clear (&self->pull_throttle_lock);
+
   glnx_close_fd (&self->lock.fd);
   g_mutex_clear (&self->lock.mutex);
 
@@ -1323,13 +1354,19 @@ ostree_repo_init (OstreeRepo *self)
 
   g_mutex_init (&self->lock.mutex);
   g_mutex_init (&self->cache_lock);
+  g_rw_lock_init (&self->dirmeta_cache_lock);
   g_mutex_init (&self->txn_lock);
+  g_mutex_init (&self->txn_commit_lock);
 
   self->remotes = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify)NULL,
                                          (GDestroyNotify)ostree_remote_unref);
   self->bls_append_values = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify)g_free,
                                                    (GDestroyNotify)g_free);
   g_mutex_init (&self->remotes_lock);
+  g_mutex_init (&self->pull_throttle_lock);
+  self->gpg_verifiers = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify)g_free,
+                                               (GDestroyNotify)g_object_unref);
+  g_mutex_init (&self->gpg_verifiers_lock);
 
   self->repo_dir_fd = -1;
   self->cache_dir_fd = -1;
@@ -2940,9 +2977,11 @@ min_free_space_calculate_reserved_bytes (OstreeRepo *self, guint64 *bytes, GErro
   return TRUE;
 }
 
+/* Parse a size of the form '123MB', '123GB' or '123TB', as used by e.g.
+ * the min-free-space-size config option, into MBs.
+ */
 static gboolean
-min_free_space_size_validate_and_convert (OstreeRepo *self, const char *min_free_space_size_str,
-                                          GError **error)
+size_validate_and_convert_mb (const char *size_str_full, guint64 *out_mb, GError **error)
 {
   static GRegex *regex;
   static gsize regex_initialized;
@@ -2954,7 +2993,7 @@ min_free_space_size_validate_and_convert (OstreeRepo *self, const char *min_free
     }
 
   g_autoptr (GMatchInfo) match = NULL;
-  if (!g_regex_match (regex, min_free_space_size_str, 0, &match))
+  if (!g_regex_match (regex, size_str_full, 0, &match))
     return glnx_throw (error, "It should be of the format '123MB', '123GB' or '123TB'");
 
   g_autofree char *size_str = g_match_info_fetch (match, 1);
@@ -2976,11 +3015,11 @@ min_free_space_size_validate_and_convert (OstreeRepo *self, const char *min_free
       g_assert_not_reached ();
     }
 
-  guint64 min_free_space = g_ascii_strtoull (size_str, NULL, 10);
-  if (shifts > 0 && g_bit_nth_lsf (min_free_space, 63 - shifts) != -1)
+  guint64 size = g_ascii_strtoull (size_str, NULL, 10);
+  if (shifts > 0 && g_bit_nth_lsf (size, 63 - shifts) != -1)
     return glnx_throw (error, "Value was too high");
 
-  self->min_free_space_mb = min_free_space << shifts;
+  *out_mb = size << shifts;
 
   return TRUE;
 }
@@ -3121,7 +3160,8 @@ reload_core_config (OstreeRepo *self, GCancellable *cancellable, GError **error)
           return FALSE;
 
         /* Validate the string and convert the size to MBs */
-        if (!min_free_space_size_validate_and_convert (self, min_free_space_size_str, error))
+        if (!size_validate_and_convert_mb (min_free_space_size_str, &self->min_free_space_mb,
+                                           error))
           return glnx_prefix_error (error, "Invalid min-free-space-size '%s'",
                                     min_free_space_size_str);
       }
@@ -3209,6 +3249,22 @@ reload_core_config (OstreeRepo *self, GCancellable *cancellable, GError **error)
     self->payload_link_threshold = g_ascii_strtoull (payload_threshold, NULL, 10);
   }
 
+  {
+    g_autofree char *delta_cache_max_size_str = NULL;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "delta-cache-max-size", NULL,
+                                            &delta_cache_max_size_str, error))
+      return FALSE;
+
+    /* Unset means the delta cache is disabled */
+    self->delta_cache_max_size_mb = 0;
+    if (delta_cache_max_size_str
+        && !size_validate_and_convert_mb (delta_cache_max_size_str, &self->delta_cache_max_size_mb,
+                                          error))
+      return glnx_prefix_error (error, "Invalid delta-cache-max-size '%s'",
+                                delta_cache_max_size_str);
+  }
+
   {
     g_auto (GStrv) configured_finders = NULL;
     g_autoptr (GError) local_error = NULL;
@@ -3573,6 +3629,115 @@ _ostree_repo_file_replace_contents (OstreeRepo *self, int dfd, const char *path,
                                         cancellable, error);
 }
 
+/**
+ * ostree_repo_set_pull_throttle:
+ * @self: An #OstreeRepo
+ * @options: GVariant of type `a{sv}`
+ *
+ * Change how pulls in progress on @self are throttled, overriding the
+ * corresponding options they were started with.  This may be called from any
+ * thread, e.g. by a daemon handling a D-Bus call while a pull runs in another
+ * thread, and takes effect within a fraction of a second.  Options from
+ * earlier calls are kept, so a call only needs to contain the ones it
+ * changes.  Pulls started after a call aren't affected by it.
+ *
+ * The following options are understood; see ostree_repo_pull_with_options()
+ * for their meaning:
+ *
+ *   * `max-bandwidth-bytes` (`t`): Download rate cap, or 0 to lift it
+ *   * `background` (`b`): Whether to use the idle I/O priority
+ *
+ * Since: 2024.8
+ */
+void
+ostree_repo_set_pull_throttle (OstreeRepo *self, GVariant *options)
+{
+  g_return_if_fail (OSTREE_IS_REPO (self));
+  g_return_if_fail (g_variant_is_of_type (options, G_VARIANT_TYPE_VARDICT));
+
+  g_mutex_lock (&self->pull_throttle_lock);
+  g_auto (GVariantDict) dict;
+  g_variant_dict_init (&dict, self->pull_throttle_options);
+  const char *key;
+  GVariant *value;
+  GVariantIter iter;
+  g_variant_iter_init (&iter, options);
+  while (g_variant_iter_loop (&iter, "{&sv}", &key, &value))
+    g_variant_dict_insert_value (&dict, key, value);
+  g_clear_pointer (&self->pull_throttle_options, g_variant_unref);
+  self->pull_throttle_options = g_variant_ref_sink (g_variant_dict_end (&dict));
+  self->pull_throttle_serial++;
+  g_mutex_unlock (&self->pull_throttle_lock);
+}
+
+guint
+_ostree_repo_get_pull_throttle_serial (OstreeRepo *self)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->pull_throttle_lock);
+  return self->pull_throttle_serial;
+}
+
+/* Returns the options accumulated by ostree_repo_set_pull_throttle() if there
+ * were calls since *@inout_serial, updating it; %NULL otherwise.
+ */
+GVariant *
+_ostree_repo_get_pull_throttle (OstreeRepo *self, guint *inout_serial)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->pull_throttle_lock);
+  if (*inout_serial == self->pull_throttle_serial)
+    return NULL;
+  *inout_serial = self->pull_throttle_serial;
+  return g_variant_ref (self->pull_throttle_options);
+}
+
+/* See ioprio_set(2); glibc has no wrapper */
+#define OSTREE_IOPRIO_WHO_PROCESS 1
+#define OSTREE_IOPRIO_CLASS_SHIFT 13
+#define OSTREE_IOPRIO_CLASS_IDLE 3
+
+/* Move the calling thread to the idle I/O scheduling class. Returns its
+ * previous I/O priority to pass to _ostree_restore_ioprio(), or -1 if it was
+ * not changed.
+ */
+int
+_ostree_set_idle_ioprio (void)
+{
+  int prev = syscall (SYS_ioprio_get, OSTREE_IOPRIO_WHO_PROCESS, 0);
+  if (prev < 0 || (prev >> OSTREE_IOPRIO_CLASS_SHIFT) == OSTREE_IOPRIO_CLASS_IDLE)
+    return -1;
+  if (syscall (SYS_ioprio_set, OSTREE_IOPRIO_WHO_PROCESS, 0,
+               OSTREE_IOPRIO_CLASS_IDLE << OSTREE_IOPRIO_CLASS_SHIFT)
+      < 0)
+    {
+      g_debug ("Failed to set idle I/O priority: %s", g_strerror (errno));
+      return -1;
+    }
+  return prev;
+}
+
+void
+_ostree_restore_ioprio (int prev_ioprio)
+{
+  if (prev_ioprio >= 0)
+    (void)syscall (SYS_ioprio_set, OSTREE_IOPRIO_WHO_PROCESS, 0, prev_ioprio);
+}
+
+/* For worker threads writing objects or applying deltas for @txn (or the
+ * default transaction of @self if %NULL): while a pull in background mode
+ * writes to that transaction, use the idle I/O priority.  Other writers to
+ * @self keep theirs.  Returns what to pass to _ostree_restore_ioprio() when
+ * done.
+ */
+int
+_ostree_repo_begin_background_io (OstreeRepo *self, OstreeTransaction *txn)
+{
+  if (txn == NULL)
+    txn = &self->txn;
+  if (g_atomic_int_get (&txn->n_background_pulls) == 0)
+    return -1;
+  return _ostree_set_idle_ioprio ();
+}
+
 /**
  * ostree_repo_get_path:
  * @self: Repo
@@ -3589,9 +3754,9 @@ ostree_repo_get_path (OstreeRepo *self)
   /* Did we have an abspath?  Return it */
   if (self->repodir)
     return self->repodir;
-  /* Lazily create a fd-relative path */
-  if (!self->repodir_fdrel)
-    self->repodir_fdrel = ot_fdrel_to_gfile (self->repo_dir_fd, ".");
+  /* Lazily create a fd-relative path; this may be called from several threads */
+  if (g_once_init_enter (&self->repodir_fdrel))
+    g_once_init_leave (&self->repodir_fdrel, ot_fdrel_to_gfile (self->repo_dir_fd, "."));
   return self->repodir_fdrel;
 }
 
@@ -3842,21 +4007,22 @@ load_metadata_internal (OstreeRepo *self, OstreeObjectType objtype, const char *
     *out_variant = NULL;
 
   /* Special caching for dirmeta objects, since they're commonly referenced many
-   * times.
+   * times. Most of the time there's no cache, which we can tell without
+   * taking the lock.
    */
   const gboolean is_dirmeta_cachable
-      = (objtype == OSTREE_OBJECT_TYPE_DIR_META && out_variant && !out_stream);
+      = (objtype == OSTREE_OBJECT_TYPE_DIR_META && out_variant && !out_stream
+         && g_atomic_int_get (&self->dirmeta_cache_refcount) > 0);
   if (is_dirmeta_cachable)
     {
-      GMutex *lock = &self->cache_lock;
-      g_mutex_lock (lock);
+      g_rw_lock_reader_lock (&self->dirmeta_cache_lock);
       GVariant *cache_hit = NULL;
-      /* Look it up, if we have a cache */
+      /* Look it up, if we (still) have a cache */
       if (self->dirmeta_cache)
         cache_hit = g_hash_table_lookup (self->dirmeta_cache, sha256);
       if (cache_hit)
         *out_variant = g_variant_ref (cache_hit);
-      g_mutex_unlock (lock);
+      g_rw_lock_reader_unlock (&self->dirmeta_cache_lock);
       if (cache_hit)
         return TRUE;
     }
@@ -3866,9 +4032,10 @@ load_metadata_internal (OstreeRepo *self, OstreeObjectType objtype, const char *
   if (!ot_openat_ignore_enoent (self->objects_dir_fd, loose_path_buf, &fd, error))
     return FALSE;
 
-  if (fd < 0 && self->commit_stagedir.initialized)
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  if (fd < 0 && txn->stagedir.initialized)
     {
-      if (!ot_openat_ignore_enoent (self->commit_stagedir.fd, loose_path_buf, &fd, error))
+      if (!ot_openat_ignore_enoent (txn->stagedir.fd, loose_path_buf, &fd, error))
         return FALSE;
     }
 
@@ -3886,12 +4053,11 @@ load_metadata_internal (OstreeRepo *self, OstreeObjectType objtype, const char *
           /* Now, let's put it in the cache */
           if (is_dirmeta_cachable)
             {
-              GMutex *lock = &self->cache_lock;
-              g_mutex_lock (lock);
+              g_rw_lock_writer_lock (&self->dirmeta_cache_lock);
               if (self->dirmeta_cache)
                 g_hash_table_replace (self->dirmeta_cache, g_strdup (sha256),
                                       g_variant_ref (ret_variant));
-              g_mutex_unlock (lock);
+              g_rw_lock_writer_unlock (&self->dirmeta_cache_lock);
             }
         }
       else if (out_stream)
@@ -3972,9 +4138,10 @@ repo_load_file_archive (OstreeRepo *self, const char *checksum, GInputStream **o
   if (!ot_openat_ignore_enoent (self->objects_dir_fd, loose_path_buf, &fd, error))
     return FALSE;
 
-  if (fd < 0 && self->commit_stagedir.initialized)
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  if (fd < 0 && txn->stagedir.initialized)
     {
-      if (!ot_openat_ignore_enoent (self->commit_stagedir.fd, loose_path_buf, &fd, error))
+      if (!ot_openat_ignore_enoent (txn->stagedir.fd, loose_path_buf, &fd, error))
         return FALSE;
     }
 
@@ -4048,13 +4215,14 @@ _ostree_repo_load_file_bare (OstreeRepo *self, const char *checksum, int *out_fd
   _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
 
   /* Do a fstatat() and find the object directory that contains this object */
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   int objdir_fd = self->objects_dir_fd;
   int res;
   if ((res = TEMP_FAILURE_RETRY (fstatat (objdir_fd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW)))
           < 0
-      && errno == ENOENT && self->commit_stagedir.initialized)
+      && errno == ENOENT && txn->stagedir.initialized)
     {
-      objdir_fd = self->commit_stagedir.fd;
+      objdir_fd = txn->stagedir.fd;
       res = TEMP_FAILURE_RETRY (fstatat (objdir_fd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW));
     }
   if (res < 0 && errno != ENOENT)
@@ -4294,9 +4462,10 @@ _ostree_repo_has_loose_object (OstreeRepo *self, const char *checksum, OstreeObj
 
   gboolean found = FALSE;
   /* It's easier to share code if we make this an array */
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
   int dfd_searches[] = { -1, self->objects_dir_fd };
-  if (self->commit_stagedir.initialized)
-    dfd_searches[0] = self->commit_stagedir.fd;
+  if (txn->stagedir.initialized)
+    dfd_searches[0] = txn->stagedir.fd;
   for (guint i = 0; i < G_N_ELEMENTS (dfd_searches); i++)
     {
       int dfd = dfd_searches[i];
@@ -4564,9 +4733,10 @@ ostree_repo_query_object_storage_size (OstreeRepo *self, OstreeObjectType objtyp
   struct stat stbuf;
   res = TEMP_FAILURE_RETRY (
       fstatat (self->objects_dir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW));
-  if (res < 0 && errno == ENOENT && self->commit_stagedir.initialized)
+  OstreeTransaction *txn = _ostree_repo_get_txn (self);
+  if (res < 0 && errno == ENOENT && txn->stagedir.initialized)
     res = TEMP_FAILURE_RETRY (
-        fstatat (self->commit_stagedir.fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW));
+        fstatat (txn->stagedir.fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW));
 
   if (res < 0)
     return glnx_throw_errno_prefix (error, "Querying object %s.%s", sha256,
@@ -5483,6 +5653,52 @@ _ostree_repo_gpg_prepare_verifier (OstreeRepo *self, const gchar *remote_name, G
   return TRUE;
 }
 
+/* Replace *@verifier with the one we kept for @remote_name if it has the same
+ * keys, as that has its GnuPG home directory set up already.  Otherwise keep
+ * *@verifier for next time, with a cache of its imported keyring shared with
+ * other processes in the repo's cache directory.
+ */
+static gboolean
+reuse_gpg_verifier (OstreeRepo *self, const char *remote_name, OstreeGpgVerifier **verifier,
+                    GCancellable *cancellable, GError **error)
+{
+  const char *fingerprint = _ostree_gpg_verifier_get_fingerprint (*verifier, error);
+  if (fingerprint == NULL)
+    return FALSE;
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->gpg_verifiers_lock);
+  OstreeGpgVerifier *kept = g_hash_table_lookup (self->gpg_verifiers, remote_name);
+  if (kept != NULL && g_str_equal (_ostree_gpg_verifier_get_fingerprint (kept, NULL), fingerprint))
+    {
+      g_set_object (verifier, kept);
+      return TRUE;
+    }
+
+  if (self->cache_dir_fd != -1)
+    {
+      g_autofree char *cache_path = g_build_filename (_OSTREE_GPG_CACHE_DIR, remote_name, NULL);
+      glnx_autofd int cache_dfd = -1;
+      if (!glnx_shutil_mkdir_p_at_open (self->cache_dir_fd, cache_path, DEFAULT_DIRECTORY_MODE,
+                                        &cache_dfd, cancellable, error))
+        return FALSE;
+
+      /* The cached keyrings decide which signatures we accept, so don't use
+       * a directory someone else could have put them in.
+       */
+      struct stat stbuf;
+      if (!glnx_fstat (cache_dfd, &stbuf, error))
+        return FALSE;
+      if (stbuf.st_uid != geteuid () || (stbuf.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+        g_debug ("Not caching GPG keyrings in %s: not owned by us or writable by others",
+                 cache_path);
+      else
+        _ostree_gpg_verifier_set_cache_dir (*verifier, g_steal_fd (&cache_dfd));
+    }
+
+  g_hash_table_replace (self->gpg_verifiers, g_strdup (remote_name), g_object_ref (*verifier));
+  return TRUE;
+}
+
 static OstreeGpgVerifyResult *
 _ostree_repo_gpg_verify_data_internal (OstreeRepo *self, const gchar *remote_name, GBytes *data,
                                        GBytes *signatures, GFile *keyringdir, GFile *extra_keyring,
@@ -5493,6 +5709,16 @@ _ostree_repo_gpg_verify_data_internal (OstreeRepo *self, const gchar *remote_nam
                                           &verifier, cancellable, error))
     return NULL;
 
+  /* Reading the keyrings is cheap, importing them into a GnuPG home directory
+   * isn't; do that once for as long as a remote's keys stay the same.
+   */
+  if (remote_name != NULL && remote_name != OSTREE_ALL_REMOTES && keyringdir == NULL
+      && extra_keyring == NULL)
+    {
+      if (!reuse_gpg_verifier (self, remote_name, &verifier, cancellable, error))
+        return NULL;
+    }
+
   return _ostree_gpg_verifier_check_signature (verifier, data, signatures, cancellable, error);
 }
 
@@ -5739,12 +5965,19 @@ ostree_repo_verify_summary (OstreeRepo *self, const char *remote_name, GBytes *s
 #endif /* OSTREE_DISABLE_GPGME */
 }
 
+/* Each ancestor costs a commit load per ref on every summary regeneration, and
+ * 32 bytes per ref in the summary. */
+#define SUMMARY_MAX_ANCESTOR_DEPTH 1024
+
 /* Add an entry for a @ref ↦ @checksum mapping to an `a(s(t@ay@a{sv}))`
  * @refs_builder to go into a `summary` file. This includes building the
- * standard additional metadata keys for the ref. */
+ * standard additional metadata keys for the ref, the detached metadata of
+ * the commit if @include_detached_metadata is set, and up to @ancestor_depth
+ * of its ancestors. */
 static gboolean
 summary_add_ref_entry (OstreeRepo *self, const char *ref, const char *checksum,
-                       GVariantBuilder *refs_builder, GError **error)
+                       gboolean include_detached_metadata, guint ancestor_depth,
+                       OtVariantBuilder *refs_builder, GCancellable *cancellable, GError **error)
 {
   g_auto (GVariantDict) commit_metadata_builder = OT_VARIANT_BUILDER_INITIALIZER;
 
@@ -5778,10 +6011,69 @@ summary_add_ref_entry (OstreeRepo *self, const char *ref, const char *checksum,
   if (g_variant_lookup (orig_metadata, OSTREE_COMMIT_META_KEY_VERSION, "&s", &version))
     g_variant_dict_insert (&commit_metadata_builder, OSTREE_COMMIT_VERSION, "s", version);
 
-  g_variant_builder_add_value (
-      refs_builder, g_variant_new ("(s(t@ay@a{sv}))", ref, (guint64)g_variant_get_size (commit_obj),
-                                   ostree_checksum_to_bytes_v (checksum),
-                                   g_variant_dict_end (&commit_metadata_builder)));
+  /* Saves clients a request for it; an empty one tells them there is none */
+  if (include_detached_metadata)
+    {
+      g_autoptr (GVariant) detached_metadata = NULL;
+      if (!ostree_repo_read_commit_detached_metadata (self, checksum, &detached_metadata,
+                                                      cancellable, error))
+        return FALSE;
+      if (detached_metadata == NULL)
+        detached_metadata = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("{sv}"),
+                                                                     NULL, 0));
+      g_variant_dict_insert_value (&commit_metadata_builder, OSTREE_COMMIT_DETACHED_METADATA,
+                                   detached_metadata);
+    }
+
+  /* Lets clients pulling with a depth fetch the ancestors in parallel; we stop
+   * early at a parent we don't have, as clients handle a truncated history.
+   */
+  if (ancestor_depth > 0)
+    {
+      g_auto (GVariantBuilder) ancestors_builder = OT_VARIANT_BUILDER_INITIALIZER;
+      g_variant_builder_init (&ancestors_builder, G_VARIANT_TYPE ("aay"));
+      g_autofree char *parent = ostree_commit_get_parent (commit_obj);
+      for (guint i = 0; parent != NULL && i < ancestor_depth; i++)
+        {
+          g_variant_builder_add_value (&ancestors_builder, ostree_checksum_to_bytes_v (parent));
+
+          g_autoptr (GVariant) parent_obj = NULL;
+          if (i + 1 < ancestor_depth
+              && !ostree_repo_load_variant_if_exists (self, OSTREE_OBJECT_TYPE_COMMIT, parent,
+                                                      &parent_obj, error))
+            return FALSE;
+          g_free (parent);
+          parent = (parent_obj != NULL) ? ostree_commit_get_parent (parent_obj) : NULL;
+        }
+      g_variant_dict_insert_value (&commit_metadata_builder, OSTREE_COMMIT_ANCESTORS,
+                                   g_variant_builder_end (&ancestors_builder));
+    }
+
+  return ot_variant_builder_add (refs_builder, error, "(s(t@ay@a{sv}))", ref,
+                                 (guint64)g_variant_get_size (commit_obj),
+                                 ostree_checksum_to_bytes_v (checksum),
+                                 g_variant_dict_end (&commit_metadata_builder));
+}
+
+/* Add the entries of @ref_map (ref ↦ checksum), sorted by ref, to the
+ * currently open `a(s(t@ay@a{sv}))` container of @refs_builder. */
+static gboolean
+summary_add_ref_entries (OstreeRepo *self, GHashTable *ref_map, gboolean include_detached_metadata,
+                         guint ancestor_depth, OtVariantBuilder *refs_builder,
+                         GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GList) ordered_refs = g_hash_table_get_keys (ref_map);
+  ordered_refs = g_list_sort (ordered_refs, (GCompareFunc)strcmp);
+
+  for (GList *iter = ordered_refs; iter != NULL; iter = iter->next)
+    {
+      const char *ref = iter->data;
+      const char *commit = g_hash_table_lookup (ref_map, ref);
+
+      if (!summary_add_ref_entry (self, ref, commit, include_detached_metadata, ancestor_depth,
+                                  refs_builder, cancellable, error))
+        return FALSE;
+    }
 
   return TRUE;
 }
@@ -5881,29 +6173,15 @@ regenerate_metadata (OstreeRepo *self, gboolean do_metadata_commit, GVariant *ad
 
   g_auto (GVariantDict) additional_metadata_builder = OT_VARIANT_BUILDER_INITIALIZER;
   g_variant_dict_init (&additional_metadata_builder, additional_metadata);
-  g_autoptr (GVariantBuilder) refs_builder
-      = g_variant_builder_new (G_VARIANT_TYPE ("a(s(taya{sv}))"));
-
-  {
-    if (main_collection_id == NULL)
-      {
-        g_autoptr (GHashTable) refs = NULL;
-        if (!ostree_repo_list_refs (self, NULL, &refs, cancellable, error))
-          return FALSE;
 
-        g_autoptr (GList) ordered_keys = g_hash_table_get_keys (refs);
-        ordered_keys = g_list_sort (ordered_keys, (GCompareFunc)strcmp);
-
-        for (GList *iter = ordered_keys; iter; iter = iter->next)
-          {
-            const char *ref = iter->data;
-            const char *commit = g_hash_table_lookup (refs, ref);
-
-            if (!summary_add_ref_entry (self, ref, commit, refs_builder, error))
-              return FALSE;
-          }
-      }
-  }
+  /* The refs without a collection; these are only included when the repo
+   * itself has no collection ID. */
+  g_autoptr (GHashTable) refs = NULL;
+  if (main_collection_id == NULL)
+    {
+      if (!ostree_repo_list_refs (self, NULL, &refs, cancellable, error))
+        return FALSE;
+    }
 
   if (!ot_keyfile_get_boolean_with_default (self->config, "core", "no-deltas-in-summary", FALSE,
                                             &no_deltas_in_summary, error))
@@ -5967,20 +6245,53 @@ regenerate_metadata (OstreeRepo *self, gboolean do_metadata_commit, GVariant *ad
   g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_INDEXED_DELTAS,
                                g_variant_new_boolean (TRUE));
 
-  /* Add refs which have a collection specified, which could be in refs/mirrors,
-   * refs/heads, and/or refs/remotes. */
+  gboolean summary_detached_metadata = FALSE;
+  if (!ot_keyfile_get_boolean_with_default (self->config, "core", "summary-detached-metadata",
+                                            FALSE, &summary_detached_metadata, error))
+    return FALSE;
+
+  guint summary_ancestor_depth;
+  {
+    g_autofree char *ancestor_depth_str = NULL;
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "summary-ancestor-depth", "0",
+                                            &ancestor_depth_str, error))
+      return FALSE;
+    guint64 ancestor_depth;
+    if (!g_ascii_string_to_unsigned (ancestor_depth_str, 10, 0, SUMMARY_MAX_ANCESTOR_DEPTH,
+                                     &ancestor_depth, error))
+      return glnx_prefix_error (error, "Invalid summary-ancestor-depth '%s'", ancestor_depth_str);
+    summary_ancestor_depth = ancestor_depth;
+  }
+
   {
-    g_autoptr (GHashTable) collection_refs = NULL;
-    if (!ostree_repo_list_collection_refs (self, NULL, &collection_refs,
-                                           OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable, error))
+    gboolean generate_inventory = FALSE;
+    if (!ot_keyfile_get_boolean_with_default (self->config, "core", "generate-inventory", FALSE,
+                                              &generate_inventory, error))
       return FALSE;
+    if (generate_inventory)
+      {
+        g_autoptr (GVariant) index_digest = NULL;
+        if (!_ostree_repo_write_inventory (self, &index_digest, cancellable, error))
+          return FALSE;
+        g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_INVENTORY,
+                                     index_digest);
+      }
+  }
 
-    gsize collection_map_size = 0;
+  /* Add refs which have a collection specified, which could be in refs/mirrors,
+   * refs/heads, and/or refs/remotes. */
+  g_autoptr (GHashTable) collection_refs = NULL;
+  if (!ostree_repo_list_collection_refs (self, NULL, &collection_refs,
+                                         OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable, error))
+    return FALSE;
+
+  gboolean have_collection_map = FALSE;
+  g_autoptr (GHashTable) collection_map = NULL; /* (element-type utf8 GHashTable) */
+  collection_map
+      = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_hash_table_unref);
+  {
     GHashTableIter iter;
-    g_autoptr (GHashTable) collection_map = NULL; /* (element-type utf8 GHashTable) */
     g_hash_table_iter_init (&iter, collection_refs);
-    collection_map
-        = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_hash_table_unref);
 
     const OstreeCollectionRef *c_ref;
     const char *checksum;
@@ -5995,74 +6306,24 @@ regenerate_metadata (OstreeRepo *self, gboolean do_metadata_commit, GVariant *ad
           }
 
         g_hash_table_insert (ref_map, c_ref->ref_name, (gpointer)checksum);
-      }
-
-    g_autoptr (GVariantBuilder) collection_refs_builder
-        = g_variant_builder_new (G_VARIANT_TYPE ("a{sa(s(taya{sv}))}"));
-
-    g_autoptr (GList) ordered_collection_ids = g_hash_table_get_keys (collection_map);
-    ordered_collection_ids = g_list_sort (ordered_collection_ids, (GCompareFunc)strcmp);
-
-    for (GList *collection_iter = ordered_collection_ids; collection_iter;
-         collection_iter = collection_iter->next)
-      {
-        const char *collection_id = collection_iter->data;
-        GHashTable *ref_map = g_hash_table_lookup (collection_map, collection_id);
 
         /* We put the local repo's collection ID in the main refs map, rather
          * than the collection map, for backwards compatibility. */
-        gboolean is_main_collection_id
-            = (main_collection_id != NULL && g_str_equal (collection_id, main_collection_id));
-
-        if (!is_main_collection_id)
-          {
-            g_variant_builder_open (collection_refs_builder, G_VARIANT_TYPE ("{sa(s(taya{sv}))}"));
-            g_variant_builder_add (collection_refs_builder, "s", collection_id);
-            g_variant_builder_open (collection_refs_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
-          }
-
-        g_autoptr (GList) ordered_refs = g_hash_table_get_keys (ref_map);
-        ordered_refs = g_list_sort (ordered_refs, (GCompareFunc)strcmp);
-
-        for (GList *ref_iter = ordered_refs; ref_iter != NULL; ref_iter = ref_iter->next)
-          {
-            const char *ref = ref_iter->data;
-            const char *commit = g_hash_table_lookup (ref_map, ref);
-            GVariantBuilder *builder
-                = is_main_collection_id ? refs_builder : collection_refs_builder;
-
-            if (!summary_add_ref_entry (self, ref, commit, builder, error))
-              return FALSE;
-
-            if (!is_main_collection_id)
-              collection_map_size++;
-          }
-
-        if (!is_main_collection_id)
-          {
-            g_variant_builder_close (collection_refs_builder); /* array */
-            g_variant_builder_close (collection_refs_builder); /* dict entry */
-          }
+        if (main_collection_id == NULL || !g_str_equal (c_ref->collection_id, main_collection_id))
+          have_collection_map = TRUE;
       }
 
     if (main_collection_id != NULL)
-      g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_COLLECTION_ID,
-                                   g_variant_new_string (main_collection_id));
-    if (collection_map_size > 0)
-      g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_COLLECTION_MAP,
-                                   g_variant_builder_end (collection_refs_builder));
-  }
-
-  g_autoptr (GVariant) summary = NULL;
-  {
-    g_autoptr (GVariantBuilder) summary_builder
-        = g_variant_builder_new (OSTREE_SUMMARY_GVARIANT_FORMAT);
-
-    g_variant_builder_add_value (summary_builder, g_variant_builder_end (refs_builder));
-    g_variant_builder_add_value (summary_builder,
-                                 g_variant_dict_end (&additional_metadata_builder));
-    summary = g_variant_builder_end (summary_builder);
-    g_variant_ref_sink (summary);
+      {
+        g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_COLLECTION_ID,
+                                     g_variant_new_string (main_collection_id));
+
+        refs = g_hash_table_lookup (collection_map, main_collection_id);
+        if (refs != NULL)
+          g_hash_table_ref (refs);
+        else
+          refs = g_hash_table_new (g_str_hash, g_str_equal);
+      }
   }
 
   if (!ostree_repo_static_delta_reindex (self, 0, NULL, cancellable, error))
@@ -6078,10 +6339,98 @@ regenerate_metadata (OstreeRepo *self, gboolean do_metadata_commit, GVariant *ad
     return FALSE;
   g_debug ("Using summary tmpdir %s", summary_tmpdir.path);
 
-  if (!_ostree_repo_file_replace_contents (self, summary_tmpdir.fd, "summary",
-                                           g_variant_get_data (summary),
-                                           g_variant_get_size (summary), cancellable, error))
-    return FALSE;
+  /* The summary is streamed directly into the file rather than built in
+   * memory; for a repo with many refs it can get large, and the in-memory
+   * GVariant would also have to be serialized again. */
+  {
+    g_auto (GLnxTmpfile) summary_tmpf = {
+      0,
+    };
+    if (!glnx_open_tmpfile_linkable_at (summary_tmpdir.fd, ".", O_WRONLY | O_CLOEXEC,
+                                        &summary_tmpf, error))
+      return FALSE;
+
+    g_autoptr (OtVariantBuilder) summary_builder
+        = ot_variant_builder_new (OSTREE_SUMMARY_GVARIANT_FORMAT, summary_tmpf.fd);
+
+    if (!ot_variant_builder_open (summary_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"), error)
+        || !summary_add_ref_entries (self, refs, summary_detached_metadata,
+                                     summary_ancestor_depth, summary_builder, cancellable, error)
+        || !ot_variant_builder_close (summary_builder, error))
+      return FALSE;
+
+    if (!ot_variant_builder_open (summary_builder, G_VARIANT_TYPE_VARDICT, error))
+      return FALSE;
+
+    g_autoptr (GVariant) additional_metadata_v
+        = g_variant_ref_sink (g_variant_dict_end (&additional_metadata_builder));
+    /* Any ostree.summary.collection-map passed in by the caller is replaced */
+    const gsize n_additional_metadata = g_variant_n_children (additional_metadata_v);
+    for (gsize i = 0; i < n_additional_metadata; i++)
+      {
+        g_autoptr (GVariant) entry = g_variant_get_child_value (additional_metadata_v, i);
+        g_autoptr (GVariant) key = g_variant_get_child_value (entry, 0);
+
+        if (have_collection_map
+            && g_str_equal (g_variant_get_string (key, NULL), OSTREE_SUMMARY_COLLECTION_MAP))
+          continue;
+
+        if (!ot_variant_builder_add_value (summary_builder, entry, error))
+          return FALSE;
+      }
+
+    if (have_collection_map)
+      {
+        if (!ot_variant_builder_open (summary_builder, G_VARIANT_TYPE ("{sv}"), error)
+            || !ot_variant_builder_add (summary_builder, error, "s",
+                                        OSTREE_SUMMARY_COLLECTION_MAP)
+            || !ot_variant_builder_open (summary_builder, G_VARIANT_TYPE_VARIANT, error)
+            || !ot_variant_builder_open (summary_builder, G_VARIANT_TYPE ("a{sa(s(taya{sv}))}"),
+                                         error))
+          return FALSE;
+
+        g_autoptr (GList) ordered_collection_ids = g_hash_table_get_keys (collection_map);
+        ordered_collection_ids = g_list_sort (ordered_collection_ids, (GCompareFunc)strcmp);
+
+        for (GList *iter = ordered_collection_ids; iter; iter = iter->next)
+          {
+            const char *collection_id = iter->data;
+            GHashTable *ref_map = g_hash_table_lookup (collection_map, collection_id);
+
+            if (main_collection_id != NULL && g_str_equal (collection_id, main_collection_id))
+              continue;
+
+            if (!ot_variant_builder_open (summary_builder, G_VARIANT_TYPE ("{sa(s(taya{sv}))}"),
+                                          error)
+                || !ot_variant_builder_add (summary_builder, error, "s", collection_id)
+                || !ot_variant_builder_open (summary_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"),
+                                             error)
+                || !summary_add_ref_entries (self, ref_map, summary_detached_metadata,
+                                             summary_ancestor_depth, summary_builder,
+                                             cancellable, error)
+                || !ot_variant_builder_close (summary_builder, error) /* array */
+                || !ot_variant_builder_close (summary_builder, error)) /* dict entry */
+              return FALSE;
+          }
+
+        if (!ot_variant_builder_close (summary_builder, error)    /* map */
+            || !ot_variant_builder_close (summary_builder, error) /* variant */
+            || !ot_variant_builder_close (summary_builder, error)) /* dict entry */
+          return FALSE;
+      }
+
+    if (!ot_variant_builder_close (summary_builder, error)
+        || !ot_variant_builder_end (summary_builder, error))
+      return FALSE;
+
+    if (!self->disable_fsync && fdatasync (summary_tmpf.fd) < 0)
+      return glnx_throw_errno_prefix (error, "fdatasync");
+    if (!glnx_fchmod (summary_tmpf.fd, 0644, error))
+      return FALSE;
+    if (!glnx_link_tmpfile_at (&summary_tmpf, GLNX_LINK_TMPFILE_REPLACE, summary_tmpdir.fd,
+                               "summary", error))
+      return FALSE;
+  }
 
   if (gpg_key_ids != NULL
       && !_ostree_repo_add_gpg_signature_summary_at (
@@ -6400,13 +6749,12 @@ void
 _ostree_repo_memory_cache_ref_init (OstreeRepoMemoryCacheRef *state, OstreeRepo *repo)
 {
   state->repo = g_object_ref (repo);
-  GMutex *lock = &repo->cache_lock;
-  g_mutex_lock (lock);
-  repo->dirmeta_cache_refcount++;
+  g_rw_lock_writer_lock (&repo->dirmeta_cache_lock);
   if (repo->dirmeta_cache == NULL)
     repo->dirmeta_cache
         = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
-  g_mutex_unlock (lock);
+  g_atomic_int_inc (&repo->dirmeta_cache_refcount);
+  g_rw_lock_writer_unlock (&repo->dirmeta_cache_lock);
 }
 
 /* See ostree-repo-private.h for more information about this */
@@ -6414,12 +6762,10 @@ void
 _ostree_repo_memory_cache_ref_destroy (OstreeRepoMemoryCacheRef *state)
 {
   OstreeRepo *repo = state->repo;
-  GMutex *lock = &repo->cache_lock;
-  g_mutex_lock (lock);
-  repo->dirmeta_cache_refcount--;
-  if (repo->dirmeta_cache_refcount == 0)
+  g_rw_lock_writer_lock (&repo->dirmeta_cache_lock);
+  if (g_atomic_int_dec_and_test (&repo->dirmeta_cache_refcount))
     g_clear_pointer (&repo->dirmeta_cache, g_hash_table_unref);
-  g_mutex_unlock (lock);
+  g_rw_lock_writer_unlock (&repo->dirmeta_cache_lock);
   g_object_unref (repo);
 }
 
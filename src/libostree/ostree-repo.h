@@ -290,6 +290,54 @@ _OSTREE_PUBLIC
 void ostree_repo_transaction_set_collection_ref (OstreeRepo *self, const OstreeCollectionRef *ref,
                                                  const char *checksum);
 
+/**
+ * OstreeTransaction:
+ *
+ * A transaction on an #OstreeRepo that can run concurrently with others on the
+ * same instance; see ostree_transaction_new().
+ *
+ * Since: 2024.8
+ */
+typedef struct OstreeTransaction OstreeTransaction;
+
+_OSTREE_PUBLIC
+GType ostree_transaction_get_type (void);
+
+_OSTREE_PUBLIC
+OstreeTransaction *ostree_transaction_new (OstreeRepo *repo, GCancellable *cancellable,
+                                           GError **error);
+
+_OSTREE_PUBLIC
+OstreeTransaction *ostree_transaction_ref (OstreeTransaction *txn);
+
+_OSTREE_PUBLIC
+void ostree_transaction_unref (OstreeTransaction *txn);
+
+_OSTREE_PUBLIC
+OstreeRepo *ostree_transaction_get_repo (OstreeTransaction *txn);
+
+_OSTREE_PUBLIC
+void ostree_transaction_push_thread_default (OstreeTransaction *txn);
+
+_OSTREE_PUBLIC
+void ostree_transaction_pop_thread_default (OstreeTransaction *txn);
+
+_OSTREE_PUBLIC
+void ostree_transaction_set_ref (OstreeTransaction *txn, const char *remote, const char *ref,
+                                 const char *checksum);
+
+_OSTREE_PUBLIC
+void ostree_transaction_set_collection_ref (OstreeTransaction *txn, const OstreeCollectionRef *ref,
+                                            const char *checksum);
+
+_OSTREE_PUBLIC
+gboolean ostree_transaction_commit (OstreeTransaction *txn, OstreeRepoTransactionStats *out_stats,
+                                    GCancellable *cancellable, GError **error);
+
+_OSTREE_PUBLIC
+gboolean ostree_transaction_abort (OstreeTransaction *txn, GCancellable *cancellable,
+                                   GError **error);
+
 _OSTREE_PUBLIC
 gboolean ostree_repo_set_ref_immediate (OstreeRepo *self, const char *remote, const char *ref,
                                         const char *checksum, GCancellable *cancellable,
@@ -1133,6 +1181,9 @@ gboolean ostree_repo_pull_with_options (OstreeRepo *self, const char *remote_nam
                                         GVariant *options, OstreeAsyncProgress *progress,
                                         GCancellable *cancellable, GError **error);
 
+_OSTREE_PUBLIC
+void ostree_repo_set_pull_throttle (OstreeRepo *self, GVariant *options);
+
 _OSTREE_PUBLIC
 void ostree_repo_find_remotes_async (OstreeRepo *self, const OstreeCollectionRef *const *refs,
                                      GVariant *options, OstreeRepoFinder **finders,
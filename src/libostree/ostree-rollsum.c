@@ -28,20 +28,73 @@
 
 #define ROLLSUM_BLOB_MAX (8192 * 4)
 
-static GHashTable *
-rollsum_chunks_crc32 (GBytes *bytes)
+#define ROLLSUM_CHUNK_NONE G_MAXUINT32
+
+typedef struct
+{
+  guint32 crc;
+  guint32 next; /* Next chunk with the same crc, in offset order */
+  guint64 start;
+  guint64 size;
+} RollsumChunk;
+
+/* The chunks of a buffer, in offset order, plus an open-addressed table
+ * mapping each distinct crc to the first chunk carrying it.  Chunks sharing
+ * a crc are chained through RollsumChunk.next.
+ */
+typedef struct
+{
+  GArray *chunks;
+  guint32 *slots; /* Index into chunks of the chain head, or ROLLSUM_CHUNK_NONE */
+  guint32 *tails; /* Index into chunks of the chain tail, parallel to slots */
+  gsize mask;
+} RollsumChunkTable;
+
+static void
+rollsum_chunk_table_clear (RollsumChunkTable *table)
+{
+  g_clear_pointer (&table->chunks, g_array_unref);
+  g_clear_pointer (&table->slots, g_free);
+  g_clear_pointer (&table->tails, g_free);
+}
+
+static inline gsize
+rollsum_slot_for_crc (const RollsumChunkTable *table, guint32 crc)
+{
+  /* The crc is already well distributed, but mix it anyway so that
+   * crafted input can't trivially cluster the low bits.
+   */
+  return (gsize)(crc * 2654435761U) & table->mask;
+}
+
+/* Returns the slot for @crc; it is either empty or holds a chain for @crc. */
+static inline gsize
+rollsum_chunk_table_probe (const RollsumChunkTable *table, guint32 crc)
+{
+  const RollsumChunk *chunks = (RollsumChunk *)table->chunks->data;
+  gsize slot = rollsum_slot_for_crc (table, crc);
+
+  while (table->slots[slot] != ROLLSUM_CHUNK_NONE && chunks[table->slots[slot]].crc != crc)
+    slot = (slot + 1) & table->mask;
+  return slot;
+}
+
+static void
+rollsum_chunks_crc32 (GBytes *bytes, RollsumChunkTable *table)
 {
   gsize start = 0;
   gboolean rollsum_end = FALSE;
-  GHashTable *ret_rollsums = NULL;
   const guint8 *buf;
   gsize buflen;
   gsize remaining;
-
-  ret_rollsums = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_ptr_array_unref);
+  gsize n_slots;
 
   buf = g_bytes_get_data (bytes, &buflen);
 
+  /* Chunks average BUP_BLOBSIZE bytes; this is just a starting size. */
+  table->chunks = g_array_sized_new (FALSE, FALSE, sizeof (RollsumChunk),
+                                     MAX (buflen / BUP_BLOBSIZE, 16));
+
   remaining = buflen;
   while (remaining > 0)
     {
@@ -62,136 +115,109 @@ rollsum_chunks_crc32 (GBytes *bytes)
         offset = MIN (ROLLSUM_BLOB_MAX, remaining);
 
       /* Use zlib's crc32 */
-      {
-        guint32 crc = crc32 (0L, NULL, 0);
-        GVariant *val;
-        GPtrArray *matches;
-
-        crc = crc32 (crc, buf, offset);
-
-        val = g_variant_ref_sink (g_variant_new ("(utt)", crc, (guint64)start, (guint64)offset));
-        matches = g_hash_table_lookup (ret_rollsums, GUINT_TO_POINTER (crc));
-        if (!matches)
-          {
-            matches = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
-            g_hash_table_insert (ret_rollsums, GUINT_TO_POINTER (crc), matches);
-          }
-        g_ptr_array_add (matches, val);
-      }
+      RollsumChunk chunk = { 0, ROLLSUM_CHUNK_NONE, start, offset };
+      /* Note this covers the start of the buffer rather than the chunk, as it
+       * always has; changing it would change the matches, and so the deltas
+       * generated.  Matches are confirmed by comparing the bytes anyway.
+       */
+      chunk.crc = crc32 (crc32 (0L, NULL, 0), buf, offset);
+      g_array_append_val (table->chunks, chunk);
 
       start += offset;
       remaining -= offset;
     }
 
-  return ret_rollsums;
-}
-
-static gint
-compare_matches (const void *app, const void *bpp)
-{
-  GVariant **avpp = (GVariant **)app;
-  GVariant *a = *avpp;
-  GVariant **bvpp = (GVariant **)bpp;
-  GVariant *b = *bvpp;
-  guint64 a_start, b_start;
+  g_assert_cmpuint (table->chunks->len, <, ROLLSUM_CHUNK_NONE);
 
-  g_variant_get_child (a, 2, "t", &a_start);
-  g_variant_get_child (b, 2, "t", &b_start);
+  /* Keep the load factor at or below 1/2 */
+  n_slots = 16;
+  while (n_slots < (gsize)table->chunks->len * 2)
+    n_slots <<= 1;
+  table->mask = n_slots - 1;
+  table->slots = g_new (guint32, n_slots);
+  table->tails = g_new (guint32, n_slots);
+  memset (table->slots, 0xff, n_slots * sizeof (guint32));
 
-  g_assert_cmpint (a_start, !=, b_start);
-
-  if (a_start < b_start)
-    return -1;
-  return 1;
+  RollsumChunk *chunks = (RollsumChunk *)table->chunks->data;
+  for (guint32 i = 0; i < table->chunks->len; i++)
+    {
+      gsize slot = rollsum_chunk_table_probe (table, chunks[i].crc);
+      if (table->slots[slot] == ROLLSUM_CHUNK_NONE)
+        table->slots[slot] = i;
+      else
+        chunks[table->tails[slot]].next = i;
+      table->tails[slot] = i;
+    }
 }
 
 OstreeRollsumMatches *
 _ostree_compute_rollsum_matches (GBytes *from, GBytes *to)
 {
   OstreeRollsumMatches *ret_rollsum = NULL;
-  g_autoptr (GHashTable) from_rollsum = NULL;
-  g_autoptr (GHashTable) to_rollsum = NULL;
-  g_autoptr (GPtrArray) matches = NULL;
+  RollsumChunkTable from_rollsum = { 0, };
+  RollsumChunkTable to_rollsum = { 0, };
   const guint8 *from_buf;
   gsize from_len;
   const guint8 *to_buf;
   gsize to_len;
-  gpointer hkey, hvalue;
-  GHashTableIter hiter;
 
   ret_rollsum = g_new0 (OstreeRollsumMatches, 1);
-
-  matches = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  ret_rollsum->matches = g_array_new (FALSE, FALSE, sizeof (OstreeRollsumMatch));
 
   from_buf = g_bytes_get_data (from, &from_len);
   to_buf = g_bytes_get_data (to, &to_len);
 
-  from_rollsum = rollsum_chunks_crc32 (from);
-  to_rollsum = rollsum_chunks_crc32 (to);
+  rollsum_chunks_crc32 (from, &from_rollsum);
+  rollsum_chunks_crc32 (to, &to_rollsum);
 
-  g_hash_table_iter_init (&hiter, to_rollsum);
-  while (g_hash_table_iter_next (&hiter, &hkey, &hvalue))
+  const RollsumChunk *from_chunks = (RollsumChunk *)from_rollsum.chunks->data;
+  const RollsumChunk *to_chunks = (RollsumChunk *)to_rollsum.chunks->data;
+
+  /* Walking the target chunks in offset order means the matches come out
+   * already sorted by to_start.
+   */
+  for (guint32 i = 0; i < to_rollsum.chunks->len; i++)
     {
-      GPtrArray *to_chunks = hvalue;
-      GPtrArray *from_chunks;
+      const RollsumChunk *to_chunk = &to_chunks[i];
+      gsize from_slot = rollsum_chunk_table_probe (&from_rollsum, to_chunk->crc);
+      guint32 j = from_rollsum.slots[from_slot];
+
+      if (j == ROLLSUM_CHUNK_NONE)
+        continue;
 
-      from_chunks = g_hash_table_lookup (from_rollsum, hkey);
-      if (from_chunks != NULL)
+      /* Count each distinct crc once, on its first target chunk */
+      if (to_rollsum.slots[rollsum_chunk_table_probe (&to_rollsum, to_chunk->crc)] == i)
+        ret_rollsum->crcmatches++;
+
+      for (; j != ROLLSUM_CHUNK_NONE; j = from_chunks[j].next)
         {
-          guint i;
+          const RollsumChunk *from_chunk = &from_chunks[j];
+
+          g_assert (from_chunk->crc == to_chunk->crc);
 
-          ret_rollsum->crcmatches++;
+          /* Same crc32 but different length, skip it.  */
+          if (from_chunk->size != to_chunk->size)
+            continue;
 
-          for (i = 0; i < to_chunks->len; i++)
+          /* Rsync uses a cryptographic checksum, but let's be
+           * very conservative here and just memcmp.
+           */
+          if (memcmp (from_buf + from_chunk->start, to_buf + to_chunk->start, to_chunk->size) == 0)
             {
-              GVariant *to_chunk = to_chunks->pdata[i];
-              guint64 to_start, to_offset;
-              guint32 tocrc;
-              guint j;
-
-              g_variant_get (to_chunk, "(utt)", &tocrc, &to_start, &to_offset);
-
-              for (j = 0; j < from_chunks->len; j++)
-                {
-                  GVariant *from_chunk = from_chunks->pdata[j];
-                  guint32 fromcrc;
-                  guint64 from_start, from_offset;
-
-                  g_variant_get (from_chunk, "(utt)", &fromcrc, &from_start, &from_offset);
-
-                  g_assert (fromcrc == tocrc);
-
-                  /* Same crc32 but different length, skip it.  */
-                  if (to_offset != from_offset)
-                    continue;
-
-                  /* Rsync uses a cryptographic checksum, but let's be
-                   * very conservative here and just memcmp.
-                   */
-                  if (memcmp (from_buf + from_start, to_buf + to_start, to_offset) == 0)
-                    {
-                      GVariant *match
-                          = g_variant_new ("(uttt)", fromcrc, to_offset, to_start, from_start);
-                      ret_rollsum->bufmatches++;
-                      ret_rollsum->match_size += to_offset;
-                      g_ptr_array_add (matches, g_variant_ref_sink (match));
-                      break; /* Don't need any more matches */
-                    }
-                }
+              OstreeRollsumMatch match
+                  = { to_chunk->crc, to_chunk->size, to_chunk->start, from_chunk->start };
+              ret_rollsum->bufmatches++;
+              ret_rollsum->match_size += to_chunk->size;
+              g_array_append_val (ret_rollsum->matches, match);
+              break; /* Don't need any more matches */
             }
         }
-
-      ret_rollsum->total += to_chunks->len;
     }
 
-  g_ptr_array_sort (matches, compare_matches);
+  ret_rollsum->total = to_rollsum.chunks->len;
 
-  ret_rollsum->from_rollsums = from_rollsum;
-  from_rollsum = NULL;
-  ret_rollsum->to_rollsums = to_rollsum;
-  to_rollsum = NULL;
-  ret_rollsum->matches = matches;
-  matches = NULL;
+  rollsum_chunk_table_clear (&from_rollsum);
+  rollsum_chunk_table_clear (&to_rollsum);
 
   return ret_rollsum;
 }
@@ -199,8 +225,6 @@ _ostree_compute_rollsum_matches (GBytes *from, GBytes *to)
 void
 _ostree_rollsum_matches_free (OstreeRollsumMatches *rollsum)
 {
-  g_hash_table_unref (rollsum->to_rollsums);
-  g_hash_table_unref (rollsum->from_rollsums);
-  g_ptr_array_unref (rollsum->matches);
+  g_array_unref (rollsum->matches);
   g_free (rollsum);
 }
@@ -24,15 +24,25 @@
 
 G_BEGIN_DECLS
 
+/* A region of @size bytes at @to_start in the target which is identical to
+ * the region at @from_start in the source.  @crc is the zlib crc32 of the
+ * region.
+ */
+typedef struct
+{
+  guint32 crc;
+  guint64 size;
+  guint64 to_start;
+  guint64 from_start;
+} OstreeRollsumMatch;
+
 typedef struct
 {
-  GHashTable *from_rollsums;
-  GHashTable *to_rollsums;
   guint crcmatches;
   guint bufmatches;
   guint total;
   guint64 match_size;
-  GPtrArray *matches;
+  GArray *matches; /* OstreeRollsumMatch, sorted by to_start */
 } OstreeRollsumMatches;
 
 OstreeRollsumMatches *_ostree_compute_rollsum_matches (GBytes *from, GBytes *to);
@@ -0,0 +1,49 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Statically defined tracepoints (USDT), in the "ostree" provider. These
+ * compile to a single nop plus an ELF note, so they cost nothing unless a
+ * tracer such as bpftrace or perf attaches to them; see docs/tracing.md for
+ * the list and contrib/bpftrace/ for examples. Arguments must be cheap to
+ * compute, since they're evaluated regardless. When <sys/sdt.h> isn't
+ * available, they compile to nothing.
+ *
+ * Strings are passed as `const char *`, and checksums as hex strings where
+ * we have one; (nullable) arguments may be NULL.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define OSTREE_PROBE(name) DTRACE_PROBE (ostree, name)
+#define OSTREE_PROBE1(name, a1) DTRACE_PROBE1 (ostree, name, a1)
+#define OSTREE_PROBE2(name, a1, a2) DTRACE_PROBE2 (ostree, name, a1, a2)
+#define OSTREE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3 (ostree, name, a1, a2, a3)
+#define OSTREE_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4 (ostree, name, a1, a2, a3, a4)
+#else
+#define OSTREE_PROBE(name) \
+  do \
+    { \
+    } \
+  while (0)
+#define OSTREE_PROBE1(name, a1) OSTREE_PROBE (name)
+#define OSTREE_PROBE2(name, a1, a2) OSTREE_PROBE (name)
+#define OSTREE_PROBE3(name, a1, a2, a3) OSTREE_PROBE (name)
+#define OSTREE_PROBE4(name, a1, a2, a3, a4) OSTREE_PROBE (name)
+#endif
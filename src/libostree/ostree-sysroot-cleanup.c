@@ -547,6 +547,9 @@ _ostree_sysroot_cleanup_internal (OstreeSysroot *self, gboolean do_prune_repo,
   if (!_ostree_sysroot_ensure_writable (self, error))
     return FALSE;
 
+  if (!_ostree_sysroot_invalidate_soft_reboot (self, cancellable, error))
+    return FALSE;
+
   if (!cleanup_other_bootversions (self, cancellable, error))
     return glnx_prefix_error (error, "Cleaning bootversions");
 
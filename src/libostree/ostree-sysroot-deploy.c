@@ -23,6 +23,7 @@
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
 #include <glib-unix.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
@@ -488,43 +489,33 @@ copy_modified_config_file (int orig_etc_fd, int modified_etc_fd, int new_etc_fd,
 }
 
 /*
- * merge_configuration_from:
+ * merge_configuration_dirs:
  * @sysroot: Sysroot
- * @merge_deployment: Source of configuration differences
- * @new_deployment: Target for merge of configuration
- * @new_deployment_dfd: Directory fd for @new_deployment (may *not* be -1)
+ * @merge_deployment_dfd: Directory fd for the deployment with configuration differences
+ * @subdir: (nullable): Subdirectory of `/etc` to merge, or %NULL for all of it
+ * @new_dfd: Directory fd for the target of the merge
  * @cancellable: Cancellable
  * @error: Error
  *
- * Compute the difference between @merge_deployment's `/usr/etc` and `/etc`, and
- * apply that to @new_deployment's `/etc`.
+ * Compute the difference between `/usr/etc/@subdir` and `/etc/@subdir` in the
+ * merge deployment, and apply that to @new_dfd.
  *
  * The algorithm for computing the difference is pretty simple; it's
  * approximately equivalent to "diff -unR orig_etc modified_etc",
  * except that rather than attempting a 3-way merge if a file is also
- * changed in @new_etc, the modified version always wins.
+ * changed in @new_dfd, the modified version always wins.
  */
 static gboolean
-merge_configuration_from (OstreeSysroot *sysroot, OstreeDeployment *merge_deployment,
-                          OstreeDeployment *new_deployment, int new_deployment_dfd,
-                          GCancellable *cancellable, GError **error)
+merge_configuration_dirs (OstreeSysroot *sysroot, int merge_deployment_dfd, const char *subdir,
+                          int new_dfd, GCancellable *cancellable, GError **error)
 {
-  GLNX_AUTO_PREFIX_ERROR ("During /etc merge", error);
   const OstreeSysrootDebugFlags flags = sysroot->debug_flags;
-
-  g_assert (merge_deployment != NULL && new_deployment != NULL);
-  g_assert (new_deployment_dfd != -1);
-
-  g_autofree char *merge_deployment_path
-      = ostree_sysroot_get_deployment_dirpath (sysroot, merge_deployment);
-  glnx_autofd int merge_deployment_dfd = -1;
-  if (!glnx_opendirat (sysroot->sysroot_fd, merge_deployment_path, FALSE, &merge_deployment_dfd,
-                       error))
-    return FALSE;
+  const char *orig_path = subdir ? glnx_strjoina ("usr/etc/", subdir) : "usr/etc";
+  const char *modified_path = subdir ? glnx_strjoina ("etc/", subdir) : "etc";
 
   /* TODO: get rid of GFile usage here */
-  g_autoptr (GFile) orig_etc = ot_fdrel_to_gfile (merge_deployment_dfd, "usr/etc");
-  g_autoptr (GFile) modified_etc = ot_fdrel_to_gfile (merge_deployment_dfd, "etc");
+  g_autoptr (GFile) orig_etc = ot_fdrel_to_gfile (merge_deployment_dfd, orig_path);
+  g_autoptr (GFile) modified_etc = ot_fdrel_to_gfile (merge_deployment_dfd, modified_path);
   /* Return values for below */
   g_autoptr (GPtrArray) modified
       = g_ptr_array_new_with_free_func ((GDestroyNotify)ostree_diff_item_unref);
@@ -542,24 +533,26 @@ merge_configuration_from (OstreeSysroot *sysroot, OstreeDeployment *merge_deploy
                          added, cancellable, error))
     return glnx_prefix_error (error, "While computing configuration diff");
 
-  {
-    g_autofree char *msg
-        = g_strdup_printf ("Copying /etc changes: %u modified, %u removed, %u added", modified->len,
-                           removed->len, added->len);
-    ot_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL (OSTREE_CONFIGMERGE_ID),
-                     "MESSAGE=%s", msg, "ETC_N_MODIFIED=%u", modified->len, "ETC_N_REMOVED=%u",
-                     removed->len, "ETC_N_ADDED=%u", added->len, NULL);
-    _ostree_sysroot_emit_journal_msg (sysroot, msg);
-  }
+  /* Only the merge of all of /etc is announced; subdirectories are just
+   * merged ahead of time, see sysroot_stage_selinux_policy().
+   */
+  if (subdir == NULL)
+    {
+      g_autofree char *msg
+          = g_strdup_printf ("Copying /etc changes: %u modified, %u removed, %u added",
+                             modified->len, removed->len, added->len);
+      ot_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
+                       SD_ID128_FORMAT_VAL (OSTREE_CONFIGMERGE_ID), "MESSAGE=%s", msg,
+                       "ETC_N_MODIFIED=%u", modified->len, "ETC_N_REMOVED=%u", removed->len,
+                       "ETC_N_ADDED=%u", added->len, NULL);
+      _ostree_sysroot_emit_journal_msg (sysroot, msg);
+    }
 
   glnx_autofd int orig_etc_fd = -1;
-  if (!glnx_opendirat (merge_deployment_dfd, "usr/etc", TRUE, &orig_etc_fd, error))
+  if (!glnx_opendirat (merge_deployment_dfd, orig_path, TRUE, &orig_etc_fd, error))
     return FALSE;
   glnx_autofd int modified_etc_fd = -1;
-  if (!glnx_opendirat (merge_deployment_dfd, "etc", TRUE, &modified_etc_fd, error))
-    return FALSE;
-  glnx_autofd int new_etc_fd = -1;
-  if (!glnx_opendirat (new_deployment_dfd, "etc", TRUE, &new_etc_fd, error))
+  if (!glnx_opendirat (merge_deployment_dfd, modified_path, TRUE, &modified_etc_fd, error))
     return FALSE;
 
   for (guint i = 0; i < removed->len; i++)
@@ -570,7 +563,7 @@ merge_configuration_from (OstreeSysroot *sysroot, OstreeDeployment *merge_deploy
       path = g_file_get_relative_path (orig_etc, file);
       g_assert (path);
 
-      if (!glnx_shutil_rm_rf_at (new_etc_fd, path, cancellable, error))
+      if (!glnx_shutil_rm_rf_at (new_dfd, path, cancellable, error))
         return FALSE;
     }
 
@@ -581,7 +574,7 @@ merge_configuration_from (OstreeSysroot *sysroot, OstreeDeployment *merge_deploy
 
       g_assert (path);
 
-      if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd, path, flags,
+      if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_dfd, path, flags,
                                       cancellable, error))
         return FALSE;
     }
@@ -592,7 +585,7 @@ merge_configuration_from (OstreeSysroot *sysroot, OstreeDeployment *merge_deploy
 
       g_assert (path);
 
-      if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_etc_fd, path, flags,
+      if (!copy_modified_config_file (orig_etc_fd, modified_etc_fd, new_dfd, path, flags,
                                       cancellable, error))
         return FALSE;
     }
@@ -600,6 +593,43 @@ merge_configuration_from (OstreeSysroot *sysroot, OstreeDeployment *merge_deploy
   return TRUE;
 }
 
+/*
+ * merge_configuration_from:
+ * @sysroot: Sysroot
+ * @merge_deployment: Source of configuration differences
+ * @new_deployment: Target for merge of configuration
+ * @new_deployment_dfd: Directory fd for @new_deployment (may *not* be -1)
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Compute the difference between @merge_deployment's `/usr/etc` and `/etc`, and
+ * apply that to @new_deployment's `/etc`; see merge_configuration_dirs().
+ */
+static gboolean
+merge_configuration_from (OstreeSysroot *sysroot, OstreeDeployment *merge_deployment,
+                          OstreeDeployment *new_deployment, int new_deployment_dfd,
+                          GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("During /etc merge", error);
+
+  g_assert (merge_deployment != NULL && new_deployment != NULL);
+  g_assert (new_deployment_dfd != -1);
+
+  g_autofree char *merge_deployment_path
+      = ostree_sysroot_get_deployment_dirpath (sysroot, merge_deployment);
+  glnx_autofd int merge_deployment_dfd = -1;
+  if (!glnx_opendirat (sysroot->sysroot_fd, merge_deployment_path, FALSE, &merge_deployment_dfd,
+                       error))
+    return FALSE;
+
+  glnx_autofd int new_etc_fd = -1;
+  if (!glnx_opendirat (new_deployment_dfd, "etc", TRUE, &new_etc_fd, error))
+    return FALSE;
+
+  return merge_configuration_dirs (sysroot, merge_deployment_dfd, NULL, new_etc_fd, cancellable,
+                                   error);
+}
+
 /* Look up @revision in the repository, and check it out in
  * /ostree/deploy/OS/deploy/${treecsum}.${deployserial}.
  * A dfd for the result is returned in @out_deployment_dfd.
@@ -2279,10 +2309,11 @@ get_deployment_ostree_version (OstreeRepo *repo, OstreeDeployment *deployment)
  * change.
  *
  * Hence, this function determines if @a and @b are fully compatible from a
- * bootloader perspective.
+ * bootloader perspective; deployment_boots_equal() is the same, except that
+ * it ignores what only shows up in the menu.
  */
 static gboolean
-deployment_bootconfigs_equal (OstreeRepo *repo, OstreeDeployment *a, OstreeDeployment *b)
+deployment_boots_equal (OstreeDeployment *a, OstreeDeployment *b)
 {
   /* same kernel & initramfs? */
   const char *a_bootcsum = ostree_deployment_get_bootcsum (a);
@@ -2300,12 +2331,6 @@ deployment_bootconfigs_equal (OstreeRepo *repo, OstreeDeployment *a, OstreeDeplo
   if (strcmp (a_boot_options_without_ostree, b_boot_options_without_ostree) != 0)
     return FALSE;
 
-  /* same ostree version? this is just for the menutitle, we won't have to cp the kernel */
-  g_autofree char *a_version = get_deployment_ostree_version (repo, a);
-  g_autofree char *b_version = get_deployment_ostree_version (repo, b);
-  if (g_strcmp0 (a_version, b_version) != 0)
-    return FALSE;
-
   /* same stateroot? */
   const char *a_stateroot = ostree_deployment_get_osname (a);
   const char *b_stateroot = ostree_deployment_get_osname (b);
@@ -2315,6 +2340,21 @@ deployment_bootconfigs_equal (OstreeRepo *repo, OstreeDeployment *a, OstreeDeplo
   return TRUE;
 }
 
+static gboolean
+deployment_bootconfigs_equal (OstreeRepo *repo, OstreeDeployment *a, OstreeDeployment *b)
+{
+  if (!deployment_boots_equal (a, b))
+    return FALSE;
+
+  /* same ostree version? this is just for the menutitle, we won't have to cp the kernel */
+  g_autofree char *a_version = get_deployment_ostree_version (repo, a);
+  g_autofree char *b_version = get_deployment_ostree_version (repo, b);
+  if (g_strcmp0 (a_version, b_version) != 0)
+    return FALSE;
+
+  return TRUE;
+}
+
 /* This used to be a temporary hack to create "current" symbolic link
  * that's easy to follow inside the gnome-ostree build scripts (now
  * gnome-continuous).  It wasn't atomic, and nowadays people can use
@@ -2797,6 +2837,9 @@ ostree_sysroot_write_deployments_with_options (OstreeSysroot *self, GPtrArray *n
   if (!_ostree_sysroot_ensure_writable (self, error))
     return FALSE;
 
+  if (!_ostree_sysroot_invalidate_soft_reboot (self, cancellable, error))
+    return FALSE;
+
   const bool skip_early_prune = (self->opt_flags & OSTREE_SYSROOT_GLOBAL_OPT_NO_EARLY_PRUNE) > 0;
   if (!skip_early_prune && !opts->disable_auto_early_prune
       && !auto_early_prune_old_deployments (self, new_deployments, cancellable, error))
@@ -3329,17 +3372,307 @@ _ostree_sysroot_run_in_deployment (int deployment_dfd, const char *const *bwrap_
 }
 
 #ifdef HAVE_SELINUX
+/* Rebuilding the SELinux policy from the module store in /etc after the /etc
+ * merge is slow, so we keep track of its inputs in a key file in the backing
+ * directory of each deployment:
+ *
+ *  - `usr`: the /usr/etc/selinux tree of the commit, i.e. the policy it ships
+ *  - `etc`: fingerprint of /etc/selinux as of the last rebuild
+ *  - `semodule`, `refresh`: the semodule binary, and whether it has --refresh
+ *  - `staged-inputs`: when staging, fingerprint of the /etc/selinux the policy
+ *    in SELINUX_POLICY_STAGED was rebuilt from
+ */
+#define SELINUX_POLICY_STAMP "selinux-policy"
+#define SELINUX_POLICY_STAMP_GROUP "selinux-policy"
+#define SELINUX_POLICY_STAGED "selinux"
+
+/* Like checksum_dir_recurse(), but also covering names, modes and symlinks,
+ * so that any change to the tree shows up.
+ */
+static gboolean
+fingerprint_dir_recurse (int dfd, const char *path, OtChecksum *checksum,
+                         GCancellable *cancellable, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfditer = {
+    0,
+  };
+  g_autoptr (GPtrArray) d_entries = g_ptr_array_new_with_free_func (g_free);
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfditer, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfditer, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      g_ptr_array_add (d_entries, g_strdup (dent->d_name));
+    }
+
+  g_ptr_array_sort (d_entries, str_sort_cb);
+
+  for (guint i = 0; i < d_entries->len; i++)
+    {
+      const gchar *d_name = (gchar *)g_ptr_array_index (d_entries, i);
+      struct stat stbuf;
+
+      if (!glnx_fstatat (dfditer.fd, d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      const guint32 mode = GUINT32_TO_BE (stbuf.st_mode);
+      ot_checksum_update (checksum, (const guint8 *)d_name, strlen (d_name) + 1);
+      ot_checksum_update (checksum, (const guint8 *)&mode, sizeof (mode));
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!fingerprint_dir_recurse (dfditer.fd, d_name, checksum, cancellable, error))
+            return FALSE;
+          /* Can't be part of a name, so it ends the directory unambiguously */
+          ot_checksum_update (checksum, (const guint8 *)"/", 1);
+        }
+      else if (S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *target
+              = glnx_readlinkat_malloc (dfditer.fd, d_name, cancellable, error);
+          if (!target)
+            return FALSE;
+          ot_checksum_update (checksum, (const guint8 *)target, strlen (target) + 1);
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        {
+          const guint64 size = GUINT64_TO_BE (stbuf.st_size);
+          ot_checksum_update (checksum, (const guint8 *)&size, sizeof (size));
+          glnx_autofd int fd = -1;
+          if (!glnx_openat_rdonly (dfditer.fd, d_name, FALSE, &fd, error))
+            return FALSE;
+          if (!ot_checksum_update_fd (checksum, fd, cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static char *
+fingerprint_dir (int dfd, const char *path, GCancellable *cancellable, GError **error)
+{
+  g_auto (OtChecksum) checksum = {
+    0,
+  };
+  ot_checksum_init (&checksum);
+  if (!fingerprint_dir_recurse (dfd, path, &checksum, cancellable, error))
+    return glnx_prefix_error_null (error, "Checksumming %s", path);
+
+  char hexdigest[OSTREE_SHA256_STRING_LEN + 1];
+  ot_checksum_get_hexdigest (&checksum, hexdigest, sizeof (hexdigest));
+  return g_strdup (hexdigest);
+}
+
+/* Return the checksum of the first of @paths in the commit of @deployment which
+ * is of type @ftype; this is cheap, since it's just read from the repo.  If
+ * there's none, or we can't tell, return %NULL, so that nothing is cached.
+ */
+static char *
+get_deployment_path_checksum (OstreeSysroot *sysroot, OstreeDeployment *deployment,
+                              const char *const *paths, GFileType ftype)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GFile) root = NULL;
+  OstreeRepo *repo = ostree_sysroot_repo (sysroot);
+  if (!ostree_repo_read_commit (repo, ostree_deployment_get_csum (deployment), &root, NULL, NULL,
+                                &local_error))
+    {
+      g_debug ("%s", local_error->message);
+      return NULL;
+    }
+
+  for (const char *const *it = paths; it && *it; it++)
+    {
+      g_autoptr (GFile) f = g_file_resolve_relative_path (root, *it);
+      if (g_file_query_file_type (f, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) != ftype)
+        continue;
+
+      OstreeRepoFile *repo_f = (OstreeRepoFile *)f;
+      if (!ostree_repo_file_ensure_resolved (repo_f, &local_error))
+        {
+          g_debug ("%s", local_error->message);
+          return NULL;
+        }
+      if (ftype == G_FILE_TYPE_DIRECTORY)
+        return g_strconcat (ostree_repo_file_tree_get_contents_checksum (repo_f),
+                            ostree_repo_file_tree_get_metadata_checksum (repo_f), NULL);
+      return g_strdup (ostree_repo_file_get_checksum (repo_f));
+    }
+
+  return NULL;
+}
+
+static char *
+get_usr_selinux_policy_checksum (OstreeSysroot *sysroot, OstreeDeployment *deployment)
+{
+  static const char *const paths[] = { "usr/etc/selinux", "etc/selinux", NULL };
+  return get_deployment_path_checksum (sysroot, deployment, paths, G_FILE_TYPE_DIRECTORY);
+}
+
+/* Load the key file described above for @deployment; it's empty if there's none yet */
+static GKeyFile *
+load_selinux_policy_stamp (OstreeSysroot *sysroot, OstreeDeployment *deployment,
+                           GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GKeyFile) stamp = g_key_file_new ();
+  if (deployment == NULL)
+    return g_steal_pointer (&stamp);
+
+  g_autofree char *backing_relpath = _ostree_sysroot_get_deployment_backing_relpath (deployment);
+  g_autofree char *path = g_build_filename (backing_relpath, SELINUX_POLICY_STAMP, NULL);
+  glnx_autofd int fd = -1;
+  if (!ot_openat_ignore_enoent (sysroot->sysroot_fd, path, &fd, error))
+    return NULL;
+  if (fd < 0)
+    return g_steal_pointer (&stamp);
+
+  g_autofree char *contents = glnx_fd_readall_utf8 (fd, NULL, cancellable, error);
+  if (!contents)
+    return NULL;
+  /* It's only a cache, so just start over if it's unreadable */
+  if (!g_key_file_load_from_data (stamp, contents, -1, 0, NULL))
+    g_debug ("Ignoring invalid %s", path);
+
+  return g_steal_pointer (&stamp);
+}
+
+static gboolean
+write_selinux_policy_stamp (OstreeSysroot *sysroot, OstreeDeployment *deployment, GKeyFile *stamp,
+                            GCancellable *cancellable, GError **error)
+{
+  g_autofree char *backing_relpath = _ostree_sysroot_get_deployment_backing_relpath (deployment);
+  if (!glnx_ensure_dir (sysroot->sysroot_fd, backing_relpath, 0700, error))
+    return glnx_prefix_error (error, "Creating backing dir");
+
+  gsize len;
+  g_autofree char *contents = g_key_file_to_data (stamp, &len, error);
+  if (!contents)
+    return FALSE;
+  g_autofree char *path = g_build_filename (backing_relpath, SELINUX_POLICY_STAMP, NULL);
+  return glnx_file_replace_contents_at (sysroot->sysroot_fd, path, (guint8 *)contents, len,
+                                        GLNX_FILE_REPLACE_NODATASYNC, cancellable, error);
+}
+
+/* Determine whether semodule in @deployment supports --refresh.  Probing means
+ * spawning it, so the result is cached in @stamp along with the checksum of the
+ * binary; @merge_stamp is checked for a result for the same binary too.
+ */
+static gboolean
+semodule_has_refresh (OstreeSysroot *sysroot, OstreeDeployment *deployment, int deployment_dfd,
+                      GKeyFile *stamp, GKeyFile *merge_stamp, gboolean *out_has_refresh,
+                      GError **error)
+{
+  static const char *const semodule_paths[] = { "usr/bin/semodule", "usr/sbin/semodule", NULL };
+  g_autofree char *semodule
+      = get_deployment_path_checksum (sysroot, deployment, semodule_paths, G_FILE_TYPE_REGULAR);
+
+  gboolean found = FALSE;
+  GKeyFile *cached[] = { stamp, merge_stamp };
+  for (guint i = 0; semodule != NULL && !found && i < G_N_ELEMENTS (cached); i++)
+    {
+      g_autofree char *cached_semodule
+          = g_key_file_get_string (cached[i], SELINUX_POLICY_STAMP_GROUP, "semodule", NULL);
+      if (g_strcmp0 (cached_semodule, semodule) != 0)
+        continue;
+      g_autoptr (GError) local_error = NULL;
+      gboolean has_refresh = g_key_file_get_boolean (cached[i], SELINUX_POLICY_STAMP_GROUP,
+                                                     "refresh", &local_error);
+      if (local_error == NULL)
+        {
+          *out_has_refresh = has_refresh;
+          found = TRUE;
+        }
+    }
+
+  if (!found)
+    {
+      static const gchar *const SEMODULE_HELP_ARGV[] = { "semodule", "--help", NULL };
+      gint exit_status;
+      g_autofree gchar *stdout = NULL;
+      if (!_ostree_sysroot_run_in_deployment (deployment_dfd, NULL, SEMODULE_HELP_ARGV,
+                                              &exit_status, &stdout, error))
+        return FALSE;
+      if (!g_spawn_check_exit_status (exit_status, error))
+        return glnx_prefix_error (error, "failed to run semodule");
+      *out_has_refresh = strstr (stdout, "--refresh") != NULL;
+    }
+
+  if (semodule != NULL)
+    {
+      g_key_file_set_string (stamp, SELINUX_POLICY_STAMP_GROUP, "semodule", semodule);
+      g_key_file_set_boolean (stamp, SELINUX_POLICY_STAMP_GROUP, "refresh", *out_has_refresh);
+    }
+  return TRUE;
+}
+
+/* Whether the policy compiled when @merge_stamp was written is also what we'd
+ * get now: the /usr policy (@usr_policy), the semodule binary (as recorded in
+ * @stamp by semodule_has_refresh()) and the merged /etc/selinux (@inputs) must
+ * all be the same.
+ */
+static gboolean
+selinux_policy_unchanged_from_merge (GKeyFile *stamp, GKeyFile *merge_stamp,
+                                     const char *usr_policy, const char *inputs)
+{
+  g_autofree char *semodule
+      = g_key_file_get_string (stamp, SELINUX_POLICY_STAMP_GROUP, "semodule", NULL);
+  g_autofree char *merge_semodule
+      = g_key_file_get_string (merge_stamp, SELINUX_POLICY_STAMP_GROUP, "semodule", NULL);
+  g_autofree char *merge_usr_policy
+      = g_key_file_get_string (merge_stamp, SELINUX_POLICY_STAMP_GROUP, "usr", NULL);
+  g_autofree char *merge_etc
+      = g_key_file_get_string (merge_stamp, SELINUX_POLICY_STAMP_GROUP, "etc", NULL);
+
+  return usr_policy != NULL && g_strcmp0 (usr_policy, merge_usr_policy) == 0 && semodule != NULL
+         && g_strcmp0 (semodule, merge_semodule) == 0 && g_str_equal (inputs, merge_etc ?: "");
+}
+
+/* Rebuild the policy from the module store in @deployment_dfd's /etc/selinux,
+ * or @selinux_dir (relative to the deployment) if set.
+ */
+static gboolean
+run_semodule_refresh (int deployment_dfd, const char *selinux_dir, GError **error)
+{
+  static const gchar *const SEMODULE_REBUILD_ARGV[] = { "semodule", "-N", "--refresh", NULL };
+  const gchar *const bind_argv[] = { "--bind", selinux_dir, "/etc/selinux", NULL };
+  gint exit_status;
+
+  ot_journal_print (LOG_INFO, "Refreshing SELinux policy");
+  guint64 start_msec = g_get_monotonic_time () / 1000;
+  if (!_ostree_sysroot_run_in_deployment (deployment_dfd, selinux_dir ? bind_argv : NULL,
+                                          SEMODULE_REBUILD_ARGV, &exit_status, NULL, error))
+    return FALSE;
+  guint64 end_msec = g_get_monotonic_time () / 1000;
+  ot_journal_print (LOG_INFO, "Refreshed SELinux policy in %" G_GUINT64_FORMAT " ms",
+                    end_msec - start_msec);
+  return g_spawn_check_exit_status (exit_status, error);
+}
+
 /*
  * Run semodule to check if the module content changed after merging /etc
- * and rebuild the policy if needed.
+ * and rebuild the policy if needed.  This is skipped if the merged
+ * /etc/selinux, the /usr policy and semodule are the same as when the merge
+ * deployment was finalized, since the /etc merge then already carried over its rebuilt
+ * policy; and if it matches what we rebuilt ahead of time when staging, that
+ * is used.
  */
 static gboolean
-sysroot_finalize_selinux_policy (int deployment_dfd, GError **error)
+sysroot_finalize_selinux_policy (OstreeSysroot *self, OstreeDeployment *deployment,
+                                 OstreeDeployment *merge_deployment, int deployment_dfd,
+                                 GCancellable *cancellable, GError **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("Finalizing SELinux policy", error);
   struct stat stbuf;
-  gint exit_status;
-  g_autofree gchar *stdout = NULL;
 
   if (!glnx_fstatat_allow_noent (deployment_dfd, "etc/selinux/config", &stbuf, AT_SYMLINK_NOFOLLOW,
                                  error))
@@ -3349,33 +3682,181 @@ sysroot_finalize_selinux_policy (int deployment_dfd, GError **error)
   if (errno != 0)
     return TRUE;
 
+  g_autoptr (GKeyFile) stamp = load_selinux_policy_stamp (self, deployment, cancellable, error);
+  if (!stamp)
+    return FALSE;
+  g_autoptr (GKeyFile) merge_stamp
+      = load_selinux_policy_stamp (self, merge_deployment, cancellable, error);
+  if (!merge_stamp)
+    return FALSE;
+
   /*
    * Skip the SELinux policy refresh if the --refresh
    * flag is not supported by semodule.
    */
-  static const gchar *const SEMODULE_HELP_ARGV[] = { "semodule", "--help", NULL };
-  if (!_ostree_sysroot_run_in_deployment (deployment_dfd, NULL, SEMODULE_HELP_ARGV, &exit_status,
-                                          &stdout, error))
+  gboolean has_refresh;
+  if (!semodule_has_refresh (self, deployment, deployment_dfd, stamp, merge_stamp, &has_refresh,
+                             error))
     return FALSE;
-  if (!g_spawn_check_exit_status (exit_status, error))
-    return glnx_prefix_error (error, "failed to run semodule");
-  if (!strstr (stdout, "--refresh"))
+  if (!has_refresh)
     {
       ot_journal_print (LOG_INFO, "semodule does not have --refresh");
-      return TRUE;
+      return write_selinux_policy_stamp (self, deployment, stamp, cancellable, error);
     }
 
-  static const gchar *const SEMODULE_REBUILD_ARGV[] = { "semodule", "-N", "--refresh", NULL };
+  g_autofree char *usr_policy = get_usr_selinux_policy_checksum (self, deployment);
+  g_autofree char *inputs = fingerprint_dir (deployment_dfd, "etc/selinux", cancellable, error);
+  if (!inputs)
+    return FALSE;
+  g_autofree char *staged_inputs
+      = g_key_file_get_string (stamp, SELINUX_POLICY_STAMP_GROUP, "staged-inputs", NULL);
 
-  ot_journal_print (LOG_INFO, "Refreshing SELinux policy");
-  guint64 start_msec = g_get_monotonic_time () / 1000;
-  if (!_ostree_sysroot_run_in_deployment (deployment_dfd, NULL, SEMODULE_REBUILD_ARGV, &exit_status,
-                                          NULL, error))
+  g_autofree char *backing_relpath = _ostree_sysroot_get_deployment_backing_relpath (deployment);
+  g_autofree char *staged_path = g_build_filename (backing_relpath, SELINUX_POLICY_STAGED, NULL);
+  if (!glnx_fstatat_allow_noent (self->sysroot_fd, staged_path, &stbuf, AT_SYMLINK_NOFOLLOW,
+                                 error))
     return FALSE;
-  guint64 end_msec = g_get_monotonic_time () / 1000;
-  ot_journal_print (LOG_INFO, "Refreshed SELinux policy in %" G_GUINT64_FORMAT " ms",
-                    end_msec - start_msec);
-  return g_spawn_check_exit_status (exit_status, error);
+  const gboolean have_staged = errno == 0;
+
+  if (selinux_policy_unchanged_from_merge (stamp, merge_stamp, usr_policy, inputs))
+    {
+      ot_journal_print (LOG_INFO, "SELinux policy unchanged from merge deployment");
+    }
+  else if (have_staged && g_str_equal (inputs, staged_inputs ?: ""))
+    {
+      ot_journal_print (LOG_INFO, "Using SELinux policy rebuilt when staging");
+      if (!glnx_shutil_rm_rf_at (deployment_dfd, "etc/selinux", cancellable, error))
+        return FALSE;
+      g_autofree char *deployment_path = ostree_sysroot_get_deployment_dirpath (self, deployment);
+      g_autofree char *dest_path = g_build_filename (deployment_path, "etc/selinux", NULL);
+      if (!glnx_renameat (self->sysroot_fd, staged_path, self->sysroot_fd, dest_path, error))
+        return FALSE;
+
+      /* semodule wrote it outside of /etc, so fix up the labels */
+      g_autoptr (OstreeSePolicy) sepolicy
+          = ostree_sepolicy_new_at (deployment_dfd, cancellable, error);
+      if (!sepolicy)
+        return FALSE;
+      g_autoptr (GFile) selinux_dir = ot_fdrel_to_gfile (deployment_dfd, "etc/selinux");
+      if (!selinux_relabel_dir (self, sepolicy, selinux_dir, "etc/selinux", cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      if (!run_semodule_refresh (deployment_dfd, NULL, error))
+        return FALSE;
+    }
+
+  if (!glnx_shutil_rm_rf_at (self->sysroot_fd, staged_path, cancellable, error))
+    return FALSE;
+
+  g_autofree char *etc = fingerprint_dir (deployment_dfd, "etc/selinux", cancellable, error);
+  if (!etc)
+    return FALSE;
+  g_key_file_set_string (stamp, SELINUX_POLICY_STAMP_GROUP, "etc", etc);
+  if (usr_policy != NULL)
+    g_key_file_set_string (stamp, SELINUX_POLICY_STAMP_GROUP, "usr", usr_policy);
+  (void)g_key_file_remove_key (stamp, SELINUX_POLICY_STAMP_GROUP, "staged-inputs", NULL);
+  return write_selinux_policy_stamp (self, deployment, stamp, cancellable, error);
+}
+
+/* Rebuild the SELinux policy of a staged deployment when it's staged, rather
+ * than at shutdown.  Since the /etc merge only happens then, we do the merge of
+ * /etc/selinux now on a copy in the backing directory, and rebuild the policy
+ * there; sysroot_finalize_selinux_policy() uses it if /etc/selinux ends up the
+ * same, which it does unless the configuration changes in the meantime.
+ */
+static gboolean
+sysroot_stage_selinux_policy (OstreeSysroot *self, OstreeDeployment *deployment,
+                              OstreeDeployment *merge_deployment, GCancellable *cancellable,
+                              GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Rebuilding SELinux policy", error);
+  struct stat stbuf;
+
+  g_autofree char *deployment_path = ostree_sysroot_get_deployment_dirpath (self, deployment);
+  glnx_autofd int deployment_dfd = -1;
+  if (!glnx_opendirat (self->sysroot_fd, deployment_path, TRUE, &deployment_dfd, error))
+    return FALSE;
+  g_autofree char *merge_deployment_path
+      = ostree_sysroot_get_deployment_dirpath (self, merge_deployment);
+  glnx_autofd int merge_deployment_dfd = -1;
+  if (!glnx_opendirat (self->sysroot_fd, merge_deployment_path, TRUE, &merge_deployment_dfd,
+                       error))
+    return FALSE;
+
+  /* Leave anything out of the ordinary to finalization */
+  const char *const required[][2] = { { "etc/selinux/config", NULL },
+                                      { "usr/etc/selinux", "etc/selinux" } };
+  for (guint i = 0; i < G_N_ELEMENTS (required); i++)
+    {
+      int dfd = i == 0 ? deployment_dfd : merge_deployment_dfd;
+      for (guint j = 0; j < 2 && required[i][j]; j++)
+        {
+          if (!glnx_fstatat_allow_noent (dfd, required[i][j], &stbuf, AT_SYMLINK_NOFOLLOW, error))
+            return FALSE;
+          if (errno != 0)
+            return TRUE;
+        }
+    }
+
+  g_autoptr (GKeyFile) stamp = g_key_file_new ();
+  g_autoptr (GKeyFile) merge_stamp
+      = load_selinux_policy_stamp (self, merge_deployment, cancellable, error);
+  if (!merge_stamp)
+    return FALSE;
+
+  gboolean has_refresh;
+  if (!semodule_has_refresh (self, deployment, deployment_dfd, stamp, merge_stamp, &has_refresh,
+                             error))
+    return FALSE;
+  if (!has_refresh)
+    return write_selinux_policy_stamp (self, deployment, stamp, cancellable, error);
+
+  g_autofree char *backing_relpath = _ostree_sysroot_get_deployment_backing_relpath (deployment);
+  if (!glnx_ensure_dir (self->sysroot_fd, backing_relpath, 0700, error))
+    return glnx_prefix_error (error, "Creating backing dir");
+  glnx_autofd int backing_dfd = -1;
+  if (!glnx_opendirat (self->sysroot_fd, backing_relpath, TRUE, &backing_dfd, error))
+    return FALSE;
+  glnx_autofd int etc_dfd = -1;
+  if (!glnx_opendirat (deployment_dfd, "etc", TRUE, &etc_dfd, error))
+    return FALSE;
+
+  if (!glnx_shutil_rm_rf_at (backing_dfd, SELINUX_POLICY_STAGED, cancellable, error))
+    return FALSE;
+  if (!copy_dir_recurse (etc_dfd, backing_dfd, SELINUX_POLICY_STAGED, self->debug_flags,
+                         cancellable, error))
+    return FALSE;
+  glnx_autofd int staged_dfd = -1;
+  if (!glnx_opendirat (backing_dfd, SELINUX_POLICY_STAGED, TRUE, &staged_dfd, error))
+    return FALSE;
+  if (!merge_configuration_dirs (self, merge_deployment_dfd, "selinux", staged_dfd, cancellable,
+                                 error))
+    return FALSE;
+
+  g_autofree char *inputs
+      = fingerprint_dir (backing_dfd, SELINUX_POLICY_STAGED, cancellable, error);
+  if (!inputs)
+    return FALSE;
+
+  /* Would finalization find nothing to do?  See sysroot_finalize_selinux_policy(). */
+  g_autofree char *usr_policy = get_usr_selinux_policy_checksum (self, deployment);
+  if (selinux_policy_unchanged_from_merge (stamp, merge_stamp, usr_policy, inputs))
+    {
+      if (!glnx_shutil_rm_rf_at (backing_dfd, SELINUX_POLICY_STAGED, cancellable, error))
+        return FALSE;
+      return write_selinux_policy_stamp (self, deployment, stamp, cancellable, error);
+    }
+
+  /* bwrap runs in the deployment, which is next to the backing directory */
+  g_autofree char *staged_relpath = g_strconcat ("../../backing/", glnx_basename (backing_relpath),
+                                                 "/" SELINUX_POLICY_STAGED, NULL);
+  if (!run_semodule_refresh (deployment_dfd, staged_relpath, error))
+    return FALSE;
+
+  g_key_file_set_string (stamp, SELINUX_POLICY_STAMP_GROUP, "staged-inputs", inputs);
+  return write_selinux_policy_stamp (self, deployment, stamp, cancellable, error);
 }
 #endif /* HAVE_SELINUX */
 
@@ -3457,7 +3938,8 @@ sysroot_finalize_deployment (OstreeSysroot *self, OstreeDeployment *deployment,
         return FALSE;
 
 #ifdef HAVE_SELINUX
-      if (!sysroot_finalize_selinux_policy (deployment_dfd, error))
+      if (!sysroot_finalize_selinux_policy (self, deployment, merge_deployment, deployment_dfd,
+                                            cancellable, error))
         return FALSE;
 #endif /* HAVE_SELINUX */
     }
@@ -3751,6 +4233,9 @@ ostree_sysroot_stage_tree_with_options (OstreeSysroot *self, const char *osname,
   if (booted_deployment == NULL)
     return glnx_prefix_error (error, "Cannot stage deployment");
 
+  if (!_ostree_sysroot_invalidate_soft_reboot (self, cancellable, error))
+    return FALSE;
+
   g_autoptr (OstreeDeployment) deployment = NULL;
   if (!sysroot_initialize_deployment (self, osname, revision, origin, opts, &deployment,
                                       cancellable, error))
@@ -3775,6 +4260,17 @@ ostree_sysroot_stage_tree_with_options (OstreeSysroot *self, const char *osname,
       return FALSE;
   }
 
+#ifdef HAVE_SELINUX
+  /* This is only to save time at shutdown, so don't fail staging over it */
+  if (merge_deployment)
+    {
+      g_autoptr (GError) local_error = NULL;
+      if (!sysroot_stage_selinux_policy (self, deployment, merge_deployment, cancellable,
+                                         &local_error))
+        ot_journal_print (LOG_WARNING, "%s", local_error->message);
+    }
+#endif /* HAVE_SELINUX */
+
   /* After here we defer action until shutdown. The remaining arguments (merge
    * deployment, kargs) are serialized to a state file in /run.
    */
@@ -3903,6 +4399,156 @@ ostree_sysroot_change_finalization (OstreeSysroot *self, OstreeDeployment *deplo
   return TRUE;
 }
 
+/**
+ * ostree_sysroot_deployment_can_soft_reboot:
+ * @self: Sysroot
+ * @deployment: Deployment
+ *
+ * Determine whether the booted system can switch to @deployment with a soft
+ * reboot, i.e. only restarting userspace.  That's the case if it boots with
+ * the same kernel, initramfs and kernel arguments as the booted deployment,
+ * and shares its stateroot.
+ *
+ * Returns: %TRUE if @deployment can be soft rebooted into
+ * Since: 2024.8
+ */
+gboolean
+ostree_sysroot_deployment_can_soft_reboot (OstreeSysroot *self, OstreeDeployment *deployment)
+{
+  OstreeDeployment *booted_deployment = ostree_sysroot_get_booted_deployment (self);
+  if (booted_deployment == NULL)
+    return FALSE;
+  if (ostree_deployment_equal (booted_deployment, deployment))
+    return FALSE;
+
+  return deployment_boots_equal (booted_deployment, deployment);
+}
+
+/* Child setup for ostree-prepare-root --soft-reboot; the root it prepares
+ * must be set up in the mount namespace the soft reboot happens in, and not
+ * in e.g. the private one from ostree_sysroot_initialize_with_mount_namespace(),
+ * where /sysroot has been made writable.
+ */
+static void
+enter_pid1_mount_namespace (gpointer user_data)
+{
+  int fd = open ("/proc/1/ns/mnt", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      perror ("open(/proc/1/ns/mnt)");
+      _exit (1);
+    }
+  if (setns (fd, CLONE_NEWNS) < 0)
+    {
+      perror ("setns(CLONE_NEWNS)");
+      _exit (1);
+    }
+  (void)close (fd);
+}
+
+/**
+ * ostree_sysroot_deployment_set_soft_reboot:
+ * @self: Sysroot
+ * @deployment: Deployment, which must be the next one to boot
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Prepare @deployment as the root for the next `systemctl soft-reboot`, by
+ * running `ostree-prepare-root --soft-reboot`.  This replaces any previously
+ * prepared one.  It's an error if ostree_sysroot_deployment_can_soft_reboot()
+ * returns %FALSE for @deployment.
+ *
+ * @deployment must be the staged deployment or the default one, so that the
+ * system comes back to it on a full reboot too.  Changing the deployments
+ * afterwards clears the prepared root, and this should be called again.
+ *
+ * Since: 2024.8
+ */
+gboolean
+ostree_sysroot_deployment_set_soft_reboot (OstreeSysroot *self, OstreeDeployment *deployment,
+                                           GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Preparing soft reboot", error);
+
+  if (!ostree_sysroot_require_booted_deployment (self, error))
+    return FALSE;
+  if (!ostree_sysroot_deployment_can_soft_reboot (self, deployment))
+    return glnx_throw (error, "Deployment %s.%d requires a full reboot",
+                       ostree_deployment_get_csum (deployment),
+                       ostree_deployment_get_deployserial (deployment));
+
+  GPtrArray *deployments = ostree_sysroot_get_deployments (self);
+  if (deployments->len == 0 || !ostree_deployment_equal (deployments->pdata[0], deployment))
+    return glnx_throw (error, "Deployment %s.%d is not the default deployment",
+                       ostree_deployment_get_csum (deployment),
+                       ostree_deployment_get_deployserial (deployment));
+
+  if (!ostree_sysroot_clear_soft_reboot (self, cancellable, error))
+    return FALSE;
+
+  /* The physical root of the booted system is always at /sysroot */
+  g_autofree char *deployment_path = ostree_sysroot_get_deployment_dirpath (self, deployment);
+  const char *const prepare_root_argv[] = { OSTREE_BOOTDIR "/ostree-prepare-root",
+                                            "--soft-reboot", "/sysroot", deployment_path, NULL };
+  int estatus;
+  if (!g_spawn_sync ("/", (char **)prepare_root_argv, NULL, 0, enter_pid1_mount_namespace, NULL,
+                     NULL, NULL, &estatus, error))
+    return FALSE;
+  if (!g_spawn_check_exit_status (estatus, error))
+    {
+      /* Don't leave anything half set up behind */
+      (void)ostree_sysroot_clear_soft_reboot (self, cancellable, NULL);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * ostree_sysroot_clear_soft_reboot:
+ * @self: Sysroot
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Undo ostree_sysroot_deployment_set_soft_reboot(), so that a soft reboot
+ * restarts userspace in the booted deployment again.  It's not an error if
+ * there's nothing to undo.
+ *
+ * Since: 2024.8
+ */
+gboolean
+ostree_sysroot_clear_soft_reboot (OstreeSysroot *self, GCancellable *cancellable, GError **error)
+{
+  /* This detaches the submounts too */
+  if (umount2 (OTCORE_RUN_NEXTROOT, MNT_DETACH) < 0 && errno != EINVAL && errno != ENOENT)
+    return glnx_throw_errno_prefix (error, "umount(%s)", OTCORE_RUN_NEXTROOT);
+  if (!ot_ensure_unlinked_at (AT_FDCWD, OTCORE_RUN_NEXTROOT_BOOTED, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Drop the root prepared by ostree_sysroot_deployment_set_soft_reboot(), as
+ * it may not be what the next boot uses anymore once the deployments change.
+ * Finalizing a staged deployment is the exception: it happens while the old
+ * userspace shuts down for the very soft reboot that was prepared.
+ */
+gboolean
+_ostree_sysroot_invalidate_soft_reboot (OstreeSysroot *self, GCancellable *cancellable,
+                                        GError **error)
+{
+  if (self->booted_deployment == NULL || self->finalizing_staged)
+    return TRUE;
+
+  if (!glnx_fstatat_allow_noent (AT_FDCWD, OTCORE_RUN_NEXTROOT_BOOTED, NULL, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    return TRUE;
+
+  ot_journal_print (LOG_INFO, "Deployments changed, clearing prepared soft reboot");
+  return ostree_sysroot_clear_soft_reboot (self, cancellable, error);
+}
+
 /* Invoked at shutdown time by ostree-finalize-staged.service */
 static gboolean
 _ostree_sysroot_finalize_staged_inner (OstreeSysroot *self, GCancellable *cancellable,
@@ -4024,9 +4670,17 @@ _ostree_sysroot_finalize_staged (OstreeSysroot *self, GCancellable *cancellable,
   g_autoptr (GError) finalization_error = NULL;
   if (!_ostree_sysroot_ensure_boot_fd (self, error))
     return FALSE;
-  if (!_ostree_sysroot_finalize_staged_inner (self, cancellable, &finalization_error))
+  self->finalizing_staged = TRUE;
+  gboolean finalized
+      = _ostree_sysroot_finalize_staged_inner (self, cancellable, &finalization_error);
+  self->finalizing_staged = FALSE;
+  if (!finalized)
     {
       g_autoptr (GError) writing_error = NULL;
+      g_autoptr (GError) soft_reboot_error = NULL;
+      /* Don't soft reboot into a deployment we failed to finalize */
+      if (!_ostree_sysroot_invalidate_soft_reboot (self, cancellable, &soft_reboot_error))
+        g_printerr ("Failed to clear soft reboot: %s\n", soft_reboot_error->message);
       g_assert_cmpint (self->boot_fd, !=, -1);
       if (!glnx_file_replace_contents_at (self->boot_fd, _OSTREE_FINALIZE_STAGED_FAILURE_PATH,
                                           (guint8 *)finalization_error->message, -1, 0, cancellable,
@@ -85,6 +85,8 @@ struct OstreeSysroot
   OstreeDeployment *booted_deployment;
   OstreeDeployment *staged_deployment;
   GVariant *staged_deployment_data;
+  // True while ostree-finalize-staged writes out the staged deployment
+  gboolean finalizing_staged;
   // True if loaded_ts is initialized
   gboolean has_loaded;
   struct timespec loaded_ts;
@@ -140,6 +142,8 @@ gboolean _ostree_sysroot_reload_staged (OstreeSysroot *self, GError **error);
 
 gboolean _ostree_sysroot_finalize_staged (OstreeSysroot *self, GCancellable *cancellable,
                                           GError **error);
+gboolean _ostree_sysroot_invalidate_soft_reboot (OstreeSysroot *self, GCancellable *cancellable,
+                                                 GError **error);
 gboolean _ostree_sysroot_boot_complete (OstreeSysroot *self, GCancellable *cancellable,
                                         GError **error);
 
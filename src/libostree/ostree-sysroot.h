@@ -222,6 +222,19 @@ _OSTREE_PUBLIC
 gboolean ostree_sysroot_change_finalization (OstreeSysroot *self, OstreeDeployment *deployment,
                                              GError **error);
 
+_OSTREE_PUBLIC
+gboolean ostree_sysroot_deployment_can_soft_reboot (OstreeSysroot *self,
+                                                    OstreeDeployment *deployment);
+
+_OSTREE_PUBLIC
+gboolean ostree_sysroot_deployment_set_soft_reboot (OstreeSysroot *self,
+                                                    OstreeDeployment *deployment,
+                                                    GCancellable *cancellable, GError **error);
+
+_OSTREE_PUBLIC
+gboolean ostree_sysroot_clear_soft_reboot (OstreeSysroot *self, GCancellable *cancellable,
+                                           GError **error);
+
 _OSTREE_PUBLIC
 gboolean ostree_sysroot_deployment_set_mutable (OstreeSysroot *self, OstreeDeployment *deployment,
                                                 gboolean is_mutable, GCancellable *cancellable,
@@ -106,3 +106,10 @@ ComposefsConfig *otcore_load_composefs_config (const char *cmdline, GKeyFile *co
 #define OTCORE_RUN_BOOTED_KEY_BACKING_ROOTDEVINO "backing-root-device-inode"
 
 #define OTCORE_RUN_BOOTED_KEY_TRANSIENT_ETC "transient-etc"
+
+// Where systemd looks for the root to switch to on `systemctl soft-reboot`;
+// set up by `ostree-prepare-root --soft-reboot`.
+#define OTCORE_RUN_NEXTROOT "/run/nextroot"
+// The OTCORE_RUN_BOOTED metadata for the root in OTCORE_RUN_NEXTROOT; ostree-remount
+// moves it into place once we've switched to it.
+#define OTCORE_RUN_NEXTROOT_BOOTED OTCORE_RUN_OSTREE "/nextroot-booted"
@@ -29,6 +29,7 @@
 #include <gnutls/gnutls.h>
 #endif
 
+#include <gio/gfiledescriptorbased.h>
 #include <string.h>
 
 void
@@ -189,13 +190,51 @@ ot_gio_write_update_checksum (GOutputStream *out, gconstpointer data, gsize len,
   return TRUE;
 }
 
+/* Size of the read buffer used by ot_checksum_update_fd(); like coreutils
+ * (see ioblksize.h there), we've found 128KiB to be a good tradeoff between
+ * syscall overhead and cache usage.
+ */
+#define OT_CHECKSUM_FD_BUFSIZE (128 * 1024)
+
+/* Feed everything from the current offset of @fd up to EOF into @checksum,
+ * reading directly into one large buffer.
+ */
+gboolean
+ot_checksum_update_fd (OtChecksum *checksum, int fd, GCancellable *cancellable, GError **error)
+{
+  (void)posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  g_autofree guint8 *buf = g_malloc (OT_CHECKSUM_FD_BUFSIZE);
+  while (TRUE)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      ssize_t bytes_read = TEMP_FAILURE_RETRY (read (fd, buf, OT_CHECKSUM_FD_BUFSIZE));
+      if (bytes_read < 0)
+        return glnx_throw_errno_prefix (error, "read");
+      if (bytes_read == 0)
+        break;
+      ot_checksum_update (checksum, buf, bytes_read);
+    }
+
+  return TRUE;
+}
+
 gboolean
 ot_gio_splice_update_checksum (GOutputStream *out, GInputStream *in, OtChecksum *checksum,
                                GCancellable *cancellable, GError **error)
 {
   g_return_val_if_fail (out != NULL || checksum != NULL, FALSE);
 
-  if (checksum != NULL)
+  /* Unbuffered fd-backed streams (GUnixInputStream, GLocalFileInputStream)
+   * share their offset with the fd, so we can bypass the stream entirely.
+   */
+  if (out == NULL && G_IS_FILE_DESCRIPTOR_BASED (in))
+    return ot_checksum_update_fd (checksum,
+                                  g_file_descriptor_based_get_fd ((GFileDescriptorBased *)in),
+                                  cancellable, error);
+  else if (checksum != NULL)
     {
       gsize bytes_read, bytes_written;
       char buf[4096];
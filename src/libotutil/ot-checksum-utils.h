@@ -62,6 +62,9 @@ void ot_checksum_get_hexdigest (OtChecksum *checksum, char *buf, size_t buflen);
 void ot_checksum_clear (OtChecksum *checksum);
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (OtChecksum, ot_checksum_clear)
 
+gboolean ot_checksum_update_fd (OtChecksum *checksum, int fd, GCancellable *cancellable,
+                                GError **error);
+
 gboolean ot_gio_write_update_checksum (GOutputStream *out, gconstpointer data, gsize len,
                                        gsize *out_bytes_written, OtChecksum *checksum,
                                        GCancellable *cancellable, GError **error);
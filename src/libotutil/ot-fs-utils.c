@@ -277,3 +277,96 @@ ot_get_dir_size (int dfd, const char *path, guint64 blocksize, guint64 *out_size
 
   return TRUE;
 }
+
+/* Set @out_has_holes to whether the @len bytes of @fd starting at its
+ * current offset contain any holes, i.e. whether it's a sparse file. The
+ * file offset is left unchanged. Filesystems without SEEK_HOLE support
+ * report no holes.
+ */
+gboolean
+ot_fd_has_holes (int fd, off_t len, gboolean *out_has_holes, GError **error)
+{
+  *out_has_holes = FALSE;
+
+  off_t cur = lseek (fd, 0, SEEK_CUR);
+  if (cur < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+
+  off_t hole = lseek (fd, cur, SEEK_HOLE);
+  if (hole < 0)
+    {
+      if (errno != EINVAL && errno != ENXIO)
+        return glnx_throw_errno_prefix (error, "lseek(SEEK_HOLE)");
+    }
+  else
+    *out_has_holes = hole < cur + len;
+
+  if (lseek (fd, cur, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+
+  return TRUE;
+}
+
+/* Copy the first @len bytes (or everything, if @len is -1) of @src_fd to
+ * the start of @dest_fd, preserving holes: only the data extents found
+ * with SEEK_DATA/SEEK_HOLE are copied, and the rest is left unallocated.
+ * Files which are fully allocated (the common case), or filesystems which
+ * don't support this, go through glnx_regfile_copy_bytes() as usual, so
+ * that whole-file copies can still be reflinked.
+ */
+gboolean
+ot_regfile_copy_sparse (int src_fd, int dest_fd, off_t len, GError **error)
+{
+  struct stat stbuf;
+  if (!glnx_fstat (src_fd, &stbuf, error))
+    return FALSE;
+
+  if ((off_t)stbuf.st_blocks * 512 >= stbuf.st_size)
+    {
+      if (glnx_regfile_copy_bytes (src_fd, dest_fd, len) < 0)
+        return glnx_throw_errno_prefix (error, "regfile copy");
+      return TRUE;
+    }
+
+  if (len < 0)
+    len = stbuf.st_size;
+
+  off_t offset = 0;
+  while (offset < len)
+    {
+      off_t data = lseek (src_fd, offset, SEEK_DATA);
+      if (data < 0 && errno == ENXIO)
+        break; /* Only a hole is left */
+      else if (data < 0 && errno == EINVAL && offset == 0)
+        {
+          /* No SEEK_DATA support; copy everything */
+          if (lseek (src_fd, 0, SEEK_SET) < 0)
+            return glnx_throw_errno_prefix (error, "lseek");
+          if (glnx_regfile_copy_bytes (src_fd, dest_fd, len) < 0)
+            return glnx_throw_errno_prefix (error, "regfile copy");
+          return TRUE;
+        }
+      else if (data < 0)
+        return glnx_throw_errno_prefix (error, "lseek(SEEK_DATA)");
+      if (data >= len)
+        break;
+
+      off_t hole = lseek (src_fd, data, SEEK_HOLE);
+      if (hole < 0)
+        return glnx_throw_errno_prefix (error, "lseek(SEEK_HOLE)");
+      hole = MIN (hole, len);
+
+      if (lseek (src_fd, data, SEEK_SET) < 0 || lseek (dest_fd, data, SEEK_SET) < 0)
+        return glnx_throw_errno_prefix (error, "lseek");
+      if (glnx_regfile_copy_bytes (src_fd, dest_fd, hole - data) < 0)
+        return glnx_throw_errno_prefix (error, "regfile copy");
+
+      offset = hole;
+    }
+
+  /* Extend the file over a trailing hole */
+  if (ftruncate (dest_fd, len) < 0)
+    return glnx_throw_errno_prefix (error, "ftruncate");
+
+  return TRUE;
+}
@@ -78,4 +78,8 @@ gboolean ot_parse_file_by_line (const char *path, gboolean (*cb) (const char *,
 gboolean ot_get_dir_size (int dfd, const char *path, guint64 blocksize, guint64 *out_size,
                           GCancellable *cancellable, GError **error);
 
+gboolean ot_fd_has_holes (int fd, off_t len, gboolean *out_has_holes, GError **error);
+
+gboolean ot_regfile_copy_sparse (int src_fd, int dest_fd, off_t len, GError **error);
+
 G_END_DECLS
@@ -729,6 +729,9 @@ struct _OtVariantBuilder
   gint ref_count;
   int fd;
 
+  /* If set, updated with everything written to fd */
+  OtChecksum *checksum;
+
   /* This is only useful for the topmost builder and points to the top
    * of the builder stack. Public APIs take the topmost builder reference
    * and use this to find the currently active builder */
@@ -845,6 +848,53 @@ ot_variant_builder_ref (OtVariantBuilder *builder)
   return builder;
 }
 
+/* Have everything written from now on also be added to @checksum, which
+ * must outlive the builder. This avoids having to read back the
+ * serialized variant to compute its checksum.
+ */
+void
+ot_variant_builder_set_checksum (OtVariantBuilder *builder, OtChecksum *checksum)
+{
+  builder->checksum = checksum;
+}
+
+static gboolean
+ot_variant_builder_write (OtVariantBuilder *builder, const void *buf, gsize len, GError **error)
+{
+  if (glnx_loop_write (builder->fd, buf, len) < 0)
+    return glnx_throw_errno (error);
+  if (builder->checksum)
+    ot_checksum_update (builder->checksum, buf, len);
+  return TRUE;
+}
+
+static gboolean
+ot_variant_builder_write_from_fd (OtVariantBuilder *builder, int fd, guint64 size, GError **error)
+{
+  /* Without a checksum, let the kernel do the copying */
+  if (!builder->checksum)
+    {
+      if (glnx_regfile_copy_bytes (fd, builder->fd, size) < 0)
+        return glnx_throw_errno (error);
+      return TRUE;
+    }
+
+  guint8 buf[16 * 1024];
+  while (size > 0)
+    {
+      gssize n_read = TEMP_FAILURE_RETRY (read (fd, buf, MIN (size, sizeof (buf))));
+      if (n_read < 0)
+        return glnx_throw_errno (error);
+      if (n_read == 0)
+        return glnx_throw (error, "Unexpected EOF");
+      if (!ot_variant_builder_write (builder, buf, n_read, error))
+        return FALSE;
+      size -= n_read;
+    }
+
+  return TRUE;
+}
+
 /* This is called before adding a child to the container.  It updates
    the internal state and does the needed alignment */
 static gboolean
@@ -891,8 +941,8 @@ ot_variant_builder_pre_add (OtVariantBuilderInfo *info, const GVariantType *type
 
   while (info->offset & alignment)
     {
-      if (glnx_loop_write (info->builder->fd, "\0", 1) < 0)
-        return glnx_throw_errno (error);
+      if (!ot_variant_builder_write (info->builder, "\0", 1, error))
+        return FALSE;
       info->offset++;
     }
 
@@ -935,11 +985,11 @@ ot_variant_builder_post_add (OtVariantBuilderInfo *info, const GVariantType *typ
   else if (g_variant_type_is_variant (info->type))
     {
       /* Zero separate */
-      if (glnx_loop_write (info->builder->fd, "\0", 1) < 0)
-        return glnx_throw_errno (error);
+      if (!ot_variant_builder_write (info->builder, "\0", 1, error))
+        return FALSE;
 
-      if (glnx_loop_write (info->builder->fd, (char *)type, strlen ((char *)type)) < 0)
-        return glnx_throw_errno (error);
+      if (!ot_variant_builder_write (info->builder, type, strlen ((char *)type), error))
+        return FALSE;
 
       info->offset += 1 + strlen ((char *)type);
     }
@@ -966,8 +1016,8 @@ ot_variant_builder_add_from_fd (OtVariantBuilder *builder, const GVariantType *t
   if (!ot_variant_builder_pre_add (info, type, error))
     return FALSE;
 
-  if (glnx_regfile_copy_bytes (fd, builder->fd, size) < 0)
-    return glnx_throw_errno (error);
+  if (!ot_variant_builder_write_from_fd (builder, fd, size, error))
+    return FALSE;
 
   if (!ot_variant_builder_post_add (info, type, size, error))
     return FALSE;
@@ -998,8 +1048,8 @@ ot_variant_builder_add_value (OtVariantBuilder *builder, GVariant *value, GError
 
   if (data)
     {
-      if (glnx_loop_write (builder->fd, data, data_size) < 0)
-        return glnx_throw_errno (error);
+      if (!ot_variant_builder_write (builder, data, data_size, error))
+        return FALSE;
     }
 
   if (!ot_variant_builder_post_add (info, g_variant_get_type (value), data_size, error))
@@ -1133,8 +1183,8 @@ ot_variant_builder_end (OtVariantBuilder *builder, GError **error)
             }
         }
 
-      if (glnx_loop_write (builder->fd, offset_table, offset_table_size) < 0)
-        return glnx_throw_errno (error);
+      if (!ot_variant_builder_write (builder, offset_table, offset_table_size, error))
+        return FALSE;
 
       info->offset += offset_table_size;
     }
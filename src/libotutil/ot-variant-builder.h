@@ -24,6 +24,7 @@
 #include <gio/gio.h>
 
 #include "libglnx.h"
+#include "ot-checksum-utils.h"
 
 G_BEGIN_DECLS
 
@@ -32,6 +33,7 @@ typedef struct _OtVariantBuilder OtVariantBuilder;
 OtVariantBuilder *ot_variant_builder_new (const GVariantType *type, int fd);
 void ot_variant_builder_unref (OtVariantBuilder *builder);
 OtVariantBuilder *ot_variant_builder_ref (OtVariantBuilder *builder);
+void ot_variant_builder_set_checksum (OtVariantBuilder *builder, OtChecksum *checksum);
 gboolean ot_variant_builder_end (OtVariantBuilder *builder, GError **error);
 gboolean ot_variant_builder_open (OtVariantBuilder *builder, const GVariantType *type,
                                   GError **error);
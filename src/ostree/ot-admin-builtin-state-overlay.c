@@ -31,6 +31,7 @@
 #include "glnx-xattrs.h"
 #include "ostree-core.h"
 #include "ostree-deployment.h"
+#include "ostree.h"
 #include "ot-admin-builtins.h"
 
 #define OSTREE_STATEOVERLAYS_DIR "/var/ostree/state-overlays"
@@ -42,7 +43,12 @@
 /* https://www.kernel.org/doc/html/latest/filesystems/overlayfs.html */
 #define OVERLAYFS_DIR_XATTR_OPAQUE "trusted.overlay.opaque"
 
-static GOptionEntry options[] = { { NULL } };
+static gboolean opt_prune_changed_only;
+
+static GOptionEntry options[]
+    = { { "prune-changed-only", 0, 0, G_OPTION_ARG_NONE, &opt_prune_changed_only,
+          "Only prune upperdir entries shadowing content changed in the new deployment", NULL },
+        { NULL } };
 
 static gboolean
 ensure_overlay_dirs (const char *overlay_dir, int *out_overlay_dfd, GCancellable *cancellable,
@@ -97,6 +103,24 @@ is_opaque_dir (int dfd, const char *dname, gboolean *out_is_opaque, GError **err
   return TRUE;
 }
 
+static gboolean
+prune_upperdir_entry (int upper_dfd, const char *name, gboolean is_dir, GCancellable *cancellable,
+                      GError **error)
+{
+  if (is_dir)
+    {
+      if (!glnx_shutil_rm_rf_at (upper_dfd, name, cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      /* just unlinkat(); saves one openat() call */
+      if (!glnx_unlinkat (upper_dfd, name, 0, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
 static gboolean
 prune_upperdir_recurse (int lower_dfd, int upper_dfd, GCancellable *cancellable, GError **error)
 {
@@ -146,24 +170,168 @@ prune_upperdir_recurse (int lower_dfd, int upper_dfd, GCancellable *cancellable,
         }
 
       /* any other case, we prune (this also implicitly covers whiteouts and opaque dirs) */
-      if (dent->d_type == DT_DIR)
-        {
-          if (!glnx_shutil_rm_rf_at (upper_dfd, dent->d_name, cancellable, error))
-            return FALSE;
-        }
-      else
+      if (!prune_upperdir_entry (upper_dfd, dent->d_name, dent->d_type == DT_DIR, cancellable,
+                                 error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Prune whatever the upperdir has at @relpath, which was added or modified in
+ * the lowerdir. Only the entries along that path are looked at. If @recurse is
+ * set and both sides are directories, the directory is pruned using the full
+ * walk (used for directories whose children aren't individually part of the
+ * diff, i.e. when an entry changed type).
+ */
+static gboolean
+prune_upperdir_path (int lower_dfd, int upper_dfd, const char *relpath, gboolean recurse,
+                     GCancellable *cancellable, GError **error)
+{
+  g_auto (GStrv) components = g_strsplit (relpath, "/", -1);
+  const guint n_components = g_strv_length (components);
+  glnx_autofd int lower_parent_dfd = -1;
+  glnx_autofd int upper_parent_dfd = -1;
+  int lower_cur_dfd = lower_dfd;
+  int upper_cur_dfd = upper_dfd;
+
+  for (guint i = 0; i < n_components; i++)
+    {
+      const char *name = components[i];
+      const gboolean is_last = (i == n_components - 1);
+
+      if (*name == '\0')
+        continue;
+
+      struct stat upper_stbuf;
+      if (!glnx_fstatat_allow_noent (upper_cur_dfd, name, &upper_stbuf, AT_SYMLINK_NOFOLLOW,
+                                     error))
+        return FALSE;
+      if (errno == ENOENT)
+        return TRUE; /* nothing in the upperdir shadows this path */
+
+      struct stat lower_stbuf;
+      if (!glnx_fstatat_allow_noent (lower_cur_dfd, name, &lower_stbuf, AT_SYMLINK_NOFOLLOW,
+                                     error))
+        return FALSE;
+      if (errno == ENOENT)
+        return TRUE; /* state file; carry on */
+
+      if (S_ISDIR (upper_stbuf.st_mode) && S_ISDIR (lower_stbuf.st_mode))
         {
-          /* just unlinkat(); saves one openat() call */
-          if (!glnx_unlinkat (upper_dfd, dent->d_name, 0, error))
+          gboolean is_opaque = FALSE;
+          if (!is_opaque_dir (upper_cur_dfd, name, &is_opaque, error))
             return FALSE;
+
+          if (!is_opaque)
+            {
+              if (is_last && !recurse)
+                return TRUE; /* children are handled individually */
+
+              glnx_autofd int lower_subdfd = -1;
+              if (!glnx_opendirat (lower_cur_dfd, name, FALSE, &lower_subdfd, error))
+                return FALSE;
+              glnx_autofd int upper_subdfd = -1;
+              if (!glnx_opendirat (upper_cur_dfd, name, FALSE, &upper_subdfd, error))
+                return FALSE;
+
+              if (is_last)
+                return prune_upperdir_recurse (lower_subdfd, upper_subdfd, cancellable, error);
+
+              glnx_close_fd (&lower_parent_dfd);
+              lower_parent_dfd = glnx_steal_fd (&lower_subdfd);
+              lower_cur_dfd = lower_parent_dfd;
+              glnx_close_fd (&upper_parent_dfd);
+              upper_parent_dfd = glnx_steal_fd (&upper_subdfd);
+              upper_cur_dfd = upper_parent_dfd;
+              continue;
+            }
         }
+
+      /* a file, whiteout or opaque dir shadowing changed content; prune it */
+      return prune_upperdir_entry (upper_cur_dfd, name, S_ISDIR (upper_stbuf.st_mode), cancellable,
+                                   error);
+    }
+
+  return TRUE;
+}
+
+/* Prune the upperdir using the diff between the commit it was last rebased on
+ * and the new one, so that only paths which changed in the lowerdir are
+ * visited. Sets @out_pruned to %FALSE if the diff can't be computed (e.g. the
+ * old commit was garbage collected), in which case the caller should fall back
+ * to walking the whole upperdir.
+ */
+static gboolean
+prune_upperdir_from_diff (OstreeRepo *repo, const char *from_checksum, const char *to_checksum,
+                          const char *mountpath, int lower_dfd, int upper_dfd,
+                          gboolean *out_pruned, GCancellable *cancellable, GError **error)
+{
+  *out_pruned = FALSE;
+
+  gboolean have_commit = FALSE;
+  if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, from_checksum, &have_commit,
+                               cancellable, error))
+    return FALSE;
+  if (!have_commit)
+    return TRUE;
+
+  OstreeRepoCommitState commitstate;
+  if (!ostree_repo_load_commit (repo, from_checksum, NULL, &commitstate, error))
+    return FALSE;
+  if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+    return TRUE;
+
+  g_autoptr (GFile) from_root = NULL;
+  if (!ostree_repo_read_commit (repo, from_checksum, &from_root, NULL, cancellable, error))
+    return FALSE;
+  g_autoptr (GFile) to_root = NULL;
+  if (!ostree_repo_read_commit (repo, to_checksum, &to_root, NULL, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GFile) from_dir = g_file_resolve_relative_path (from_root, mountpath);
+  g_autoptr (GFile) to_dir = g_file_resolve_relative_path (to_root, mountpath);
+  if (g_file_query_file_type (from_dir, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable)
+          != G_FILE_TYPE_DIRECTORY
+      || g_file_query_file_type (to_dir, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable)
+             != G_FILE_TYPE_DIRECTORY)
+    return TRUE;
+
+  g_autoptr (GPtrArray) modified
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)ostree_diff_item_unref);
+  g_autoptr (GPtrArray) removed = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  g_autoptr (GPtrArray) added = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE, from_dir, to_dir, modified, removed, added,
+                         cancellable, error))
+    return FALSE;
+
+  /* Removed paths don't need anything; whatever the upperdir has there no
+   * longer shadows anything and is now state. */
+  for (guint i = 0; i < modified->len; i++)
+    {
+      OstreeDiffItem *diff = modified->pdata[i];
+      g_autofree char *relpath = g_file_get_relative_path (to_dir, diff->target);
+      const gboolean type_changed = g_file_info_get_file_type (diff->src_info)
+                                    != g_file_info_get_file_type (diff->target_info);
+      if (!prune_upperdir_path (lower_dfd, upper_dfd, relpath, type_changed, cancellable, error))
+        return glnx_prefix_error (error, "in %s", relpath);
     }
 
+  for (guint i = 0; i < added->len; i++)
+    {
+      GFile *added_file = added->pdata[i];
+      g_autofree char *relpath = g_file_get_relative_path (to_dir, added_file);
+      if (!prune_upperdir_path (lower_dfd, upper_dfd, relpath, FALSE, cancellable, error))
+        return glnx_prefix_error (error, "in %s", relpath);
+    }
+
+  *out_pruned = TRUE;
   return TRUE;
 }
 
 static gboolean
-prune_upperdir (int sysroot_fd, const char *mountpath, int overlay_dfd, GCancellable *cancellable,
+prune_upperdir (OstreeSysroot *sysroot, const char *mountpath, int overlay_dfd,
+                const char *from_checksum, const char *to_checksum, GCancellable *cancellable,
                 GError **error)
 {
   glnx_autofd int lower_dfd = -1;
@@ -174,6 +342,22 @@ prune_upperdir (int sysroot_fd, const char *mountpath, int overlay_dfd, GCancell
   if (!glnx_opendirat (overlay_dfd, OSTREE_STATEOVERLAY_UPPER_DIR, FALSE, &upper_dfd, error))
     return FALSE;
 
+  /* If we know which commit the upperdir was last rebased on, only look at
+   * what changed since. */
+  if (opt_prune_changed_only && from_checksum != NULL)
+    {
+      g_autoptr (OstreeRepo) repo = NULL;
+      if (!ostree_sysroot_get_repo (sysroot, &repo, cancellable, error))
+        return FALSE;
+
+      gboolean pruned = FALSE;
+      if (!prune_upperdir_from_diff (repo, from_checksum, to_checksum, mountpath, lower_dfd,
+                                     upper_dfd, &pruned, cancellable, error))
+        return FALSE;
+      if (pruned)
+        return TRUE;
+    }
+
   if (!prune_upperdir_recurse (lower_dfd, upper_dfd, cancellable, error))
     return FALSE;
 
@@ -273,8 +457,8 @@ ot_admin_builtin_state_overlay (int argc, char **argv, OstreeCommandInvocation *
   if (g_strcmp0 (current_checksum, target_checksum) != 0)
     {
       /* the lowerdir was updated; prune the upperdir */
-      if (!prune_upperdir (ostree_sysroot_get_fd (sysroot), mountpath, overlay_dfd, cancellable,
-                           error))
+      if (!prune_upperdir (sysroot, mountpath, overlay_dfd, current_checksum, target_checksum,
+                           cancellable, error))
         return glnx_prefix_error (error, "Pruning upperdir for %s", overlay_name);
 
       if (!set_overlay_deployment_checksum (overlay_dfd, target_checksum, cancellable, error))
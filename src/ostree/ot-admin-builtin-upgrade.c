@@ -31,6 +31,7 @@
 #include <unistd.h>
 
 static gboolean opt_reboot;
+static gboolean opt_soft_reboot;
 static gboolean opt_allow_downgrade;
 static gboolean opt_pull_only;
 static gboolean opt_deploy_only;
@@ -42,6 +43,9 @@ static GOptionEntry options[] = {
   { "os", 0, 0, G_OPTION_ARG_STRING, &opt_osname,
     "Use a different operating system root than the current one", "OSNAME" },
   { "reboot", 'r', 0, G_OPTION_ARG_NONE, &opt_reboot, "Reboot after a successful upgrade", NULL },
+  { "soft-reboot", 0, 0, G_OPTION_ARG_NONE, &opt_soft_reboot,
+    "Prepare a soft reboot (of userspace only) if the kernel and its arguments are unchanged",
+    NULL },
   { "allow-downgrade", 0, 0, G_OPTION_ARG_NONE, &opt_allow_downgrade,
     "Permit deployment of chronologically older trees", NULL },
   { "override-commit", 0, 0, G_OPTION_ARG_STRING, &opt_override_commit,
@@ -78,6 +82,12 @@ ot_admin_builtin_upgrade (int argc, char **argv, OstreeCommandInvocation *invoca
                    "Cannot simultaneously specify --pull-only and --reboot");
       return FALSE;
     }
+  else if (opt_pull_only && opt_soft_reboot)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Cannot simultaneously specify --pull-only and --soft-reboot");
+      return FALSE;
+    }
 
   OstreeSysrootUpgraderFlags flags = 0;
   if (opt_stage)
@@ -154,11 +164,36 @@ ot_admin_builtin_upgrade (int argc, char **argv, OstreeCommandInvocation *invoca
             return FALSE;
         }
 
+      gboolean soft_reboot = FALSE;
+      if (opt_soft_reboot)
+        {
+          if (!ostree_sysroot_load (sysroot, cancellable, error))
+            return FALSE;
+          /* The new deployment is the default one */
+          OstreeDeployment *new_deployment = ostree_sysroot_get_deployments (sysroot)->pdata[0];
+          if (ostree_sysroot_deployment_can_soft_reboot (sysroot, new_deployment))
+            {
+              if (!ostree_sysroot_deployment_set_soft_reboot (sysroot, new_deployment, cancellable,
+                                                              error))
+                return FALSE;
+              soft_reboot = TRUE;
+            }
+          else
+            g_print ("Kernel or boot configuration changed; a full reboot is required.\n");
+        }
+
       if (opt_reboot)
         {
-          if (!ot_admin_execve_reboot (sysroot, error))
+          if (soft_reboot)
+            {
+              if (!ot_admin_execve_soft_reboot (sysroot, error))
+                return FALSE;
+            }
+          else if (!ot_admin_execve_reboot (sysroot, error))
             return FALSE;
         }
+      else if (soft_reboot)
+        g_print ("Prepared soft reboot; use `systemctl soft-reboot` to apply.\n");
     }
 
   return TRUE;
@@ -155,3 +155,19 @@ ot_admin_execve_reboot (OstreeSysroot *sysroot, GError **error)
     return glnx_throw_errno_prefix (error, "execve(systemctl reboot)");
   return TRUE;
 }
+
+/* Like ot_admin_execve_reboot(), but only restarting userspace, into the root
+ * prepared by ostree_sysroot_deployment_set_soft_reboot().
+ */
+gboolean
+ot_admin_execve_soft_reboot (OstreeSysroot *sysroot, GError **error)
+{
+  OstreeDeployment *booted = ostree_sysroot_get_booted_deployment (sysroot);
+
+  if (!booted)
+    return TRUE;
+
+  if (execlp ("systemctl", "systemctl", "soft-reboot", NULL) < 0)
+    return glnx_throw_errno_prefix (error, "execve(systemctl soft-reboot)");
+  return TRUE;
+}
@@ -66,13 +66,30 @@ gboolean
 ostree_builtin_checksum (int argc, char **argv, OstreeCommandInvocation *invocation,
                          GCancellable *cancellable, GError **error)
 {
-  g_autoptr (GOptionContext) context = g_option_context_new ("PATH");
+  g_autoptr (GOptionContext) context = g_option_context_new ("PATH...");
   if (!ostree_option_context_parse (context, options, &argc, &argv, invocation, NULL, cancellable,
                                     error))
     return FALSE;
 
   if (argc < 2)
     return glnx_throw (error, "A filename must be given");
+
+  const OstreeChecksumFlags flags
+      = opt_ignore_xattrs ? OSTREE_CHECKSUM_FLAGS_IGNORE_XATTRS : OSTREE_CHECKSUM_FLAGS_NONE;
+
+  /* Multiple files are checksummed in parallel, and printed like sha256sum */
+  if (argc > 2)
+    {
+      g_auto (GStrv) checksums = NULL;
+      if (!ostree_checksum_files_at (AT_FDCWD, (const char *const *)argv + 1,
+                                     OSTREE_OBJECT_TYPE_FILE, flags, &checksums, cancellable,
+                                     error))
+        return FALSE;
+      for (int i = 1; i < argc; i++)
+        g_print ("%s  %s\n", checksums[i - 1], argv[i]);
+      return TRUE;
+    }
+
   const char *path = argv[1];
 
   /* for test coverage, use the async API if no flags are needed */
@@ -94,8 +111,8 @@ ostree_builtin_checksum (int argc, char **argv, OstreeCommandInvocation *invocat
     }
 
   g_autofree char *checksum = NULL;
-  if (!ostree_checksum_file_at (AT_FDCWD, path, NULL, OSTREE_OBJECT_TYPE_FILE,
-                                OSTREE_CHECKSUM_FLAGS_IGNORE_XATTRS, &checksum, cancellable, error))
+  if (!ostree_checksum_file_at (AT_FDCWD, path, NULL, OSTREE_OBJECT_TYPE_FILE, flags, &checksum,
+                                cancellable, error))
     return FALSE;
 
   g_print ("%s\n", checksum);
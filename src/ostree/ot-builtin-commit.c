@@ -74,6 +74,7 @@ static gboolean opt_generate_sizes;
 static gboolean opt_composefs_metadata;
 static gboolean opt_disable_fsync;
 static char *opt_timestamp;
+static char *opt_static_delta_from;
 
 static gboolean
 parse_fsync_cb (const char *option_name, const char *value, gpointer data, GError **error)
@@ -177,6 +178,8 @@ static GOptionEntry options[] = {
     "POLICY" },
   { "timestamp", 0, 0, G_OPTION_ARG_STRING, &opt_timestamp, "Override the timestamp of the commit",
     "TIMESTAMP" },
+  { "generate-static-delta-from", 0, 0, G_OPTION_ARG_STRING, &opt_static_delta_from,
+    "Generate a static delta from REV (or \"empty\") to the new commit", "REV" },
   { NULL }
 };
 
@@ -440,6 +443,7 @@ ostree_builtin_commit (int argc, char **argv, OstreeCommandInvocation *invocatio
   g_autoptr (GFile) object_to_commit = NULL;
   g_autofree char *parent = NULL;
   g_autofree char *commit_checksum = NULL;
+  g_autofree char *static_delta_from = NULL;
   g_autoptr (GFile) root = NULL;
   g_autoptr (GVariant) metadata = NULL;
   g_autoptr (GVariant) detached_metadata = NULL;
@@ -520,6 +524,15 @@ ostree_builtin_commit (int argc, char **argv, OstreeCommandInvocation *invocatio
         }
     }
 
+  /* Resolve this now, so that e.g. the branch being committed to refers
+   * to its previous commit */
+  if (opt_static_delta_from && !g_str_equal (opt_static_delta_from, "empty"))
+    {
+      if (!ostree_repo_resolve_rev (repo, opt_static_delta_from, FALSE, &static_delta_from,
+                                    error))
+        goto out;
+    }
+
   if (!parent && opt_metadata_keep)
     {
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -1009,6 +1022,19 @@ ostree_builtin_commit (int argc, char **argv, OstreeCommandInvocation *invocatio
       commit_checksum = g_strdup (parent);
     }
 
+  /* Doing this right away means the new objects are likely still in the
+   * page cache, rather than needing another pass over the disk.
+   */
+  if (opt_static_delta_from && !skip_commit
+      && g_strcmp0 (static_delta_from, commit_checksum) != 0)
+    {
+      g_autoptr (GVariant) params = g_variant_ref_sink (g_variant_new ("a{sv}", NULL));
+      if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                              static_delta_from, commit_checksum, NULL, params,
+                                              cancellable, error))
+        goto out;
+    }
+
   if (opt_table_output)
     {
       g_print ("Commit: %s\n", commit_checksum);
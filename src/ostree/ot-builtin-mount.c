@@ -0,0 +1,822 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* A read-only FUSE filesystem serving a commit directly out of the
+ * repository, without checking it out. Directories are served from the
+ * dirtree/dirmeta objects, and file content is only read when a file is
+ * actually opened. Content of uncompressed (bare) objects is read straight
+ * from the object file; archive objects are decompressed lazily, in
+ * blocks, which are kept in a bounded LRU cache. Since the content never
+ * changes, the kernel page cache is kept across opens.
+ */
+
+#include "config.h"
+
+#ifndef FUSE_USE_VERSION
+#error config.h needs to define FUSE_USE_VERSION
+#endif
+
+#include <fuse.h>
+#include <gio/gfiledescriptorbased.h>
+
+#include "ostree.h"
+#include "ot-builtins.h"
+#include "otutil.h"
+
+/* ATTENTION:
+ * Please remember to update the bash-completion script (bash/ostree) and
+ * man page (man/ostree-mount.xml) when changing the option list.
+ */
+
+static gboolean opt_foreground;
+static gboolean opt_single_threaded;
+static int opt_cache_size_mb = 64;
+static char **opt_fuse_options;
+
+static GOptionEntry options[]
+    = { { "foreground", 'f', 0, G_OPTION_ARG_NONE, &opt_foreground,
+          "Stay in the foreground until unmounted", NULL },
+        { "single-threaded", 's', 0, G_OPTION_ARG_NONE, &opt_single_threaded,
+          "Serve requests from a single thread", NULL },
+        { "cache-size", 0, 0, G_OPTION_ARG_INT, &opt_cache_size_mb,
+          "Maximum size of decompressed content cached in memory (default: 64)", "MB" },
+        { "option", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &opt_fuse_options,
+          "Additional FUSE mount option", "OPT" },
+        { NULL } };
+
+/* Archive objects are decompressed in blocks of this size */
+#define MOUNT_BLOCK_SIZE (128 * 1024)
+
+typedef struct
+{
+  struct stat stbuf;
+  char *symlink_target;
+  GVariant *xattrs;
+} MountFileEntry;
+
+typedef struct
+{
+  OstreeRepo *repo;
+  char root_contents[OSTREE_SHA256_STRING_LEN + 1];
+  char root_meta[OSTREE_SHA256_STRING_LEN + 1];
+  struct timespec mtime;
+
+  /* Protects the metadata caches below; the repo itself may be read from
+   * several threads at once, so loading objects happens without it.
+   */
+  GMutex metadata_lock;
+  GHashTable *metadata; /* object name → GVariant */
+  GHashTable *files;    /* checksum → MountFileEntry */
+
+  /* Decompressed blocks of archive objects, most recently used first */
+  GMutex cache_lock;
+  GHashTable *blocks; /* "checksum.index" → GList link in blocks_lru */
+  GQueue blocks_lru;  /* of MountCachedBlock */
+  guint64 blocks_size;
+  guint64 blocks_max_size;
+} MountState;
+
+typedef struct
+{
+  char *key;
+  GBytes *data;
+} MountCachedBlock;
+
+typedef struct
+{
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  guint64 size;
+  int fd; /* For uncompressed objects, -1 otherwise */
+
+  GMutex lock; /* Protects the decompression state below */
+  GInputStream *in;
+  guint64 in_offset;
+} MountOpenFile;
+
+typedef struct
+{
+  gboolean is_dir;
+  /* For files, the content checksum; for directories, the dirtree checksum */
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  char meta_checksum[OSTREE_SHA256_STRING_LEN + 1];
+} MountNode;
+
+static MountState *
+get_state (void)
+{
+  return fuse_get_context ()->private_data;
+}
+
+static int
+errno_from_error (GError *error)
+{
+  g_debug ("%s", error->message);
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    return -ENOENT;
+  return -EIO;
+}
+
+static void
+mount_file_entry_free (MountFileEntry *entry)
+{
+  g_free (entry->symlink_target);
+  g_clear_pointer (&entry->xattrs, g_variant_unref);
+  g_free (entry);
+}
+
+static void
+mount_cached_block_free (MountCachedBlock *block)
+{
+  g_free (block->key);
+  g_bytes_unref (block->data);
+  g_free (block);
+}
+
+/* Returns a new reference to the metadata object, loading it if needed */
+static GVariant *
+load_metadata (MountState *state, OstreeObjectType objtype, const char *checksum, GError **error)
+{
+  g_autofree char *key = ostree_object_to_string (checksum, objtype);
+
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&state->metadata_lock);
+    GVariant *ret = g_hash_table_lookup (state->metadata, key);
+    if (ret != NULL)
+      return g_variant_ref (ret);
+  }
+
+  g_autoptr (GVariant) loaded = NULL;
+  if (!ostree_repo_load_variant (state->repo, objtype, checksum, &loaded, error))
+    return NULL;
+
+  /* Another thread may have loaded it meanwhile; keep the first one */
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&state->metadata_lock);
+  GVariant *ret = g_hash_table_lookup (state->metadata, key);
+  if (ret == NULL)
+    {
+      ret = g_steal_pointer (&loaded);
+      g_hash_table_insert (state->metadata, g_steal_pointer (&key), ret);
+    }
+
+  return g_variant_ref (ret);
+}
+
+/* The returned entry is owned by the state */
+static MountFileEntry *
+load_file_entry (MountState *state, const char *checksum, GError **error)
+{
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&state->metadata_lock);
+    MountFileEntry *entry = g_hash_table_lookup (state->files, checksum);
+    if (entry != NULL)
+      return entry;
+  }
+
+  g_autoptr (GFileInfo) info = NULL;
+  g_autoptr (GVariant) xattrs = NULL;
+  if (!ostree_repo_load_file (state->repo, checksum, NULL, &info, &xattrs, NULL, error))
+    return NULL;
+
+  MountFileEntry *entry = g_new0 (MountFileEntry, 1);
+  entry->stbuf.st_mode = g_file_info_get_attribute_uint32 (info, "unix::mode");
+  entry->stbuf.st_uid = g_file_info_get_attribute_uint32 (info, "unix::uid");
+  entry->stbuf.st_gid = g_file_info_get_attribute_uint32 (info, "unix::gid");
+  entry->stbuf.st_nlink = 1;
+  entry->stbuf.st_mtim = state->mtime;
+  entry->stbuf.st_ctim = state->mtime;
+  entry->stbuf.st_atim = state->mtime;
+  if (g_file_info_get_file_type (info) == G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      entry->symlink_target = g_strdup (g_file_info_get_symlink_target (info));
+      entry->stbuf.st_size = strlen (entry->symlink_target);
+    }
+  else
+    entry->stbuf.st_size = g_file_info_get_size (info);
+  entry->stbuf.st_blocks = (entry->stbuf.st_size + 511) / 512;
+  entry->xattrs = g_steal_pointer (&xattrs);
+
+  /* Another thread may have loaded it meanwhile; keep the first one */
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&state->metadata_lock);
+  MountFileEntry *existing = g_hash_table_lookup (state->files, checksum);
+  if (existing != NULL)
+    {
+      mount_file_entry_free (entry);
+      return existing;
+    }
+  g_hash_table_insert (state->files, g_strdup (checksum), entry);
+  return entry;
+}
+
+/* Find @name in an a(s...) dirtree array, which is sorted by name */
+static gboolean
+dirtree_lookup (GVariant *entries, const char *name, GVariant **out_entry)
+{
+  gsize lo = 0;
+  gsize hi = g_variant_n_children (entries);
+
+  while (lo < hi)
+    {
+      const gsize mid = lo + (hi - lo) / 2;
+      g_autoptr (GVariant) entry = g_variant_get_child_value (entries, mid);
+      const char *entry_name;
+      g_variant_get_child (entry, 0, "&s", &entry_name);
+
+      const int cmp = strcmp (name, entry_name);
+      if (cmp == 0)
+        {
+          *out_entry = g_steal_pointer (&entry);
+          return TRUE;
+        }
+      else if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return FALSE;
+}
+
+/* Returns 0 or a negative errno */
+static int
+resolve_path (MountState *state, const char *path, MountNode *out_node)
+{
+  g_autoptr (GError) local_error = NULL;
+
+  out_node->is_dir = TRUE;
+  memcpy (out_node->checksum, state->root_contents, sizeof (out_node->checksum));
+  memcpy (out_node->meta_checksum, state->root_meta, sizeof (out_node->meta_checksum));
+
+  g_auto (GStrv) components = g_strsplit (path, "/", -1);
+  for (char **iter = components; *iter != NULL; iter++)
+    {
+      const char *name = *iter;
+      if (*name == '\0')
+        continue;
+      if (!out_node->is_dir)
+        return -ENOTDIR;
+
+      g_autoptr (GVariant) dirtree
+          = load_metadata (state, OSTREE_OBJECT_TYPE_DIR_TREE, out_node->checksum, &local_error);
+      if (dirtree == NULL)
+        return errno_from_error (local_error);
+
+      g_autoptr (GVariant) files = g_variant_get_child_value (dirtree, 0);
+      g_autoptr (GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+      g_autoptr (GVariant) entry = NULL;
+      if (dirtree_lookup (files, name, &entry))
+        {
+          g_autoptr (GVariant) csum_v = NULL;
+          g_variant_get_child (entry, 1, "@ay", &csum_v);
+          out_node->is_dir = FALSE;
+          ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v),
+                                              out_node->checksum);
+        }
+      else if (dirtree_lookup (dirs, name, &entry))
+        {
+          g_autoptr (GVariant) contents_csum_v = NULL;
+          g_autoptr (GVariant) meta_csum_v = NULL;
+          g_variant_get_child (entry, 1, "@ay", &contents_csum_v);
+          g_variant_get_child (entry, 2, "@ay", &meta_csum_v);
+          ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (contents_csum_v),
+                                              out_node->checksum);
+          ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (meta_csum_v),
+                                              out_node->meta_checksum);
+        }
+      else
+        return -ENOENT;
+    }
+
+  return 0;
+}
+
+static int
+#if FUSE_USE_VERSION >= 31
+callback_getattr (const char *path, struct stat *st_data, struct fuse_file_info *finfo)
+#else
+callback_getattr (const char *path, struct stat *st_data)
+#endif
+{
+  MountState *state = get_state ();
+  g_autoptr (GError) local_error = NULL;
+  MountNode node;
+
+  int r = resolve_path (state, path, &node);
+  if (r < 0)
+    return r;
+
+  if (node.is_dir)
+    {
+      g_autoptr (GVariant) dirmeta
+          = load_metadata (state, OSTREE_OBJECT_TYPE_DIR_META, node.meta_checksum, &local_error);
+      if (dirmeta == NULL)
+        return errno_from_error (local_error);
+
+      guint32 uid, gid, mode;
+      g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, NULL);
+      memset (st_data, 0, sizeof (*st_data));
+      st_data->st_mode = GUINT32_FROM_BE (mode);
+      st_data->st_uid = GUINT32_FROM_BE (uid);
+      st_data->st_gid = GUINT32_FROM_BE (gid);
+      st_data->st_nlink = 2;
+      st_data->st_mtim = state->mtime;
+      st_data->st_ctim = state->mtime;
+      st_data->st_atim = state->mtime;
+    }
+  else
+    {
+      MountFileEntry *entry = load_file_entry (state, node.checksum, &local_error);
+      if (entry == NULL)
+        return errno_from_error (local_error);
+      *st_data = entry->stbuf;
+    }
+
+  return 0;
+}
+
+static int
+callback_readlink (const char *path, char *buf, size_t size)
+{
+  MountState *state = get_state ();
+  g_autoptr (GError) local_error = NULL;
+  MountNode node;
+
+  int r = resolve_path (state, path, &node);
+  if (r < 0)
+    return r;
+  if (node.is_dir)
+    return -EINVAL;
+
+  MountFileEntry *entry = load_file_entry (state, node.checksum, &local_error);
+  if (entry == NULL)
+    return errno_from_error (local_error);
+  if (entry->symlink_target == NULL)
+    return -EINVAL;
+
+  /* Note FUSE wants the string to be always nul-terminated, even if
+   * truncated.
+   */
+  g_strlcpy (buf, entry->symlink_target, size);
+  return 0;
+}
+
+static int
+#if FUSE_USE_VERSION >= 31
+callback_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                  struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+#else
+callback_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                  struct fuse_file_info *fi)
+#endif
+{
+  MountState *state = get_state ();
+  g_autoptr (GError) local_error = NULL;
+  MountNode node;
+
+  int r = resolve_path (state, path, &node);
+  if (r < 0)
+    return r;
+  if (!node.is_dir)
+    return -ENOTDIR;
+
+  g_autoptr (GVariant) dirtree
+      = load_metadata (state, OSTREE_OBJECT_TYPE_DIR_TREE, node.checksum, &local_error);
+  if (dirtree == NULL)
+    return errno_from_error (local_error);
+
+  const char *names[] = { ".", ".." };
+  for (guint i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+#if FUSE_USE_VERSION >= 31
+      if (filler (buf, names[i], NULL, 0, 0))
+#else
+      if (filler (buf, names[i], NULL, 0))
+#endif
+        return 0;
+    }
+
+  for (int i = 0; i < 2; i++)
+    {
+      g_autoptr (GVariant) entries = g_variant_get_child_value (dirtree, i);
+      GVariantIter viter;
+      g_variant_iter_init (&viter, entries);
+      g_autoptr (GVariant) entry = NULL;
+      while ((entry = g_variant_iter_next_value (&viter)) != NULL)
+        {
+          const char *name;
+          g_variant_get_child (entry, 0, "&s", &name);
+#if FUSE_USE_VERSION >= 31
+          if (filler (buf, name, NULL, 0, 0))
+#else
+          if (filler (buf, name, NULL, 0))
+#endif
+            return 0;
+          g_clear_pointer (&entry, g_variant_unref);
+        }
+    }
+
+  return 0;
+}
+
+static int
+callback_open (const char *path, struct fuse_file_info *finfo)
+{
+  MountState *state = get_state ();
+  g_autoptr (GError) local_error = NULL;
+  MountNode node;
+
+  if ((finfo->flags & O_ACCMODE) != O_RDONLY)
+    return -EROFS;
+
+  int r = resolve_path (state, path, &node);
+  if (r < 0)
+    return r;
+  if (node.is_dir)
+    return -EISDIR;
+
+  MountFileEntry *entry = load_file_entry (state, node.checksum, &local_error);
+  if (entry == NULL)
+    return errno_from_error (local_error);
+  if (!S_ISREG (entry->stbuf.st_mode))
+    return -EINVAL;
+
+  MountOpenFile *file = g_new0 (MountOpenFile, 1);
+  memcpy (file->checksum, node.checksum, sizeof (file->checksum));
+  file->size = entry->stbuf.st_size;
+  file->fd = -1;
+  g_mutex_init (&file->lock);
+
+  /* Uncompressed objects can be read directly */
+  {
+    g_autoptr (GInputStream) in = NULL;
+    if (!ostree_repo_load_file (state->repo, node.checksum, &in, NULL, NULL, NULL, &local_error))
+      {
+        g_mutex_clear (&file->lock);
+        g_free (file);
+        return errno_from_error (local_error);
+      }
+    if (G_IS_FILE_DESCRIPTOR_BASED (in))
+      file->fd = fcntl (g_file_descriptor_based_get_fd ((GFileDescriptorBased *)in),
+                        F_DUPFD_CLOEXEC, 3);
+    else
+      file->in = g_steal_pointer (&in);
+  }
+
+  finfo->fh = (guint64)(gsize)file;
+  /* Objects are immutable, so anything in the page cache stays valid */
+  finfo->keep_cache = 1;
+  return 0;
+}
+
+static GBytes *
+cache_lookup (MountState *state, const char *key)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&state->cache_lock);
+
+  GList *link = g_hash_table_lookup (state->blocks, key);
+  if (link == NULL)
+    return NULL;
+
+  g_queue_unlink (&state->blocks_lru, link);
+  g_queue_push_head_link (&state->blocks_lru, link);
+  return g_bytes_ref (((MountCachedBlock *)link->data)->data);
+}
+
+static void
+cache_insert (MountState *state, char *key, GBytes *data)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&state->cache_lock);
+
+  if (g_hash_table_contains (state->blocks, key))
+    {
+      g_free (key);
+      return;
+    }
+
+  MountCachedBlock *block = g_new0 (MountCachedBlock, 1);
+  block->key = key;
+  block->data = g_bytes_ref (data);
+  g_queue_push_head (&state->blocks_lru, block);
+  g_hash_table_insert (state->blocks, block->key, state->blocks_lru.head);
+  state->blocks_size += g_bytes_get_size (data);
+
+  while (state->blocks_size > state->blocks_max_size && state->blocks_lru.length > 1)
+    {
+      MountCachedBlock *oldest = g_queue_pop_tail (&state->blocks_lru);
+      g_hash_table_remove (state->blocks, oldest->key);
+      state->blocks_size -= g_bytes_get_size (oldest->data);
+      mount_cached_block_free (oldest);
+    }
+}
+
+static char *
+block_key (const char *checksum, guint64 index)
+{
+  return g_strdup_printf ("%s.%" G_GUINT64_FORMAT, checksum, index);
+}
+
+/* Return decompressed block @index of an archive object */
+static GBytes *
+read_block (MountState *state, MountOpenFile *file, guint64 index, GError **error)
+{
+  g_autofree char *key = block_key (file->checksum, index);
+  GBytes *ret = cache_lookup (state, key);
+  if (ret != NULL)
+    return ret;
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&file->lock);
+
+  /* Another reader of this file may have gotten it meanwhile */
+  ret = cache_lookup (state, key);
+  if (ret != NULL)
+    return ret;
+
+  /* Decompression is sequential; to go backwards, start over */
+  if (file->in == NULL || file->in_offset > index * MOUNT_BLOCK_SIZE)
+    {
+      g_clear_object (&file->in);
+      if (!ostree_repo_load_file (state->repo, file->checksum, &file->in, NULL, NULL, NULL,
+                                  error))
+        return NULL;
+      file->in_offset = 0;
+    }
+
+  while (ret == NULL)
+    {
+      const guint64 this_index = file->in_offset / MOUNT_BLOCK_SIZE;
+      const gsize len = MIN (MOUNT_BLOCK_SIZE, file->size - file->in_offset);
+      g_autofree guint8 *buf = g_malloc (len);
+      gsize n_read;
+
+      if (len == 0)
+        return glnx_null_throw (error, "Read past end of object %s", file->checksum);
+      if (!g_input_stream_read_all (file->in, buf, len, &n_read, NULL, error))
+        return NULL;
+      if (n_read != len)
+        return glnx_null_throw (error, "Unexpected EOF in object %s", file->checksum);
+      file->in_offset += n_read;
+
+      g_autoptr (GBytes) block = g_bytes_new_take (g_steal_pointer (&buf), n_read);
+      /* Cache everything we had to decompress on the way too */
+      cache_insert (state, block_key (file->checksum, this_index), block);
+      if (this_index == index)
+        ret = g_steal_pointer (&block);
+    }
+
+  return ret;
+}
+
+static int
+callback_read (const char *path, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *finfo)
+{
+  MountState *state = get_state ();
+  MountOpenFile *file = (MountOpenFile *)(gsize)finfo->fh;
+
+  if (file->fd != -1)
+    {
+      ssize_t r = TEMP_FAILURE_RETRY (pread (file->fd, buf, size, offset));
+      if (r < 0)
+        return -errno;
+      return r;
+    }
+
+  if (offset < 0)
+    return -EINVAL;
+  if ((guint64)offset >= file->size)
+    return 0;
+  size = MIN (size, file->size - offset);
+
+  size_t copied = 0;
+  while (copied < size)
+    {
+      g_autoptr (GError) local_error = NULL;
+      const guint64 pos = offset + copied;
+      g_autoptr (GBytes) block = read_block (state, file, pos / MOUNT_BLOCK_SIZE, &local_error);
+      if (block == NULL)
+        return errno_from_error (local_error);
+
+      gsize block_len;
+      const guint8 *block_data = g_bytes_get_data (block, &block_len);
+      const gsize block_offset = pos % MOUNT_BLOCK_SIZE;
+      const gsize n = MIN (size - copied, block_len - block_offset);
+      memcpy (buf + copied, block_data + block_offset, n);
+      copied += n;
+    }
+
+  return copied;
+}
+
+static int
+callback_release (const char *path, struct fuse_file_info *finfo)
+{
+  MountOpenFile *file = (MountOpenFile *)(gsize)finfo->fh;
+
+  glnx_close_fd (&file->fd);
+  g_clear_object (&file->in);
+  g_mutex_clear (&file->lock);
+  g_free (file);
+  return 0;
+}
+
+static GVariant *
+lookup_xattrs (MountState *state, const char *path, int *out_errno)
+{
+  g_autoptr (GError) local_error = NULL;
+  MountNode node;
+
+  *out_errno = resolve_path (state, path, &node);
+  if (*out_errno < 0)
+    return NULL;
+
+  if (node.is_dir)
+    {
+      g_autoptr (GVariant) dirmeta
+          = load_metadata (state, OSTREE_OBJECT_TYPE_DIR_META, node.meta_checksum, &local_error);
+      if (dirmeta == NULL)
+        {
+          *out_errno = errno_from_error (local_error);
+          return NULL;
+        }
+      return g_variant_get_child_value (dirmeta, 3);
+    }
+  else
+    {
+      MountFileEntry *entry = load_file_entry (state, node.checksum, &local_error);
+      if (entry == NULL)
+        {
+          *out_errno = errno_from_error (local_error);
+          return NULL;
+        }
+      if (entry->xattrs == NULL)
+        return g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("(ayay)"), NULL, 0));
+      return g_variant_ref (entry->xattrs);
+    }
+}
+
+static int
+callback_getxattr (const char *path, const char *name, char *value, size_t size)
+{
+  int r;
+  g_autoptr (GVariant) xattrs = lookup_xattrs (get_state (), path, &r);
+  if (xattrs == NULL)
+    return r;
+
+  const guint n = g_variant_n_children (xattrs);
+  for (guint i = 0; i < n; i++)
+    {
+      const guint8 *xattr_name;
+      g_autoptr (GVariant) xattr_value = NULL;
+      g_variant_get_child (xattrs, i, "(^&ay@ay)", &xattr_name, &xattr_value);
+      if (strcmp ((const char *)xattr_name, name) != 0)
+        continue;
+
+      gsize value_len;
+      const guint8 *value_data = g_variant_get_fixed_array (xattr_value, &value_len, 1);
+      if (size == 0)
+        return value_len;
+      if (size < value_len)
+        return -ERANGE;
+      memcpy (value, value_data, value_len);
+      return value_len;
+    }
+
+  return -ENODATA;
+}
+
+static int
+callback_listxattr (const char *path, char *list, size_t size)
+{
+  int r;
+  g_autoptr (GVariant) xattrs = lookup_xattrs (get_state (), path, &r);
+  if (xattrs == NULL)
+    return r;
+
+  size_t total = 0;
+  const guint n = g_variant_n_children (xattrs);
+  for (guint i = 0; i < n; i++)
+    {
+      const guint8 *xattr_name;
+      g_variant_get_child (xattrs, i, "(^&ay@ay)", &xattr_name, NULL);
+      const size_t len = strlen ((const char *)xattr_name) + 1;
+      if (size > 0)
+        {
+          if (total + len > size)
+            return -ERANGE;
+          memcpy (list + total, xattr_name, len);
+        }
+      total += len;
+    }
+
+  return total;
+}
+
+static struct fuse_operations callback_oper = {
+  .getattr = callback_getattr,
+  .readlink = callback_readlink,
+  .readdir = callback_readdir,
+  .open = callback_open,
+  .read = callback_read,
+  .release = callback_release,
+  .getxattr = callback_getxattr,
+  .listxattr = callback_listxattr,
+};
+
+gboolean
+ostree_builtin_mount (int argc, char **argv, OstreeCommandInvocation *invocation,
+                      GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GOptionContext) context = g_option_context_new ("COMMIT MOUNTPOINT");
+  g_autoptr (OstreeRepo) repo = NULL;
+  if (!ostree_option_context_parse (context, options, &argc, &argv, invocation, &repo, cancellable,
+                                    error))
+    return FALSE;
+
+  if (argc != 3)
+    {
+      ot_util_usage_error (context, "A COMMIT and MOUNTPOINT argument are required", error);
+      return FALSE;
+    }
+  const char *rev = argv[1];
+  const char *mountpoint = argv[2];
+
+  if (opt_cache_size_mb < 0)
+    return glnx_throw (error, "Invalid --cache-size: %d", opt_cache_size_mb);
+
+  g_autofree char *commit = NULL;
+  if (!ostree_repo_resolve_rev (repo, rev, FALSE, &commit, error))
+    return FALSE;
+  g_autoptr (GVariant) commit_v = NULL;
+  if (!ostree_repo_load_commit (repo, commit, &commit_v, NULL, error))
+    return FALSE;
+
+  MountState state = {
+    0,
+  };
+  state.repo = repo;
+  g_autoptr (GVariant) root_contents_v = NULL;
+  g_autoptr (GVariant) root_meta_v = NULL;
+  g_variant_get_child (commit_v, 6, "@ay", &root_contents_v);
+  g_variant_get_child (commit_v, 7, "@ay", &root_meta_v);
+  if (!ostree_validate_structureof_csum_v (root_contents_v, error)
+      || !ostree_validate_structureof_csum_v (root_meta_v, error))
+    return FALSE;
+  ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (root_contents_v),
+                                      state.root_contents);
+  ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (root_meta_v), state.root_meta);
+  /* Everything in the commit gets its timestamp */
+  state.mtime.tv_sec = ostree_commit_get_timestamp (commit_v);
+
+  g_mutex_init (&state.metadata_lock);
+  state.metadata
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+  state.files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)mount_file_entry_free);
+  g_mutex_init (&state.cache_lock);
+  state.blocks = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&state.blocks_lru);
+  state.blocks_max_size = (guint64)opt_cache_size_mb * 1024 * 1024;
+
+  g_autoptr (GPtrArray) fuse_argv = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (fuse_argv, g_strdup ("ostree-mount"));
+  g_ptr_array_add (fuse_argv, g_strdup (mountpoint));
+  if (opt_foreground)
+    g_ptr_array_add (fuse_argv, g_strdup ("-f"));
+  if (opt_single_threaded)
+    g_ptr_array_add (fuse_argv, g_strdup ("-s"));
+  g_ptr_array_add (fuse_argv, g_strdup ("-o"));
+  g_ptr_array_add (fuse_argv, g_strdup_printf ("ro,default_permissions,fsname=ostree:%s", commit));
+  for (char **iter = opt_fuse_options; iter && *iter; iter++)
+    {
+      g_ptr_array_add (fuse_argv, g_strdup ("-o"));
+      g_ptr_array_add (fuse_argv, g_strdup (*iter));
+    }
+  g_ptr_array_add (fuse_argv, NULL);
+
+  int r = fuse_main (fuse_argv->len - 1, (char **)fuse_argv->pdata, &callback_oper, &state);
+
+  g_queue_clear_full (&state.blocks_lru, (GDestroyNotify)mount_cached_block_free);
+  g_hash_table_unref (state.blocks);
+  g_mutex_clear (&state.cache_lock);
+  g_hash_table_unref (state.files);
+  g_hash_table_unref (state.metadata);
+  g_mutex_clear (&state.metadata_lock);
+
+  if (r != 0)
+    return glnx_throw (error, "Failed to mount %s on %s", commit, mountpoint);
+
+  return TRUE;
+}
@@ -28,6 +28,7 @@
 static gboolean opt_disable_fsync;
 static gboolean opt_per_object_fsync;
 static gboolean opt_mirror;
+static gboolean opt_inventory;
 static gboolean opt_commit_only;
 static gboolean opt_dry_run;
 static gboolean opt_disable_static_deltas;
@@ -39,6 +40,7 @@ static gboolean opt_disable_verify_bindings;
 static char *opt_timestamp_check_from_rev;
 static gboolean opt_bareuseronly_files;
 static gboolean opt_retry_all;
+static gboolean opt_background;
 static char **opt_subpaths;
 static char **opt_http_headers;
 static char *opt_cache_dir;
@@ -49,6 +51,7 @@ static int opt_network_retries = -1;
 static int opt_low_speed_limit_bytes = -1;
 static int opt_low_speed_time_seconds = -1;
 static int opt_max_outstanding_fetcher_requests = -1;
+static gint64 opt_max_bandwidth_bytes = -1;
 static char *opt_url;
 static char **opt_localcache_repos;
 
@@ -75,6 +78,8 @@ static GOptionEntry options[]
           NULL },
         { "mirror", 0, 0, G_OPTION_ARG_NONE, &opt_mirror,
           "Write refs suitable for a mirror and fetches all refs if none provided", NULL },
+        { "inventory", 0, 0, G_OPTION_ARG_NONE, &opt_inventory,
+          "When mirroring, fetch missing objects using the remote's object inventory", NULL },
         { "subpath", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_subpaths,
           "Only pull the provided subpath(s)", NULL },
         { "untrusted", 0, 0, G_OPTION_ARG_NONE, &opt_untrusted,
@@ -106,6 +111,10 @@ static GOptionEntry options[]
         { "max-outstanding-fetcher-requests", 0, 0, G_OPTION_ARG_INT,
           &opt_max_outstanding_fetcher_requests,
           "The max amount of concurrent connections allowed. (default: 8)", "N" },
+        { "max-bandwidth-bytes", 0, 0, G_OPTION_ARG_INT64, &opt_max_bandwidth_bytes,
+          "Limit the total download rate to N bytes per second", "N" },
+        { "background", 0, 0, G_OPTION_ARG_NONE, &opt_background,
+          "Write to disk with the idle I/O priority", NULL },
         { "localcache-repo", 'L', 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_localcache_repos,
           "Add REPO as local cache source for objects during this pull", "REPO" },
         { "timestamp-check", 'T', 0, G_OPTION_ARG_NONE, &opt_timestamp_check,
@@ -356,6 +365,14 @@ ostree_builtin_pull (int argc, char **argv, OstreeCommandInvocation *invocation,
           &builder, "{s@v}", "max-outstanding-fetcher-requests",
           g_variant_new_variant (g_variant_new_uint32 (opt_max_outstanding_fetcher_requests)));
 
+    if (opt_max_bandwidth_bytes >= 0)
+      g_variant_builder_add (
+          &builder, "{s@v}", "max-bandwidth-bytes",
+          g_variant_new_variant (g_variant_new_uint64 (opt_max_bandwidth_bytes)));
+    if (opt_background)
+      g_variant_builder_add (&builder, "{s@v}", "background",
+                             g_variant_new_variant (g_variant_new_boolean (TRUE)));
+
     if (opt_retry_all)
       g_variant_builder_add (&builder, "{s@v}", "retry-all-network-errors",
                              g_variant_new_variant (g_variant_new_boolean (FALSE)));
@@ -390,6 +407,9 @@ ostree_builtin_pull (int argc, char **argv, OstreeCommandInvocation *invocation,
     if (opt_per_object_fsync)
       g_variant_builder_add (&builder, "{s@v}", "per-object-fsync",
                              g_variant_new_variant (g_variant_new_boolean (TRUE)));
+    if (opt_inventory)
+      g_variant_builder_add (&builder, "{s@v}", "inventory",
+                             g_variant_new_variant (g_variant_new_boolean (TRUE)));
     g_variant_builder_add (
         &builder, "{s@v}", "disable-verify-bindings",
         g_variant_new_variant (g_variant_new_boolean (opt_disable_verify_bindings)));
@@ -49,6 +49,9 @@ BUILTINPROTO (log);
 BUILTINPROTO (pull);
 BUILTINPROTO (pull_local);
 BUILTINPROTO (ls);
+#ifdef HAVE_FUSE
+BUILTINPROTO (mount);
+#endif
 BUILTINPROTO (prune);
 BUILTINPROTO (refs);
 BUILTINPROTO (reset);
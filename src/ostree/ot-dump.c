@@ -246,6 +246,24 @@ dump_summary_ref (const char *collection_id, const char *ref_name, guint64 commi
           pretty_key = "Version";
           value_str = g_strdup (g_variant_get_string (value, NULL));
         }
+      else if (g_strcmp0 (key, OSTREE_COMMIT_DETACHED_METADATA) == 0)
+        {
+          /* Signatures aren't useful to print in full */
+          g_autoptr (GPtrArray) keys = g_ptr_array_new ();
+          GVariantIter detached_iter;
+          const char *detached_key;
+          g_variant_iter_init (&detached_iter, value);
+          while (g_variant_iter_next (&detached_iter, "{&sv}", &detached_key, NULL))
+            g_ptr_array_add (keys, (char *)detached_key);
+          g_ptr_array_add (keys, NULL);
+          pretty_key = "Detached metadata";
+          value_str = keys->len > 1 ? g_strjoinv (", ", (char **)keys->pdata) : g_strdup ("none");
+        }
+      else if (g_strcmp0 (key, OSTREE_COMMIT_ANCESTORS) == 0)
+        {
+          pretty_key = "Ancestors";
+          value_str = g_strdup_printf ("%" G_GSIZE_FORMAT, g_variant_n_children (value));
+        }
       else
         {
           value_str = g_variant_print (value, FALSE);
@@ -48,6 +48,16 @@
  * # Running as pid 1
  *
  * See ostree-prepare-root-static.c for this.
+ *
+ * # Soft reboots
+ *
+ * With `--soft-reboot SYSROOT DEPLOYMENT`, this instead runs on the booted
+ * system and prepares DEPLOYMENT (relative to SYSROOT, the physical root) in
+ * /run/nextroot, which `systemctl soft-reboot` then switches to without going
+ * through the firmware and kernel again.  This is only valid if the deployment
+ * boots with the same kernel, initramfs and kernel arguments as the booted one.
+ * It must run in PID 1's mount namespace, so that the new root is set up from
+ * the same (possibly read-only) /sysroot as userspace sees.
  */
 
 #include "config.h"
@@ -147,6 +157,37 @@ resolve_deploy_path (const char *kernel_cmdline, const char *root_mountpoint)
   return deploy_path;
 }
 
+/* For soft reboots, the deployment is given explicitly since the kernel
+ * commandline refers to the booted one.
+ */
+static char *
+resolve_soft_reboot_deploy_path (const char *root_mountpoint, const char *deployment)
+{
+  g_autofree char *destpath = g_build_filename (root_mountpoint, deployment, NULL);
+  char *deploy_path = realpath (destpath, NULL);
+  if (deploy_path == NULL)
+    err (EXIT_FAILURE, "realpath(%s) failed", destpath);
+  g_autofree char *deploy_prefix = g_build_filename (root_mountpoint, "ostree/deploy/", NULL);
+  if (!g_str_has_prefix (deploy_path, deploy_prefix))
+    errx (EXIT_FAILURE, "Not a deployment: %s", deploy_path);
+  struct stat stbuf;
+  if (stat (deploy_path, &stbuf) < 0)
+    err (EXIT_FAILURE, "stat(%s) failed", deploy_path);
+  if (!S_ISDIR (stbuf.st_mode))
+    errx (EXIT_FAILURE, "Not a deployment: %s", deploy_path);
+  g_print ("Preparing soft reboot into: %s\n", deploy_path);
+  return deploy_path;
+}
+
+// Directories under /run which persist from the boot are expected to exist
+// already when preparing a soft reboot.
+static void
+mkdir_run_dir (const char *path, mode_t mode, bool soft_reboot)
+{
+  if (mkdirat (AT_FDCWD, path, mode) < 0 && !(soft_reboot && errno == EEXIST))
+    err (EXIT_FAILURE, "Failed to create %s", path);
+}
+
 #ifdef HAVE_COMPOSEFS
 static GVariant *
 load_variant (const char *root_mountpoint, const char *digest, const char *extension,
@@ -261,9 +302,20 @@ main (int argc, char *argv[])
   struct stat stbuf;
   g_autoptr (GError) error = NULL;
 
-  if (argc < 2)
-    err (EXIT_FAILURE, "usage: ostree-prepare-root SYSROOT");
+  const bool soft_reboot = argc > 1 && strcmp (argv[1], "--soft-reboot") == 0;
+  if (soft_reboot)
+    {
+      argc--;
+      argv++;
+    }
+  if (argc < 2 || (soft_reboot && argc < 3))
+    errx (EXIT_FAILURE, "usage: ostree-prepare-root SYSROOT\n"
+                        "       ostree-prepare-root --soft-reboot SYSROOT DEPLOYMENT");
   const char *root_arg = argv[1];
+  /* Where we construct the new root; for a soft reboot that's directly its final
+   * location, since moving mounts out of the (shared) /run isn't allowed.
+   */
+  const char *tmp_sysroot = soft_reboot ? OTCORE_RUN_NEXTROOT : TMP_SYSROOT;
 
   g_autofree char *kernel_cmdline = read_proc_cmdline ();
   if (!kernel_cmdline)
@@ -286,6 +338,9 @@ main (int argc, char *argv[])
   if (!ot_keyfile_get_boolean_with_default (config, ROOT_KEY, TRANSIENT_KEY, FALSE, &root_transient,
                                             &error))
     return FALSE;
+  // Its state in /run is still in use by the booted root
+  if (soft_reboot && root_transient)
+    errx (EXIT_FAILURE, "root.transient is not supported with soft reboots");
 
   // We always parse the composefs config, because we want to detect and error
   // out if it's enabled, but not supported at compile time.
@@ -309,7 +364,9 @@ main (int argc, char *argv[])
   const char *root_mountpoint = realpath (root_arg, NULL);
   if (root_mountpoint == NULL)
     err (EXIT_FAILURE, "realpath(\"%s\")", root_arg);
-  g_autofree char *deploy_path = resolve_deploy_path (kernel_cmdline, root_mountpoint);
+  g_autofree char *deploy_path = soft_reboot
+                                     ? resolve_soft_reboot_deploy_path (root_mountpoint, argv[2])
+                                     : resolve_deploy_path (kernel_cmdline, root_mountpoint);
   const char *deploy_directory_name = glnx_basename (deploy_path);
   // Note that realpath() should have stripped any trailing `/` which shouldn't
   // be in the karg to start with, but we assert here to be sure we have a non-empty
@@ -317,10 +374,8 @@ main (int argc, char *argv[])
   g_assert (deploy_directory_name && *deploy_directory_name);
 
   /* These are global state directories underneath /run */
-  if (mkdirat (AT_FDCWD, OTCORE_RUN_OSTREE, 0755) < 0)
-    err (EXIT_FAILURE, "Failed to create %s", OTCORE_RUN_OSTREE);
-  if (mkdirat (AT_FDCWD, OTCORE_RUN_OSTREE_PRIVATE, 0) < 0)
-    err (EXIT_FAILURE, "Failed to create %s", OTCORE_RUN_OSTREE_PRIVATE);
+  mkdir_run_dir (OTCORE_RUN_OSTREE, 0755, soft_reboot);
+  mkdir_run_dir (OTCORE_RUN_OSTREE_PRIVATE, 0, soft_reboot);
 
   /* Fall back to querying the repository configuration in the target disk.
    * This is an operating system builder choice.  More info:
@@ -341,15 +396,28 @@ main (int argc, char *argv[])
            (int)sysroot_currently_writable);
 
   /* Remount root MS_PRIVATE here to avoid errors due to the kernel-enforced
-   * constraint that disallows MS_SHARED mounts to be moved.
+   * constraint that disallows MS_SHARED mounts to be moved.  On a running
+   * system, we must not change that, but we don't move mounts there either.
    *
    * Kernel docs: Documentation/filesystems/sharedsubtree.txt
    */
-  if (mount (NULL, "/", NULL, MS_REC | MS_PRIVATE | MS_SILENT, NULL) < 0)
-    err (EXIT_FAILURE, "failed to make \"/\" private mount");
+  if (!soft_reboot)
+    {
+      if (mount (NULL, "/", NULL, MS_REC | MS_PRIVATE | MS_SILENT, NULL) < 0)
+        err (EXIT_FAILURE, "failed to make \"/\" private mount");
+    }
 
-  if (mkdir (TMP_SYSROOT, 0755) < 0)
-    err (EXIT_FAILURE, "couldn't create temporary sysroot %s", TMP_SYSROOT);
+  if (soft_reboot)
+    {
+      mkdir_run_dir (tmp_sysroot, 0755, soft_reboot);
+      struct stat run_stbuf;
+      if (stat ("/run", &run_stbuf) < 0 || stat (tmp_sysroot, &stbuf) < 0)
+        err (EXIT_FAILURE, "stat(%s)", tmp_sysroot);
+      if (stbuf.st_dev != run_stbuf.st_dev)
+        errx (EXIT_FAILURE, "%s is already mounted", tmp_sysroot);
+    }
+  else if (mkdir (tmp_sysroot, 0755) < 0)
+    err (EXIT_FAILURE, "couldn't create temporary sysroot %s", tmp_sysroot);
 
   /* Run in the deploy_path dir so we can use relative paths below */
   if (chdir (deploy_path) < 0)
@@ -371,8 +439,8 @@ main (int argc, char *argv[])
   bool using_composefs = false;
 
 #ifdef HAVE_COMPOSEFS
-  /* We construct the new sysroot in /sysroot.tmp, which is either the composefs
-     mount or a bind mount of the deploy-dir */
+  /* We construct the new sysroot in /sysroot.tmp (or /run/nextroot), which is either
+     the composefs mount or a bind mount of the deploy-dir */
   if (composefs_config->enabled != OT_TRISTATE_NO)
     {
       const char *objdirs[] = { "/sysroot/ostree/repo/objects" };
@@ -384,8 +452,7 @@ main (int argc, char *argv[])
 
       cfs_options.flags = 0;
       cfs_options.image_mountdir = OSTREE_COMPOSEFS_LOWERMNT;
-      if (mkdirat (AT_FDCWD, OSTREE_COMPOSEFS_LOWERMNT, 0700) < 0)
-        err (EXIT_FAILURE, "Failed to create %s", OSTREE_COMPOSEFS_LOWERMNT);
+      mkdir_run_dir (OSTREE_COMPOSEFS_LOWERMNT, 0700, soft_reboot);
 
       g_autofree char *expected_digest = NULL;
 
@@ -457,7 +524,7 @@ main (int argc, char *argv[])
           cfs_options.expected_fsverity_digest = expected_digest;
         }
 
-      if (lcfs_mount_image (OSTREE_COMPOSEFS_NAME, TMP_SYSROOT, &cfs_options) == 0)
+      if (lcfs_mount_image (OSTREE_COMPOSEFS_NAME, tmp_sysroot, &cfs_options) == 0)
         {
           using_composefs = true;
           g_variant_builder_add (&metadata_builder, "{sv}", OTCORE_RUN_BOOTED_KEY_COMPOSEFS,
@@ -493,7 +560,7 @@ main (int argc, char *argv[])
         }
       g_print ("Using legacy ostree bind mount for /\n");
       /* The deploy root starts out bind mounted to sysroot.tmp */
-      if (mount (deploy_path, TMP_SYSROOT, NULL, MS_BIND | MS_SILENT, NULL) < 0)
+      if (mount (deploy_path, tmp_sysroot, NULL, MS_BIND | MS_SILENT, NULL) < 0)
         err (EXIT_FAILURE, "failed to make initial bind mount %s", deploy_path);
     }
 
@@ -502,8 +569,10 @@ main (int argc, char *argv[])
                          g_variant_new_boolean (root_transient));
 
   /* This will result in a system with /sysroot read-only. Thus, two additional
-   * writable bind-mounts (for /etc and /var) are required later on. */
-  if (sysroot_readonly)
+   * writable bind-mounts (for /etc and /var) are required later on.  For a soft
+   * reboot, we run in PID 1's mount namespace of the booted system, where the
+   * sysroot is legitimately read-only already. */
+  if (sysroot_readonly && !soft_reboot)
     {
       if (!sysroot_currently_writable)
         errx (EXIT_FAILURE, OTCORE_SYSROOT_NOT_WRITEABLE, root_arg);
@@ -523,7 +592,8 @@ main (int argc, char *argv[])
         {
           if (snprintf (srcpath, sizeof (srcpath), "%s/boot", root_mountpoint) < 0)
             err (EXIT_FAILURE, "failed to assemble /boot path");
-          if (mount (srcpath, TMP_SYSROOT "/boot", NULL, MS_BIND | MS_SILENT, NULL) < 0)
+          const char *tmp_sysroot_boot = glnx_strjoina (tmp_sysroot, "/boot");
+          if (mount (srcpath, tmp_sysroot_boot, NULL, MS_BIND | MS_SILENT, NULL) < 0)
             err (EXIT_FAILURE, "failed to bind mount %s to boot", srcpath);
         }
     }
@@ -538,17 +608,20 @@ main (int argc, char *argv[])
                                                 &etc_transient, &error))
         errx (EXIT_FAILURE, "Failed to parse etc.transient value: %s", error->message);
 
-      static const char *tmp_sysroot_etc = TMP_SYSROOT "/etc";
+      const char *tmp_sysroot_etc = glnx_strjoina (tmp_sysroot, "/etc");
       if (etc_transient)
         {
+          if (soft_reboot)
+            errx (EXIT_FAILURE, "etc.transient is not supported with soft reboots");
+
           char *ovldir = "/run/ostree/transient-etc";
 
           g_variant_builder_add (&metadata_builder, "{sv}", OTCORE_RUN_BOOTED_KEY_TRANSIENT_ETC,
                                  g_variant_new_string (ovldir));
 
-          char *lowerdir = "usr/etc";
+          const char *lowerdir = "usr/etc";
           if (using_composefs)
-            lowerdir = TMP_SYSROOT "/usr/etc";
+            lowerdir = glnx_strjoina (tmp_sysroot, "/usr/etc");
 
           g_autofree char *upperdir = g_build_filename (ovldir, "upper", NULL);
           g_autofree char *workdir = g_build_filename (ovldir, "work", NULL);
@@ -573,10 +646,10 @@ main (int argc, char *argv[])
         {
           /* Bind-mount /etc (at deploy path), and remount as writable. */
           if (mount ("etc", tmp_sysroot_etc, NULL, MS_BIND | MS_SILENT, NULL) < 0)
-            err (EXIT_FAILURE, "failed to prepare /etc bind-mount at /sysroot.tmp/etc");
+            err (EXIT_FAILURE, "failed to prepare /etc bind-mount at %s", tmp_sysroot_etc);
           if (mount (tmp_sysroot_etc, tmp_sysroot_etc, NULL, MS_BIND | MS_REMOUNT | MS_SILENT, NULL)
               < 0)
-            err (EXIT_FAILURE, "failed to make writable /etc bind-mount at /sysroot.tmp/etc");
+            err (EXIT_FAILURE, "failed to make writable /etc bind-mount at %s", tmp_sysroot_etc);
         }
     }
 
@@ -587,27 +660,28 @@ main (int argc, char *argv[])
    * --hotfix.
    * Also, hotfixes are incompatible with signed composefs use for security reasons.
    */
+  const char *tmp_sysroot_usr = glnx_strjoina (tmp_sysroot, "/usr");
   if (lstat (OTCORE_HOTFIX_USR_OVL_WORK, &stbuf) == 0
       && !(using_composefs && composefs_config->is_signed))
     {
       /* Do we have a persistent overlayfs for /usr?  If so, mount it now. */
-      const char usr_ovl_options[]
-          = "lowerdir=" TMP_SYSROOT
-            "/usr,upperdir=.usr-ovl-upper,workdir=" OTCORE_HOTFIX_USR_OVL_WORK;
+      g_autofree char *usr_ovl_options
+          = g_strdup_printf ("lowerdir=%s,upperdir=.usr-ovl-upper,workdir=%s", tmp_sysroot_usr,
+                             OTCORE_HOTFIX_USR_OVL_WORK);
 
       unsigned long mflags = MS_SILENT;
       // Propagate readonly state
       if (!sysroot_currently_writable)
         mflags |= MS_RDONLY;
-      if (mount ("overlay", TMP_SYSROOT "/usr", "overlay", mflags, usr_ovl_options) < 0)
+      if (mount ("overlay", tmp_sysroot_usr, "overlay", mflags, usr_ovl_options) < 0)
         err (EXIT_FAILURE, "failed to mount /usr overlayfs");
     }
   else if (!using_composefs)
     {
       /* Otherwise, a read-only bind mount for /usr. (Not needed for composefs) */
-      if (mount (TMP_SYSROOT "/usr", TMP_SYSROOT "/usr", NULL, MS_BIND | MS_SILENT, NULL) < 0)
+      if (mount (tmp_sysroot_usr, tmp_sysroot_usr, NULL, MS_BIND | MS_SILENT, NULL) < 0)
         err (EXIT_FAILURE, "failed to bind mount (class:readonly) /usr");
-      if (mount (TMP_SYSROOT "/usr", TMP_SYSROOT "/usr", NULL,
+      if (mount (tmp_sysroot_usr, tmp_sysroot_usr, NULL,
                  MS_BIND | MS_REMOUNT | MS_RDONLY | MS_SILENT, NULL)
           < 0)
         err (EXIT_FAILURE, "failed to bind mount (class:readonly) /usr");
@@ -615,8 +689,9 @@ main (int argc, char *argv[])
 
   /* Prepare /var.
    * When a read-only sysroot is configured, this adds a dedicated bind-mount (to itself)
-   * so that the stateroot location stays writable. */
-  if (sysroot_readonly)
+   * so that the stateroot location stays writable.  For a soft reboot, that was already
+   * done at boot, for the same stateroot. */
+  if (sysroot_readonly && !soft_reboot)
     {
       /* Bind-mount /var (at stateroot path), and remount as writable. */
       if (mount ("../../var", "../../var", NULL, MS_BIND | MS_SILENT, NULL) < 0)
@@ -642,7 +717,8 @@ main (int argc, char *argv[])
    */
   if (mount_var)
     {
-      if (mount ("../../var", TMP_SYSROOT "/var", NULL, MS_BIND | MS_SILENT, NULL) < 0)
+      const char *tmp_sysroot_var = glnx_strjoina (tmp_sysroot, "/var");
+      if (mount ("../../var", tmp_sysroot_var, NULL, MS_BIND | MS_SILENT, NULL) < 0)
         err (EXIT_FAILURE, "failed to bind mount ../../var to var");
     }
 
@@ -650,11 +726,34 @@ main (int argc, char *argv[])
   {
     g_autoptr (GVariant) metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
     const guint8 *buf = g_variant_get_data (metadata) ?: (guint8 *)"";
-    if (!glnx_file_replace_contents_at (AT_FDCWD, OTCORE_RUN_BOOTED, buf,
-                                        g_variant_get_size (metadata), 0, NULL, &error))
-      errx (EXIT_FAILURE, "Writing %s: %s", OTCORE_RUN_BOOTED, error->message);
+    // The booted root's metadata stays in place until we switch
+    const char *run_booted = soft_reboot ? OTCORE_RUN_NEXTROOT_BOOTED : OTCORE_RUN_BOOTED;
+    if (!glnx_file_replace_contents_at (AT_FDCWD, run_booted, buf, g_variant_get_size (metadata),
+                                        0, NULL, &error))
+      errx (EXIT_FAILURE, "Writing %s: %s", run_booted, error->message);
   }
 
+  /* For a soft reboot, the root is already where it needs to be; all that's
+   * left is the physical root, which stays mounted at root_mountpoint here.
+   */
+  if (soft_reboot)
+    {
+      const char *tmp_sysroot_sysroot = glnx_strjoina (tmp_sysroot, "/sysroot");
+      if (mount (root_mountpoint, tmp_sysroot_sysroot, NULL, MS_BIND | MS_REC | MS_SILENT, NULL)
+          < 0)
+        err (EXIT_FAILURE, "failed to bind mount %s to %s", root_mountpoint, tmp_sysroot_sysroot);
+      if (sysroot_readonly)
+        {
+          if (mount (tmp_sysroot_sysroot, tmp_sysroot_sysroot, NULL,
+                     MS_BIND | MS_REMOUNT | MS_RDONLY | MS_SILENT, NULL)
+              < 0)
+            err (EXIT_FAILURE, "failed to make %s read-only", tmp_sysroot_sysroot);
+        }
+      if (mount ("none", tmp_sysroot_sysroot, NULL, MS_PRIVATE | MS_SILENT, NULL) < 0)
+        err (EXIT_FAILURE, "remounting '%s' private", tmp_sysroot_sysroot);
+      exit (EXIT_SUCCESS);
+    }
+
   if (chdir (TMP_SYSROOT) < 0)
     err (EXIT_FAILURE, "failed to chdir to " TMP_SYSROOT);
 
@@ -133,11 +133,38 @@ relabel_dir_for_upper (const char *upper_path, const char *real_path, gboolean i
 #endif
 }
 
+/* If we got here through a soft reboot into a root prepared by
+ * `ostree-prepare-root --soft-reboot`, its metadata replaces that of the
+ * previous root.  systemd has moved /run/nextroot to / by then, so if it's
+ * still a mount point, we weren't switched to it.
+ */
+static void
+adopt_nextroot_metadata (void)
+{
+  struct stat stbuf;
+  if (lstat (OTCORE_RUN_NEXTROOT_BOOTED, &stbuf) < 0)
+    {
+      if (errno != ENOENT)
+        err (EXIT_FAILURE, "failed to stat %s", OTCORE_RUN_NEXTROOT_BOOTED);
+      return;
+    }
+
+  struct stat run_stbuf;
+  if (stat ("/run", &run_stbuf) < 0)
+    err (EXIT_FAILURE, "failed to stat /run");
+  if (stat (OTCORE_RUN_NEXTROOT, &stbuf) == 0 && stbuf.st_dev != run_stbuf.st_dev)
+    return;
+
+  if (rename (OTCORE_RUN_NEXTROOT_BOOTED, OTCORE_RUN_BOOTED) < 0)
+    err (EXIT_FAILURE, "failed to rename %s", OTCORE_RUN_NEXTROOT_BOOTED);
+}
+
 int
 main (int argc, char *argv[])
 {
   g_autoptr (GError) error = NULL;
   g_autoptr (GVariant) ostree_run_metadata_v = NULL;
+  adopt_nextroot_metadata ();
   {
     glnx_autofd int fd = open (OTCORE_RUN_BOOTED, O_RDONLY | O_CLOEXEC);
     if (fd < 0)
@@ -19,7 +19,7 @@
 
 set -euo pipefail
 
-echo "1..$((90 + ${extra_basic_tests:-0}))"
+echo "1..$((91 + ${extra_basic_tests:-0}))"
 
 CHECKOUT_U_ARG=""
 CHECKOUT_H_ARGS="-H"
@@ -279,6 +279,21 @@ $OSTREE commit ${COMMIT_ARGS} -b test2-custom-parent -s '' --parent=${prevparent
 assert_streq $($OSTREE log test2-custom-parent |grep '^commit' | wc -l) "3"
 echo "ok commit custom parent"
 
+cd ${test_tmpdir}
+rm -rf large-dir
+mkdir -p large-dir/subdir
+for i in $(seq 5000); do echo $i > large-dir/file-$i; done
+$OSTREE commit ${COMMIT_ARGS} -b test-large-dir -s '' large-dir
+$OSTREE fsck
+$OSTREE ls test-large-dir > ls.txt
+assert_streq "$(grep -c ' /file-' ls.txt)" "5000"
+assert_file_has_content ls.txt ' /subdir$'
+$OSTREE cat test-large-dir /file-4242 > file-4242.txt
+assert_file_has_content file-4242.txt '^4242$'
+$OSTREE refs --delete test-large-dir
+rm -rf large-dir ls.txt file-4242.txt
+echo "ok commit large directory"
+
 cd ${test_tmpdir}
 orphaned_rev=$($OSTREE commit ${COMMIT_ARGS} --orphan -s "$(date)" $test_tmpdir/checkout-test2-4)
 $OSTREE ls ${orphaned_rev} >/dev/null
@@ -313,6 +328,14 @@ else
         checkout_content_checksum=$(sha256sum $fn | cut -f1 -d' ')
         assert_streq "$object_content_checksum" "$checkout_content_checksum"
     done
+    # Multiple paths are checksummed in parallel; verify against the single-file path
+    find checksum-test/ -type f | sort > checksum-test-files
+    $CMD_PREFIX ostree checksum $CHECKSUM_FLAG $(cat checksum-test-files) > checksum-batch
+    assert_streq "$(wc -l < checksum-batch)" "$(wc -l < checksum-test-files)"
+    while read fn; do
+        checksum=$($CMD_PREFIX ostree checksum $CHECKSUM_FLAG $fn)
+        assert_file_has_content_literal checksum-batch "${checksum}  ${fn}"
+    done < checksum-test-files
     echo "ok checksum CLI"
 fi
 
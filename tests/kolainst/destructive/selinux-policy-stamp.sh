@@ -0,0 +1,84 @@
+#!/bin/bash
+
+# Verify that the SELinux policy rebuild is only skipped when its inputs
+# (the /usr policy, semodule and the merged /etc/selinux) are unchanged
+# from the merge deployment.
+
+set -xeuo pipefail
+
+. ${KOLA_EXT_DATA}/libinsttest.sh
+
+require_writable_sysroot
+prepare_tmpdir
+
+backing_dir=/ostree/deploy/${host_osname}/backing
+
+# Deploy @1, and set new_stamp to the policy stamp of the new deployment and
+# log.txt to what was logged meanwhile.
+deploy_and_log() {
+  cursor=$(journalctl -n 0 --show-cursor | sed -e 's,^-- cursor: ,,')
+  ostree admin deploy --karg-proc-cmdline "$1"
+  journalctl --after-cursor "${cursor}" -o cat > log.txt
+  new_csum=$(rpm-ostree status --json | jq -r '.deployments[0].checksum')
+  new_serial=$(rpm-ostree status --json | jq -r '.deployments[0].serial')
+  new_stamp=${backing_dir}/${new_csum}.${new_serial}/selinux-policy
+}
+
+stamp_value() {
+  grep "^$2=" "$1" | cut -d = -f 2-
+}
+
+case "${AUTOPKGTEST_REBOOT_MARK:-}" in
+  "")
+    # Get a booted deployment with a stamp of its own
+    deploy_and_log ${host_refspec}
+    for key in usr etc semodule refresh; do
+      assert_file_has_content ${new_stamp} "^${key}="
+    done
+    /tmp/autopkgtest-reboot "2"
+    ;;
+  "2")
+    booted_stamp=${backing_dir}/${host_commit}.$(rpm-ostree status --json | \
+      jq -r '.deployments[] | select(.booted) | .serial')/selinux-policy
+    test -f ${booted_stamp}
+
+    # Nothing changed: the merged policy is reused as is
+    deploy_and_log ${host_refspec}
+    assert_file_has_content log.txt 'SELinux policy unchanged from merge deployment'
+    assert_not_file_has_content log.txt 'Refreshing SELinux policy'
+    for key in usr etc semodule; do
+      assert_streq "$(stamp_value ${new_stamp} ${key})" "$(stamp_value ${booted_stamp} ${key})"
+    done
+    ostree admin undeploy 0
+
+    # A change to /etc/selinux shows up in its fingerprint
+    echo test > /etc/selinux/ostree-test-stamp
+    deploy_and_log ${host_refspec}
+    assert_file_has_content log.txt 'Refreshing SELinux policy'
+    assert_not_streq "$(stamp_value ${new_stamp} etc)" "$(stamp_value ${booted_stamp} etc)"
+    ostree admin undeploy 0
+    rm /etc/selinux/ostree-test-stamp
+
+    # So does a different semodule, even with the same policy
+    cd /ostree/repo/tmp
+    ostree checkout --fsync=0 -H ${host_commit} test-semodule
+    semodule=usr/sbin/semodule
+    if ! test -f test-semodule/${semodule}; then
+      semodule=usr/bin/semodule
+    fi
+    cp test-semodule/${semodule} test-semodule/${semodule}.new
+    echo >> test-semodule/${semodule}.new
+    mv test-semodule/${semodule}.new test-semodule/${semodule}
+    ostree commit --link-checkout-speedup --selinux-policy=test-semodule -b test-semodule \
+      --consume --tree=dir=test-semodule
+    cd -
+    deploy_and_log test-semodule
+    assert_file_has_content log.txt 'Refreshing SELinux policy'
+    assert_streq "$(stamp_value ${new_stamp} usr)" "$(stamp_value ${booted_stamp} usr)"
+    assert_not_streq "$(stamp_value ${new_stamp} semodule)" \
+      "$(stamp_value ${booted_stamp} semodule)"
+    ostree admin undeploy 0
+    ostree refs --delete test-semodule
+    ;;
+  *) fatal "Unexpected AUTOPKGTEST_REBOOT_MARK=${AUTOPKGTEST_REBOOT_MARK}" ;;
+esac
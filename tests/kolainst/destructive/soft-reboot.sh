@@ -0,0 +1,113 @@
+#!/bin/bash
+
+# Verify that `ostree admin upgrade --soft-reboot` only prepares /run/nextroot
+# when the boot configuration is unchanged, that changing the deployments
+# afterwards drops it again, and that `systemctl soft-reboot` then switches
+# to the new deployment with the usual (read-only) mounts.
+
+set -xeuo pipefail
+
+. ${KOLA_EXT_DATA}/libinsttest.sh
+
+prepare_tmpdir
+
+# Kept across the soft reboot
+state=/var/tmp/ostree-test-soft-reboot
+
+# Add a new commit to the soft-reboot ref, so there's something to upgrade to
+new_commit() {
+  ostree commit --no-bindings -b soft-reboot --tree=ref=${host_commit} \
+    --add-metadata-string=ostree.test-soft-reboot="$(date +%s.%N)"
+}
+
+# /sysroot may be read-only; only make it writable in a private mount namespace,
+# so that the soft reboot below sees the same mounts as a real boot would.
+copy_to_sysroot() {
+  unshare -m /bin/sh -c 'mount -o remount,rw /sysroot && cp "$1" "$2"' sh "$1" "$2"
+}
+
+assert_soft_reboot_prepared() {
+  mountpoint -q /run/nextroot
+  test -f /run/ostree/nextroot-booted
+}
+
+assert_no_soft_reboot() {
+  if mountpoint -q /run/nextroot; then
+    fatal "/run/nextroot is still mounted"
+  fi
+  test '!' -f /run/ostree/nextroot-booted
+}
+
+case "${AUTOPKGTEST_REBOOT_MARK:-}" in
+  "")
+    # `ostree admin upgrade` follows the origin of the booted deployment; point
+    # that at the local soft-reboot ref for the duration of the test.
+    mkdir -p ${state}
+    rpm-ostree status --json | jq -r '.deployments[] | select(.booted) |
+      "/ostree/deploy/\(.osname)/deploy/\(.checksum).\(.serial).origin"' > ${state}/origin-path
+    origin_path=$(cat ${state}/origin-path)
+    cp ${origin_path} ${state}/orig.origin
+    printf '[origin]\nrefspec=soft-reboot\n' > soft-reboot.origin
+    copy_to_sysroot soft-reboot.origin ${origin_path}
+
+    # Same kernel, initramfs and kargs
+    new_commit
+    ostree admin upgrade --soft-reboot > out.txt
+    assert_file_has_content out.txt 'Prepared soft reboot'
+    assert_soft_reboot_prepared
+
+    # Writing out deployments drops it
+    ostree admin undeploy 0
+    assert_no_soft_reboot
+
+    # So does a cleanup
+    new_commit
+    ostree admin upgrade --soft-reboot
+    assert_soft_reboot_prepared
+    ostree admin cleanup
+    assert_no_soft_reboot
+
+    # And staging a deployment
+    new_commit
+    ostree admin upgrade --soft-reboot
+    assert_soft_reboot_prepared
+    ostree admin deploy --stage soft-reboot
+    assert_no_soft_reboot
+    ostree admin undeploy 0
+
+    # Now actually switch to it
+    new_commit
+    ostree admin upgrade --soft-reboot
+    assert_soft_reboot_prepared
+    ostree rev-parse soft-reboot > ${state}/expected-commit
+    cat /proc/sys/kernel/random/boot_id > ${state}/boot-id
+    findmnt -no OPTIONS /sysroot > ${state}/sysroot-options
+    /tmp/autopkgtest-soft-reboot "2"
+    ;;
+  "2")
+    # Userspace restarted, but not the kernel
+    assert_streq "$(cat /proc/sys/kernel/random/boot_id)" "$(cat ${state}/boot-id)"
+    test -f /run/ostree-booted
+    assert_no_soft_reboot
+    booted=$(rpm-ostree status --json | jq -r '.deployments[] | select(.booted) | .checksum')
+    assert_streq "${booted}" "$(cat ${state}/expected-commit)"
+
+    # The new root is set up as at boot: /usr is read-only, and so is /sysroot
+    # if it was before
+    findmnt -no OPTIONS -T /usr > usr-options.txt
+    assert_file_has_content usr-options.txt '^ro\b'
+    findmnt -no OPTIONS /sysroot > sysroot-options.txt
+    if grep -q '^ro\b' ${state}/sysroot-options; then
+      assert_file_has_content sysroot-options.txt '^ro\b'
+    fi
+    touch /etc/ostree-test-soft-reboot
+    rm /etc/ostree-test-soft-reboot
+
+    # Back to the original deployment and origin for the next boot
+    copy_to_sysroot ${state}/orig.origin $(cat ${state}/origin-path)
+    ostree admin set-default 1
+    ostree refs --delete soft-reboot
+    rm -rf ${state}
+    ;;
+  *) fatal "Unexpected AUTOPKGTEST_REBOOT_MARK=${AUTOPKGTEST_REBOOT_MARK}" ;;
+esac
@@ -0,0 +1,85 @@
+#!/bin/bash
+set -xeuo pipefail
+
+. ${KOLA_EXT_DATA}/libinsttest.sh
+
+# Like state-overlay.sh, but with --prune-changed-only: on upgrade, only
+# shadowings of paths which changed in the new commit are dropped.
+
+case "${AUTOPKGTEST_REBOOT_MARK:-}" in
+  "")
+    mkdir -p /var/tmp/rootfs/foobar
+    (cd /var/tmp/rootfs/foobar
+     echo 'foobar' > a_changed_file
+     echo 'foobar' > an_unchanged_file
+     echo 'foobar' > a_changed_file_to_delete
+     ln -s foobar a_changed_symlink
+     mkdir -p a_deeply/nested/subdir
+     echo foobar > a_deeply/nested/subdir/changed
+     echo foobar > a_deeply/nested/subdir/unchanged
+     echo foobar > a_file_becoming_a_dir
+    )
+
+    ostree commit --no-bindings -P -b foobar --tree=ref="${host_commit}" --tree=dir=/var/tmp/rootfs
+    rpm-ostree rebase :foobar
+    mkdir -p /etc/systemd/system/ostree-state-overlay@foobar.service.d
+    cat > /etc/systemd/system/ostree-state-overlay@foobar.service.d/changed-only.conf <<'EOF'
+[Service]
+ExecStart=
+ExecStart=/usr/bin/ostree admin state-overlay --prune-changed-only %i /%I
+EOF
+    systemctl enable ostree-state-overlay@foobar.service
+    /tmp/autopkgtest-reboot "2"
+    ;;
+  "2")
+    if [[ $(findmnt /foobar -no SOURCE) != overlay ]]; then
+      fatal "/foobar is not overlay"
+    fi
+
+    cd /foobar
+
+    echo "state" > state
+    echo "state" > a_deeply/nested/subdir/state
+
+    echo shadow > a_changed_file
+    echo shadow > an_unchanged_file
+    rm a_changed_file_to_delete
+    ln -sf shadow a_changed_symlink
+    echo shadow > a_deeply/nested/subdir/changed
+    echo shadow > a_deeply/nested/subdir/unchanged
+    echo shadow > a_file_becoming_a_dir
+
+    # upgrade to a commit changing some of the shadowed paths
+    (cd /var/tmp/rootfs/foobar
+     echo 'changed' > a_changed_file
+     echo 'changed' > a_changed_file_to_delete
+     ln -sf changed a_changed_symlink
+     echo changed > a_deeply/nested/subdir/changed
+     rm a_file_becoming_a_dir
+     mkdir a_file_becoming_a_dir
+     echo changed > a_file_becoming_a_dir/file
+    )
+    ostree commit --no-bindings -P -b foobar --tree=ref="${host_commit}" --tree=dir=/var/tmp/rootfs
+    rpm-ostree upgrade
+    /tmp/autopkgtest-reboot "3"
+    ;;
+  "3")
+    cd /foobar
+
+    # state is still there
+    assert_file_has_content state state
+    assert_file_has_content a_deeply/nested/subdir/state state
+
+    # shadowings of changed paths are gone
+    assert_file_has_content a_changed_file changed
+    assert_file_has_content a_changed_file_to_delete changed
+    [[ $(readlink a_changed_symlink) == changed ]]
+    assert_file_has_content a_deeply/nested/subdir/changed changed
+    assert_file_has_content a_file_becoming_a_dir/file changed
+
+    # shadowings of unchanged paths are kept
+    assert_file_has_content an_unchanged_file shadow
+    assert_file_has_content a_deeply/nested/subdir/unchanged shadow
+    ;;
+  *) fatal "Unexpected AUTOPKGTEST_REBOOT_MARK=${AUTOPKGTEST_REBOOT_MARK}" ;;
+esac
@@ -52,7 +52,7 @@ function verify_initial_contents() {
     assert_file_has_content baz/cow '^moo$'
 }
 
-n_base_tests=35
+n_base_tests=37
 gpg_tests=3
 if has_ostree_feature gpgme; then
     echo "1..$(($n_base_tests+$gpg_tests))"
@@ -491,6 +491,54 @@ assert_not_has_file baz/saucer
 
 echo "ok static delta"
 
+# Repos sharing a cache dir reuse each other's delta downloads
+cd ${test_tmpdir}
+rm -rf delta-cache
+mkdir delta-cache
+repo_init --no-sign-verify
+${CMD_PREFIX} ostree --repo=repo config set core.delta-cache-max-size 100MB
+${CMD_PREFIX} ostree --repo=repo pull origin main@${prev_rev}
+${CMD_PREFIX} ostree --repo=repo pull --cache-dir=delta-cache --require-static-deltas origin main
+find delta-cache/deltas -type f ! -name .lock > cached-deltas.txt
+assert_file_has_content cached-deltas.txt '/[0-9a-f][0-9a-f]/[0-9a-f]\{62\}$'
+mv ostree-srv/gnomerepo/deltas ostree-srv/gnomerepo/deltas.bak
+repo_init --no-sign-verify
+${CMD_PREFIX} ostree --repo=repo config set core.delta-cache-max-size 100MB
+${CMD_PREFIX} ostree --repo=repo pull origin main@${prev_rev}
+${CMD_PREFIX} ostree --repo=repo pull --verbose --cache-dir=delta-cache --require-static-deltas \
+  origin main > pull-cached.txt 2>&1
+mv ostree-srv/gnomerepo/deltas.bak ostree-srv/gnomerepo/deltas
+# Cached parts are applied from the deltapart queue, like fetched ones
+assert_file_has_content pull-cached.txt 'applying cached deltapart'
+assert_not_file_has_content pull-cached.txt 'starting fetch of deltapart'
+${CMD_PREFIX} ostree --repo=repo fsck
+assert_streq "${new_rev}" "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:main)"
+rm -rf delta-cache
+echo "ok static delta cache"
+
+# Deltas of several refs which share a part only fetch it once
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo commit ${COMMIT_ARGS} -b main-copy \
+  -s 'copy of main' --tree=ref=main
+copy_rev=$(${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo rev-parse main-copy)
+for rev in ${new_rev} ${copy_rev}; do
+    ${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo static-delta generate --empty --to=${rev}
+done
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo summary -u
+repo_init --no-sign-verify
+${CMD_PREFIX} ostree --repo=repo pull --verbose --require-static-deltas origin main main-copy \
+  > pull-shared.txt 2>&1
+assert_file_has_content pull-shared.txt 'part 0 already requested'
+grep -c 'starting fetch of deltapart' pull-shared.txt > n-fetches.txt || true
+assert_streq "$(cat n-fetches.txt)" "1"
+${CMD_PREFIX} ostree --repo=repo fsck
+assert_streq "${copy_rev}" "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:main-copy)"
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo static-delta delete "${copy_rev}"
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo static-delta delete "${new_rev}"
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo refs --delete main-copy
+${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo summary -u
+echo "ok static delta parts shared between refs"
+
 cd ${test_tmpdir}
 ${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo static-delta generate --swap-endianness main
 ${CMD_PREFIX} ostree --repo=ostree-srv/gnomerepo summary -u
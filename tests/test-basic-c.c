@@ -433,6 +433,75 @@ test_big_metadata (void)
   g_assert (ret);
 }
 
+/* Dirtrees this large are streamed to disk rather than built in memory;
+ * make sure we end up with exactly the same object either way.
+ */
+static void
+test_large_dirtree (gconstpointer data)
+{
+  OstreeRepo *repo = (void *)data;
+  g_autoptr (GError) error = NULL;
+  const guint n_files = 5000;
+  const char *file_checksum = "8d6b1f4c2ad3a8f6c9b7e6d5a4c3b2a1908f7e6d5c4b3a29180f7e6d5c4b3a29";
+  const char *meta_checksum = "5e8a8d4c9a0c7b1e0bd3c38f1c1ad0f0d7a3cb4a0b7e4e8c1ddc6a1f8e1c2b3a";
+
+  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  ostree_mutable_tree_set_metadata_checksum (mtree, meta_checksum);
+  g_autoptr (OstreeMutableTree) subdir = NULL;
+  g_assert (ostree_mutable_tree_ensure_dir (mtree, "subdir", &subdir, &error));
+  g_assert_no_error (error);
+  ostree_mutable_tree_set_metadata_checksum (subdir, meta_checksum);
+
+  /* The expected tree, built in memory; names are zero-padded so that
+   * they're added in sorted order.
+   */
+  GVariantBuilder files_builder;
+  g_variant_builder_init (&files_builder, G_VARIANT_TYPE ("a(say)"));
+  for (guint i = 0; i < n_files; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("file-%05u", i);
+      g_assert (ostree_mutable_tree_replace_file (mtree, name, file_checksum, &error));
+      g_assert_no_error (error);
+      g_variant_builder_add (&files_builder, "(s@ay)", name,
+                             ostree_checksum_to_bytes_v (file_checksum));
+    }
+  g_autoptr (GVariant) empty_tree = g_variant_ref_sink (
+      g_variant_new ("(@a(say)@a(sayay))", g_variant_new_array (G_VARIANT_TYPE ("(say)"), NULL, 0),
+                     g_variant_new_array (G_VARIANT_TYPE ("(sayay)"), NULL, 0)));
+  g_autofree char *empty_tree_checksum = g_compute_checksum_for_data (
+      G_CHECKSUM_SHA256, g_variant_get_data (empty_tree), g_variant_get_size (empty_tree));
+  GVariantBuilder dirs_builder;
+  g_variant_builder_init (&dirs_builder, G_VARIANT_TYPE ("a(sayay)"));
+  g_variant_builder_add (&dirs_builder, "(s@ay@ay)", "subdir",
+                         ostree_checksum_to_bytes_v (empty_tree_checksum),
+                         ostree_checksum_to_bytes_v (meta_checksum));
+  g_autoptr (GVariant) expected_tree = g_variant_ref_sink (
+      g_variant_new ("(@a(say)@a(sayay))", g_variant_builder_end (&files_builder),
+                     g_variant_builder_end (&dirs_builder)));
+  g_autoptr (GVariant) expected_normal = g_variant_get_normal_form (expected_tree);
+  g_autofree char *expected_checksum
+      = g_compute_checksum_for_data (G_CHECKSUM_SHA256, g_variant_get_data (expected_normal),
+                                     g_variant_get_size (expected_normal));
+
+  g_assert (ostree_repo_prepare_transaction (repo, NULL, NULL, &error));
+  g_assert_no_error (error);
+  g_autoptr (GFile) root = NULL;
+  g_assert (ostree_repo_write_mtree (repo, mtree, &root, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (ostree_repo_commit_transaction (repo, NULL, NULL, &error));
+  g_assert_no_error (error);
+
+  const char *contents_checksum
+      = ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root));
+  g_assert_cmpstr (contents_checksum, ==, expected_checksum);
+
+  g_autoptr (GVariant) stored_tree = NULL;
+  g_assert (ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, contents_checksum,
+                                      &stored_tree, &error));
+  g_assert_no_error (error);
+  g_assert (g_variant_equal (stored_tree, expected_normal));
+}
+
 static void
 compare_xattrs (GVariant *orig, GVariant *new)
 {
@@ -530,6 +599,357 @@ test_dirmeta_xattrs (void)
   g_assert_error (local_error, G_IO_ERROR, G_IO_ERROR_FAILED);
 }
 
+#define CONCURRENT_READ_THREADS 8
+#define CONCURRENT_READ_ITERATIONS 25
+
+typedef struct
+{
+  OstreeRepo *repo;
+  const char *commit;
+  guint n_reachable;
+} ConcurrentReadData;
+
+/* Exercise the read APIs of a single repo, checking they agree with what
+ * the main thread found.
+ */
+static gpointer
+concurrent_read_thread (gpointer user_data)
+{
+  ConcurrentReadData *data = user_data;
+  g_autoptr (GError) error = NULL;
+
+  for (guint i = 0; i < CONCURRENT_READ_ITERATIONS; i++)
+    {
+      g_autofree char *commit = NULL;
+      ostree_repo_resolve_rev (data->repo, "test2", FALSE, &commit, &error);
+      g_assert_no_error (error);
+      g_assert_cmpstr (commit, ==, data->commit);
+
+      g_autoptr (GHashTable) reachable = NULL;
+      ostree_repo_traverse_commit (data->repo, commit, -1, &reachable, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpuint (g_hash_table_size (reachable), ==, data->n_reachable);
+
+      GLNX_HASH_TABLE_FOREACH (reachable, GVariant *, object)
+        {
+          const char *checksum;
+          OstreeObjectType objtype;
+          ostree_object_name_deserialize (object, &checksum, &objtype);
+
+          gboolean have_object = FALSE;
+          ostree_repo_has_object (data->repo, objtype, checksum, &have_object, NULL, &error);
+          g_assert_no_error (error);
+          g_assert (have_object);
+
+          if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+            {
+              g_autoptr (GVariant) variant = NULL;
+              ostree_repo_load_variant (data->repo, objtype, checksum, &variant, &error);
+              g_assert_no_error (error);
+              g_autofree char *actual = g_compute_checksum_for_data (
+                  G_CHECKSUM_SHA256, g_variant_get_data (variant), g_variant_get_size (variant));
+              g_assert_cmpstr (actual, ==, checksum);
+            }
+          else
+            {
+              g_autoptr (GInputStream) input = NULL;
+              g_autoptr (GFileInfo) info = NULL;
+              g_autoptr (GVariant) xattrs = NULL;
+              ostree_repo_load_file (data->repo, checksum, &input, &info, &xattrs, NULL, &error);
+              g_assert_no_error (error);
+              g_autofree guchar *csum = NULL;
+              ostree_checksum_file_from_input (info, xattrs, input, objtype, &csum, NULL, &error);
+              g_assert_no_error (error);
+              g_autofree char *actual = ostree_checksum_from_bytes (csum);
+              g_assert_cmpstr (actual, ==, checksum);
+            }
+        }
+
+      g_autoptr (GFile) root = NULL;
+      ostree_repo_read_commit (data->repo, commit, &root, NULL, NULL, &error);
+      g_assert_no_error (error);
+      g_assert (ostree_repo_get_path (data->repo) != NULL);
+    }
+
+  /* Checkouts share the dirmeta cache */
+  g_auto (GLnxTmpDir) tmpdir = {
+    0,
+  };
+  glnx_mkdtemp ("test-concurrent-checkout-XXXXXX", 0700, &tmpdir, &error);
+  g_assert_no_error (error);
+  OstreeRepoCheckoutAtOptions options = {
+    0,
+  };
+  options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
+  ostree_repo_checkout_at (data->repo, &options, tmpdir.fd, "checkout", data->commit, NULL,
+                           &error);
+  g_assert_no_error (error);
+  glnx_tmpdir_delete (&tmpdir, NULL, &error);
+  g_assert_no_error (error);
+
+  return NULL;
+}
+
+static void
+test_concurrent_reads (gconstpointer user_data)
+{
+  OstreeRepo *repo = OSTREE_REPO (user_data);
+  g_autoptr (GError) error = NULL;
+  g_autofree char *commit = NULL;
+
+  ostree_repo_resolve_rev (repo, "test2", FALSE, &commit, &error);
+  g_assert_no_error (error);
+  g_autoptr (GHashTable) reachable = NULL;
+  ostree_repo_traverse_commit (repo, commit, -1, &reachable, NULL, &error);
+  g_assert_no_error (error);
+
+  ConcurrentReadData data = { repo, commit, g_hash_table_size (reachable) };
+  GThread *threads[CONCURRENT_READ_THREADS];
+  for (guint i = 0; i < G_N_ELEMENTS (threads); i++)
+    threads[i] = g_thread_new ("concurrent-read", concurrent_read_thread, &data);
+  for (guint i = 0; i < G_N_ELEMENTS (threads); i++)
+    g_thread_join (threads[i]);
+}
+
+#define CONCURRENT_TRANSACTIONS 4
+
+typedef struct
+{
+  OstreeTransaction *txn;
+  guint index;
+  char *commit;
+} ConcurrentTransactionData;
+
+/* Write a commit in the thread default transaction and stage a ref to it */
+static gpointer
+concurrent_transaction_thread (gpointer user_data)
+{
+  ConcurrentTransactionData *data = user_data;
+  OstreeRepo *repo = ostree_transaction_get_repo (data->txn);
+  g_autoptr (GError) error = NULL;
+
+  ostree_transaction_push_thread_default (data->txn);
+
+  g_autoptr (GFile) root = NULL;
+  ostree_repo_read_commit (repo, "test2", &root, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_autofree char *subject = g_strdup_printf ("Transaction %u", data->index);
+  ostree_repo_write_commit (repo, NULL, subject, NULL, NULL, OSTREE_REPO_FILE (root),
+                            &data->commit, NULL, &error);
+  g_assert_no_error (error);
+
+  g_autofree char *ref = g_strdup_printf ("txn%u", data->index);
+  ostree_repo_transaction_set_ref (repo, NULL, ref, data->commit);
+
+  /* This thread sees what it staged */
+  gboolean have_object = FALSE;
+  ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, data->commit, &have_object, NULL,
+                          &error);
+  g_assert_no_error (error);
+  g_assert (have_object);
+  g_autofree char *rev = NULL;
+  ostree_repo_resolve_rev (repo, ref, FALSE, &rev, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (rev, ==, data->commit);
+
+  ostree_transaction_pop_thread_default (data->txn);
+  return NULL;
+}
+
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  guint n_waiting;
+} ConcurrentSizesBarrier;
+
+typedef struct
+{
+  OstreeTransaction *txn;
+  guint index;
+  ConcurrentSizesBarrier *barrier;
+} ConcurrentSizesData;
+
+/* Write a tree with a file of its own in the thread default transaction,
+ * and once every thread has, commit it with object sizes; these only cover
+ * the objects of this transaction.
+ */
+static gpointer
+concurrent_sizes_thread (gpointer user_data)
+{
+  ConcurrentSizesData *data = user_data;
+  OstreeRepo *repo = ostree_transaction_get_repo (data->txn);
+  g_autoptr (GError) error = NULL;
+
+  ostree_transaction_push_thread_default (data->txn);
+
+  g_auto (GLnxTmpDir) tmpdir = {
+    0,
+  };
+  glnx_mkdtemp ("test-concurrent-sizes-XXXXXX", 0700, &tmpdir, &error);
+  g_assert_no_error (error);
+  g_autofree char *contents = g_strdup_printf ("Transaction %u", data->index);
+  glnx_file_replace_contents_at (tmpdir.fd, "file", (guint8 *)contents, strlen (contents), 0,
+                                 NULL, &error);
+  g_assert_no_error (error);
+
+  g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
+      OSTREE_REPO_COMMIT_MODIFIER_FLAGS_GENERATE_SIZES, NULL, NULL, NULL);
+  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  ostree_repo_write_dfd_to_mtree (repo, tmpdir.fd, ".", mtree, modifier, NULL, &error);
+  g_assert_no_error (error);
+  g_autoptr (GFile) root = NULL;
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+
+  g_mutex_lock (&data->barrier->lock);
+  data->barrier->n_waiting++;
+  g_cond_broadcast (&data->barrier->cond);
+  while (data->barrier->n_waiting < CONCURRENT_TRANSACTIONS)
+    g_cond_wait (&data->barrier->cond, &data->barrier->lock);
+  g_mutex_unlock (&data->barrier->lock);
+
+  g_autofree char *commit = NULL;
+  ostree_repo_write_commit (repo, NULL, contents, NULL, NULL, OSTREE_REPO_FILE (root), &commit,
+                            NULL, &error);
+  g_assert_no_error (error);
+
+  g_autoptr (GVariant) commit_variant = NULL;
+  ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit, &commit_variant, &error);
+  g_assert_no_error (error);
+  g_autoptr (GPtrArray) sizes = NULL;
+  ostree_commit_get_object_sizes (commit_variant, &sizes, &error);
+  g_assert_no_error (error);
+
+  /* The file, the root dirtree and its dirmeta */
+  g_assert_cmpuint (sizes->len, ==, 3);
+  g_autofree char *file_checksum = NULL;
+  g_autoptr (OstreeMutableTree) subdir = NULL;
+  ostree_mutable_tree_lookup (mtree, "file", &file_checksum, &subdir, &error);
+  g_assert_no_error (error);
+  gboolean found = FALSE;
+  for (guint i = 0; i < sizes->len; i++)
+    {
+      OstreeCommitSizesEntry *entry = sizes->pdata[i];
+      if (g_str_equal (entry->checksum, file_checksum))
+        {
+          g_assert_cmpint (entry->objtype, ==, OSTREE_OBJECT_TYPE_FILE);
+          g_assert_cmpuint (entry->unpacked, ==, strlen (contents));
+          found = TRUE;
+        }
+    }
+  g_assert (found);
+
+  ostree_transaction_pop_thread_default (data->txn);
+  return NULL;
+}
+
+static void
+test_concurrent_transactions (gconstpointer user_data)
+{
+  OstreeRepo *repo = OSTREE_REPO (user_data);
+  g_autoptr (GError) error = NULL;
+
+  ConcurrentTransactionData data[CONCURRENT_TRANSACTIONS] = {
+    0,
+  };
+  for (guint i = 0; i < G_N_ELEMENTS (data); i++)
+    {
+      data[i].txn = ostree_transaction_new (repo, NULL, &error);
+      g_assert_no_error (error);
+      data[i].index = i;
+    }
+
+  GThread *threads[CONCURRENT_TRANSACTIONS];
+  for (guint i = 0; i < G_N_ELEMENTS (threads); i++)
+    threads[i] = g_thread_new ("concurrent-txn", concurrent_transaction_thread, &data[i]);
+  for (guint i = 0; i < G_N_ELEMENTS (threads); i++)
+    g_thread_join (threads[i]);
+
+  for (guint i = 0; i < G_N_ELEMENTS (data); i++)
+    {
+      g_autofree char *ref = g_strdup_printf ("txn%u", i);
+
+      /* Nothing is visible outside the transaction until it's committed */
+      gboolean have_object = TRUE;
+      ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, data[i].commit, &have_object, NULL,
+                              &error);
+      g_assert_no_error (error);
+      g_assert (!have_object);
+      g_autofree char *rev = NULL;
+      ostree_repo_resolve_rev (repo, ref, TRUE, &rev, &error);
+      g_assert_no_error (error);
+      g_assert_null (rev);
+
+      OstreeRepoTransactionStats stats;
+      ostree_transaction_commit (data[i].txn, &stats, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpuint (stats.metadata_objects_written, ==, 1);
+
+      ostree_repo_resolve_rev (repo, ref, FALSE, &rev, &error);
+      g_assert_no_error (error);
+      g_assert_cmpstr (rev, ==, data[i].commit);
+      ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, data[i].commit, &have_object, NULL,
+                              &error);
+      g_assert_no_error (error);
+      g_assert (have_object);
+
+      /* Committing twice is an error, aborting afterwards does nothing */
+      g_assert_false (ostree_transaction_commit (data[i].txn, NULL, NULL, &error));
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+      g_clear_error (&error);
+      ostree_transaction_abort (data[i].txn, NULL, &error);
+      g_assert_no_error (error);
+
+      g_clear_pointer (&data[i].txn, ostree_transaction_unref);
+      g_free (data[i].commit);
+    }
+
+  /* An aborted transaction leaves nothing behind */
+  g_autoptr (OstreeTransaction) txn = ostree_transaction_new (repo, NULL, &error);
+  g_assert_no_error (error);
+  g_autofree char *commit = NULL;
+  ostree_repo_resolve_rev (repo, "test2", FALSE, &commit, &error);
+  g_assert_no_error (error);
+  ostree_transaction_set_ref (txn, NULL, "txn-aborted", commit);
+  ostree_transaction_abort (txn, NULL, &error);
+  g_assert_no_error (error);
+  g_autofree char *rev = NULL;
+  ostree_repo_resolve_rev (repo, "txn-aborted", TRUE, &rev, &error);
+  g_assert_no_error (error);
+  g_assert_null (rev);
+
+  /* Commits with object sizes only get those of their own transaction */
+  ConcurrentSizesBarrier barrier = {
+    0,
+  };
+  g_mutex_init (&barrier.lock);
+  g_cond_init (&barrier.cond);
+  ConcurrentSizesData sizes_data[CONCURRENT_TRANSACTIONS] = {
+    0,
+  };
+  for (guint i = 0; i < G_N_ELEMENTS (sizes_data); i++)
+    {
+      sizes_data[i].txn = ostree_transaction_new (repo, NULL, &error);
+      g_assert_no_error (error);
+      sizes_data[i].index = i;
+      sizes_data[i].barrier = &barrier;
+    }
+  GThread *sizes_threads[CONCURRENT_TRANSACTIONS];
+  for (guint i = 0; i < G_N_ELEMENTS (sizes_threads); i++)
+    sizes_threads[i] = g_thread_new ("concurrent-sizes", concurrent_sizes_thread, &sizes_data[i]);
+  for (guint i = 0; i < G_N_ELEMENTS (sizes_threads); i++)
+    g_thread_join (sizes_threads[i]);
+  for (guint i = 0; i < G_N_ELEMENTS (sizes_data); i++)
+    {
+      ostree_transaction_abort (sizes_data[i].txn, NULL, &error);
+      g_assert_no_error (error);
+      g_clear_pointer (&sizes_data[i].txn, ostree_transaction_unref);
+    }
+  g_mutex_clear (&barrier.lock);
+  g_cond_clear (&barrier.cond);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -545,12 +965,15 @@ main (int argc, char **argv)
   g_test_add_data_func ("/repo-not-system", repo, test_repo_is_not_system);
   g_test_add_data_func ("/raw-file-to-archive-stream", repo, test_raw_file_to_archive_stream);
   g_test_add_data_func ("/objectwrites", repo, test_object_writes);
+  g_test_add_data_func ("/large-dirtree", repo, test_large_dirtree);
   g_test_add_func ("/xattrs-devino-cache", test_devino_cache_xattrs);
   g_test_add_func ("/break-hardlink", test_break_hardlink);
   g_test_add_func ("/remotename", test_validate_remotename);
   g_test_add_func ("/big-metadata", test_big_metadata);
   g_test_add_func ("/read-xattrs", test_read_xattrs);
   g_test_add_func ("/dirmeta-xattrs", test_dirmeta_xattrs);
+  g_test_add_data_func ("/concurrent-reads", repo, test_concurrent_reads);
+  g_test_add_data_func ("/concurrent-transactions", repo, test_concurrent_transactions);
 
   return g_test_run ();
 out:
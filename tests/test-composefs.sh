@@ -48,4 +48,39 @@ assert_streq "${digest}" "031fab2c7f390b752a820146dc89f6880e5739cba7490f64024e0c
 composefs-info dump test2-co.cfs >/dev/null
 tap_ok "checkout composefs"
 
+# Generated images are cached and reused
+unset OSTREE_SKIP_CACHE
+rev=$($OSTREE rev-parse test-composefs)
+$OSTREE checkout --composefs test-composefs test2-co-cached.cfs
+ls repo/tmp/cache/composefs > cached.txt
+assert_file_has_content cached.txt "^${rev}\.v0$"
+$OSTREE checkout --composefs test-composefs test2-co-again.cfs
+cmp test2-co.cfs test2-co-cached.cfs
+cmp test2-co.cfs test2-co-again.cfs
+# A corrupted cache entry is discarded, as the commit has a composefs digest
+for f in repo/tmp/cache/composefs/*; do
+    rm -f "$f"
+    echo garbage > "$f"
+done
+rm test2-co-again.cfs
+$OSTREE checkout --composefs test-composefs test2-co-again.cfs
+cmp test2-co.cfs test2-co-again.cfs
+# Pruning only drops images for commits which are gone
+$OSTREE prune --refs-only
+ls repo/tmp/cache/composefs > cached.txt
+assert_file_has_content cached.txt "^${rev}\.v0$"
+# Unknown entries which aren't regular files are left alone
+mkdir repo/tmp/cache/composefs/somedir
+$OSTREE refs --delete test-composefs
+$OSTREE prune --refs-only
+ls repo/tmp/cache/composefs > cached.txt
+assert_not_file_has_content cached.txt "^${rev}\.v0$"
+assert_file_has_content cached.txt "^somedir$"
+# Commits without a composefs digest aren't cached
+test2_rev=$($OSTREE rev-parse test2)
+$OSTREE checkout --composefs test2 test2-nodigest.cfs
+ls repo/tmp/cache/composefs > cached.txt
+assert_not_file_has_content cached.txt "^${test2_rev}"
+tap_ok "composefs image cache"
+
 tap_end
@@ -26,7 +26,7 @@ skip_without_user_xattrs
 bindatafiles="bash true ostree"
 morebindatafiles="false ls"
 
-echo '1..14'
+echo '1..15'
 
 mkdir repo
 ostree_repo_init repo --mode=archive
@@ -317,6 +317,19 @@ ${CMD_PREFIX} ostree --repo=repo2 pull-local --require-static-deltas repo otherb
 
 echo 'ok rebase deltas'
 
+# Generate a delta while committing
+echo commit-time-delta > files/commit-time-delta
+otherrev=$(${CMD_PREFIX} ostree --repo=repo rev-parse otherbranch)
+${CMD_PREFIX} ostree --repo=repo commit -b otherbranch --tree=dir=files --generate-static-delta-from=otherbranch
+newotherrev=$(${CMD_PREFIX} ostree --repo=repo rev-parse otherbranch)
+${CMD_PREFIX} ostree --repo=repo static-delta list > deltas.txt
+assert_file_has_content deltas.txt "^${otherrev}-${newotherrev}$"
+${CMD_PREFIX} ostree --repo=repo summary -u
+${CMD_PREFIX} ostree --repo=repo2 pull-local --require-static-deltas repo otherbranch
+${CMD_PREFIX} ostree --repo=repo2 fsck
+
+echo 'ok commit --generate-static-delta-from'
+
 ${CMD_PREFIX} ostree --repo=repo summary -u
 if ${CMD_PREFIX} ostree --repo=repo static-delta show GARBAGE 2> err.txt; then
     assert_not_reached "static-delta show GARBAGE unexpectedly succeeded"
@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library. If not, see <https://www.gnu.org/licenses/>.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_fuse
+
+echo "1..4"
+
+cd ${test_tmpdir}
+mkdir -p files/subdir mnt
+echo first > files/firstfile
+ln -s firstfile files/firstfile-link
+# Larger than a decompression block, and not all the same
+for i in $(seq 50000); do echo "line $i"; done > files/subdir/bigfile
+cleanup_fuse() {
+    fusermount -u ${test_tmpdir}/mnt || true
+}
+libtest_exit_cmds+=(cleanup_fuse)
+
+for mode in bare archive; do
+    rm -rf repo-${mode}
+    ostree_repo_init repo-${mode} --mode=${mode}
+    ${CMD_PREFIX} ostree --repo=repo-${mode} commit -b test --tree=dir=files
+
+    ${CMD_PREFIX} ostree --repo=repo-${mode} mount --cache-size=1 test mnt
+    assert_file_has_content mnt/firstfile '^first$'
+    assert_streq "$(readlink mnt/firstfile-link)" firstfile
+    cmp mnt/subdir/bigfile files/subdir/bigfile
+    # Read from the middle, then backwards
+    assert_streq "$(tail -c +300000 mnt/subdir/bigfile | head -1)" \
+                 "$(tail -c +300000 files/subdir/bigfile | head -1)"
+    cmp mnt/subdir/bigfile files/subdir/bigfile
+    ls mnt > ls.txt
+    assert_file_has_content ls.txt '^subdir$'
+    if touch mnt/newfile 2>err.txt; then
+        fatal "created a file in a read-only mount"
+    fi
+    if echo foo > mnt/firstfile; then
+        fatal "wrote to a file in a read-only mount"
+    fi
+    fusermount -u mnt
+    echo "ok mount ${mode}"
+done
+
+if ${CMD_PREFIX} ostree --repo=repo-bare mount nosuchref mnt 2>err.txt; then
+    fatal "mounted a nonexistent ref"
+fi
+assert_file_has_content err.txt 'nosuchref'
+echo "ok mount nonexistent ref"
+
+${CMD_PREFIX} ostree --repo=repo-archive mount test mnt
+${CMD_PREFIX} ostree --repo=repo-archive checkout -U test checkout
+for i in $(seq 4); do
+    cat mnt/subdir/bigfile > out-$i.txt &
+done
+wait
+for i in $(seq 4); do
+    cmp out-$i.txt checkout/subdir/bigfile
+done
+fusermount -u mnt
+echo "ok mount concurrent reads"
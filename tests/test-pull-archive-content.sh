@@ -0,0 +1,118 @@
+#!/bin/bash
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library. If not, see <https://www.gnu.org/licenses/>.
+
+# Content objects pulled from an archive remote are linked into archive repos
+# as downloaded, and inflated directly into bare ones; check that both reject
+# objects which don't match what we'd have written ourselves.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..5"
+
+setup_fake_remote_repo1 "archive" "--canonical-permissions"
+
+cd ${test_tmpdir}
+srvrepo=ostree-srv/gnomerepo
+cp -a ${srvrepo} ${srvrepo}.orig
+cow=$(ostree_file_path_to_checksum ${srvrepo} main /baz/cow)
+cowpath=${srvrepo}/$(ostree_checksum_to_relative_object_path ${srvrepo} ${cow})
+
+reset_remote() {
+    rm -rf ${srvrepo}
+    cp -a ${srvrepo}.orig ${srvrepo}
+}
+
+init_repo() {
+    rm repo -rf
+    ostree_repo_init repo --mode=$1
+    ${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin \
+      $(cat httpd-address)/ostree/gnomerepo
+}
+
+assert_pull_fails() {
+    if ${CMD_PREFIX} ostree --repo=repo pull origin main 2>err.txt; then
+        fatal "pull of corrupted object succeeded"
+    fi
+    assert_file_has_content err.txt "$1"
+    if ${CMD_PREFIX} ostree --repo=repo show origin:main >/dev/null 2>&1; then
+        fatal "ref written despite corrupted object"
+    fi
+}
+
+for mode in archive bare-user-only; do
+    init_repo ${mode}
+    ${CMD_PREFIX} ostree --repo=repo pull origin main
+    ${CMD_PREFIX} ostree --repo=repo fsck
+    if test ${mode} = archive; then
+        cmp ${cowpath} repo/$(ostree_checksum_to_relative_object_path repo ${cow})
+    fi
+done
+echo "ok pull"
+
+# Garbage in the header padding doesn't change the object checksum, but it
+# would be stored as is
+python3 -c 'import sys
+path = sys.argv[1]
+data = bytearray(open(path, "rb").read())
+data[4:8] = b"\xff" * 4
+open(path, "wb").write(data)' ${cowpath}
+init_repo archive
+assert_pull_fails "Corrupted file object ${cow}; non-canonical header"
+reset_remote
+echo "ok non-canonical header"
+
+echo trailing >> ${cowpath}
+for mode in archive bare-user-only; do
+    init_repo ${mode}
+    assert_pull_fails "Corrupted file object ${cow}: Trailing data after compressed content"
+done
+reset_remote
+echo "ok trailing data"
+
+for mode in archive bare-user-only; do
+    init_repo ${mode}
+    echo 'min-free-space-size=1000000GB' >> repo/config
+    assert_pull_fails "min-free-space-size"
+done
+echo "ok min-free-space-size"
+
+# ostree_raw_file_to_archive_z2_stream() with no input writes just the header
+# for empty files, with no deflate stream at all
+reset_remote
+rm -rf srv-files
+${CMD_PREFIX} ostree --repo=${srvrepo} checkout -U main srv-files
+touch srv-files/empty
+${CMD_PREFIX} ostree --repo=${srvrepo} commit --canonical-permissions -b empty \
+  --tree=dir=srv-files
+empty=$(ostree_file_path_to_checksum ${srvrepo} empty /empty)
+emptypath=${srvrepo}/$(ostree_checksum_to_relative_object_path ${srvrepo} ${empty})
+python3 -c 'import sys
+path = sys.argv[1]
+data = open(path, "rb").read()
+header_size = int.from_bytes(data[0:4], "big")
+open(path, "wb").write(data[:8 + header_size])' ${emptypath}
+for mode in archive bare-user-only; do
+    init_repo ${mode}
+    ${CMD_PREFIX} ostree --repo=repo pull origin empty
+    ${CMD_PREFIX} ostree --repo=repo fsck
+    if test ${mode} = archive; then
+        cmp ${emptypath} repo/$(ostree_checksum_to_relative_object_path repo ${empty})
+    fi
+done
+echo "ok empty file without payload"
@@ -0,0 +1,122 @@
+#!/bin/bash
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library. If not, see <https://www.gnu.org/licenses/>.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..7"
+
+setup_fake_remote_repo1 "archive"
+
+srvrepo=${test_tmpdir}/ostree-srv/gnomerepo
+${CMD_PREFIX} ostree --repo=${srvrepo} config set core.generate-inventory true
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+assert_streq "$(ls ${srvrepo}/inventory/ | grep -c '^[0-9a-f]\{64\}\.index$')" "1"
+ls ${srvrepo}/inventory/ | grep -q '^[0-9a-f]\{64\}\.bucket$'
+echo "ok generate inventory"
+
+# Regenerating without changes yields the same files
+ls ${srvrepo}/inventory > inventory-before.txt
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+ls ${srvrepo}/inventory > inventory-after.txt
+assert_streq "$(cat inventory-after.txt)" "$(cat inventory-before.txt)"
+rm -f inventory-before.txt inventory-after.txt
+echo "ok inventory is reproducible"
+
+cd ${test_tmpdir}
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull --mirror --inventory origin
+${CMD_PREFIX} ostree --repo=repo fsck
+${CMD_PREFIX} ostree --repo=repo checkout -U main main-copy
+assert_file_has_content main-copy/baz/cow "moo"
+assert_file_has_content main-copy/baz/another/y "x"
+rm -rf main-copy
+echo "ok initial mirror with inventory"
+
+# Add a single new file; only the buckets of the new objects should be
+# fetched, and the mirror should end up with the full new commit.
+rm -rf ${test_tmpdir}/srv-files
+${CMD_PREFIX} ostree --repo=${srvrepo} checkout -U main ${test_tmpdir}/srv-files
+echo "new content" > ${test_tmpdir}/srv-files/baz/newfile
+${CMD_PREFIX} ostree --repo=${srvrepo} commit -b main --tree=dir=${test_tmpdir}/srv-files -s "New file"
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+truncate -s 0 ${test_tmpdir}/httpd/httpd.log
+${CMD_PREFIX} ostree --repo=repo pull --verbose --mirror --inventory origin > out.txt 2>&1
+assert_not_file_has_content out.txt "scanning commits instead"
+${CMD_PREFIX} ostree --repo=repo fsck
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo rev-parse main)" \
+             "$(${CMD_PREFIX} ostree --repo=${srvrepo} rev-parse main)"
+${CMD_PREFIX} ostree --repo=repo checkout -U main main-copy
+assert_file_has_content main-copy/baz/newfile "new content"
+assert_file_has_content main-copy/baz/cow "moo"
+rm -rf main-copy
+assert_file_has_content ${test_tmpdir}/httpd/httpd.log 'inventory/[0-9a-f]*\.index'
+n_buckets=$(grep -c 'serving .*/inventory/[0-9a-f]*\.bucket$' ${test_tmpdir}/httpd/httpd.log || true)
+if test "${n_buckets}" -gt 8; then
+    assert_not_reached "Fetched ${n_buckets} inventory buckets"
+fi
+echo "ok incremental mirror with inventory"
+
+# A client which fetched the summary just before it was regenerated can
+# still use the inventory it refers to
+cp ${srvrepo}/summary ${test_tmpdir}/summary.old
+echo "more content" > ${test_tmpdir}/srv-files/baz/morefile
+${CMD_PREFIX} ostree --repo=${srvrepo} commit -b main --tree=dir=${test_tmpdir}/srv-files -s "More"
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+assert_streq "$(ls ${srvrepo}/inventory/ | grep -c '\.index$')" "2"
+cp ${srvrepo}/summary ${test_tmpdir}/summary.new
+cp ${test_tmpdir}/summary.old ${srvrepo}/summary
+rm -rf repo2
+ostree_repo_init repo2 --mode=archive
+${CMD_PREFIX} ostree --repo=repo2 remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo2 pull --verbose --mirror --inventory origin > out.txt 2>&1
+assert_not_file_has_content out.txt "scanning commits instead"
+${CMD_PREFIX} ostree --repo=repo2 fsck
+cp ${test_tmpdir}/summary.new ${srvrepo}/summary
+echo "ok inventory of the previous summary"
+
+# A modified index must not be trusted; we fall back to scanning commits
+for index in ${srvrepo}/inventory/*.index; do
+    cp ${index} ${index}.orig
+    echo garbage >> ${index}
+done
+rm -rf repo2
+ostree_repo_init repo2 --mode=archive
+${CMD_PREFIX} ostree --repo=repo2 remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo2 pull --verbose --mirror --inventory origin > out.txt 2>&1
+assert_file_has_content out.txt "Index doesn't match the digest in the summary; scanning commits instead"
+${CMD_PREFIX} ostree --repo=repo2 fsck
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo2 rev-parse main)" \
+             "$(${CMD_PREFIX} ostree --repo=${srvrepo} rev-parse main)"
+for index in ${srvrepo}/inventory/*.index; do
+    mv ${index}.orig ${index}
+done
+echo "ok corrupted inventory index"
+
+# The inventory covers the whole remote, so it's only for mirroring all refs
+if ${CMD_PREFIX} ostree --repo=repo2 pull --inventory origin main 2>err.txt; then
+    assert_not_reached "pull --inventory without --mirror succeeded"
+fi
+assert_file_has_content err.txt "only be used when mirroring all refs"
+# And without an inventory on the remote, we just walk the commits
+${CMD_PREFIX} ostree --repo=${srvrepo} config set core.generate-inventory false
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+${CMD_PREFIX} ostree --repo=repo2 pull --mirror --inventory origin
+${CMD_PREFIX} ostree --repo=repo2 fsck
+echo "ok inventory fallbacks"
@@ -26,7 +26,7 @@ if test -z "${OSTREE_HTTPD}"; then
     exit 0
 fi
 
-echo "1..3"
+echo "1..4"
 
 setup_fake_remote_repo1 "archive"
 
@@ -106,6 +106,28 @@ ostree_repo_init repo
 ${CMD_PREFIX} ostree --repo=repo remote add origin --no-sign-verify \
   --contenturl=mirrorlist=$(cat httpd-address)/ostree/mirrorlist \
   mirrorlist=$(cat httpd-address)/ostree/mirrorlist
-${CMD_PREFIX} ostree --repo=repo pull origin:main
+${CMD_PREFIX} ostree --repo=repo pull --verbose origin:main > out.txt 2>&1
+
+# the mirrors missing objects are ranked down for the next pull
+for mirror in content_mirror1 content_mirror2; do
+  assert_file_has_content out.txt \
+    "Recording failed requests to mirror '$(cat ${mirror}-address)/ostree/gnomerepo'"
+done
+assert_not_file_has_content out.txt \
+  "Recording failed requests to mirror '$(cat content_mirror3-address)/ostree/gnomerepo'"
+# and a failed config probe counts once, like any other failed request
+nonexistent=$(cat content_mirror1-address)/ostree/non-existent-repo
+grep -c "Recording failed requests to mirror '${nonexistent}'" out.txt > count.txt || true
+assert_streq "$(cat count.txt)" "1"
 
 echo "ok pull objects from split urls mirrorlists"
+
+# the mirrorlist is cached, so pulling again must not need it
+
+ls repo/tmp/cache/mirrorlists > mirrorlists.txt
+assert_streq "$(wc -l < mirrorlists.txt)" "1"
+mv ${test_tmpdir}/ostree-srv/mirrorlist{,.bak}
+${CMD_PREFIX} ostree --repo=repo pull origin:main
+mv ${test_tmpdir}/ostree-srv/mirrorlist{.bak,}
+
+echo "ok pull using cached mirrorlist"
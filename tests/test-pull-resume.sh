@@ -23,7 +23,7 @@ set -euo pipefail
 
 setup_fake_remote_repo1 "archive" "" "--force-range-requests"
 
-echo '1..1'
+echo '1..2'
 
 repopath=${test_tmpdir}/ostree-srv/gnomerepo
 cp -a ${repopath} ${repopath}.orig
@@ -51,3 +51,26 @@ else
 fi
 rm -rf ${repopath}
 cp -a ${repopath}.orig ${repopath}
+
+# An interrupted pull leaves a journal in its staging directory, which the
+# next attempt resumes from rather than scanning all the trees again.
+cow=$(ostree_file_path_to_checksum ${repopath} main /baz/cow)
+cowobj=${repopath}/$(ostree_checksum_to_relative_object_path ${repopath} ${cow})
+mv ${cowobj} ${test_tmpdir}/cow.filez
+rm repo -rf
+ostree_repo_init repo
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+if ${CMD_PREFIX} ostree --repo=repo pull --disable-static-deltas origin main 2>err.log; then
+    assert_not_reached "pull with a missing object succeeded"
+fi
+ls repo/tmp/staging-*/pull-journal >/dev/null
+mv ${test_tmpdir}/cow.filez ${cowobj}
+${CMD_PREFIX} ostree --repo=repo pull -v --disable-static-deltas origin main &>out.txt
+assert_file_has_content out.txt "resuming pull from journal"
+${CMD_PREFIX} ostree --repo=repo fsck
+${CMD_PREFIX} ostree --repo=repo checkout -U main main-copy
+assert_file_has_content main-copy/baz/cow "moo"
+if ls repo/tmp/staging-*/pull-journal 2>/dev/null; then
+    assert_not_reached "pull journal left behind"
+fi
+echo "ok pull resumes from journal"
@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library. If not, see <https://www.gnu.org/licenses/>.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..4"
+
+setup_fake_remote_repo1 "archive"
+
+srvrepo=${test_tmpdir}/ostree-srv/gnomerepo
+for i in 1 2 3; do
+    ${CMD_PREFIX} ostree --repo=${srvrepo} commit -b main --tree=ref=main -s "Commit ${i}"
+done
+for depth in -1 garbage 1025; do
+    ${CMD_PREFIX} ostree --repo=${srvrepo} config set core.summary-ancestor-depth ${depth}
+    if ${CMD_PREFIX} ostree --repo=${srvrepo} summary -u 2>${test_tmpdir}/err.txt; then
+        assert_not_reached "summary -u with summary-ancestor-depth=${depth} succeeded"
+    fi
+    assert_file_has_content ${test_tmpdir}/err.txt "Invalid summary-ancestor-depth"
+done
+echo "ok invalid summary-ancestor-depth"
+
+${CMD_PREFIX} ostree --repo=${srvrepo} config set core.summary-ancestor-depth 3
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+${CMD_PREFIX} ostree --repo=${srvrepo} summary --view > ${test_tmpdir}/summary.txt
+assert_file_has_content_literal ${test_tmpdir}/summary.txt "Ancestors (ostree.commit.ancestors): 3"
+echo "ok summary with ancestors"
+
+cd ${test_tmpdir}
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull --depth=2 origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+find repo/objects -name '*.commit' | wc -l > commitcount
+assert_file_has_content commitcount "^3$"
+find repo/state -name '*.commitpartial' | wc -l > commitpartialcount
+assert_file_has_content commitpartialcount "^0$"
+for rev in main main^ main^^; do
+    assert_streq "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:${rev})" \
+                 "$(${CMD_PREFIX} ostree --repo=${srvrepo} rev-parse ${rev})"
+done
+# Past the ancestors in the summary, we walk the history as usual
+${CMD_PREFIX} ostree --repo=repo pull --depth=-1 origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+find repo/objects -name '*.commit' | wc -l > commitcount
+assert_file_has_content commitcount "^6$"
+echo "ok pull ancestors listed in summary"
+
+# The summary may list a parent which the remote has pruned
+${CMD_PREFIX} ostree --repo=${srvrepo} prune --refs-only --depth=0
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+rm -rf repo
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull --depth=2 origin main
+find repo/objects -name '*.commit' | wc -l > commitcount
+assert_file_has_content commitcount "^1$"
+find repo/state -name '*.commitpartial' | wc -l > commitpartialcount
+assert_file_has_content commitpartialcount "^0$"
+echo "ok pull with truncated history"
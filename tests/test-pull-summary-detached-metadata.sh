@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library. If not, see <https://www.gnu.org/licenses/>.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..3"
+
+setup_fake_remote_repo1 "archive"
+
+srvrepo=${test_tmpdir}/ostree-srv/gnomerepo
+${CMD_PREFIX} ostree --repo=${srvrepo} commit -b main --tree=ref=main \
+              --add-detached-metadata-string=FOO=BAR -s "With detached metadata"
+mkdir ${test_tmpdir}/other-files
+echo 'hello' > ${test_tmpdir}/other-files/hello
+${CMD_PREFIX} ostree --repo=${srvrepo} commit -b other --tree=dir=${test_tmpdir}/other-files \
+              -s "Without detached metadata"
+${CMD_PREFIX} ostree --repo=${srvrepo} config set core.summary-detached-metadata true
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+${CMD_PREFIX} ostree --repo=${srvrepo} summary --view > summary.txt
+assert_file_has_content_literal summary.txt "Detached metadata (ostree.commit.detached-metadata): FOO"
+assert_file_has_content_literal summary.txt "Detached metadata (ostree.commit.detached-metadata): none"
+echo "ok summary with detached metadata"
+
+cd ${test_tmpdir}
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+truncate -s 0 ${test_tmpdir}/httpd/httpd.log
+${CMD_PREFIX} ostree --repo=repo pull origin main other
+${CMD_PREFIX} ostree --repo=repo fsck
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo show --print-detached-metadata-key=FOO main)" "'BAR'"
+assert_not_file_has_content ${test_tmpdir}/httpd/httpd.log "\.commitmeta"
+echo "ok pull uses detached metadata from summary"
+
+# Without it in the summary, it's still fetched separately
+${CMD_PREFIX} ostree --repo=${srvrepo} config set core.summary-detached-metadata false
+${CMD_PREFIX} ostree --repo=${srvrepo} summary -u
+rm -rf repo
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+truncate -s 0 ${test_tmpdir}/httpd/httpd.log
+${CMD_PREFIX} ostree --repo=repo pull origin main
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo show --print-detached-metadata-key=FOO main)" "'BAR'"
+assert_file_has_content ${test_tmpdir}/httpd/httpd.log "\.commitmeta"
+echo "ok pull without detached metadata in summary"
@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library. If not, see <https://www.gnu.org/licenses/>.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..2"
+
+setup_fake_remote_repo1 "archive"
+
+cd ${test_tmpdir}
+ostree_repo_init repo --mode=archive
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull --background origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok background pull"
+
+# Add 512 KiB of incompressible content, and pull it at 128 KiB/s; allowing
+# for the initial burst, that must take at least 2 seconds.
+srvrepo=${test_tmpdir}/ostree-srv/gnomerepo
+rm -rf srv-files
+${CMD_PREFIX} ostree --repo=${srvrepo} checkout -U main srv-files
+for i in 1 2 3 4; do
+    dd if=/dev/urandom of=srv-files/blob${i} bs=1024 count=128 status=none
+done
+${CMD_PREFIX} ostree --repo=${srvrepo} commit -b main --tree=dir=srv-files -s "Blobs"
+start=$(date +%s)
+${CMD_PREFIX} ostree --repo=repo pull --disable-static-deltas --max-bandwidth-bytes=131072 origin main
+end=$(date +%s)
+${CMD_PREFIX} ostree --repo=repo fsck
+if test $((end - start)) -lt 2; then
+    assert_not_reached "Pulling 512 KiB at 128 KiB/s took less than 2 seconds"
+fi
+echo "ok bandwidth cap"
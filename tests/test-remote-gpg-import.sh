@@ -27,7 +27,7 @@ unset OSTREE_GPG_HOME
 setup_fake_remote_repo1 "archive"
 
 # Some tests require an appropriate gpg
-num_non_gpg_tests=4
+num_non_gpg_tests=5
 num_gpg_tests=2
 num_tests=$((num_non_gpg_tests + num_gpg_tests))
 
@@ -250,6 +250,54 @@ assert_file_has_content err.txt "public key not found"
 
 echo "ok"
 
+# The keys imported to verify signatures are cached for each remote, until
+# the contents of its keyring files change.  Pulling an already stored commit
+# doesn't verify anything, so drop it each time.
+pull_r20() {
+    rm repo/refs/remotes/* -rf
+    ${OSTREE} prune --refs-only
+    ${OSTREE} pull R20:main
+}
+cp ${test_tmpdir}/gpghome/key3.asc ${test_tmpdir}/key3-copy.asc
+${OSTREE} remote add --set=gpgkeypath=${test_tmpdir}/key3-copy.asc R20 $(cat httpd-address)/ostree/gnomerepo
+pull_r20 >/dev/null
+ls repo/tmp/cache/gpg/R20 > cached.txt
+assert_streq "$(grep -c '\.gpg$' cached.txt)" "1"
+assert_streq "$(grep -c '\.sha256$' cached.txt)" "1"
+pull_r20 >/dev/null
+ls repo/tmp/cache/gpg/R20 > cached-again.txt
+assert_streq "$(cat cached-again.txt)" "$(cat cached.txt)"
+# Only the contents matter, not the timestamps
+touch -d "1 hour ago" ${test_tmpdir}/key3-copy.asc
+pull_r20 >/dev/null
+ls repo/tmp/cache/gpg/R20 > cached-again.txt
+assert_streq "$(cat cached-again.txt)" "$(cat cached.txt)"
+# A cached keyring which doesn't match its checksum isn't used
+cached_keyring=repo/tmp/cache/gpg/R20/$(grep '\.gpg$' cached.txt)
+echo garbage > ${cached_keyring}
+pull_r20 >/dev/null
+assert_not_file_has_content ${cached_keyring} garbage
+assert_streq "$(sha256sum < ${cached_keyring} | cut -d ' ' -f 1)" "$(cat ${cached_keyring%.gpg}.sha256)"
+# Changing the keys replaces the cached keyring
+cp ${test_tmpdir}/gpghome/key1.asc ${test_tmpdir}/key3-copy.asc
+if pull_r20 2>err.txt; then
+    assert_not_reached "Unexpectedly succeeded at pulling with a cached keyring for other keys"
+fi
+assert_file_has_content err.txt "public key not found"
+ls repo/tmp/cache/gpg/R20 > cached-again.txt
+assert_streq "$(wc -l < cached-again.txt)" "2"
+if test "$(cat cached-again.txt)" = "$(cat cached.txt)"; then
+    assert_not_reached "GPG keyring cache not refreshed"
+fi
+# Nothing is cached in a directory others can write to
+rm -f repo/tmp/cache/gpg/R20/*
+chmod g+w repo/tmp/cache/gpg/R20
+cp ${test_tmpdir}/gpghome/key3.asc ${test_tmpdir}/key3-copy.asc
+pull_r20 >/dev/null
+assert_streq "$(ls repo/tmp/cache/gpg/R20 | wc -l)" "0"
+rm -f cached.txt cached-again.txt
+echo "ok gpg keyring cache"
+
 # Test deltas with signed commits; this test is a bit
 # weird here but this file has separate per-remote keys.
 cd ${test_tmpdir}
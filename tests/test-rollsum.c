@@ -28,6 +28,144 @@
 #include <glib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
+
+/* The original GHashTable/GVariant based implementation of
+ * _ostree_compute_rollsum_matches(), kept here to verify the current one
+ * produces identical matches and to benchmark against.
+ */
+typedef struct
+{
+  guint crcmatches;
+  guint bufmatches;
+  guint total;
+  guint64 match_size;
+  GPtrArray *matches;
+} ReferenceRollsumMatches;
+
+static GHashTable *
+reference_rollsum_chunks_crc32 (GBytes *bytes)
+{
+  gsize start = 0;
+  gboolean rollsum_end = FALSE;
+  GHashTable *ret_rollsums
+      = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_ptr_array_unref);
+  gsize buflen;
+  const guint8 *buf = g_bytes_get_data (bytes, &buflen);
+  gsize remaining = buflen;
+
+  while (remaining > 0)
+    {
+      int offset, bits;
+
+      if (!rollsum_end)
+        {
+          offset = bupsplit_find_ofs (buf + start, MIN (G_MAXINT32, remaining), &bits);
+          if (offset == 0)
+            {
+              rollsum_end = TRUE;
+              offset = MIN (8192 * 4, remaining);
+            }
+          else if (offset > 8192 * 4)
+            offset = 8192 * 4;
+        }
+      else
+        offset = MIN (8192 * 4, remaining);
+
+      guint32 crc = crc32 (crc32 (0L, NULL, 0), buf, offset);
+      GVariant *val
+          = g_variant_ref_sink (g_variant_new ("(utt)", crc, (guint64)start, (guint64)offset));
+      GPtrArray *matches = g_hash_table_lookup (ret_rollsums, GUINT_TO_POINTER (crc));
+      if (!matches)
+        {
+          matches = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+          g_hash_table_insert (ret_rollsums, GUINT_TO_POINTER (crc), matches);
+        }
+      g_ptr_array_add (matches, val);
+
+      start += offset;
+      remaining -= offset;
+    }
+
+  return ret_rollsums;
+}
+
+static gint
+reference_compare_matches (const void *app, const void *bpp)
+{
+  GVariant *a = *(GVariant **)app;
+  GVariant *b = *(GVariant **)bpp;
+  guint64 a_start, b_start;
+
+  g_variant_get_child (a, 2, "t", &a_start);
+  g_variant_get_child (b, 2, "t", &b_start);
+
+  g_assert_cmpint (a_start, !=, b_start);
+
+  if (a_start < b_start)
+    return -1;
+  return 1;
+}
+
+static void
+reference_rollsum_matches (GBytes *from, GBytes *to, ReferenceRollsumMatches *ret)
+{
+  g_autoptr (GHashTable) from_rollsum = reference_rollsum_chunks_crc32 (from);
+  g_autoptr (GHashTable) to_rollsum = reference_rollsum_chunks_crc32 (to);
+  const guint8 *from_buf = g_bytes_get_data (from, NULL);
+  const guint8 *to_buf = g_bytes_get_data (to, NULL);
+  gpointer hkey, hvalue;
+  GHashTableIter hiter;
+
+  memset (ret, 0, sizeof (*ret));
+  ret->matches = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+
+  g_hash_table_iter_init (&hiter, to_rollsum);
+  while (g_hash_table_iter_next (&hiter, &hkey, &hvalue))
+    {
+      GPtrArray *to_chunks = hvalue;
+      GPtrArray *from_chunks = g_hash_table_lookup (from_rollsum, hkey);
+
+      if (from_chunks != NULL)
+        {
+          ret->crcmatches++;
+
+          for (guint i = 0; i < to_chunks->len; i++)
+            {
+              guint64 to_start, to_offset;
+              guint32 tocrc;
+
+              g_variant_get (to_chunks->pdata[i], "(utt)", &tocrc, &to_start, &to_offset);
+
+              for (guint j = 0; j < from_chunks->len; j++)
+                {
+                  guint32 fromcrc;
+                  guint64 from_start, from_offset;
+
+                  g_variant_get (from_chunks->pdata[j], "(utt)", &fromcrc, &from_start,
+                                 &from_offset);
+
+                  if (to_offset != from_offset)
+                    continue;
+
+                  if (memcmp (from_buf + from_start, to_buf + to_start, to_offset) == 0)
+                    {
+                      GVariant *match
+                          = g_variant_new ("(uttt)", fromcrc, to_offset, to_start, from_start);
+                      ret->bufmatches++;
+                      ret->match_size += to_offset;
+                      g_ptr_array_add (ret->matches, g_variant_ref_sink (match));
+                      break;
+                    }
+                }
+            }
+        }
+
+      ret->total += to_chunks->len;
+    }
+
+  g_ptr_array_sort (ret->matches, reference_compare_matches);
+}
 
 static void
 test_rollsum_helper (const unsigned char *a, gsize size_a, const unsigned char *b, gsize size_b,
@@ -37,7 +175,8 @@ test_rollsum_helper (const unsigned char *a, gsize size_a, const unsigned char *
   g_autoptr (GBytes) bytes_a = g_bytes_new_static (a, size_a);
   g_autoptr (GBytes) bytes_b = g_bytes_new_static (b, size_b);
   OstreeRollsumMatches *matches;
-  GPtrArray *matchlist;
+  ReferenceRollsumMatches reference;
+  GArray *matchlist;
   guint64 sum_matched = 0;
 
   matches = _ostree_compute_rollsum_matches (bytes_a, bytes_b);
@@ -47,24 +186,39 @@ test_rollsum_helper (const unsigned char *a, gsize size_a, const unsigned char *
   else
     g_assert_cmpint (matchlist->len, ==, 0);
 
+  reference_rollsum_matches (bytes_a, bytes_b, &reference);
+  g_assert_cmpint (matches->crcmatches, ==, reference.crcmatches);
+  g_assert_cmpint (matches->bufmatches, ==, reference.bufmatches);
+  g_assert_cmpint (matches->total, ==, reference.total);
+  g_assert_cmpint (matches->match_size, ==, reference.match_size);
+  g_assert_cmpint (matchlist->len, ==, reference.matches->len);
+
   for (i = 0; i < matchlist->len; i++)
     {
+      const OstreeRollsumMatch *match = &g_array_index (matchlist, OstreeRollsumMatch, i);
       guint32 crc;
-      GVariant *match = matchlist->pdata[i];
       guint64 offset = 0, to_start = 0, from_start = 0;
-      g_variant_get (match, "(uttt)", &crc, &offset, &to_start, &from_start);
 
-      g_assert_cmpint (offset, >=, 0);
-      g_assert_cmpint (from_start, <, size_a);
-      g_assert_cmpint (to_start, <, size_b);
+      g_variant_get (reference.matches->pdata[i], "(uttt)", &crc, &offset, &to_start, &from_start);
+      g_assert_cmpint (match->crc, ==, crc);
+      g_assert_cmpint (match->size, ==, offset);
+      g_assert_cmpint (match->to_start, ==, to_start);
+      g_assert_cmpint (match->from_start, ==, from_start);
+
+      g_assert_cmpint (match->from_start, <, size_a);
+      g_assert_cmpint (match->to_start, <, size_b);
+      if (i > 0)
+        g_assert_cmpint (g_array_index (matchlist, OstreeRollsumMatch, i - 1).to_start, <,
+                         match->to_start);
 
-      sum_matched += offset;
+      sum_matched += match->size;
 
-      g_assert_cmpint (memcmp (a + from_start, b + to_start, offset), ==, 0);
+      g_assert_cmpint (memcmp (a + match->from_start, b + match->to_start, match->size), ==, 0);
     }
 
   g_assert_cmpint (sum_matched, ==, matches->match_size);
 
+  g_ptr_array_unref (reference.matches);
   _ostree_rollsum_matches_free (matches);
 }
 
@@ -180,11 +334,55 @@ test_bupsplit_sum (void)
   g_assert_cmpint (sum3a, ==, sum3b);
 }
 
+/* Not run by default; use `test-rollsum -m perf` */
+static void
+test_rollsum_benchmark (void)
+{
+#define BENCHMARK_BUFFER_SIZE (64 * 1024 * 1024)
+  g_autofree unsigned char *a = g_malloc (BENCHMARK_BUFFER_SIZE);
+  g_autofree unsigned char *b = g_malloc (BENCHMARK_BUFFER_SIZE);
+  g_autoptr (GRand) rand = g_rand_new_with_seed (42);
+  g_autoptr (GTimer) timer = g_timer_new ();
+  gsize i;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Benchmark only runs in perf mode");
+      return;
+    }
+
+  /* Mostly identical buffers, with a scattering of modified bytes */
+  for (i = 0; i < BENCHMARK_BUFFER_SIZE; i++)
+    a[i] = b[i] = g_rand_int (rand);
+  for (i = 0; i < BENCHMARK_BUFFER_SIZE / 65536; i++)
+    b[g_rand_int_range (rand, 0, BENCHMARK_BUFFER_SIZE)] ^= 0xff;
+
+  g_autoptr (GBytes) bytes_a = g_bytes_new_static (a, BENCHMARK_BUFFER_SIZE);
+  g_autoptr (GBytes) bytes_b = g_bytes_new_static (b, BENCHMARK_BUFFER_SIZE);
+
+  g_timer_start (timer);
+  g_autoptr (OstreeRollsumMatches) matches = _ostree_compute_rollsum_matches (bytes_a, bytes_b);
+  double current = g_timer_elapsed (timer, NULL);
+
+  ReferenceRollsumMatches reference;
+  g_timer_start (timer);
+  reference_rollsum_matches (bytes_a, bytes_b, &reference);
+  double original = g_timer_elapsed (timer, NULL);
+
+  g_assert_cmpint (matches->matches->len, ==, reference.matches->len);
+  g_assert_cmpint (matches->match_size, ==, reference.match_size);
+  g_ptr_array_unref (reference.matches);
+
+  g_test_minimized_result (current, "rollsum of %u MiB: %.3fs (original: %.3fs)",
+                           BENCHMARK_BUFFER_SIZE / (1024 * 1024), current, original);
+}
+
 int
 main (int argc, char **argv)
 {
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/rollsum", test_rollsum);
   g_test_add_func ("/bupsum", test_bupsplit_sum);
+  g_test_add_func ("/rollsum/benchmark", test_rollsum_benchmark);
   return g_test_run ();
 }
@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# SPDX-License-Identifier: LGPL-2.0+
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library. If not, see <https://www.gnu.org/licenses/>.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+cd ${test_tmpdir}
+
+# Returns the allocated size of a file in KiB
+allocated_kb() {
+    du -k "$1" | cut -f 1
+}
+
+mkdir files
+truncate -s 64M files/disk.img
+echo "data at the start" | dd of=files/disk.img conv=notrunc status=none
+echo "data in the middle" | dd of=files/disk.img bs=1M seek=32 conv=notrunc status=none
+if [ "$(allocated_kb files/disk.img)" -ge 1024 ]; then
+    skip "no sparse file support in ${test_tmpdir}"
+fi
+cp --sparse=never files/disk.img dense.img
+
+echo "1..3"
+
+ostree_repo_init repo --mode=bare-user
+${CMD_PREFIX} ostree --repo=repo commit -b sparse --tree=dir=files
+rm files/disk.img
+cp dense.img files/disk.img
+${CMD_PREFIX} ostree --repo=repo commit -b dense --tree=dir=files
+assert_streq "$(ostree_file_path_to_checksum repo dense /disk.img)" \
+    "$(ostree_file_path_to_checksum repo sparse /disk.img)"
+${CMD_PREFIX} ostree --repo=repo fsck
+echo "ok sparse file has the same checksum as dense file"
+
+objpath=repo/$(ostree_file_path_to_relative_object_path repo sparse /disk.img)
+if [ "$(allocated_kb ${objpath})" -ge 1024 ]; then
+    fatal "object for sparse file is not sparse"
+fi
+echo "ok sparse object"
+
+${CMD_PREFIX} ostree --repo=repo checkout -U --force-copy sparse checkout
+cmp checkout/disk.img dense.img
+if [ "$(allocated_kb checkout/disk.img)" -ge 1024 ]; then
+    fatal "checkout of sparse file is not sparse"
+fi
+echo "ok sparse checkout"